@@ -232,7 +232,17 @@ void vkglTF::Model::loadNode(vkglTF::Node *parent, const tinygltf::Node &node, u
         newMesh->id = globMeshId++;
         allMeshNames.insert(mesh.name);
         drawMeshNames.insert(mesh.name);
-        for (size_t j = 0; j < mesh.primitives.size(); j++) {
+        // A shared mesh repeats the primitives of its first node, which point at the vertices loaded there
+        auto sharedMesh = sharedMeshes.find(node.mesh);
+        bool shared = sharedMesh != sharedMeshes.end();
+        if (shared) {
+            for (Primitive *primitive : sharedMesh->second->primitives) {
+                newMesh->primitives.push_back(new Primitive(*primitive));
+            }
+        } else if (shareMeshes) {
+            sharedMeshes[node.mesh] = newMesh;
+        }
+        for (size_t j = 0; !shared && j < mesh.primitives.size(); j++) {
             const tinygltf::Primitive &primitive = mesh.primitives[j];
             if (primitive.indices < 0) {
                 continue;
@@ -718,6 +728,31 @@ void vkglTF::Model::convertLocalVertexToWorld(const glm::mat4 modelMatrix,
     }
 }
 
+void vkglTF::Model::getMeshGeometry(const Mesh &mesh, uint32_t &firstVertex, uint32_t &vertexCount,
+                                    uint32_t &firstIndex, std::vector<uint32_t> &localIndices) const
+{
+    // loadNode appends the primitives of a mesh one after another, so its vertices and indices are contiguous
+    firstVertex = UINT32_MAX;
+    firstIndex = UINT32_MAX;
+    uint32_t lastVertex = 0;
+    uint32_t lastIndex = 0;
+    for (const Primitive *primitive : mesh.primitives) {
+        firstVertex = std::min(firstVertex, primitive->firstVertex);
+        firstIndex = std::min(firstIndex, primitive->firstIndex);
+        lastVertex = std::max(lastVertex, primitive->firstVertex + primitive->vertexCount);
+        lastIndex = std::max(lastIndex, primitive->firstIndex + primitive->indexCount);
+    }
+    if (mesh.primitives.empty()) {
+        firstVertex = 0;
+        firstIndex = 0;
+    }
+    vertexCount = lastVertex - firstVertex;
+    localIndices.resize(lastIndex - firstIndex);
+    for (size_t i = 0; i < localIndices.size(); i++) {
+        localIndices[i] = indexBuffer[firstIndex + i] - firstVertex;
+    }
+}
+
 void vkglTF::Model::prepareVulkanModel(vks::VulkanDevice *device, VkQueue transferQueue)
 {
     size_t vertexBufferSize = vertexBuffer.size() * sizeof(vkvert::Vertex);
@@ -843,6 +878,8 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 
     indexBuffer.clear();
     vertexBuffer.clear();
+    sharedMeshes.clear();
+    shareMeshes = (fileLoadingFlags & FileLoadingFlags::ShareMeshes) != 0;
 
     if (fileLoaded) {
         if (!(fileLoadingFlags & FileLoadingFlags::DontLoadImages)) {
@@ -12,6 +12,7 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "vulkan/vulkan.h"
@@ -197,7 +198,10 @@ struct Animation {
 enum FileLoadingFlags { None = 0x00000000,
                         PreMultiplyVertexColors = 0x00000002,
                         DontLoadImages = 0x00000004,
-                        PreConvert = 0x00000008};
+                        PreConvert = 0x00000008,
+                        // A glTF mesh used by several nodes keeps one copy of its vertices and indices, which the
+                        // nodes share. Not for convertLocalVertexToWorld, which bakes every node into its own vertices.
+                        ShareMeshes = 0x00000010};
 
 enum RenderFlags {
     BindImages = 0x00000001,
@@ -226,6 +230,9 @@ private:
     uint32_t materialCount = 0;
     std::vector<VkDescriptorImageInfo> textureDescriptors = {};
     std::vector<VkDescriptorBufferInfo> nodeBufferDescriptors = {};
+    // glTF mesh index to the first node mesh loaded from it, for FileLoadingFlags::ShareMeshes
+    std::unordered_map<int, Mesh *> sharedMeshes;
+    bool shareMeshes = false;
     void collectRelectionInformations(Node *node);
 
 public:
@@ -289,6 +296,9 @@ public:
                       uint32_t fileLoadingFlags = vkglTF::FileLoadingFlags::None, float scale = 1.0f);
     void prepareVulkanModel(vks::VulkanDevice *device, VkQueue transferQueue);
     void convertLocalVertexToWorld(const glm::mat4 modelMatrix, std::vector<vkvert::Vertex> &outWorldVertices);
+    // Geometry of a mesh for building its bvh in local space, indices are rebased onto firstVertex
+    void getMeshGeometry(const Mesh &mesh, uint32_t &firstVertex, uint32_t &vertexCount, uint32_t &firstIndex,
+                         std::vector<uint32_t> &localIndices) const;
     void bindBuffers(VkCommandBuffer commandBuffer);
     void drawNode(Node *node, VkCommandBuffer commandBuffer, uint32_t renderFlags = 0,
                   VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindSet = 1);
@@ -0,0 +1,66 @@
+// clang-format off
+// Decoding of the quantized 4-wide bvh nodes, laid out as QuantizedBvhNode in include/Traversal.h and
+// exported by Traversal::GetQuantizedBLAS. Every node takes four uvec4; the including shader declares
+//     layout (std430, set = 0, binding = B_CPR) buffer cpr4xBvh { uvec4 bvhNode[]; };
+#ifndef QUANTIZED_BVH_GLSL
+#define QUANTIZED_BVH_GLSL
+
+const uint QBVH_NODE_UVEC4S = 4u;
+const uint QBVH_INNER_BIT = 0x80u;
+const uint QBVH_COUNT_SHIFT = 4u;
+const uint QBVH_OFFSET_MASK = 0x0fu;
+
+// The four bytes of a word, slot i from byte i.
+vec4 qbvhUnpackSlots(uint bytes)
+{
+    return vec4(uvec4(bytes, bytes >> 8u, bytes >> 16u, bytes >> 24u) & 0xffu);
+}
+
+// Test the four children of a node. tEntry receives where the ray enters each hit child.
+bvec4 qbvhIntersectNode(uint node, vec3 origin, vec3 invDir, float tmin, float tmax, out vec4 tEntry)
+{
+    uvec4 grid = bvhNode[node * QBVH_NODE_UVEC4S];
+    uvec4 qlower = bvhNode[node * QBVH_NODE_UVEC4S + 2u];
+    uvec4 qupper = bvhNode[node * QBVH_NODE_UVEC4S + 3u];
+    vec3 gridOrigin = uintBitsToFloat(grid.xyz);
+    // Power of two steps, so the products below are exact like on the cpu.
+    vec3 scale = uintBitsToFloat((uvec3(grid.w, grid.w >> 8u, grid.w >> 16u) & 0xffu) << 23u);
+    vec4 tNear = vec4(tmin);
+    vec4 tFar = vec4(tmax);
+    for (int axis = 0; axis < 3; axis++) {
+        vec4 lower = gridOrigin[axis] + qbvhUnpackSlots(qlower[axis]) * scale[axis];
+        vec4 upper = gridOrigin[axis] + qbvhUnpackSlots(qupper[axis]) * scale[axis];
+        vec4 t0 = (lower - origin[axis]) * invDir[axis];
+        vec4 t1 = (upper - origin[axis]) * invDir[axis];
+        // Picking the planes by direction sign keeps unused slots (lower > upper) from ever hitting.
+        bool negative = invDir[axis] < 0.0;
+        tNear = max(tNear, negative ? t1 : t0);
+        tFar = min(tFar, negative ? t0 : t1);
+    }
+    tEntry = tNear;
+    return lessThanEqual(tNear, tFar);
+}
+
+uint qbvhChildMeta(uint node, uint slot)
+{
+    return (bvhNode[node * QBVH_NODE_UVEC4S + 1u].z >> (slot * 8u)) & 0xffu;
+}
+
+bool qbvhIsInner(uint meta)
+{
+    return (meta & QBVH_INNER_BIT) != 0u;
+}
+
+// The node index of an inner child.
+uint qbvhInnerChild(uint node, uint meta)
+{
+    return bvhNode[node * QBVH_NODE_UVEC4S + 1u].x + (meta & ~QBVH_INNER_BIT);
+}
+
+// The primIndices range of a leaf child, 1 to 4 triangles.
+void qbvhLeafRange(uint node, uint meta, out uint first, out uint count)
+{
+    first = bvhNode[node * QBVH_NODE_UVEC4S + 1u].y + (meta & QBVH_OFFSET_MASK);
+    count = meta >> QBVH_COUNT_SHIFT;
+}
+#endif
@@ -59,6 +59,17 @@ layout(set = 0, binding = 7) buffer readonly IndexBuffer {
 layout(set = 0, binding = 8) buffer CountBuffer {
     uint countBuffer[];
 };
+
+// A bvh instance: its first triangle in indexBuffer, hit triangle ids are relative to it, and for a BLAS in the
+// local space of its mesh the transform of its hits to world space
+struct BvhInstance {
+    mat4 transform;
+    uint firstTriangle;
+    uint localVertices;
+};
+layout(set = 0, binding = 9) buffer readonly InstanceBuffer {
+    BvhInstance bvhInstances[];
+};
 #endif // FRAGMENT_SHADER
 
 #endif // RAY_TRACING
@@ -49,6 +49,19 @@
 //     float t;
 // };
 
+// TraceRayHitFormat -- T_PRIMID_INSTID_U_V_PACKED
+// struct HitInfo {
+//     float t;
+//     uint triInstId;     // triId = triInstId & 0xFFFFFFu, instId = triInstId >> 24
+//     uint uv;            // vec2(u, v) = unpackUnorm2x16(uv)
+// };
+
+// TraceRayHitFormat -- T_PRIMID_INSTID_PACKED
+// struct HitInfo {
+//     float t;
+//     uint triInstId;     // triId = triInstId & 0xFFFFFFu, instId = triInstId >> 24
+// };
+
 // void traceRay(in Ray ray, in uint rayFlags, inout HitInfo hit);
 
 // layout (std430, set = 0, binding = 0) buffer cpr4xBvh
@@ -93,6 +106,7 @@ const float BLEND_FACTOR = 0.6f;
 void getHitInformation(
     const ivec3 triangleIndices,
     const vec2 centerUV,
+    const BvhInstance instance,
     out vec4 hitColor,
     out vec2 hitSampeUV,
     out vec3 hitPosition,
@@ -124,13 +138,22 @@ void getHitInformation(
     vec4 weight0_1 = vertexBuffer[triangleIndices.y].weight0;
     vec4 weight0_2 = vertexBuffer[triangleIndices.z].weight0;
 
-    convetLocalToWorld(hitPosition0, hitNormal0, joint0_0, weight0_0);
-    convetLocalToWorld(hitPosition1, hitNormal1, joint0_1, weight0_1);
-    convetLocalToWorld(hitPosition2, hitNormal2, joint0_2, weight0_2);
+    if (instance.localVertices == 0u) {
+        convetLocalToWorld(hitPosition0, hitNormal0, joint0_0, weight0_0);
+        convetLocalToWorld(hitPosition1, hitNormal1, joint0_1, weight0_1);
+        convetLocalToWorld(hitPosition2, hitNormal2, joint0_2, weight0_2);
+    }
 
     hitSampeUV = hitSampleUV0 * (1 - centerUV.x - centerUV.y) + hitSampleUV1 * centerUV.x + hitSampleUV2 * centerUV.y;
     hitPosition = hitPosition0 * (1 - centerUV.x - centerUV.y) + hitPosition1 * centerUV.x + hitPosition2 * centerUV.y;
     hitNormal = hitNormal0 * (1 - centerUV.x - centerUV.y) + hitNormal1 * centerUV.x + hitNormal2 * centerUV.y;
+
+    if (instance.localVertices != 0u) {
+        // The node uniform belongs to the node being drawn, the hit may be on any other; the instance transform
+        // already holds the flipped Y-Axis.
+        hitPosition = (instance.transform * vec4(hitPosition, 1.0)).xyz;
+        hitNormal = normalize(transpose(inverse(mat3(instance.transform))) * hitNormal);
+    }
 #endif
 }
 
@@ -28,7 +28,8 @@ void main()
     atomicAdd(countBuffer[0], 1);
 #endif
     if (hitInfo.t >= 0.0f) {
-        const uint triangleId = hitInfo.triId;
+        const BvhInstance instance = bvhInstances[hitInfo.instId];
+        const uint triangleId = instance.firstTriangle + hitInfo.triId;
         const ivec3 triangleIndices =
         ivec3(indexBuffer[triangleId * 3], indexBuffer[triangleId * 3 + 1], indexBuffer[triangleId * 3 + 2]);
         const vec2 hitTriangelUv = vec2(hitInfo.u, hitInfo.v);
@@ -36,7 +37,7 @@ void main()
         vec2 drawSampleUV = vec2(0.5);
         vec3 drawPosition = vec3(0.5);
         vec3 drawNormal = vec3(0.5);
-        getHitInformation(triangleIndices, hitTriangelUv, baseColor, drawSampleUV, drawPosition, drawNormal);
+        getHitInformation(triangleIndices, hitTriangelUv, instance, baseColor, drawSampleUV, drawPosition, drawNormal);
 #ifdef USE_PBR_REFLECT
         outColor = simplePBR(baseColor, drawSampleUV, drawPosition, drawNormal);
 #else
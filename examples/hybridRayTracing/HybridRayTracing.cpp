@@ -5,6 +5,8 @@
 
 #include "HybridRayTracing.h"
 
+#include <chrono>
+
 #include "VulkanSkyboxPipeline.h"
 #include "VulkanOnscreenPipeline.h"
 
@@ -59,6 +61,14 @@ HybridRayTracing::~HybridRayTracing() noexcept
 }
 
 void HybridRayTracing::LoadAssets()
+{
+    LoadSceneModels();
+    m_models.sky.loadFromFile(getAssetPath() + "models/cube.gltf", vulkanDevice, queue, 0);
+    m_environmentCube.loadFromFile(getAssetPath() + "enviroments/papermill.ktx", VK_FORMAT_R16G16B16A16_SFLOAT,
+        vulkanDevice, queue);
+}
+
+void HybridRayTracing::LoadSceneModels()
 {
     std::vector<std::string> fileNames = { "H-20w.gltf", "H-10w.gltf" }; //
     m_gltfModels = { "H-20w", "H-10w" };                                 //
@@ -67,13 +77,10 @@ void HybridRayTracing::LoadAssets()
     for (size_t i = 0; i < fileNames.size(); i++) {
         for (size_t j = 0; j < m_rtShaders.size(); j++) {
             size_t idx = i * m_rtShaders.size() + j;
-            m_models.scene[idx].loadFromFile(getAssetPath() + "models/" + fileNames[i], vulkanDevice, queue, 0);
+            m_models.scene[idx].loadFromFile(getAssetPath() + "models/" + fileNames[i], vulkanDevice, queue,
+                m_instancedBVH ? vkglTF::FileLoadingFlags::ShareMeshes : vkglTF::FileLoadingFlags::None);
         }
     }
-
-    m_models.sky.loadFromFile(getAssetPath() + "models/cube.gltf", vulkanDevice, queue, 0);
-    m_environmentCube.loadFromFile(getAssetPath() + "enviroments/papermill.ktx", VK_FORMAT_R16G16B16A16_SFLOAT,
-        vulkanDevice, queue);
 }
 
 void HybridRayTracing::GenerateIBLTextures()
@@ -152,7 +159,8 @@ bool HybridRayTracing::PrepareRayTracingPasses()
     for (size_t i = 0; i != m_gltfModels.size(); ++i) {
         for (size_t j = 0; j != m_rtShaders.size(); ++j) {
             auto rtPass = std::make_unique<rt::RayTracingPass>(vulkanDevice, static_cast<uint32_t>(width * m_downScale),
-                static_cast<uint32_t>(height * m_downScale));
+                static_cast<uint32_t>(height * m_downScale), m_instancedBVH,
+                static_cast<uint32_t>(drawCmdBuffers.size()));
             if (!rtPass->SetupRenderPass()) {
                 return false;
             }
@@ -299,7 +307,8 @@ void HybridRayTracing::buildCommandBuffers()
 
         if (m_enableRT) {
             m_rayTracingPasses[passId]->RefitBVH(drawCmdBuffers[i]);
-            m_rayTracingPasses[passId]->Draw(drawCmdBuffers[i], m_ibl.get(), m_models.scene[passId]);
+            m_rayTracingPasses[passId]->Draw(drawCmdBuffers[i], static_cast<uint32_t>(i), m_ibl.get(),
+                m_models.scene[passId]);
         }
 
         vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
@@ -335,9 +344,18 @@ void HybridRayTracing::prepare()
     Detail::RegPipelines();
     LoadAssets();
     GenerateIBLTextures();
-    if (!PrepareRayTracingPasses()) {
+    if (!PrepareScene()) {
         return;
     }
+    buildCommandBuffers();
+    prepared = true;
+}
+
+bool HybridRayTracing::PrepareScene()
+{
+    if (!PrepareRayTracingPasses()) {
+        return false;
+    }
     PreparePipelineResources();
     PrepareOnscreenPipelines();
     // update Matrices for every scene/pass !
@@ -346,11 +364,28 @@ void HybridRayTracing::prepare()
     }
     UpdateParams();
     UpdateUniformBuffers();
-    if (!PrepareRayTracingPipelines()) {
+    return PrepareRayTracingPipelines();
+}
+
+void HybridRayTracing::SwitchBVHMode()
+{
+    // The models are loaded with shared meshes in instanced mode only, so the scene is reloaded with its passes
+    // and the pipelines that refer to them. No frame is in flight and the update loop is idle between frames.
+    vkDeviceWaitIdle(device);
+    m_onScreenPipelines.reflectionBlendRenders.clear();
+    m_onScreenPipelines.sceneRender.reset();
+    m_onScreenPipelines.skyboxRender.reset();
+    m_resources.clear();
+    m_rayTracingPasses.clear();
+    m_models.scene.clear();
+    LoadSceneModels();
+    if (!PrepareScene()) {
+        LOGE("Failed to switch the instanced BVH %s.", m_instancedBVH ? "on" : "off");
+        prepared = false;
         return;
     }
+    m_rayTracingPasses[m_models.index * m_rtShaders.size() + m_rtIndex]->SetStat(m_showStat);
     buildCommandBuffers();
-    prepared = true;
 }
 
 void HybridRayTracing::UpdateResourceAsyncly()
@@ -391,6 +426,13 @@ void HybridRayTracing::render()
     if (!prepared || !swapChain.prepared) {
         return;
     }
+    if (m_switchBVH) {
+        m_switchBVH = false;
+        SwitchBVHMode();
+        if (!prepared) {
+            return;
+        }
+    }
 
     UpdateResourceAsyncly();
 
@@ -414,16 +456,56 @@ void HybridRayTracing::render()
         m_readyToDraw = false;
     }
 
+    if (m_enableRT) {
+        // prepareFrame has waited for the last submission of this command buffer, so its staging buffer is free
+        size_t passId = m_models.index * m_rtShaders.size() + m_rtIndex;
+        m_rayTracingPasses[passId]->UploadInstances(currentBuffer);
+    }
+
     submitFrame(m_addWait);
 }
 
+#ifdef RT_CPU_PICKING
+void HybridRayTracing::PickNode()
+{
+    // unproject the cursor through the camera into the world space the BVH is built in
+    glm::vec2 ndc = mousePos / glm::vec2(static_cast<float>(width), static_cast<float>(height)) * 2.0f - 1.0f;
+    glm::mat4 invViewProj = glm::inverse(camera.matrices.perspective * camera.matrices.view);
+    glm::vec4 farPoint = invViewProj * glm::vec4(ndc, 1.0f, 1.0f);
+    glm::vec3 eye = glm::vec3(glm::inverse(camera.matrices.view)[3]);
+    glm::vec3 dir = glm::normalize(glm::vec3(farPoint) / farPoint.w - eye);
+
+    size_t passId = m_models.index * m_rtShaders.size() + m_rtIndex;
+    auto start = std::chrono::steady_clock::now();
+    vkglTF::Node *node = m_rayTracingPasses[passId]->Pick(m_models.scene[passId], eye, dir);
+    auto end = std::chrono::steady_clock::now();
+    m_pickMicroseconds = std::chrono::duration<float, std::micro>(end - start).count();
+    if (node == nullptr) {
+        m_pickedNode.clear();
+    } else {
+        m_pickedNode = node->name.empty() ? "node " + std::to_string(node->index) : node->name;
+    }
+}
+#endif
+
 void HybridRayTracing::OnUpdateUIOverlay(vks::UIOverlay *overlay)
 {
+#ifdef RT_CPU_PICKING
+    // pick on the press of a click or on a tap, not while the camera is dragged or the overlay is used
+    bool mouseDown = mouseButtons.left && !ImGui::GetIO().WantCaptureMouse;
+    if (mouseDown && !m_mouseWasDown) {
+        PickNode();
+    }
+    m_mouseWasDown = mouseDown;
+#endif
+
     if (overlay->header("Setting")) {
         bool reBuild = false;
         reBuild |= (overlay->comboBox("Models", &m_models.index, m_gltfModels));
         // if enable shader choice. overlay->comboBox("rtShaders", &m_rtIndex, m_rtShaders);
         reBuild |= (overlay->checkBox("RayTrace", &m_enableRT));
+        // applied by render, which reloads the models and rebuilds the BVHs in the other mode
+        m_switchBVH |= overlay->checkBox("Instanced BVH", &m_instancedBVH);
 
         if (overlay->checkBox("Stat", &m_showStat)) {
             m_rtIndex = m_showStat ? 1 : 0;
@@ -439,6 +521,11 @@ void HybridRayTracing::OnUpdateUIOverlay(vks::UIOverlay *overlay)
     if (m_showStat && m_reflectArea > 1e-4) {
         ImGui::Text("RT Reflect Area: %.2f%%", m_reflectArea * 100.0f);
     }
+#ifdef RT_CPU_PICKING
+    if (!m_pickedNode.empty()) {
+        ImGui::Text("Picked: %s (%.2f us)", m_pickedNode.c_str(), m_pickMicroseconds);
+    }
+#endif
 }
 
 void HybridRayTracing::OnNextFrame()
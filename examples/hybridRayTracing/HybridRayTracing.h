@@ -29,6 +29,9 @@ public:
 private:
     void GenerateIBLTextures();
     void LoadAssets();
+    void LoadSceneModels();
+    bool PrepareScene();
+    void SwitchBVHMode();
     void PreparePipelineResources();
     void PrepareOnscreenPipelines();
     bool PrepareRayTracingPasses();
@@ -38,6 +41,9 @@ private:
     void UpdateUniformBuffers();
 
     void UpdateResourceAsyncly();
+#ifdef RT_CPU_PICKING
+    void PickNode();
+#endif
 
     float m_animationTimer = 0.0f;
 
@@ -80,9 +86,16 @@ private:
     std::vector<std::string> m_rtShaders = {"raytracing_color.frag", "raytracing_stats.frag"};
     std::vector<std::unique_ptr<rt::RayTracingPass>> m_rayTracingPasses;        // n_model x n_rtShader
     bool m_enableRT = true;
+    bool m_instancedBVH = false;     // one BLAS per glTF mesh, nodes are moved through the TLAS instead of RefitBLAS
+    bool m_switchBVH = false;        // m_instancedBVH was toggled, the scene is reloaded before the next frame
     float m_downScale = 1.0f;
     bool m_showStat = false;
     float m_reflectArea = 0.0f;
+#ifdef RT_CPU_PICKING
+    bool m_mouseWasDown = false;
+    std::string m_pickedNode;          // name of the glTF node last tapped or clicked, empty for none
+    float m_pickMicroseconds = 0.0f;
+#endif
 
     std::unique_ptr<EventLoop> m_loop;
     std::thread m_thread;
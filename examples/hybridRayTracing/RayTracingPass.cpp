@@ -4,6 +4,10 @@
  */
 
 #include "RayTracingPass.h"
+
+#include <algorithm>
+#include <unordered_map>
+
 #include "SaschaWillemsVulkan/VulkanInitializers.hpp"
 #include "Utils.h"
 #include "Log.h"
@@ -63,6 +67,8 @@ private:
                 VK_SHADER_STAGE_FRAGMENT_BIT, 7),
             vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
                 VK_SHADER_STAGE_FRAGMENT_BIT, 8),
+            vks::initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                VK_SHADER_STAGE_FRAGMENT_BIT, 9),
         };
 
         VkDescriptorSetLayoutCreateInfo descLayoutCreateInfo {};
@@ -116,10 +122,18 @@ private:
         return true;
     }
 };
+
+// The world transform that convertLocalVertexToWorld bakes into the vertices, flipped Y-Axis included.
+glm::mat4 GetInstanceTransform(vkglTF::Node *node, const glm::mat4 &modelMatrix)
+{
+    return glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f)) * modelMatrix * node->getMatrix();
+}
 } // namespace detail
 
-RayTracingPass::RayTracingPass(vks::VulkanDevice *vulkandevice, uint32_t width, uint32_t height)
-    : m_vulkandevice(vulkandevice), m_width(width), m_height(height)
+RayTracingPass::RayTracingPass(vks::VulkanDevice *vulkandevice, uint32_t width, uint32_t height, bool instancedBVH,
+    uint32_t frameCount)
+    : m_vulkandevice(vulkandevice), m_width(width), m_height(height), m_instancedBVH(instancedBVH),
+      m_frameCount(std::max(1u, frameCount))
 {}
 
 RayTracingPass::~RayTracingPass() noexcept
@@ -130,6 +144,10 @@ RayTracingPass::~RayTracingPass() noexcept
     m_bvhBuffers.index.destroy();
     m_countBuffer.destroy();
     m_countStagingBuffer.destroy();
+    m_instanceBuffer.destroy();
+    for (vks::Buffer &buffer : m_instanceStagingBuffers) {
+        buffer.destroy();
+    }
 
     m_uniformBuffers.matrices.destroy();
     m_uniformBuffers.params.destroy();
@@ -164,27 +182,68 @@ bool RayTracingPass::InitTraversal()
 
 bool RayTracingPass::BuildBVH(vkglTF::Model &scene, const glm::mat4 &modelMatrix)
 {
-    m_worldVertices.resize(scene.vertexBuffer.size());
-    scene.convertLocalVertexToWorld(modelMatrix, m_worldVertices);
+    if (!m_instancedBVH) {
+        m_worldVertices.resize(scene.vertexBuffer.size());
+        scene.convertLocalVertexToWorld(modelMatrix, m_worldVertices);
+    }
+    if (!CreateBVHBuffers(scene)) {
+        return false;
+    }
 
-    size_t size = m_worldVertices.size() * sizeof(vkvert::Vertex);
-    m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_bvhBuffers.vertex, size);
-    m_bvhBuffers.vertex.setupDescriptor();
-    m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &m_bvhStagingBuffers.vertex, size,
-        m_worldVertices.data());
-    VK_CHECK_RESULT(m_bvhStagingBuffers.vertex.map());
+    bool built = m_instancedBVH ? BuildMeshBVH(scene, modelMatrix) : BuildSceneBVH(scene);
+    if (!built) {
+        return false;
+    }
 
-    size = scene.indexBuffer.size() * sizeof(uint32_t);
-    m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_bvhBuffers.index, size);
-    m_bvhBuffers.index.setupDescriptor();
-    m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                                 &m_bvhStagingBuffers.index, size,
-        scene.indexBuffer.data());
-    VK_CHECK_RESULT(m_bvhStagingBuffers.index.map());
+    // the first draw of every command buffer fills the instance buffer from its staging buffer
+    VkDeviceSize instanceSize = m_shaderInstances.size() * sizeof(ShaderInstance);
+    VK_CHECK_RESULT(m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_instanceBuffer, instanceSize));
+    m_instanceBuffer.setupDescriptor();
+    m_instanceStagingBuffers.resize(m_frameCount);
+    for (vks::Buffer &buffer : m_instanceStagingBuffers) {
+        VK_CHECK_RESULT(m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &buffer, instanceSize,
+            m_shaderInstances.data()));
+        VK_CHECK_RESULT(buffer.map());
+    }
+    m_stagedInstanceVersions.assign(m_frameCount, m_instanceVersion);
+
+    return true;
+}
+
+bool RayTracingPass::CreateBVHBuffers(vkglTF::Model &scene)
+{
+    size_t vertexSize = scene.vertexBuffer.size() * sizeof(vkvert::Vertex);
+    size_t indexSize = scene.indexBuffer.size() * sizeof(uint32_t);
+    if (m_instancedBVH) {
+        // local vertices never change, so they are uploaded once instead of being copied every frame
+        m_vulkandevice->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &m_bvhBuffers.vertex,
+            vertexSize, scene.vertexBuffer.data());
+        m_bvhBuffers.vertex.setupDescriptor();
+        m_vulkandevice->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &m_bvhBuffers.index,
+            indexSize, scene.indexBuffer.data());
+        m_bvhBuffers.index.setupDescriptor();
+    } else {
+        m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_bvhBuffers.vertex, vertexSize);
+        m_bvhBuffers.vertex.setupDescriptor();
+        m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &m_bvhStagingBuffers.vertex,
+            vertexSize, m_worldVertices.data());
+        VK_CHECK_RESULT(m_bvhStagingBuffers.vertex.map());
+
+        m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_bvhBuffers.index, indexSize);
+        m_bvhBuffers.index.setupDescriptor();
+        m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                     &m_bvhStagingBuffers.index, indexSize,
+            scene.indexBuffer.data());
+        VK_CHECK_RESULT(m_bvhStagingBuffers.index.map());
+    }
 
     uint32_t zeros[m_countSize]{0};
     m_vulkandevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT |
@@ -195,6 +254,11 @@ bool RayTracingPass::BuildBVH(vkglTF::Model &scene, const glm::mat4 &modelMatrix
                                  &m_countStagingBuffer, m_countSize, zeros);
     VK_CHECK_RESULT(m_countStagingBuffer.map());
 
+    return true;
+}
+
+bool RayTracingPass::BuildSceneBVH(vkglTF::Model &scene)
+{
     RayShop::GeometryTriangleDescription geometry;
     geometry.stride = sizeof(vkvert::Vertex) / sizeof(float);
     geometry.vertices.cpuBuffer = m_worldVertices.data();
@@ -222,6 +286,8 @@ bool RayTracingPass::BuildBVH(vkglTF::Model &scene, const glm::mat4 &modelMatrix
         instance.transform[2][2] = 1;
         instance.transform[3][3] = 1;
         intances.push_back(instance);
+        // the vertices are in world space already, the shader moves the hit with the node being drawn
+        m_shaderInstances.push_back(ShaderInstance {glm::mat4(1.0f), 0, 0, {}});
     }
     res = m_traversal->CreateTLAS(static_cast<uint32_t>(intances.size()), intances.data());
     if (res != RayShop::Result::SUCCESS) {
@@ -243,8 +309,73 @@ bool RayTracingPass::BuildBVH(vkglTF::Model &scene, const glm::mat4 &modelMatrix
     return true;
 }
 
+bool RayTracingPass::BuildMeshBVH(vkglTF::Model &scene, const glm::mat4 &modelMatrix)
+{
+    // Nodes of a shared mesh (FileLoadingFlags::ShareMeshes) have the same triangles and get the same BLAS.
+    std::unordered_map<uint32_t, uint32_t> blasOfFirstIndex;
+    std::vector<uint32_t> instanceBlases;
+    for (vkglTF::Node *node : scene.linearNodes) {
+        if (node->mesh == nullptr || node->mesh->primitives.empty()) {
+            continue;
+        }
+        uint32_t firstVertex = 0;
+        uint32_t vertexCount = 0;
+        uint32_t firstIndex = 0;
+        std::vector<uint32_t> localIndices;
+        scene.getMeshGeometry(*node->mesh, firstVertex, vertexCount, firstIndex, localIndices);
+        m_instanceNodes.push_back(node);
+        m_shaderInstances.push_back(ShaderInstance {glm::mat4(1.0f), firstIndex / 3, 1, {}});
+        auto blas = blasOfFirstIndex.find(firstIndex);
+        if (blas != blasOfFirstIndex.end()) {
+            instanceBlases.push_back(blas->second);
+            continue;
+        }
+        blasOfFirstIndex[firstIndex] = static_cast<uint32_t>(m_bvhGeometriesOnCPU.size());
+        instanceBlases.push_back(static_cast<uint32_t>(m_bvhGeometriesOnCPU.size()));
+        m_localIndices.push_back(std::move(localIndices));
+
+        RayShop::GeometryTriangleDescription geometry;
+        geometry.stride = sizeof(vkvert::Vertex) / sizeof(float);
+        geometry.vertices.cpuBuffer = scene.vertexBuffer.data() + firstVertex;
+        geometry.vertices.type = RayShop::BufferType::CPU;
+        geometry.verticesCount = vertexCount;
+        geometry.indices.cpuBuffer = m_localIndices.back().data();
+        geometry.indices.type = RayShop::BufferType::CPU;
+        geometry.indicesCount = static_cast<uint32_t>(m_localIndices.back().size());
+        m_bvhGeometriesOnCPU.push_back(geometry);
+    }
+
+    m_blases.resize(m_bvhGeometriesOnCPU.size());
+    RayShop::Result res = m_traversal->CreateBLAS(RayShop::ASBuildMethod::SAH_CPU,
+        static_cast<uint32_t>(m_bvhGeometriesOnCPU.size()), m_bvhGeometriesOnCPU.data(), m_blases.data());
+    if (res != RayShop::Result::SUCCESS) {
+        LOGE("Failed to CreateBLAS, err: %s.", m_traversal->GetErrorCodeString(res));
+        return false;
+    }
+
+    m_instances.resize(m_instanceNodes.size());
+    for (size_t i = 0; i < m_instances.size(); i++) {
+        m_instances[i].blas = m_blases[instanceBlases[i]];
+        m_shaderInstances[i].transform = detail::GetInstanceTransform(m_instanceNodes[i], modelMatrix);
+        memcpy(m_instances[i].transform, &m_shaderInstances[i].transform[0][0], sizeof(m_instances[i].transform));
+        m_instanceNodes[i]->updated = false;
+    }
+    res = m_traversal->CreateTLAS(static_cast<uint32_t>(m_instances.size()), m_instances.data());
+    if (res != RayShop::Result::SUCCESS) {
+        LOGE("Failed to CreateTLAS, err: %s.", m_traversal->GetErrorCodeString(res));
+        return false;
+    }
+
+    return true;
+}
+
 void RayTracingPass::UpdateBVH(vkglTF::Model &scene, const glm::mat4 &modelMatrix)
 {
+    if (m_instancedBVH) {
+        UpdateInstances(modelMatrix);
+        return;
+    }
+
     scene.convertLocalVertexToWorld(modelMatrix, m_worldVertices);
 
     size_t size = m_worldVertices.size() * sizeof(vkvert::Vertex);
@@ -253,8 +384,62 @@ void RayTracingPass::UpdateBVH(vkglTF::Model &scene, const glm::mat4 &modelMatri
     memcpy(m_bvhStagingBuffers.index.mapped, scene.indexBuffer.data(), size);
 }
 
+void RayTracingPass::UpdateInstances(const glm::mat4 &modelMatrix)
+{
+    // Moving a node only changes its instance transform, the BLASes and vertices stay as they are.
+    std::vector<uint32_t> movedIds;
+    std::vector<RayShop::InstanceDescription> moved;
+    for (size_t i = 0; i < m_instances.size(); i++) {
+        glm::mat4 transform = detail::GetInstanceTransform(m_instanceNodes[i], modelMatrix);
+        m_instanceNodes[i]->updated = false;
+        if (memcmp(&transform[0][0], m_instances[i].transform, sizeof(m_instances[i].transform)) != 0) {
+            memcpy(m_instances[i].transform, &transform[0][0], sizeof(m_instances[i].transform));
+            m_shaderInstances[i].transform = transform;
+            movedIds.push_back(static_cast<uint32_t>(i));
+            moved.push_back(m_instances[i]);
+        }
+    }
+    if (movedIds.empty()) {
+        return;
+    }
+
+    // the shader takes hits to world space with the same transforms as the TLAS, UploadInstances stages them
+    m_instanceVersion++;
+
+#ifdef RT_UPDATE_TLAS
+    // only the paths from the moved instances to the root are refit
+    RayShop::Result res = m_traversal->UpdateTLAS(static_cast<uint32_t>(movedIds.size()), movedIds.data(),
+        moved.data());
+    if (res != RayShop::Result::SUCCESS) {
+        LOGE("Failed to UpdateTLAS, err: %s.", m_traversal->GetErrorCodeString(res));
+    }
+#else
+    // The librtcore.so in libs does not export UpdateTLAS (see RT_UPDATE_TLAS in CMakeLists.txt), so the TLAS is
+    // rebuilt over all instances, which costs a full build however few of them moved.
+    RayShop::Result res = m_traversal->CreateTLAS(static_cast<uint32_t>(m_instances.size()), m_instances.data());
+    if (res != RayShop::Result::SUCCESS) {
+        LOGE("Failed to CreateTLAS, err: %s.", m_traversal->GetErrorCodeString(res));
+    }
+#endif
+}
+
+void RayTracingPass::UploadInstances(uint32_t frame)
+{
+    if (frame >= m_instanceStagingBuffers.size() || m_stagedInstanceVersions[frame] == m_instanceVersion) {
+        return;
+    }
+    memcpy(m_instanceStagingBuffers[frame].mapped, m_shaderInstances.data(),
+        m_shaderInstances.size() * sizeof(ShaderInstance));
+    m_stagedInstanceVersions[frame] = m_instanceVersion;
+}
+
 void RayTracingPass::RefitBVH(VkCommandBuffer cmdBuffer)
 {
+    if (m_instancedBVH) {
+        // local space BLASes never deform, UpdateBVH moves their instances instead
+        return;
+    }
+
     RayShop::Result res = m_traversal->RefitBLAS(static_cast<uint32_t>(m_bvhGeometriesOnGPU.size()),
         m_bvhGeometriesOnGPU.data(), m_blases.data(), cmdBuffer);
     if (res != RayShop::Result::SUCCESS) {
@@ -523,6 +708,7 @@ bool RayTracingPass::SetupRayTracingPipeline(const std::string& shaderName,
         Utils::WriteDescriptorSet(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, m_bvhBuffers.vertex.descriptor),
         Utils::WriteDescriptorSet(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7, m_bvhBuffers.index.descriptor),
         Utils::WriteDescriptorSet(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 8, m_countBuffer.descriptor),
+        Utils::WriteDescriptorSet(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 9, m_instanceBuffer.descriptor),
     };
 
     m_rtDescSet->Update(writeDescriptorSets);
@@ -604,16 +790,36 @@ void RayTracingPass::RecordRayTracingCmd(VkCommandBuffer cmdBuffer, vkibl::Vulka
         m_rtPipeline->GetPipelineLayout(), bindSet + 2);
 }
 
-void RayTracingPass::Draw(VkCommandBuffer cmdBuffer, vkibl::VulkanImageBasedLighting *ibl, vkglTF::Model &scene)
+void RayTracingPass::Draw(VkCommandBuffer cmdBuffer, uint32_t frame, vkibl::VulkanImageBasedLighting *ibl,
+    vkglTF::Model &scene)
 {
     VkBufferCopy copyRegion = {};
     copyRegion.srcOffset = 0;
     copyRegion.dstOffset = 0;
 
-    copyRegion.size = m_bvhStagingBuffers.vertex.size;
-    vkCmdCopyBuffer(cmdBuffer, m_bvhStagingBuffers.vertex.buffer, m_bvhBuffers.vertex.buffer, 1, &copyRegion);
-    copyRegion.size = m_bvhStagingBuffers.index.size;
-    vkCmdCopyBuffer(cmdBuffer, m_bvhStagingBuffers.index.buffer, m_bvhBuffers.index.buffer, 1, &copyRegion);
+    if (frame < m_instanceStagingBuffers.size()) {
+        // the instance buffer is still read by the ray tracing of the previous frame until this barrier
+        Utils::BarrierInfo barrierInfo {};
+        barrierInfo.srcMask = VK_ACCESS_SHADER_READ_BIT;
+        barrierInfo.dstMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrierInfo.srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        barrierInfo.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        Utils::SetMemoryBarrier(cmdBuffer, barrierInfo);
+        copyRegion.size = m_instanceBuffer.size;
+        vkCmdCopyBuffer(cmdBuffer, m_instanceStagingBuffers[frame].buffer, m_instanceBuffer.buffer, 1, &copyRegion);
+        barrierInfo.srcMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrierInfo.dstMask = VK_ACCESS_SHADER_READ_BIT;
+        barrierInfo.srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        barrierInfo.dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        Utils::SetMemoryBarrier(cmdBuffer, barrierInfo);
+    }
+
+    if (!m_instancedBVH) {
+        copyRegion.size = m_bvhStagingBuffers.vertex.size;
+        vkCmdCopyBuffer(cmdBuffer, m_bvhStagingBuffers.vertex.buffer, m_bvhBuffers.vertex.buffer, 1, &copyRegion);
+        copyRegion.size = m_bvhStagingBuffers.index.size;
+        vkCmdCopyBuffer(cmdBuffer, m_bvhStagingBuffers.index.buffer, m_bvhBuffers.index.buffer, 1, &copyRegion);
+    }
 
     // reset count buffer to zero.
     if (m_showStat) {
@@ -651,4 +857,40 @@ float RayTracingPass::GetReflectArea() const
     auto resolution = static_cast<float> (m_width * m_height);
     return static_cast<float> (rtCount) / resolution;
 }
+
+#ifdef RT_CPU_PICKING
+vkglTF::Node *RayTracingPass::Pick(vkglTF::Model &scene, const glm::vec3 &origin, const glm::vec3 &dir) const
+{
+    RayShop::Ray ray {};
+    memcpy(ray.origin, &origin[0], sizeof(ray.origin));
+    memcpy(ray.dir, &dir[0], sizeof(ray.dir));
+    ray.tmin = 0.0f;
+    ray.tmax = FLT_MAX;
+    RayShop::HitDistancePrimitiveInstanceCoordinates hit {};
+    RayShop::Result res = m_traversal->Intersect(ray, RayShop::TRACERAY_FLAG_CLOSEST_HIT, &hit);
+    if (res != RayShop::Result::SUCCESS) {
+        LOGE("Failed to Intersect, err: %s.", m_traversal->GetErrorCodeString(res));
+        return nullptr;
+    }
+    if (hit.t < 0.0f) {
+        return nullptr;
+    }
+    if (m_instancedBVH) {
+        return hit.instId < m_instanceNodes.size() ? m_instanceNodes[hit.instId] : nullptr;
+    }
+    // the baked BLAS keeps the index buffer of the model, so the triangle falls into the range of one primitive
+    uint32_t index = hit.primId * 3;
+    for (vkglTF::Node *node : scene.linearNodes) {
+        if (node->mesh == nullptr) {
+            continue;
+        }
+        for (const vkglTF::Primitive *primitive : node->mesh->primitives) {
+            if (index >= primitive->firstIndex && index < primitive->firstIndex + primitive->indexCount) {
+                return node;
+            }
+        }
+    }
+    return nullptr;
+}
+#endif
 } // namespace rt
@@ -18,7 +18,10 @@
 namespace rt {
 class RayTracingPass : private NonCopyable {
 public:
-    RayTracingPass(vks::VulkanDevice *vulkandevice, uint32_t width, uint32_t height);
+    // instancedBVH: one BLAS per mesh in local space, the node transforms go to the TLAS
+    // frameCount: the number of swapchain images, each draw command buffer stages the instances of its own
+    RayTracingPass(vks::VulkanDevice *vulkandevice, uint32_t width, uint32_t height, bool instancedBVH = false,
+        uint32_t frameCount = 1);
     ~RayTracingPass() noexcept;
 
     bool InitTraversal();
@@ -46,12 +49,32 @@ public:
     }
 
     void RefitBVH(VkCommandBuffer cmdBuffer = VK_NULL_HANDLE);
-    void Draw(VkCommandBuffer cmdBuffer, vkibl::VulkanImageBasedLighting *ibl, vkglTF::Model &scene);
+    // Copy the instances UpdateBVH moved into the staging buffer of a swapchain image. Call it once the fences
+    // of that image have been waited for and UpdateBVH has returned, i.e. between prepareFrame and submitFrame.
+    void UploadInstances(uint32_t frame);
+    void Draw(VkCommandBuffer cmdBuffer, uint32_t frame, vkibl::VulkanImageBasedLighting *ibl, vkglTF::Model &scene);
     float GetReflectArea() const;
+#ifdef RT_CPU_PICKING
+    // The glTF node hit by a ray in world space, or nullptr. Safe to call while UpdateBVH runs on another thread.
+    vkglTF::Node *Pick(vkglTF::Model &scene, const glm::vec3 &origin, const glm::vec3 &dir) const;
+#endif
     void SetStat(bool stat) { m_showStat = stat; }
 
 private:
+    // A BVH instance as the InstanceBuffer of common.glsl lays it out (std430)
+    struct ShaderInstance {
+        glm::mat4 transform;        // from the space of its vertices to world space, used for local vertices only
+        uint32_t firstTriangle;     // in the index buffer, hit triangle ids are relative to it
+        uint32_t localVertices;     // 1 for a BLAS in the space of its mesh, 0 for vertices baked into world space
+        uint32_t padding[2];
+    };
+    static_assert(sizeof(ShaderInstance) == 80, "std430 rounds the struct up to the alignment of its mat4");
+
     void SetupUniformBuffers();
+    bool CreateBVHBuffers(vkglTF::Model &scene);
+    bool BuildSceneBVH(vkglTF::Model &scene);
+    bool BuildMeshBVH(vkglTF::Model &scene, const glm::mat4 &modelMatrix);
+    void UpdateInstances(const glm::mat4 &modelMatrix);
     bool CreateRayTracingDescSet();
 
     VkRenderPassBeginInfo BuildRenderPassBeginInfo(const std::vector<VkClearValue> &clearValues);
@@ -89,6 +112,19 @@ private:
     std::vector<RayShop::GeometryTriangleDescription> m_bvhGeometriesOnCPU;
     std::vector<RayShop::GeometryTriangleDescription> m_bvhGeometriesOnGPU;
     std::vector<RayShop::BLAS> m_blases;
+    // instanced bvh: a mesh node per instance
+    bool m_instancedBVH = false;
+    std::vector<vkglTF::Node *> m_instanceNodes;
+    std::vector<RayShop::InstanceDescription> m_instances;
+    std::vector<std::vector<uint32_t>> m_localIndices;
+    // what the ray tracing shader needs to shade a hit of each instance. The host never writes a buffer the gpu may
+    // still read: every draw command buffer copies from a staging buffer of its own, written while it is idle.
+    std::vector<ShaderInstance> m_shaderInstances;
+    vks::Buffer m_instanceBuffer;
+    std::vector<vks::Buffer> m_instanceStagingBuffers;
+    uint32_t m_instanceVersion = 0;
+    std::vector<uint32_t> m_stagedInstanceVersions;       // the m_instanceVersion each staging buffer holds
+    uint32_t m_frameCount = 1;
 
     std::unique_ptr<GraphicPipeline> m_depthOnlyPipeline;
     std::unique_ptr<DescSet> m_depthOnlyDescSet;
@@ -24,6 +24,7 @@
 
 namespace RayShop {
 using BLAS = uint32_t;
+using ASBuildJob = uint32_t;
 constexpr int NUM_MAT = 4;
 
 /// @brief The flags used in tracing rays.
@@ -38,6 +39,8 @@ enum TraceRayFlag {
     TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES  = 0x4,
     /* *< Ditto. It is exclusive to back face culling flag. */
     TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES = 0x8,
+    /* *< Sort incoherent rays, e.g. reflections, by origin and direction before tracing. Hits keep the ray order. */
+    TRACERAY_FLAG_REORDER_RAYS                = 0x10,
 };
 
 /// @brief The data format hit result.
@@ -53,6 +56,15 @@ enum class TraceRayHitFormat {
     T_PRIMID_INSTID,
     /* *< ray distance (t<0 for miss), primitive id, instance id, and the barycentric u,v. */
     T_PRIMID_INSTID_U_V,
+    /* *< one bit per ray, set when anything lies between tmin and tmax: ray i is bit i % 32 of the uint32_t
+     * word i / 32. Always traced as any hit, for shadow and ambient occlusion rays. */
+    OCCLUDED_BITS,
+    /* *< ray distance (t<0 for miss), primitive id and instance id packed into one uint32_t, @see
+     * HitDistancePackedPrimitiveInstance. Needs at most 2^24 triangles per mesh and 256 instances. */
+    T_PRIMID_INSTID_PACKED,
+    /* *< T_PRIMID_INSTID_PACKED with the barycentric u,v as unorm16 packed into one uint32_t, @see
+     * HitDistancePackedPrimitiveInstanceCoordinates. */
+    T_PRIMID_INSTID_U_V_PACKED,
 };
 
 /// @brief ray structure. The users should generate rays in this format and pack them into a buffer.
@@ -98,11 +110,140 @@ struct HitDistancePrimitiveInstanceCoordinates {
     float v;
 };
 
+/// @brief The bits of a packed primitive instance id holding the primitive id, the instance id is in the others.
+constexpr uint32_t PACKED_PRIMITIVE_BITS = 24;
+constexpr uint32_t PACKED_PRIMITIVE_MASK = (1u << PACKED_PRIMITIVE_BITS) - 1;
+
+/// @brief The data definition for TraceRayHitFormat::T_PRIMID_INSTID_PACKED format. The primitive id is
+/// primInstId & PACKED_PRIMITIVE_MASK and the instance id primInstId >> PACKED_PRIMITIVE_BITS.
+struct HitDistancePackedPrimitiveInstance {
+    float t;
+    uint32_t primInstId;
+};
+
+/// @brief The data definition for TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED format. u is (uv & 0xFFFF) / 65535
+/// and v is (uv >> 16) / 65535, i.e. unpackUnorm2x16 in GLSL.
+struct HitDistancePackedPrimitiveInstanceCoordinates {
+    float t;
+    uint32_t primInstId;
+    uint32_t uv;
+};
+
+/// @brief A point for Traversal::ClosestPoint and Traversal::RadiusQuery, in the space of the TLAS.
+struct PointQuery {
+    float point[3];     /* *< The vector 3 of the query point, i.e., xyz. */
+    float radius;       /* *< Only triangles at most this far from the point count, may be infinite. */
+};
+
+/// @brief The nearest surface point of a PointQuery.
+struct ClosestPointHit {
+    float distance;     /* *< The distance to the query point (distance<0 when no triangle lies within radius). */
+    uint32_t primId;    /* *< The triangle index of the mesh. */
+    uint32_t instId;    /* *< The tlas's instance index by insertion order. */
+    float u;            /* *< The barycentric u,v of the point in the triangle, w.r.t. the mesh vertex order. */
+    float v;
+    float point[3];     /* *< The vector 3 of the nearest point, in the space of the TLAS. */
+};
+
+/// @brief A triangle within the radius of a PointQuery.
+struct RadiusQueryHit {
+    float distance;     /* *< The distance from the query point to the nearest point of the triangle. */
+    uint32_t primId;
+    uint32_t instId;
+};
+
+/// @brief The longest name of the shared memory of Traversal::StartServer, a slash included.
+constexpr uint32_t RAY_SERVER_MAX_NAME_LENGTH = 255;
+
+/// @brief The shared memory of Traversal::StartServer: one slot per batch of rays in flight, over all clients.
+struct RayServerOptions {
+    uint32_t slotCount = 8;             /* *< Rounded up to a power of two, at most 64. */
+    uint32_t slotRayCount = 65536;      /* *< Rays per batch, rounded up to a multiple of 32. Each slot takes 52
+                                         *   bytes per ray, room for the rays and the widest hits. */
+};
+
 /// @brief Acceleration structure build method. Each method has cons and pros. Users
 /// should choose the appropriate one due to the use scenario.
 enum class ASBuildMethod {
     SAH_CPU,                        /* *< Best quality and slow building by cpu. */
     SAH_GPU,                        /* *< Best quality and slow building by gpu. */
+    LBVH_CPU,                       /* *< Lowest quality and fastest building by cpu, sorted along a Morton curve. */
+    PLOC_CPU,                       /* *< Good quality and fast building by cpu, clustered along a Morton curve.
+                                          Fast enough to rebuild deforming meshes every frame instead of refitting. */
+    SAH_SPATIAL_SPLITS,             /* *< Best quality and slowest building by cpu. Triangles may be split across
+                                          several leaves, which pays off for long thin triangles in static meshes. */
+};
+
+/// @brief The flags used in building bottom level acceleration structures.
+enum ASBuildFlag {
+    /* *< The default node layout. */
+    AS_BUILD_FLAG_NONE                        = 0,
+    /* *< Store the nodes as QuantizedBvhNode, which halves the bytes read per traversal step at the price of
+     * slightly looser boxes. Worth it when memory bandwidth rather than arithmetic limits tracing. */
+    AS_BUILD_FLAG_QUANTIZED_NODES             = 0x1,
+    /* *< Restructure small treelets of the built tree to lower its SAH cost (TRBVH), which takes about as long
+     * again as an SAH build. Worth it for static meshes traced for a whole session. @see ASSahCosts */
+    AS_BUILD_FLAG_OPTIMIZE_TREELETS           = 0x2,
+};
+
+/// @brief Bottom level build settings. The defaults suit most scenes.
+struct ASBuildOptions {
+    ASBuildMethod method = ASBuildMethod::SAH_CPU; /* *< The build method. */
+    float splitBudget = 0.3f;       /* *< SAH_SPATIAL_SPLITS only: extra triangle references allowed, as a fraction
+                                          of the triangle count. It bounds the memory growth; 0 disables splits. */
+    uint32_t flags = AS_BUILD_FLAG_NONE; /* *< Combination of ASBuildFlag. */
+    float rebuildSahRatio = 1.5f;   /* *< Once refits raise the SAH cost of the blas this many times over its last
+                                          build, it is rebuilt on a background thread and swapped in by a later
+                                          RefitBLAS. 0 never rebuilds. */
+};
+
+constexpr uint32_t QUANTIZED_BVH_WIDTH = 4;
+
+/**
+ * @brief A 4-wide bvh node of 64 bytes, i.e. four uvec4 of the shader side bvhNode[] buffer.
+ * Child boxes are stored as 8-bit offsets on a per-axis grid anchored at the parent box:
+ *     lower = origin + float(qlower) * scale,   upper = origin + float(qupper) * scale,
+ *     scale = uintBitsToFloat(exponent << 23),  i.e. a power of two, so the products are exact.
+ * Decoded boxes always enclose the exact ones. An unused slot has qlower 255, qupper 0 and meta 0.
+ * meta of an inner child is 0x80 | k: the child is node childBase + k.
+ * meta of a leaf child is (count << 4) | k with count in 1..4: its triangles are primIndices[primBase + k]
+ * to primIndices[primBase + k + count - 1] of the same blas.
+ */
+struct QuantizedBvhNode {
+    float origin[3];                /* *< uvec4 0.xyz: the lower corner of the parent box. */
+    uint8_t exponents[3];           /* *< uvec4 0.w: the exponent of each axis' scale, biased by 127. */
+    uint8_t reserved0;
+    uint32_t childBase;             /* *< uvec4 1.x: the first inner child node. */
+    uint32_t primBase;              /* *< uvec4 1.y: the first primIndices entry of the leaf children. */
+    uint8_t meta[QUANTIZED_BVH_WIDTH]; /* *< uvec4 1.z: the kind and location of each child. */
+    uint32_t reserved1;
+    uint8_t qlower[3][QUANTIZED_BVH_WIDTH]; /* *< uvec4 2.xyz: the lower corners per axis, slot i in byte i. */
+    uint32_t reserved2;
+    uint8_t qupper[3][QUANTIZED_BVH_WIDTH]; /* *< uvec4 3.xyz: the upper corners per axis, slot i in byte i. */
+    uint32_t reserved3;
+};
+
+/// @brief The SAH cost of a bottom level acceleration structure, i.e. the expected cost of a ray hitting its box.
+struct ASSahCosts {
+    float built;                    /* *< Of the tree the build method produced. */
+    float optimized;                /* *< After AS_BUILD_FLAG_OPTIMIZE_TREELETS, the same as built without it. */
+    float current;                  /* *< After the refits since, which drive it up. */
+};
+
+/// @brief The host memory the cpu backend holds for one acceleration structure, in bytes.
+struct ASMemoryUsage {
+    uint64_t geometryBytes;         /* *< The own copy of the positions and indices, or the instances of a tlas. */
+    uint64_t bvhBytes;              /* *< The nodes and primIndices of the binary, wide and quantized layouts. */
+    uint64_t triangleBlockBytes;    /* *< The leaf triangles packed 4 per block for the vector kernels. */
+    uint64_t refitBytes;            /* *< The node parents and slot sources only refits read. */
+    uint64_t slackBytes;            /* *< Allocated beyond what the parts above use, e.g. left over by the build. */
+};
+
+/// @brief The host memory the cpu backend holds for all acceleration structures of a traversal, in bytes.
+struct ASMemoryStats {
+    uint32_t blasCount;             /* *< The blases alive, including destroyed ones the tlas still refers to. */
+    ASMemoryUsage blases;           /* *< The sum over those blases. */
+    ASMemoryUsage tlas;             /* *< All zero before the first CreateTLAS. */
 };
 
 /// @brief data source
@@ -123,6 +264,20 @@ struct Buffer {
     };
 };
 
+/// @brief The format of the vertex positions of a geometry.
+enum class VertexFormat {
+    FLOAT3 = 0,                     /* *< Three 32-bit floats. */
+    HALF3,                          /* *< Three IEEE 754 half floats, e.g. of a mesh quantized for upload. */
+    SNORM16_3,                      /* *< Three 16-bit signed normalized integers, i.e. value / 32767 clamped to -1.
+                                          Scale and offset go into the instance transform. */
+};
+
+/// @brief The format of the indices of a geometry.
+enum class IndexFormat {
+    UINT32 = 0,
+    UINT16,
+};
+
 /// @brief The geometry description, typically a triangular mesh, w.r.t a bottom level acceleration structure.
 struct GeometryTriangleDescription {
     Buffer vertices;                 /* *< The vertices buffer. */
@@ -133,9 +288,26 @@ struct GeometryTriangleDescription {
     uint32_t indicesCount;           /* *< The indices count. */
 };
 
+/// @brief A geometry in any vertex and index format, for the overloads taking it. GeometryTriangleDescription keeps
+/// its layout, as the prebuilt libraries take arrays of it; it is the FLOAT3 and UINT32 case of this one.
+struct GeometryTriangleDescription2 {
+    Buffer vertices;                 /* *< The vertices buffer. */
+    VertexFormat vertexFormat = VertexFormat::FLOAT3; /* *< The format of the positions. */
+    uint32_t vertexStrideBytes = 3 * sizeof(float); /* *< The bytes from one vertex to the next. */
+    uint32_t vertexOffsetBytes = 0;  /* *< The bytes from the start of vertices to the first position, e.g. the
+                                          offset of the position attribute in an interleaved vertex. */
+    uint32_t verticesCount = 0;      /* *< The vertices count. */
+
+    Buffer indices;                  /* *< The indices buffer. */
+    IndexFormat indexFormat = IndexFormat::UINT32; /* *< The format of the indices. */
+    uint32_t indexOffsetBytes = 0;   /* *< The bytes from the start of indices to the first index. */
+    uint32_t indicesCount = 0;       /* *< The indices count. */
+};
+
 /// @brief The instance description. An instance refers to a blas with an affine transformation.
 struct InstanceDescription {
-    float transform[NUM_MAT][NUM_MAT]; /* *< The 4x4 affine transform matrix, e.g., rotation, scaling and translation. */
+    float transform[NUM_MAT][NUM_MAT]; /* *< The 4x4 affine transform matrix, e.g., rotation, scaling and translation.
+                                        *   Laid out like glm::mat4, i.e. transform[column][row]. */
     BLAS blas;                       /* *< The referred blas. */
 };
 
@@ -147,6 +319,7 @@ enum class Result {
     OUT_OF_MEMORY,                  /* *< Not enough memory. */
     SHADER_COMPILE_ERROR,           /* *< Shader compile error. */
     UNKNOWN_ERROR,                  /* *< Other unknown errors. */
+    BUILD_IN_PROGRESS,              /* *< An asynchronous build is still running. @see GetBuildStatus */
 };
 
 /// @brief The mesh node description.
@@ -255,6 +428,7 @@ namespace Vulkan {
          * @param[in]   computeQueue            The compute command queue that raytracing commands will be submitted to.
          * @param[in]   computeIndice           The compute queue indices.
          * @return      Result                  Check out error code. @see Result
+         * @note        The cpu backend (rtcore/cpu) runs headless and accepts VK_NULL_HANDLE for every handle.
          */
         Result Setup(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue computeQueue,
                      uint32_t computeIndices) const noexcept;
@@ -279,6 +453,163 @@ namespace Vulkan {
                           const GeometryTriangleDescription *geometries,
                           BLAS *blases) const noexcept;
 
+        /**
+         * Create the bottom level acceleration structure with detailed build settings.
+         * @param[in]   options                 The build method and its settings. @see ASBuildOptions
+         * @param[in]   geometriesCount         The number of geometries, e.g., the triangle mesh count.
+         * @param[in]   *geometries             An array of geometries.
+         * @param[out]  *blases                 An array of output bottom level acceleration structures,
+         *                                      each of which corresponds to a geometry object.
+         * @return      Result                  Check out error code. @see Result
+         * @note
+         */
+        Result CreateBLAS(const ASBuildOptions &options,
+                          uint32_t geometriesCount,
+                          const GeometryTriangleDescription *geometries,
+                          BLAS *blases) const noexcept;
+
+        /**
+         * Ditto, for geometries in any vertex and index format, e.g. half positions read in place from an
+         * interleaved vertex buffer, or 16-bit indices.
+         */
+        Result CreateBLAS(const ASBuildOptions &options,
+                          uint32_t geometriesCount,
+                          const GeometryTriangleDescription2 *geometries,
+                          BLAS *blases) const noexcept;
+
+        /**
+         * Start creating bottom level acceleration structures on a background thread, e.g. while textures load
+         * and pipelines compile. The geometries are checked and copied before the call returns, so their buffers
+         * may be released at once. The handles are valid right away, but calls other than DestroyBLAS and
+         * CreateTLASAsync treat them as unknown until the build is done; CreateTLAS returns NOT_READY then.
+         * @param[in]   options                 The build method and its settings. @see ASBuildOptions
+         * @param[in]   geometriesCount         The number of geometries, e.g., the triangle mesh count.
+         * @param[in]   *geometries             An array of geometries.
+         * @param[out]  *blases                 An array of output bottom level acceleration structures,
+         *                                      each of which corresponds to a geometry object.
+         * @param[out]  *job                    The build, to poll with GetBuildStatus or wait for with WaitBuild.
+         * @return      Result                  Check out error code. @see Result
+         * @note        The build is spread across worker threads of its own, so tracing goes on undisturbed.
+         *              On failure the handles are released again, and the job reports why.
+         */
+        Result CreateBLASAsync(const ASBuildOptions &options,
+                               uint32_t geometriesCount,
+                               const GeometryTriangleDescription *geometries,
+                               BLAS *blases,
+                               ASBuildJob *job) const noexcept;
+
+        /**
+         * Ditto, for geometries in any vertex and index format.
+         */
+        Result CreateBLASAsync(const ASBuildOptions &options,
+                               uint32_t geometriesCount,
+                               const GeometryTriangleDescription2 *geometries,
+                               BLAS *blases,
+                               ASBuildJob *job) const noexcept;
+
+        /**
+         * Copy out the quantized nodes of a blas built with AS_BUILD_FLAG_QUANTIZED_NODES, e.g. to upload them
+         * as the uvec4 bvhNode[] buffer read by data/shaders/glsl/base/quantizedbvh.glsl.
+         * Call it with null arrays first to query the counts.
+         * @param[in]       blas                The bottom level acceleration structure.
+         * @param[in,out]   *nodesCount         The capacity of nodes on input, the node count on output.
+         * @param[out]      *nodes              The nodes, root first, or nullptr to query the count.
+         * @param[in,out]   *primIndicesCount   The capacity of primIndices on input, the entry count on output.
+         * @param[out]      *primIndices        The triangle of each leaf entry, or nullptr to query the count.
+         * @return          Result              Check out error code. @see Result
+         * @note
+         */
+        Result GetQuantizedBLAS(BLAS blas,
+                                uint32_t *nodesCount,
+                                QuantizedBvhNode *nodes,
+                                uint32_t *primIndicesCount,
+                                uint32_t *primIndices) const noexcept;
+
+        /**
+         * Query the memory a bottom level acceleration structure holds on the cpu backend.
+         * @param[in]   blas                The bottom level acceleration structure.
+         * @param[out]  *usage              The bytes of each part of it.
+         * @return      Result              Check out error code. @see Result
+         * @note
+         */
+        Result GetBLASMemoryUsage(BLAS blas, ASMemoryUsage *usage) const noexcept;
+
+        /**
+         * Query the memory all acceleration structures hold on the cpu backend, e.g. to weigh it against the
+         * texture budget. Blases still being built by CreateBLASAsync or rebuilt in the background are left out.
+         * @param[out]  *stats              The bytes of the blases and of the tlas.
+         * @return      Result              Check out error code. @see Result
+         * @note
+         */
+        Result GetMemoryStats(ASMemoryStats *stats) const noexcept;
+
+        /**
+         * Move finished bottom level acceleration structures into allocations of their exact size, and free the
+         * parents and sources only refits read. The hits stay the same. The next RefitBLAS of a compacted blas
+         * derives the refit data again, so compact the blases that stay static.
+         * @param[in]   blasesCount         The number of blases.
+         * @param[in]   *blases             The bottom level acceleration structures.
+         * @return      Result              Check out error code. @see Result
+         * @note        slackBytes and refitBytes of ASMemoryUsage drop to 0. @see GetBLASMemoryUsage
+         */
+        Result CompactBLAS(uint32_t blasesCount, const BLAS *blases) const noexcept;
+
+        /**
+         * Query how far refits have degraded a bottom level acceleration structure.
+         * @param[in]   blas                The bottom level acceleration structure.
+         * @param[out]  *ratio              Its SAH cost over the one of its last build, 1 right after a build.
+         * @return      Result              Check out error code. @see Result
+         * @note        Tracing time grows about in proportion. @see ASBuildOptions::rebuildSahRatio
+         */
+        Result GetBLASSahRatio(BLAS blas, float *ratio) const noexcept;
+
+        /**
+         * Query the SAH cost of a bottom level acceleration structure before and after its treelets were
+         * optimized, e.g. to decide per asset whether AS_BUILD_FLAG_OPTIMIZE_TREELETS pays off.
+         * @param[in]   blas                The bottom level acceleration structure.
+         * @param[out]  *costs              Its SAH costs, 0 for a blas without triangles.
+         * @return      Result              Check out error code. @see Result
+         * @note
+         */
+        Result GetBLASSahCosts(BLAS blas, ASSahCosts *costs) const noexcept;
+
+        /**
+         * Save a bottom level acceleration structure to a file, so that LoadBLAS can map it on the next start
+         * instead of building it again. The file holds the geometry and the bvh, keyed by a hash of them and of
+         * the build options, in a versioned layout of aligned sections. The traversal layouts of the running cpu
+         * are not saved, LoadBLAS derives them in one linear pass.
+         * @param[in]   blas                The bottom level acceleration structure.
+         * @param[in]   *path               The file to write. It is written beside path and renamed over it.
+         * @return      Result              Check out error code. @see Result
+         * @note        UNKNOWN_ERROR when the file cannot be written.
+         */
+        Result SaveBLAS(BLAS blas, const char *path) const noexcept;
+
+        /**
+         * Create a bottom level acceleration structure from a file written by SaveBLAS, copying the bvh out of it
+         * instead of running the build. The file only loads for the geometry and build options it was saved with.
+         * @param[in]   options             The build options, as they would be passed to CreateBLAS.
+         * @param[in]   geometry            The geometry, as it would be passed to CreateBLAS.
+         * @param[in]   *path               The file to map.
+         * @param[out]  *blas               The output bottom level acceleration structure.
+         * @return      Result              Check out error code. @see Result
+         * @note        INVALID_PARAMETER when the file is missing, damaged, of another version, or saved for another
+         *              geometry or other build options; CreateBLAS and SaveBLAS are the way to refresh it then.
+         */
+        Result LoadBLAS(const ASBuildOptions &options,
+                        const GeometryTriangleDescription &geometry,
+                        const char *path,
+                        BLAS *blas) const noexcept;
+
+        /**
+         * Ditto, for a geometry in any vertex and index format. A file matches the decoded positions and indices,
+         * so it loads for the same mesh whichever format it is given in.
+         */
+        Result LoadBLAS(const ASBuildOptions &options,
+                        const GeometryTriangleDescription2 &geometry,
+                        const char *path,
+                        BLAS *blas) const noexcept;
+
         /**
          * Create the top level acceleration structure from a bunch of BLASes.
          * @param[in]   instancesCount      The number of instances.
@@ -289,10 +620,61 @@ namespace Vulkan {
         Result CreateTLAS(uint32_t instancesCount,
                           const InstanceDescription *instances) const noexcept;
 
+        /**
+         * Move some instances of the top level acceleration structure, or point them at other blases, e.g. to
+         * animate rigid objects in a large scene. Unlike CreateTLAS it takes time in proportion to the changed
+         * instances, since only the paths from their leaves to the root are refit.
+         * @param[in]   instancesCount      The number of changed instances.
+         * @param[in]   *instanceIds        The index of each changed instance in the array given to CreateTLAS,
+         *                                  i.e. the instance id its hits report.
+         * @param[in]   *instances          The new description of each changed instance.
+         * @return      Result              Check out error code. @see Result
+         * @note        Once the refits double the SAH cost of the tree, the cpu backend rebuilds it over the current
+         *              instances instead. Nothing changes when a parameter is invalid.
+         */
+        Result UpdateTLAS(uint32_t instancesCount,
+                          const uint32_t *instanceIds,
+                          const InstanceDescription *instances) const noexcept;
+
+        /**
+         * Start creating the top level acceleration structure on a background thread. It first waits for every
+         * build started before it, so the blases of CreateBLASAsync may be instanced right away. The instances are
+         * copied before the call returns. A tlas created after it wins, even if it finishes first.
+         * @param[in]   instancesCount      The number of instances.
+         * @param[in]   *instances          An array of instance descriptions.
+         * @param[out]  *job                The build, to poll with GetBuildStatus or wait for with WaitBuild.
+         * @return      Result              Check out error code. @see Result
+         * @note
+         */
+        Result CreateTLASAsync(uint32_t instancesCount,
+                               const InstanceDescription *instances,
+                               ASBuildJob *job) const noexcept;
+
+        /**
+         * Poll a build of CreateBLASAsync or CreateTLASAsync, e.g. once a frame to enable ray tracing when done.
+         * @param[in]   job                 The build.
+         * @return      Result              BUILD_IN_PROGRESS while it runs, then its result. INVALID_PARAMETER once
+         *                                  it was released by WaitBuild.
+         * @note
+         */
+        Result GetBuildStatus(ASBuildJob job) const noexcept;
+
+        /**
+         * Wait for a build of CreateBLASAsync or CreateTLASAsync to finish, and release the job.
+         * Every job has to be released this way, which returns at once when GetBuildStatus reported it done.
+         * @param[in]   job                 The build.
+         * @return      Result              The result of the build. @see Result
+         * @note
+         */
+        Result WaitBuild(ASBuildJob job) const noexcept;
+
         /**
          * Refit the bottom level acceleration structure. It needs to be called when the geometry of
          * the blas changes but users don't want to rebuild it entirely. Note that
          * a refit AS' quality degrades. In every other a few frames, BLAS needs to be rebuilt anyway.
+         * The cpu backend does so by itself: once the SAH cost of a blas passes ASBuildOptions::rebuildSahRatio
+         * times the one of its last build, a copy of its geometry is rebuilt on a background thread, and the
+         * first RefitBLAS of the blas after that finished swaps the new tree in. Tracing never waits for it.
          * @param[in]   geometriesCount         The number of geometries, e.g., triangular mesh count.
          * @param[in]   *geometries             An array of geometries.
          * @param[in]   *blases                 An array of bottom level acceleration structures,
@@ -306,6 +688,15 @@ namespace Vulkan {
                          const BLAS *blases,
                          VkCommandBuffer cmdBuffer = VK_NULL_HANDLE) const noexcept;
 
+        /**
+         * Ditto, for geometries in any vertex and index format. The format may differ from the one the blas was
+         * built with, as long as the triangles stay the same.
+         */
+        Result RefitBLAS(uint32_t geometriesCount,
+                         const GeometryTriangleDescription2 *geometries,
+                         const BLAS *blases,
+                         VkCommandBuffer cmdBuffer = VK_NULL_HANDLE) const noexcept;
+
         /**
          * Destroy the bottom level acceleration structure. We recommend users explicitly destroy blas
          * when the blas is not in use anymore. An unreferenced blas will still occupy memory and drag
@@ -351,15 +742,36 @@ namespace Vulkan {
          *                                  backface culling/frontface culling
          * @param[in]   rays                The ray buffer
          * @param[in]   hits                The hit buffer, the buffer should allocate before call TraceRays(),
-         *                                  it's size should be rayCount * hitFormatStride
+         *                                  it's size should be rayCount * hitFormatStride, or
+         *                                  (rayCount + 31) / 32 words for OCCLUDED_BITS
          * @param[in]   hitFormat           The hit buffer format
          * @return      Result              Check out error code. @see Result
          * @see
-         * @note
+         * @note        With OCCLUDED_BITS, the bits past the last ray of the last word are left as they are.
+         *              The packed formats return INVALID_PARAMETER when the tlas has more than 256 instances
+         *              or an instanced mesh more than 2^24 triangles.
          */
         Result TraceRays(uint32_t rayCount, uint32_t rayFlags, const Buffer rays, Buffer hits,
                          TraceRayHitFormat hitFormat, VkCommandBuffer cmdBuf = VK_NULL_HANDLE) const noexcept;
 
+        /**
+         * Trace a row-major image of rays, e.g. the primary rays of a pinhole camera. Rays of the same
+         * 8x8 tile are traced together as a packet, which is faster when they are coherent.
+         * @param[in]   region              The image size; rays and hits hold width * height records, row by row.
+         * @param[in]   rayFlags            The traversal flag, combination of any hit/closest hit,
+         *                                  backface culling/frontface culling
+         * @param[in]   rays                The ray buffer
+         * @param[in]   hits                The hit buffer, it's size should be width * height * hitFormatStride,
+         *                                  or (width * height + 31) / 32 words for OCCLUDED_BITS
+         * @param[in]   hitFormat           The hit buffer format
+         * @return      Result              Check out error code. @see Result
+         * @see
+         * @note        The hits are those of the rayCount overload, up to ties between equally distant triangles.
+         *              TRACERAY_FLAG_REORDER_RAYS is ignored, the tiles are coherent already.
+         */
+        Result TraceRays(const Size &region, uint32_t rayFlags, const Buffer rays, Buffer hits,
+                         TraceRayHitFormat hitFormat, VkCommandBuffer cmdBuf = VK_NULL_HANDLE) const noexcept;
+
         /**
         * Trace refected rays on gived reflective mesh on graphic pipeline
         * @param[in]   rayMesh             The ray generated by mesh info, ray only suport TraceRayFlag
@@ -377,11 +789,88 @@ namespace Vulkan {
                          const std::vector<Buffer> &hits,
                          VkContext vkContext) const noexcept;
 
+        /**
+         * Intersect a single ray with the current TLAS on the calling thread, e.g. to pick an object under the
+         * cursor. It may be called from any thread, also while another one traces, refits or rebuilds.
+         * @param[in]   ray                 The ray, in the space of the TLAS.
+         * @param[in]   rayFlags            The traversal flag, combination of any hit/closest hit,
+         *                                  backface culling/frontface culling
+         * @param[out]  hit                 The hit, t < 0 for a miss.
+         * @return      Result              Check out error code. @see Result
+         * @note        No buffer or thread pool is involved, so a query costs little more than its traversal.
+         *              It waits while a TLAS or BLAS is being replaced.
+         */
+        Result Intersect(const Ray &ray, uint32_t rayFlags,
+                         HitDistancePrimitiveInstanceCoordinates *hit) const noexcept;
+
+        /**
+         * Intersect a few rays with the current TLAS on the calling thread, one after another.
+         * @param[in]   rayCount            The ray number.
+         * @param[in]   rays                The rays, in the space of the TLAS.
+         * @param[in]   rayFlags            The traversal flag, combination of any hit/closest hit,
+         *                                  backface culling/frontface culling
+         * @param[out]  hits                One hit per ray, t < 0 for a miss.
+         * @return      Result              Check out error code. @see Result
+         * @note        Meant for small batches; TraceRays spreads large ones over the worker threads.
+         */
+        Result Intersect(uint32_t rayCount, const Ray *rays, uint32_t rayFlags,
+                         HitDistancePrimitiveInstanceCoordinates *hits) const noexcept;
+
+        /**
+         * Find the nearest point of the scene to each of a batch of points, spreading them over the worker
+         * threads; the surface distance fields of SDF baking are one use.
+         * @param[in]   queryCount          The query number.
+         * @param[in]   queries             The points and their search radius, in the space of the TLAS.
+         * @param[out]  hits                One hit per query, distance < 0 when nothing lies within the radius.
+         * @return      Result              Check out error code. @see Result
+         * @note        A finite radius prunes most of the tree, so the queries are faster the smaller it is.
+         */
+        Result ClosestPoint(uint32_t queryCount, const PointQuery *queries, ClosestPointHit *hits) const noexcept;
+
+        /**
+         * Find the triangles within the radius of each of a batch of points, spreading them over the worker
+         * threads, e.g. for proximity effects.
+         * @param[in]   queryCount          The query number.
+         * @param[in]   queries             The points and their radius, in the space of the TLAS.
+         * @param[in]   maxHitsPerQuery     The number of hits reserved per query in hits, may be 0 to only count.
+         * @param[out]  hitCounts           One count per query, of all triangles within its radius.
+         * @param[out]  hits                queryCount * maxHitsPerQuery hits: those of query i start at
+         *                                  i * maxHitsPerQuery, nearest first. May be nullptr when
+         *                                  maxHitsPerQuery is 0.
+         * @return      Result              Check out error code. @see Result
+         * @note        When hitCounts[i] exceeds maxHitsPerQuery, only the nearest maxHitsPerQuery triangles are
+         *              written.
+         */
+        Result RadiusQuery(uint32_t queryCount, const PointQuery *queries, uint32_t maxHitsPerQuery,
+                           uint32_t *hitCounts, RadiusQueryHit *hits) const noexcept;
+
+        /**
+         * Serve the TLAS to the other processes of the machine, which attach a TraversalClient to the name and
+         * trace through this traversal. The BVHs are built and held here only, so their memory is paid once per
+         * machine; later changes of the TLAS and BLASes are served as they land.
+         * @param[in]   name                The POSIX shared-memory name, a slash followed by up to 254 characters
+         *                                  and no further slash, e.g. "/rayshop-scene".
+         * @param[in]   options             The batch slots of the shared memory.
+         * @return      Result              Check out error code. @see Result
+         * @note        Returns INVALID_PARAMETER when a server runs already, or the name is taken by a running
+         *              server of any process, and NOT_READY on Android, which has no POSIX shared memory. The
+         *              batches are traced one after another on a thread of the server, each spread over the worker
+         *              threads like TraceRays.
+         */
+        Result StartServer(const char *name, const RayServerOptions &options = RayServerOptions()) const noexcept;
+
+        /**
+         * Stop serving after the batch being traced and remove the name. Clients waiting for other batches get
+         * NOT_READY. Destroy stops the server as well.
+         * @return      Result              NOT_READY when no server runs. @see Result
+         */
+        Result StopServer() const noexcept;
+
         /**
          * The get the size in bytes of a hit buffer record.
          * @param[in]   hitFormat           A specific hit buffer format, @see TraceRayHitFormat.
          * @return      uint32_t            The hit format record size.
-         * @note
+         * @note        For OCCLUDED_BITS it is the size of a word, which holds the hits of 32 rays.
          */
         static uint32_t GetHitFormatBytes(TraceRayHitFormat hitFormat) noexcept;
 
@@ -403,6 +892,64 @@ namespace Vulkan {
     private:
         std::unique_ptr<TraversalImpl> m_impl;
     };
+
+    class TraversalClientImpl;
+
+    /// @brief Traces rays through the Traversal of another process, @see Traversal::StartServer. It holds no
+    /// acceleration structure of its own.
+    class TraversalClient {
+    public:
+        /**
+         * Default constructor.
+         */
+        explicit TraversalClient();
+
+        /**
+         * Destructor.
+         */
+        ~TraversalClient();
+
+        /**
+         * Map the shared memory of a running server. It takes a few system calls and copies nothing of the scene,
+         * so it is done in well under a millisecond.
+         * @param[in]   name                The name the server was started with.
+         * @return      Result              NOT_READY when no server runs under the name. @see Result
+         */
+        Result Attach(const char *name) const noexcept;
+
+        /*
+         * Unmap the shared memory, after the TraceRays calls in progress.
+         */
+        void Detach() const noexcept;
+
+        /**
+         * Trace rays through the server, like Traversal::TraceRays, and wait for the hits. It may be called from
+         * several threads at once.
+         * @param[in]   rayCount            The ray number.
+         * @param[in]   rayFlags            The traversal flag, combination of any hit/closest hit,
+         *                                  backface culling/frontface culling
+         * @param[in]   rays                The ray buffer, of BufferType::CPU.
+         * @param[in]   hits                The hit buffer, of BufferType::CPU; it's size as for Traversal::TraceRays.
+         * @param[in]   hitFormat           The hit buffer format
+         * @return      Result              Check out error code. @see Result
+         * @note        Calls of more rays than RayServerOptions::slotRayCount are split into batches, two of which
+         *              are in flight at a time. Returns NOT_READY when not attached, or once the server has stopped
+         *              or its process is gone.
+         */
+        Result TraceRays(uint32_t rayCount, uint32_t rayFlags, const Buffer rays, Buffer hits,
+                         TraceRayHitFormat hitFormat) const noexcept;
+
+        TraversalClient(const TraversalClient &) = delete;
+
+        TraversalClient &operator=(const TraversalClient &) = delete;
+
+        TraversalClient(TraversalClient &&) = delete;
+
+        TraversalClient &operator=(TraversalClient &&) = delete;
+
+    private:
+        std::unique_ptr<TraversalClientImpl> m_impl;
+    };
 }   // namespace Vulkan
 }   // namespace RayShop
 
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Bounding volume hierarchy data structures of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_BVH_H
+#define RAYSHOP_CPU_BVH_H
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace RayShop {
+namespace Cpu {
+constexpr uint32_t INVALID_INDEX = 0xFFFFFFFFu;
+constexpr float FLOAT_MAX = std::numeric_limits<float>::max();
+constexpr int AXIS_COUNT = 3;
+constexpr uint32_t BVH_MAX_DEPTH = 64;
+
+/// @brief Axis aligned bounding box.
+struct Aabb {
+    float lower[AXIS_COUNT];
+    float upper[AXIS_COUNT];
+};
+
+inline Aabb EmptyAabb()
+{
+    return Aabb {{FLOAT_MAX, FLOAT_MAX, FLOAT_MAX}, {-FLOAT_MAX, -FLOAT_MAX, -FLOAT_MAX}};
+}
+
+inline void Grow(Aabb &box, const float *point)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        box.lower[axis] = point[axis] < box.lower[axis] ? point[axis] : box.lower[axis];
+        box.upper[axis] = point[axis] > box.upper[axis] ? point[axis] : box.upper[axis];
+    }
+}
+
+inline void Grow(Aabb &box, const Aabb &other)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        box.lower[axis] = other.lower[axis] < box.lower[axis] ? other.lower[axis] : box.lower[axis];
+        box.upper[axis] = other.upper[axis] > box.upper[axis] ? other.upper[axis] : box.upper[axis];
+    }
+}
+
+inline bool IsEmpty(const Aabb &box)
+{
+    return box.lower[0] > box.upper[0] || box.lower[1] > box.upper[1] || box.lower[2] > box.upper[2];
+}
+
+/// Half of the surface area, which is all the SAH needs.
+inline float HalfArea(const Aabb &box)
+{
+    if (IsEmpty(box)) {
+        return 0.0f;
+    }
+    float dx = box.upper[0] - box.lower[0];
+    float dy = box.upper[1] - box.lower[1];
+    float dz = box.upper[2] - box.lower[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+inline float Center(const Aabb &box, int axis)
+{
+    return (box.lower[axis] + box.upper[axis]) * 0.5f;
+}
+
+/// Spread the low 10 bits so that two zero bits follow each of them, to interleave three axes into a Morton code.
+inline uint32_t ExpandMortonBits(uint32_t value)
+{
+    value = (value * 0x00010001u) & 0xFF0000FFu;
+    value = (value * 0x00000101u) & 0x0F00F00Fu;
+    value = (value * 0x00000011u) & 0xC30C30C3u;
+    value = (value * 0x00000005u) & 0x49249249u;
+    return value;
+}
+
+/// @brief Binary bvh node. The two children of an inner node are stored next to each other.
+struct BvhNode {
+    float lower[AXIS_COUNT];
+    uint32_t leftFirst;     /* *< The left child for inner nodes, the first primitive slot for leaves. */
+    float upper[AXIS_COUNT];
+    uint32_t primCount;     /* *< 0 for inner nodes. */
+};
+
+inline bool IsLeaf(const BvhNode &node)
+{
+    return node.primCount != 0;
+}
+
+inline Aabb NodeBounds(const BvhNode &node)
+{
+    return Aabb {{node.lower[0], node.lower[1], node.lower[2]}, {node.upper[0], node.upper[1], node.upper[2]}};
+}
+
+inline void SetNodeBounds(BvhNode &node, const Aabb &box)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        node.lower[axis] = box.lower[axis];
+        node.upper[axis] = box.upper[axis];
+    }
+}
+
+/// @brief Binary bvh. Node 0 is the root, children are always stored after their parent,
+/// and leaves refer to a range of primIndices.
+struct Bvh {
+    std::vector<BvhNode> nodes;
+    std::vector<uint32_t> primIndices;
+};
+
+/// Add the bytes the items take up, and the bytes allocated beyond them, e.g. by a reserve of the builder.
+template <typename T>
+void CountBytes(const std::vector<T> &items, uint64_t &usedBytes, uint64_t &slackBytes)
+{
+    usedBytes += static_cast<uint64_t>(items.size()) * sizeof(T);
+    slackBytes += static_cast<uint64_t>(items.capacity() - items.size()) * sizeof(T);
+}
+
+/**
+ * Move the items into an allocation of their exact size. Unlike shrink_to_fit, this is guaranteed to free the rest.
+ * @note Throws std::bad_alloc when memory runs out, leaving the items as they were.
+ */
+template <typename T>
+void ShrinkToSize(std::vector<T> &items)
+{
+    if (items.capacity() != items.size()) {
+        std::vector<T>(items.begin(), items.end()).swap(items);
+    }
+}
+
+/// Free the items together with their allocation.
+template <typename T>
+void Release(std::vector<T> &items)
+{
+    std::vector<T>().swap(items);
+}
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_BVH_H
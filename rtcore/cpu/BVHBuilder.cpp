@@ -0,0 +1,553 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Bounding volume hierarchy builders of the RayShop cpu backend.
+ */
+
+#include "BVHBuilder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t SAH_BIN_COUNT = 32;
+constexpr uint32_t PARALLEL_GRAIN_SIZE = 4096;          /* *< Primitives per chunk of a parallel pass. */
+constexpr uint32_t PARALLEL_NODE_THRESHOLD = 16384;     /* *< Nodes this large bin and partition in parallel. */
+constexpr uint32_t SPAWN_SUBTREE_THRESHOLD = 1024;      /* *< Subtrees this large become their own task. */
+constexpr uint32_t REFIT_GRAIN_SIZE = 2048;             /* *< Nodes per chunk of the parallel refit. */
+constexpr uint32_t SAH_COST_GRAIN_SIZE = 8192;          /* *< Nodes per partial sum of ComputeSahCost. */
+
+struct Bin {
+    Aabb bounds;
+    uint32_t count;
+};
+
+/// @brief The bins of all three axes, filled by one chunk of primitives.
+struct BinSet {
+    Bin bins[AXIS_COUNT][SAH_BIN_COUNT];
+};
+
+struct Split {
+    int axis = -1;
+    uint32_t bin = 0;
+    float cost = FLOAT_MAX;
+};
+
+struct BuildTask {
+    uint32_t nodeIndex;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t depth;
+};
+
+uint32_t ChunkCount(uint32_t begin, uint32_t end)
+{
+    return (end - begin + PARALLEL_GRAIN_SIZE - 1) / PARALLEL_GRAIN_SIZE;
+}
+
+/// The box of the whole triangles of a leaf, also of the spatially split references.
+Aabb LeafTriangleBounds(const IndexedTriangles &triangles, const Bvh &bvh, const BvhNode &leaf)
+{
+    Aabb bounds = EmptyAabb();
+    for (uint32_t i = 0; i < leaf.primCount; i++) {
+        const uint32_t *corners = &triangles.indices[bvh.primIndices[leaf.leftFirst + i] * 3];
+        Grow(bounds, &triangles.positions[corners[0] * AXIS_COUNT]);
+        Grow(bounds, &triangles.positions[corners[1] * AXIS_COUNT]);
+        Grow(bounds, &triangles.positions[corners[2] * AXIS_COUNT]);
+    }
+    return bounds;
+}
+
+void MergeChildBounds(const BvhNode *nodes, BvhNode &node)
+{
+    Aabb bounds = NodeBounds(nodes[node.leftFirst]);
+    Grow(bounds, NodeBounds(nodes[node.leftFirst + 1]));
+    SetNodeBounds(node, bounds);
+}
+
+/// Nodes are allocated concurrently in pairs; lay them out again in depth-first order for locality.
+void ReorderDepthFirst(Bvh &bvh)
+{
+    std::vector<BvhNode> ordered;
+    ordered.reserve(bvh.nodes.size());
+    ordered.push_back(bvh.nodes[0]);
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    stack.emplace_back(0, 0);
+    while (!stack.empty()) {
+        uint32_t from = stack.back().first;
+        uint32_t to = stack.back().second;
+        stack.pop_back();
+        const BvhNode &node = bvh.nodes[from];
+        if (IsLeaf(node)) {
+            continue;
+        }
+        uint32_t left = static_cast<uint32_t>(ordered.size());
+        ordered.push_back(bvh.nodes[node.leftFirst]);
+        ordered.push_back(bvh.nodes[node.leftFirst + 1]);
+        ordered[to].leftFirst = left;
+        stack.emplace_back(node.leftFirst + 1, left + 1);
+        stack.emplace_back(node.leftFirst, left);
+    }
+    bvh.nodes.swap(ordered);
+}
+
+class BinnedSahBuilder {
+public:
+    BinnedSahBuilder(const std::vector<Aabb> &primBounds, const BuildSettings &settings, Bvh &bvh, ThreadPool *pool)
+        : m_primBounds(primBounds), m_settings(settings), m_bvh(bvh), m_pool(pool)
+    {}
+
+    void Build()
+    {
+        uint32_t primCount = static_cast<uint32_t>(m_primBounds.size());
+        m_bvh.nodes.clear();
+        m_bvh.primIndices.resize(primCount);
+        if (primCount == 0) {
+            m_bvh.nodes.push_back(BvhNode {});
+            SetNodeBounds(m_bvh.nodes[0], EmptyAabb());
+            return;
+        }
+        m_centroids.resize(static_cast<size_t>(primCount) * AXIS_COUNT);
+        ForEachChunk(0, primCount, [this](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                m_bvh.primIndices[i] = i;
+                for (int axis = 0; axis < AXIS_COUNT; axis++) {
+                    m_centroids[i * AXIS_COUNT + axis] = Center(m_primBounds[i], axis);
+                }
+            }
+        });
+        if (m_pool != nullptr && primCount >= PARALLEL_NODE_THRESHOLD) {
+            m_scratch.resize(primCount);
+        }
+
+        // A binary tree with at least one primitive per leaf never has more nodes than this,
+        // so tasks can allocate from the array without it ever moving.
+        m_bvh.nodes.resize(static_cast<size_t>(primCount) * 2 - 1);
+        m_nodeCount.store(1);
+        TaskGroup group;
+        BuildSubtree(BuildTask {0, 0, primCount, 0}, group);
+        if (m_pool != nullptr) {
+            m_pool->Wait(group);
+        }
+        if (m_failed.load()) {
+            throw std::bad_alloc();
+        }
+        m_bvh.nodes.resize(m_nodeCount.load());
+        if (m_pool != nullptr) {
+            ReorderDepthFirst(m_bvh);
+        }
+    }
+
+private:
+    const float *Centroid(uint32_t prim) const
+    {
+        return &m_centroids[prim * AXIS_COUNT];
+    }
+
+    bool IsParallel(uint32_t begin, uint32_t end) const
+    {
+        return m_pool != nullptr && end - begin >= PARALLEL_NODE_THRESHOLD;
+    }
+
+    template <typename Func>
+    void ForEachChunk(uint32_t begin, uint32_t end, const Func &func)
+    {
+        if (m_pool != nullptr) {
+            m_pool->ParallelFor(begin, end, PARALLEL_GRAIN_SIZE, func);
+        } else {
+            func(begin, end);
+        }
+    }
+
+    void BuildSubtree(const BuildTask &root, TaskGroup &group)
+    {
+        try {
+            std::vector<BuildTask> stack;
+            stack.push_back(root);
+            while (!stack.empty()) {
+                BuildTask task = stack.back();
+                stack.pop_back();
+                BuildTask children[2];
+                if (!BuildNode(task, children)) {
+                    continue;
+                }
+                // Hand the left subtree to another thread when it is big enough to pay for the task.
+                if (m_pool != nullptr && children[0].end - children[0].begin >= SPAWN_SUBTREE_THRESHOLD) {
+                    BuildTask left = children[0];
+                    m_pool->Run(group, [this, left, &group]() { BuildSubtree(left, group); });
+                    stack.push_back(children[1]);
+                } else {
+                    stack.push_back(children[1]);
+                    stack.push_back(children[0]);
+                }
+            }
+        } catch (const std::bad_alloc &) {
+            m_failed.store(true);
+        }
+    }
+
+    /// Returns true and the two child tasks when the node was split.
+    bool BuildNode(const BuildTask &task, BuildTask (&children)[2])
+    {
+        Aabb bounds;
+        Aabb centroidBounds;
+        ComputeBounds(task.begin, task.end, bounds, centroidBounds);
+        SetNodeBounds(m_bvh.nodes[task.nodeIndex], bounds);
+
+        uint32_t count = task.end - task.begin;
+        if (count <= 1 || task.depth + 1 >= BVH_MAX_DEPTH) {
+            MakeLeaf(task);
+            return false;
+        }
+
+        Split split = FindSplit(task, centroidBounds);
+        float leafCost = m_settings.intersectionCost * static_cast<float>(count);
+        uint32_t middle = task.begin;
+        if (split.axis >= 0) {
+            if (split.cost >= leafCost && count <= m_settings.maxLeafSize) {
+                MakeLeaf(task);
+                return false;
+            }
+            middle = PartitionByBin(task, centroidBounds, split);
+        }
+        if (middle == task.begin || middle == task.end) {
+            if (count <= m_settings.maxLeafSize) {
+                MakeLeaf(task);
+                return false;
+            }
+            middle = SplitAtMedian(task, centroidBounds);
+        }
+
+        uint32_t left = m_nodeCount.fetch_add(2);
+        m_bvh.nodes[task.nodeIndex].leftFirst = left;
+        m_bvh.nodes[task.nodeIndex].primCount = 0;
+        children[0] = BuildTask {left, task.begin, middle, task.depth + 1};
+        children[1] = BuildTask {left + 1, middle, task.end, task.depth + 1};
+        return true;
+    }
+
+    void MakeLeaf(const BuildTask &task)
+    {
+        m_bvh.nodes[task.nodeIndex].leftFirst = task.begin;
+        m_bvh.nodes[task.nodeIndex].primCount = task.end - task.begin;
+    }
+
+    void ComputeRangeBounds(uint32_t begin, uint32_t end, Aabb &bounds, Aabb &centroidBounds) const
+    {
+        bounds = EmptyAabb();
+        centroidBounds = EmptyAabb();
+        for (uint32_t i = begin; i < end; i++) {
+            uint32_t prim = m_bvh.primIndices[i];
+            Grow(bounds, m_primBounds[prim]);
+            Grow(centroidBounds, Centroid(prim));
+        }
+    }
+
+    void ComputeBounds(uint32_t begin, uint32_t end, Aabb &bounds, Aabb &centroidBounds)
+    {
+        if (!IsParallel(begin, end)) {
+            ComputeRangeBounds(begin, end, bounds, centroidBounds);
+            return;
+        }
+        std::vector<Aabb> partial(ChunkCount(begin, end) * 2);
+        m_pool->ParallelFor(begin, end, PARALLEL_GRAIN_SIZE, [this, begin, &partial](uint32_t first, uint32_t last) {
+            uint32_t chunk = (first - begin) / PARALLEL_GRAIN_SIZE;
+            ComputeRangeBounds(first, last, partial[chunk * 2], partial[chunk * 2 + 1]);
+        });
+        bounds = EmptyAabb();
+        centroidBounds = EmptyAabb();
+        for (size_t chunk = 0; chunk < partial.size(); chunk += 2) {
+            Grow(bounds, partial[chunk]);
+            Grow(centroidBounds, partial[chunk + 1]);
+        }
+    }
+
+    uint32_t BinOf(uint32_t prim, const Aabb &centroidBounds, int axis) const
+    {
+        float extent = centroidBounds.upper[axis] - centroidBounds.lower[axis];
+        float scale = static_cast<float>(SAH_BIN_COUNT) / extent;
+        float position = (Centroid(prim)[axis] - centroidBounds.lower[axis]) * scale;
+        return std::min(SAH_BIN_COUNT - 1, static_cast<uint32_t>(std::max(0.0f, position)));
+    }
+
+    bool CanSplit(const Aabb &centroidBounds, int axis) const
+    {
+        return centroidBounds.upper[axis] > centroidBounds.lower[axis];
+    }
+
+    void FillBins(uint32_t begin, uint32_t end, const Aabb &centroidBounds, BinSet &binSet) const
+    {
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            for (auto &bin : binSet.bins[axis]) {
+                bin.bounds = EmptyAabb();
+                bin.count = 0;
+            }
+        }
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            if (!CanSplit(centroidBounds, axis)) {
+                continue;
+            }
+            for (uint32_t i = begin; i < end; i++) {
+                uint32_t prim = m_bvh.primIndices[i];
+                Bin &bin = binSet.bins[axis][BinOf(prim, centroidBounds, axis)];
+                Grow(bin.bounds, m_primBounds[prim]);
+                bin.count++;
+            }
+        }
+    }
+
+    Split FindSplit(const BuildTask &task, const Aabb &centroidBounds)
+    {
+        BinSet binSet;
+        if (!IsParallel(task.begin, task.end)) {
+            FillBins(task.begin, task.end, centroidBounds, binSet);
+        } else {
+            std::vector<BinSet> partial(ChunkCount(task.begin, task.end));
+            uint32_t begin = task.begin;
+            m_pool->ParallelFor(task.begin, task.end, PARALLEL_GRAIN_SIZE,
+                [this, begin, &partial, &centroidBounds](uint32_t first, uint32_t last) {
+                    FillBins(first, last, centroidBounds, partial[(first - begin) / PARALLEL_GRAIN_SIZE]);
+                });
+            binSet = partial[0];
+            for (size_t chunk = 1; chunk < partial.size(); chunk++) {
+                for (int axis = 0; axis < AXIS_COUNT; axis++) {
+                    for (uint32_t i = 0; i < SAH_BIN_COUNT; i++) {
+                        Grow(binSet.bins[axis][i].bounds, partial[chunk].bins[axis][i].bounds);
+                        binSet.bins[axis][i].count += partial[chunk].bins[axis][i].count;
+                    }
+                }
+            }
+        }
+        Split best;
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            if (CanSplit(centroidBounds, axis)) {
+                EvaluateBins(binSet.bins[axis], axis, best);
+            }
+        }
+        return best;
+    }
+
+    void EvaluateBins(const Bin *bins, int axis, Split &best) const
+    {
+        // Sweep from the right to get the cost of every right partition, then from the left.
+        float rightCost[SAH_BIN_COUNT];
+        uint32_t rightCounts[SAH_BIN_COUNT];
+        Aabb rightBounds = EmptyAabb();
+        uint32_t rightCount = 0;
+        for (uint32_t i = SAH_BIN_COUNT - 1; i > 0; i--) {
+            Grow(rightBounds, bins[i].bounds);
+            rightCount += bins[i].count;
+            rightCounts[i] = rightCount;
+            rightCost[i] = HalfArea(rightBounds) * static_cast<float>(rightCount);
+        }
+        Grow(rightBounds, bins[0].bounds);
+        float parentArea = HalfArea(rightBounds);
+        float invParentArea = parentArea > 0.0f ? 1.0f / parentArea : 0.0f;
+        Aabb leftBounds = EmptyAabb();
+        uint32_t leftCount = 0;
+        for (uint32_t i = 0; i + 1 < SAH_BIN_COUNT; i++) {
+            Grow(leftBounds, bins[i].bounds);
+            leftCount += bins[i].count;
+            if (leftCount == 0 || rightCounts[i + 1] == 0) {
+                continue;
+            }
+            float cost = m_settings.traversalCost + m_settings.intersectionCost * invParentArea *
+                (HalfArea(leftBounds) * static_cast<float>(leftCount) + rightCost[i + 1]);
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = i;
+            }
+        }
+    }
+
+    uint32_t PartitionByBin(const BuildTask &task, const Aabb &centroidBounds, const Split &split)
+    {
+        auto goesLeft = [this, &centroidBounds, &split](uint32_t prim) {
+            return BinOf(prim, centroidBounds, split.axis) <= split.bin;
+        };
+        if (!IsParallel(task.begin, task.end)) {
+            auto first = m_bvh.primIndices.begin() + task.begin;
+            auto last = m_bvh.primIndices.begin() + task.end;
+            return static_cast<uint32_t>(std::partition(first, last, goesLeft) - m_bvh.primIndices.begin());
+        }
+
+        // Stable two pass partition: count the left side of each chunk, then scatter through the scratch array.
+        uint32_t begin = task.begin;
+        uint32_t chunkCount = ChunkCount(task.begin, task.end);
+        std::vector<uint32_t> leftCounts(chunkCount);
+        m_pool->ParallelFor(task.begin, task.end, PARALLEL_GRAIN_SIZE,
+            [this, begin, &leftCounts, &goesLeft](uint32_t first, uint32_t last) {
+                uint32_t count = 0;
+                for (uint32_t i = first; i < last; i++) {
+                    count += goesLeft(m_bvh.primIndices[i]) ? 1 : 0;
+                }
+                leftCounts[(first - begin) / PARALLEL_GRAIN_SIZE] = count;
+            });
+        std::vector<uint32_t> leftOffsets(chunkCount);
+        uint32_t leftTotal = 0;
+        for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+            leftOffsets[chunk] = leftTotal;
+            leftTotal += leftCounts[chunk];
+        }
+        m_pool->ParallelFor(task.begin, task.end, PARALLEL_GRAIN_SIZE,
+            [this, begin, leftTotal, &leftOffsets, &goesLeft](uint32_t first, uint32_t last) {
+                uint32_t chunk = (first - begin) / PARALLEL_GRAIN_SIZE;
+                uint32_t left = begin + leftOffsets[chunk];
+                uint32_t right = begin + leftTotal + (first - begin) - leftOffsets[chunk];
+                for (uint32_t i = first; i < last; i++) {
+                    uint32_t prim = m_bvh.primIndices[i];
+                    m_scratch[goesLeft(prim) ? left++ : right++] = prim;
+                }
+            });
+        m_pool->ParallelFor(task.begin, task.end, PARALLEL_GRAIN_SIZE, [this](uint32_t first, uint32_t last) {
+            std::copy(m_scratch.begin() + first, m_scratch.begin() + last, m_bvh.primIndices.begin() + first);
+        });
+        return task.begin + leftTotal;
+    }
+
+    uint32_t SplitAtMedian(const BuildTask &task, const Aabb &centroidBounds)
+    {
+        int axis = 0;
+        for (int i = 1; i < AXIS_COUNT; i++) {
+            if (centroidBounds.upper[i] - centroidBounds.lower[i] >
+                centroidBounds.upper[axis] - centroidBounds.lower[axis]) {
+                axis = i;
+            }
+        }
+        uint32_t middle = task.begin + (task.end - task.begin) / 2;
+        std::nth_element(m_bvh.primIndices.begin() + task.begin, m_bvh.primIndices.begin() + middle,
+            m_bvh.primIndices.begin() + task.end,
+            [this, axis](uint32_t a, uint32_t b) { return Centroid(a)[axis] < Centroid(b)[axis]; });
+        return middle;
+    }
+
+    const std::vector<Aabb> &m_primBounds;
+    const BuildSettings &m_settings;
+    Bvh &m_bvh;
+    ThreadPool *m_pool;
+    std::vector<float> m_centroids;
+    std::vector<uint32_t> m_scratch;
+    std::atomic<uint32_t> m_nodeCount {0};
+    std::atomic<bool> m_failed {false};
+};
+} // namespace
+
+void BuildBinnedSah(const std::vector<Aabb> &primBounds, const BuildSettings &settings, Bvh &bvh, ThreadPool *pool)
+{
+    BinnedSahBuilder builder(primBounds, settings, bvh, pool);
+    builder.Build();
+}
+
+void RefitBvh(const std::vector<Aabb> &primBounds, Bvh &bvh)
+{
+    if (bvh.primIndices.empty()) {
+        return;
+    }
+    // Children are always stored after their parent, so a reverse sweep visits them first.
+    for (size_t i = bvh.nodes.size(); i-- > 0;) {
+        BvhNode &node = bvh.nodes[i];
+        Aabb bounds = EmptyAabb();
+        if (IsLeaf(node)) {
+            for (uint32_t j = 0; j < node.primCount; j++) {
+                Grow(bounds, primBounds[bvh.primIndices[node.leftFirst + j]]);
+            }
+        } else {
+            Grow(bounds, NodeBounds(bvh.nodes[node.leftFirst]));
+            Grow(bounds, NodeBounds(bvh.nodes[node.leftFirst + 1]));
+        }
+        SetNodeBounds(node, bounds);
+    }
+}
+
+void ComputeBvhParents(const Bvh &bvh, std::vector<uint32_t> &parents)
+{
+    parents.assign(bvh.nodes.size(), INVALID_INDEX);
+    if (bvh.primIndices.empty()) {
+        // An empty bvh is a lone root without primitives, which IsLeaf would take for an inner node.
+        return;
+    }
+    for (uint32_t i = 0; i < bvh.nodes.size(); i++) {
+        const BvhNode &node = bvh.nodes[i];
+        if (!IsLeaf(node)) {
+            parents[node.leftFirst] = i;
+            parents[node.leftFirst + 1] = i;
+        }
+    }
+}
+
+void RefitBvh(const IndexedTriangles &triangles, const std::vector<uint32_t> &parents, Bvh &bvh, ThreadPool *pool)
+{
+    if (bvh.primIndices.empty()) {
+        return;
+    }
+    uint32_t nodeCount = static_cast<uint32_t>(bvh.nodes.size());
+    BvhNode *nodes = bvh.nodes.data();
+    if (pool == nullptr || pool->GetThreadCount() == 1) {
+        // On one thread the reverse sweep visits children before their parent without any counter.
+        for (uint32_t i = nodeCount; i-- > 0;) {
+            if (IsLeaf(nodes[i])) {
+                SetNodeBounds(nodes[i], LeafTriangleBounds(triangles, bvh, nodes[i]));
+            } else {
+                MergeChildBounds(nodes, nodes[i]);
+            }
+        }
+        return;
+    }
+    std::unique_ptr<std::atomic<uint32_t>[]> arrivals(new std::atomic<uint32_t>[nodeCount]());
+    pool->ParallelFor(0, nodeCount, REFIT_GRAIN_SIZE, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            if (!IsLeaf(nodes[i])) {
+                continue;
+            }
+            SetNodeBounds(nodes[i], LeafTriangleBounds(triangles, bvh, nodes[i]));
+            // The first child to arrive at a parent leaves; the second one, which the acquire makes see the
+            // box of its sibling, merges both and climbs on.
+            for (uint32_t parent = parents[i]; parent != INVALID_INDEX; parent = parents[parent]) {
+                if (arrivals[parent].fetch_add(1, std::memory_order_acq_rel) == 0) {
+                    break;
+                }
+                MergeChildBounds(nodes, nodes[parent]);
+            }
+        }
+    });
+}
+
+float ComputeSahCost(const Bvh &bvh, const BuildSettings &settings, ThreadPool *pool)
+{
+    if (bvh.primIndices.empty()) {
+        return 0.0f;
+    }
+    float rootArea = HalfArea(NodeBounds(bvh.nodes[0]));
+    if (!(rootArea > 0.0f)) {
+        return 0.0f;
+    }
+    // Fixed chunks summed in order, so that the cost does not depend on the thread count.
+    uint32_t nodeCount = static_cast<uint32_t>(bvh.nodes.size());
+    std::vector<double> partials((nodeCount + SAH_COST_GRAIN_SIZE - 1) / SAH_COST_GRAIN_SIZE);
+    auto sumRange = [&bvh, &settings, &partials](uint32_t begin, uint32_t end) {
+        double sum = 0.0;
+        for (uint32_t i = begin; i < end; i++) {
+            const BvhNode &node = bvh.nodes[i];
+            sum += static_cast<double>(HalfArea(NodeBounds(node))) * NodeSahCost(node, settings);
+        }
+        partials[begin / SAH_COST_GRAIN_SIZE] = sum;
+    };
+    if (pool != nullptr) {
+        pool->ParallelFor(0, nodeCount, SAH_COST_GRAIN_SIZE, sumRange);
+    } else {
+        for (uint32_t first = 0; first < nodeCount; first += SAH_COST_GRAIN_SIZE) {
+            sumRange(first, std::min(nodeCount, first + SAH_COST_GRAIN_SIZE));
+        }
+    }
+    double total = 0.0;
+    for (double partial : partials) {
+        total += partial;
+    }
+    return static_cast<float>(total / rootArea);
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Bounding volume hierarchy builders of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_BVHBUILDER_H
+#define RAYSHOP_CPU_BVHBUILDER_H
+
+#include "BVH.h"
+#include "ThreadPool.h"
+
+namespace RayShop {
+namespace Cpu {
+/// @brief The cost model and limits shared by all builders.
+struct BuildSettings {
+    uint32_t maxLeafSize = 4;           /* *< Leaves never hold more primitives, except at BVH_MAX_DEPTH. */
+    float traversalCost = 1.0f;         /* *< SAH cost of visiting an inner node. */
+    float intersectionCost = 1.0f;      /* *< SAH cost of intersecting one primitive. */
+};
+
+/// @brief Indexed triangles, which the spatial split builder clips against split planes.
+struct IndexedTriangles {
+    const float *positions;             /* *< Packed xyz positions. */
+    const uint32_t *indices;            /* *< Three vertex indices per triangle. */
+};
+
+/**
+ * Build a binary bvh over primitive bounds with the binned surface area heuristic. With a pool, large nodes
+ * are binned and partitioned in parallel and subtrees are built as separate tasks; the result only depends
+ * on whether a pool is given, not on its size.
+ * @param[in]   primBounds      The bounds of each primitive.
+ * @param[in]   settings        The cost model.
+ * @param[out]  bvh             The built hierarchy.
+ * @param[in]   pool            The worker pool, nullptr to build on the calling thread.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void BuildBinnedSah(const std::vector<Aabb> &primBounds, const BuildSettings &settings, Bvh &bvh,
+                    ThreadPool *pool = nullptr);
+
+/**
+ * Build a binary bvh by sorting the primitives along a Morton curve and splitting at the highest differing
+ * bit of their codes. Much faster than SAH, at the cost of tree quality.
+ * @param[in]   primBounds      The bounds of each primitive.
+ * @param[in]   settings        The leaf size limit; the costs are not used.
+ * @param[out]  bvh             The built hierarchy.
+ * @param[in]   pool            The worker pool, nullptr to build on the calling thread.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void BuildLbvh(const std::vector<Aabb> &primBounds, const BuildSettings &settings, Bvh &bvh,
+               ThreadPool *pool = nullptr);
+
+/**
+ * Build a binary bvh by parallel locally-ordered clustering: starting from the Morton sorted primitives,
+ * mutually nearest clusters within a small window are merged until one remains. Subtrees are collapsed
+ * into leaves where the SAH favours it.
+ * @param[in]   primBounds      The bounds of each primitive.
+ * @param[in]   settings        The cost model used to collapse leaves.
+ * @param[out]  bvh             The built hierarchy.
+ * @param[in]   pool            The worker pool, nullptr to build on the calling thread.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void BuildPloc(const std::vector<Aabb> &primBounds, const BuildSettings &settings, Bvh &bvh,
+               ThreadPool *pool = nullptr);
+
+/**
+ * Build a binary bvh with the split bvh (SBVH) algorithm: besides binned object splits, a node may be split by
+ * a plane that clips the triangles crossing it, so that a triangle is referenced from both children. Spatial
+ * splits are only tried where the object split children overlap, and stop once the budget is used up.
+ * The resulting primIndices may hold a triangle more than once.
+ * @param[in]   primBounds      The bounds of each triangle.
+ * @param[in]   triangles       The triangles themselves.
+ * @param[in]   settings        The cost model.
+ * @param[in]   splitBudget     The extra references allowed, as a fraction of the triangle count.
+ * @param[out]  bvh             The built hierarchy.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void BuildSpatialSplitSah(const std::vector<Aabb> &primBounds, const IndexedTriangles &triangles,
+                          const BuildSettings &settings, float splitBudget, Bvh &bvh);
+
+/**
+ * Lower the SAH cost of a built bvh by treelet restructuring (TRBVH, Karras and Aila 2013): in a few bottom-up
+ * passes, every inner node grows a treelet of up to 7 subtrees below it and rebuilds it in the cheapest of their
+ * topologies. Leaves and primIndices stay as they are, and the tree stays within BVH_MAX_DEPTH. The result does
+ * not depend on the pool.
+ * @param[in]   settings    The cost model.
+ * @param[in]   pool        The worker pool, nullptr to optimize on the calling thread.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void OptimizeTreelets(const BuildSettings &settings, Bvh &bvh, ThreadPool *pool = nullptr);
+
+/**
+ * Recompute all node bounds bottom-up from the primitive bounds, keeping the topology. Spatially split
+ * references get the bounds of their whole triangle back.
+ */
+void RefitBvh(const std::vector<Aabb> &primBounds, Bvh &bvh);
+
+/**
+ * Store the parent of every node, INVALID_INDEX for the root, for the bottom-up refit below.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void ComputeBvhParents(const Bvh &bvh, std::vector<uint32_t> &parents);
+
+/**
+ * Refit a bvh over triangles in parallel, keeping the topology. Every leaf recomputes its box from the vertices
+ * and climbs towards the root; a per-node arrival counter stops the first child to finish, so that each inner
+ * node is merged exactly once, by the thread completing its second subtree. No pass waits for a whole level.
+ * @param[in]   parents     The parents from ComputeBvhParents.
+ * @param[in]   pool        The worker pool, nullptr to refit on the calling thread.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void RefitBvh(const IndexedTriangles &triangles, const std::vector<uint32_t> &parents, Bvh &bvh, ThreadPool *pool);
+
+/// The SAH weight of a node, which ComputeSahCost multiplies by its area.
+inline float NodeSahCost(const BvhNode &node, const BuildSettings &settings)
+{
+    return IsLeaf(node) ? settings.intersectionCost * node.primCount : settings.traversalCost;
+}
+
+/**
+ * The SAH cost of a bvh, i.e. the expected cost of a ray that hits its root: the area of every node relative to the
+ * root, weighted by the cost of visiting it. Refits let it grow as the boxes stretch, rebuilds bring it down again.
+ * @param[in]   pool        The worker pool, nullptr to sum on the calling thread. The result does not depend on it.
+ * @return 0 for an empty or flat bvh.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+float ComputeSahCost(const Bvh &bvh, const BuildSettings &settings, ThreadPool *pool = nullptr);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_BVHBUILDER_H
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Saving and memory-mapped loading of the bottom level acceleration structures of the RayShop cpu
+ * backend.
+ */
+
+#include "BlasFile.h"
+#include "BottomLevel.h"
+#include "BVHBuilder.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325ull;
+constexpr uint64_t FNV_PRIME = 0x100000001B3ull;
+
+static_assert(sizeof(BvhNode) == 32, "BvhNode changed its layout, bump BLAS_FILE_VERSION");
+static_assert(std::is_trivially_copyable<BvhNode>::value, "BvhNode has to be copied bytewise");
+
+/// Hash the 32-bit words of a value, which the hashed inputs all consist of.
+template <typename T>
+void HashWords(uint64_t &hash, const T &value)
+{
+    static_assert(sizeof(T) % sizeof(uint32_t) == 0, "only 32-bit words are hashed");
+    uint32_t words[sizeof(T) / sizeof(uint32_t)];
+    std::memcpy(words, &value, sizeof(T));
+    for (uint32_t word : words) {
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+}
+
+/// @brief A read only private mapping of a whole file, empty when the file cannot be mapped.
+class MappedFile {
+public:
+    explicit MappedFile(const char *path)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void *data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                m_data = static_cast<const uint8_t *>(data);
+                m_size = static_cast<size_t>(info.st_size);
+            }
+        }
+        // The mapping outlives the descriptor.
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (m_data != nullptr) {
+            munmap(const_cast<uint8_t *>(m_data), m_size);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *Data() const
+    {
+        return m_data;
+    }
+
+    size_t Size() const
+    {
+        return m_size;
+    }
+
+private:
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+uint64_t AlignOffset(uint64_t offset)
+{
+    return (offset + BLAS_FILE_ALIGNMENT - 1) / BLAS_FILE_ALIGNMENT * BLAS_FILE_ALIGNMENT;
+}
+
+bool IsSectionInFile(const BlasFileHeader &header, uint32_t section, size_t fileSize)
+{
+    uint64_t offset = header.offsets[section];
+    uint64_t size = header.sizes[section];
+    return offset % BLAS_FILE_ALIGNMENT == 0 && offset >= sizeof(BlasFileHeader) && offset <= fileSize &&
+        size <= fileSize - offset;
+}
+
+template <typename T>
+void CopySection(const MappedFile &file, const BlasFileHeader &header, uint32_t section, std::vector<T> &items)
+{
+    items.resize(header.sizes[section] / sizeof(T));
+    if (!items.empty()) {
+        std::memcpy(items.data(), file.Data() + header.offsets[section], items.size() * sizeof(T));
+    }
+}
+
+/// Every reference of the tree stays in range and every node hangs off exactly one parent within BVH_MAX_DEPTH,
+/// as the builders guarantee, so that a damaged file cannot send the traversal astray or overflow its stack.
+bool IsValidTree(const Bvh &bvh, const std::vector<uint32_t> &indices, uint32_t verticesCount)
+{
+    uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+    for (uint32_t index : indices) {
+        if (index >= verticesCount) {
+            return false;
+        }
+    }
+    for (uint32_t prim : bvh.primIndices) {
+        if (prim >= triangleCount) {
+            return false;
+        }
+    }
+    uint64_t nodeCount = bvh.nodes.size();
+    uint64_t slotCount = bvh.primIndices.size();
+    if (nodeCount == 0) {
+        return false;
+    }
+    if (slotCount == 0) {
+        // Without triangles the builders leave a lone root with empty bounds.
+        return nodeCount == 1;
+    }
+    std::vector<uint32_t> depths(nodeCount, INVALID_INDEX);
+    depths[0] = 0;
+    for (uint64_t i = 0; i < nodeCount; i++) {
+        const BvhNode &node = bvh.nodes[i];
+        if (depths[i] == INVALID_INDEX) {
+            return false;
+        }
+        if (IsLeaf(node)) {
+            if (static_cast<uint64_t>(node.leftFirst) + node.primCount > slotCount) {
+                return false;
+            }
+            continue;
+        }
+        // Children come after their parent, so their depth is set before the loop reaches them.
+        if (node.leftFirst <= i || static_cast<uint64_t>(node.leftFirst) + 1 >= nodeCount ||
+            depths[i] + 1 >= BVH_MAX_DEPTH) {
+            return false;
+        }
+        for (uint32_t child = node.leftFirst; child <= node.leftFirst + 1; child++) {
+            if (depths[child] != INVALID_INDEX) {
+                return false;
+            }
+            depths[child] = depths[i] + 1;
+        }
+    }
+    return true;
+}
+} // namespace
+
+uint64_t HashBuildInput(const ASBuildOptions &options, const std::vector<float> &positions,
+                        const std::vector<uint32_t> &indices)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    HashWords(hash, static_cast<uint32_t>(options.method));
+    HashWords(hash, options.flags);
+    HashWords(hash, options.method == ASBuildMethod::SAH_SPATIAL_SPLITS ? options.splitBudget : 0.0f);
+    HashWords(hash, static_cast<uint32_t>(positions.size() / AXIS_COUNT));
+    HashWords(hash, static_cast<uint32_t>(indices.size()));
+    for (float coordinate : positions) {
+        HashWords(hash, coordinate);
+    }
+    for (uint32_t index : indices) {
+        HashWords(hash, index);
+    }
+    return hash;
+}
+
+Result BottomLevel::Save(const char *path) const
+{
+    BlasFileHeader header {};
+    header.magic = BLAS_FILE_MAGIC;
+    header.version = BLAS_FILE_VERSION;
+    header.key = HashBuildInput(m_options, m_positions, m_indices);
+    header.unoptimizedSahCost = m_unoptimizedSahCost;
+    header.builtSahCost = m_builtSahCost;
+    header.sahCost = m_sahCost;
+    const void *sections[BLAS_SECTION_COUNT] = {m_positions.data(), m_indices.data(), m_bvh.nodes.data(),
+                                                m_bvh.primIndices.data()};
+    header.sizes[BLAS_SECTION_POSITIONS] = m_positions.size() * sizeof(float);
+    header.sizes[BLAS_SECTION_INDICES] = m_indices.size() * sizeof(uint32_t);
+    header.sizes[BLAS_SECTION_NODES] = m_bvh.nodes.size() * sizeof(BvhNode);
+    header.sizes[BLAS_SECTION_PRIM_INDICES] = m_bvh.primIndices.size() * sizeof(uint32_t);
+    uint64_t offset = AlignOffset(sizeof(BlasFileHeader));
+    for (uint32_t i = 0; i < BLAS_SECTION_COUNT; i++) {
+        header.offsets[i] = offset;
+        offset = AlignOffset(offset + header.sizes[i]);
+    }
+
+    std::string temporary = std::string(path) + ".tmp";
+    std::FILE *file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        return Result::UNKNOWN_ERROR;
+    }
+    static const uint8_t padding[BLAS_FILE_ALIGNMENT] = {};
+    bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t position = sizeof(header);
+    for (uint32_t i = 0; i < BLAS_SECTION_COUNT && written; i++) {
+        uint64_t gap = header.offsets[i] - position;
+        written = std::fwrite(padding, 1, gap, file) == gap &&
+            std::fwrite(sections[i], 1, header.sizes[i], file) == header.sizes[i];
+        position = header.offsets[i] + header.sizes[i];
+    }
+    written = std::fclose(file) == 0 && written;
+    if (!written || std::rename(temporary.c_str(), path) != 0) {
+        std::remove(temporary.c_str());
+        return Result::UNKNOWN_ERROR;
+    }
+    return Result::SUCCESS;
+}
+
+Result BottomLevel::Load(const ASBuildOptions &options, const GeometryTriangleDescription2 &geometry,
+                         const char *path)
+{
+    if (path == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    // Decoded into temporaries, so that a rejected file leaves the blas as it was.
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+    Result res = DecodeGeometry(geometry, positions, indices, nullptr);
+    if (res != Result::SUCCESS) {
+        return res;
+    }
+    MappedFile file(path);
+    if (file.Size() < sizeof(BlasFileHeader)) {
+        return Result::INVALID_PARAMETER;
+    }
+    BlasFileHeader header;
+    std::memcpy(&header, file.Data(), sizeof(header));
+    if (header.magic != BLAS_FILE_MAGIC || header.version != BLAS_FILE_VERSION ||
+        header.key != HashBuildInput(options, positions, indices) ||
+        header.sizes[BLAS_SECTION_POSITIONS] != positions.size() * sizeof(float) ||
+        header.sizes[BLAS_SECTION_INDICES] != indices.size() * sizeof(uint32_t) ||
+        header.sizes[BLAS_SECTION_NODES] % sizeof(BvhNode) != 0 ||
+        header.sizes[BLAS_SECTION_PRIM_INDICES] % sizeof(uint32_t) != 0) {
+        return Result::INVALID_PARAMETER;
+    }
+    for (uint32_t i = 0; i < BLAS_SECTION_COUNT; i++) {
+        if (!IsSectionInFile(header, i, file.Size())) {
+            return Result::INVALID_PARAMETER;
+        }
+    }
+    // The geometry sections hold what the key was hashed from, so that geometry that only collides with it in the
+    // hash is rejected as well. Compared in the mapping, the decoded copy is the one kept.
+    if (std::memcmp(file.Data() + header.offsets[BLAS_SECTION_POSITIONS], positions.data(),
+                    header.sizes[BLAS_SECTION_POSITIONS]) != 0 ||
+        std::memcmp(file.Data() + header.offsets[BLAS_SECTION_INDICES], indices.data(),
+                    header.sizes[BLAS_SECTION_INDICES]) != 0) {
+        return Result::INVALID_PARAMETER;
+    }
+    Bvh bvh;
+    CopySection(file, header, BLAS_SECTION_NODES, bvh.nodes);
+    CopySection(file, header, BLAS_SECTION_PRIM_INDICES, bvh.primIndices);
+    if (!IsValidTree(bvh, indices, geometry.verticesCount)) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::vector<uint32_t> parents;
+    ComputeBvhParents(bvh, parents);
+    m_positions.swap(positions);
+    m_indices.swap(indices);
+    m_bvh.nodes.swap(bvh.nodes);
+    m_bvh.primIndices.swap(bvh.primIndices);
+    m_parents.swap(parents);
+    m_options = options;
+    m_unoptimizedSahCost = header.unoptimizedSahCost;
+    m_builtSahCost = header.builtSahCost;
+    m_sahCost = header.sahCost;
+    UpdateTraversalLayout();
+    return Result::SUCCESS;
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Binary file layout of the bottom level acceleration structures saved by the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_BLASFILE_H
+#define RAYSHOP_CPU_BLASFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Traversal.h"
+
+namespace RayShop {
+namespace Cpu {
+constexpr uint32_t BLAS_FILE_MAGIC = 0x56425352u;  /* *< "RSBV" in little endian, which also rejects big endian. */
+constexpr uint32_t BLAS_FILE_VERSION = 2;          /* *< Bumped whenever a section or BvhNode changes its layout. */
+constexpr uint64_t BLAS_FILE_ALIGNMENT = 64;       /* *< Every section starts at a multiple of it. */
+
+/// @brief The arrays of a saved blas, in file order.
+enum BlasFileSection : uint32_t {
+    BLAS_SECTION_POSITIONS,     /* *< float x, y, z per vertex. */
+    BLAS_SECTION_INDICES,       /* *< uint32_t, three per triangle. */
+    BLAS_SECTION_NODES,         /* *< BvhNode, the root first. */
+    BLAS_SECTION_PRIM_INDICES,  /* *< uint32_t, the triangle of each leaf slot. */
+    BLAS_SECTION_COUNT
+};
+
+/**
+ * @brief The start of a saved blas. Sections are addressed by offsets from the start of the file, each aligned to
+ * BLAS_FILE_ALIGNMENT. Load checks them in the mapping, compares the geometry sections with the geometry it is given
+ * and copies the others into the blas. The node parents, the wide
+ * and quantized layouts and the triangle blocks are not saved: Load derives them in a single linear pass, as the
+ * layouts depend on the instruction set.
+ */
+struct BlasFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;                               /* *< HashBuildInput of the geometry and the build options. */
+    float unoptimizedSahCost;
+    float builtSahCost;
+    float sahCost;
+    uint32_t reserved;
+    uint64_t offsets[BLAS_SECTION_COUNT];       /* *< Bytes from the start of the file. */
+    uint64_t sizes[BLAS_SECTION_COUNT];         /* *< Bytes of each section. */
+};
+
+/**
+ * 64-bit FNV-1a hash of what shapes a bvh: the build method, its flags and split budget, and the decoded
+ * positions followed by the indices. The formats, strides and padding of the input are left out, so a mesh hashes
+ * the same whichever buffer it comes from.
+ * @param[in]   positions   Packed x, y and z per vertex.
+ */
+uint64_t HashBuildInput(const ASBuildOptions &options, const std::vector<float> &positions,
+                        const std::vector<uint32_t> &indices);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_BLASFILE_H
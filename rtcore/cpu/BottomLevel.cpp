@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Bottom level acceleration structure of the RayShop cpu backend.
+ */
+
+#include "BottomLevel.h"
+#include "BVHBuilder.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t BOUNDS_GRAIN_SIZE = 4096;
+constexpr uint32_t COPY_GRAIN_SIZE = 16384;
+constexpr uint32_t BINARY_BVH_WIDTH = 2;
+constexpr float SNORM16_MAX = 32767.0f;
+
+void ForEachChunk(ThreadPool *pool, uint32_t count, uint32_t grainSize, const ThreadPool::RangeFunc &func)
+{
+    if (pool != nullptr) {
+        pool->ParallelFor(0, count, grainSize, func);
+    } else {
+        func(0, count);
+    }
+}
+
+uint32_t GetPositionBytes(VertexFormat format)
+{
+    switch (format) {
+        case VertexFormat::FLOAT3:
+            return AXIS_COUNT * sizeof(float);
+        case VertexFormat::HALF3:
+        case VertexFormat::SNORM16_3:
+            return AXIS_COUNT * sizeof(uint16_t);
+        default:
+            return 0;
+    }
+}
+
+uint32_t GetIndexBytes(IndexFormat format)
+{
+    switch (format) {
+        case IndexFormat::UINT32:
+            return sizeof(uint32_t);
+        case IndexFormat::UINT16:
+            return sizeof(uint16_t);
+        default:
+            return 0;
+    }
+}
+
+/// Strides and offsets are in bytes, so every value is read with memcpy rather than through an aligned pointer.
+template <typename T>
+T LoadUnaligned(const uint8_t *data)
+{
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+float HalfToFloat(uint16_t half)
+{
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+    uint32_t exponent = (half >> 10) & 0x1Fu;
+    uint32_t mantissa = half & 0x3FFu;
+    uint32_t bits;
+    if (exponent == 0x1Fu) {
+        bits = sign | 0x7F800000u | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // A subnormal half is a normal float: shift the mantissa up to its implicit bit.
+        exponent = 113;
+        while ((mantissa & 0x400u) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FFu) << 13);
+    }
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+template <VertexFormat FORMAT>
+void DecodePosition(const uint8_t *vertex, float *position);
+
+template <>
+void DecodePosition<VertexFormat::FLOAT3>(const uint8_t *vertex, float *position)
+{
+    std::memcpy(position, vertex, AXIS_COUNT * sizeof(float));
+}
+
+template <>
+void DecodePosition<VertexFormat::HALF3>(const uint8_t *vertex, float *position)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        position[axis] = HalfToFloat(LoadUnaligned<uint16_t>(vertex + axis * sizeof(uint16_t)));
+    }
+}
+
+template <>
+void DecodePosition<VertexFormat::SNORM16_3>(const uint8_t *vertex, float *position)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        float value = LoadUnaligned<int16_t>(vertex + axis * sizeof(int16_t)) / SNORM16_MAX;
+        position[axis] = std::max(value, -1.0f);
+    }
+}
+
+template <VertexFormat FORMAT>
+void DecodePositions(const GeometryTriangleDescription2 &geometry, std::vector<float> &positions, ThreadPool *pool)
+{
+    const uint8_t *vertices = static_cast<const uint8_t *>(geometry.vertices.cpuBuffer) + geometry.vertexOffsetBytes;
+    uint64_t stride = geometry.vertexStrideBytes;
+    ForEachChunk(pool, geometry.verticesCount, COPY_GRAIN_SIZE, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            DecodePosition<FORMAT>(vertices + i * stride, &positions[static_cast<size_t>(i) * AXIS_COUNT]);
+        }
+    });
+}
+
+template <typename Index>
+bool AreIndicesInRange(const GeometryTriangleDescription2 &geometry, ThreadPool *pool)
+{
+    const uint8_t *indices = static_cast<const uint8_t *>(geometry.indices.cpuBuffer) + geometry.indexOffsetBytes;
+    std::atomic<bool> outOfRange {false};
+    ForEachChunk(pool, geometry.indicesCount, COPY_GRAIN_SIZE, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            if (LoadUnaligned<Index>(indices + static_cast<size_t>(i) * sizeof(Index)) >= geometry.verticesCount) {
+                outOfRange.store(true, std::memory_order_relaxed);
+                return;
+            }
+        }
+    });
+    return !outOfRange.load(std::memory_order_relaxed);
+}
+
+template <typename Index>
+void WidenIndices(const GeometryTriangleDescription2 &geometry, std::vector<uint32_t> &widened, ThreadPool *pool)
+{
+    const uint8_t *indices = static_cast<const uint8_t *>(geometry.indices.cpuBuffer) + geometry.indexOffsetBytes;
+    ForEachChunk(pool, geometry.indicesCount, COPY_GRAIN_SIZE, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            widened[i] = LoadUnaligned<Index>(indices + static_cast<size_t>(i) * sizeof(Index));
+        }
+    });
+}
+} // namespace
+
+bool IsValidGeometry(const GeometryTriangleDescription2 &geometry)
+{
+    uint32_t positionBytes = GetPositionBytes(geometry.vertexFormat);
+    return geometry.vertices.type == BufferType::CPU && geometry.vertices.cpuBuffer != nullptr &&
+        geometry.indices.type == BufferType::CPU && geometry.indices.cpuBuffer != nullptr && positionBytes != 0 &&
+        geometry.vertexStrideBytes >= positionBytes && GetIndexBytes(geometry.indexFormat) != 0 &&
+        geometry.indicesCount % 3 == 0;
+}
+
+Result DecodeGeometry(const GeometryTriangleDescription2 &geometry, std::vector<float> &positions,
+                      std::vector<uint32_t> &indices, ThreadPool *pool)
+{
+    if (!IsValidGeometry(geometry)) {
+        return Result::INVALID_PARAMETER;
+    }
+    // Every index is checked before anything is written, so that a rejected refit leaves the mesh intact.
+    bool inRange = geometry.indexFormat == IndexFormat::UINT16 ? AreIndicesInRange<uint16_t>(geometry, pool) :
+        AreIndicesInRange<uint32_t>(geometry, pool);
+    if (!inRange) {
+        return Result::INVALID_PARAMETER;
+    }
+    indices.resize(geometry.indicesCount);
+    positions.resize(static_cast<size_t>(geometry.verticesCount) * AXIS_COUNT);
+    if (geometry.indexFormat == IndexFormat::UINT16) {
+        WidenIndices<uint16_t>(geometry, indices, pool);
+    } else {
+        WidenIndices<uint32_t>(geometry, indices, pool);
+    }
+    switch (geometry.vertexFormat) {
+        case VertexFormat::HALF3:
+            DecodePositions<VertexFormat::HALF3>(geometry, positions, pool);
+            break;
+        case VertexFormat::SNORM16_3:
+            DecodePositions<VertexFormat::SNORM16_3>(geometry, positions, pool);
+            break;
+        default:
+            DecodePositions<VertexFormat::FLOAT3>(geometry, positions, pool);
+            break;
+    }
+    return Result::SUCCESS;
+}
+
+Result BottomLevel::CopyGeometry(const GeometryTriangleDescription2 &geometry, ThreadPool *pool)
+{
+    // Decoded in place, so that the refits of every frame reuse the arrays.
+    return DecodeGeometry(geometry, m_positions, m_indices, pool);
+}
+
+void BottomLevel::ComputeTriangleBounds(std::vector<Aabb> &bounds, ThreadPool *pool) const
+{
+    uint32_t triangleCount = GetTriangleCount();
+    bounds.resize(triangleCount);
+    auto computeRange = [this, &bounds](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            Aabb box = EmptyAabb();
+            Grow(box, GetVertex(i, 0));
+            Grow(box, GetVertex(i, 1));
+            Grow(box, GetVertex(i, 2));
+            bounds[i] = box;
+        }
+    };
+    ForEachChunk(pool, triangleCount, BOUNDS_GRAIN_SIZE, computeRange);
+}
+
+Result BottomLevel::Build(const ASBuildOptions &options, const GeometryTriangleDescription2 &geometry, ThreadPool *pool)
+{
+    Result res = CopyGeometry(geometry, pool);
+    if (res != Result::SUCCESS) {
+        return res;
+    }
+    BuildBvh(options, pool);
+    return Result::SUCCESS;
+}
+
+void BottomLevel::CopyGeometry(const BottomLevel &source)
+{
+    m_positions = source.m_positions;
+    m_indices = source.m_indices;
+}
+
+void BottomLevel::BuildBvh(const ASBuildOptions &options, ThreadPool *pool)
+{
+    std::vector<Aabb> bounds;
+    ComputeTriangleBounds(bounds, pool);
+    switch (options.method) {
+        case ASBuildMethod::LBVH_CPU:
+            BuildLbvh(bounds, BuildSettings {}, m_bvh, pool);
+            break;
+        case ASBuildMethod::PLOC_CPU:
+            BuildPloc(bounds, BuildSettings {}, m_bvh, pool);
+            break;
+        case ASBuildMethod::SAH_SPATIAL_SPLITS:
+            BuildSpatialSplitSah(bounds, IndexedTriangles {m_positions.data(), m_indices.data()}, BuildSettings {},
+                                 options.splitBudget, m_bvh);
+            break;
+        default:
+            // There is no device to build on, so SAH_GPU falls back to the cpu SAH builder.
+            BuildBinnedSah(bounds, BuildSettings {}, m_bvh, pool);
+            break;
+    }
+    m_options = options;
+    m_unoptimizedSahCost = ComputeSahCost(m_bvh, BuildSettings {}, pool);
+    if (options.flags & AS_BUILD_FLAG_OPTIMIZE_TREELETS) {
+        OptimizeTreelets(BuildSettings {}, m_bvh, pool);
+        m_builtSahCost = ComputeSahCost(m_bvh, BuildSettings {}, pool);
+    } else {
+        m_builtSahCost = m_unoptimizedSahCost;
+    }
+    ComputeBvhParents(m_bvh, m_parents);
+    m_sahCost = m_builtSahCost;
+    UpdateTraversalLayout();
+}
+
+Result BottomLevel::Refit(const GeometryTriangleDescription2 &geometry, ThreadPool *pool)
+{
+    if (geometry.indicesCount != m_indices.size()) {
+        return Result::INVALID_PARAMETER;
+    }
+    Result res = CopyGeometry(geometry, pool);
+    if (res != Result::SUCCESS) {
+        return res;
+    }
+    UpdateBounds(pool);
+    return Result::SUCCESS;
+}
+
+void BottomLevel::UpdateBounds(ThreadPool *pool)
+{
+    // Every build and load fills in the parents, so without them the blas was compacted. The refit data is
+    // derived again then, once, as the blas turned out not to be static.
+    if (m_parents.empty()) {
+        ComputeBvhParents(m_bvh, m_parents);
+        RefitBvh(IndexedTriangles {m_positions.data(), m_indices.data()}, m_parents, m_bvh, pool);
+        UpdateTraversalLayout();
+        m_sahCost = ComputeSahCost(m_bvh, BuildSettings {}, pool);
+        return;
+    }
+    // The topology stays, so every layout is refitted in place rather than collapsed and packed again.
+    RefitBvh(IndexedTriangles {m_positions.data(), m_indices.data()}, m_parents, m_bvh, pool);
+    if (m_options.flags & AS_BUILD_FLAG_QUANTIZED_NODES) {
+        RefitQuantizedBvh(m_bvh, m_quantizedBvh, pool);
+    } else {
+        m_wideBvhs.Refit(m_bvh, pool);
+    }
+    RefreshTriangleBlocks(m_positions, m_indices, m_triangleBlocks, pool);
+    m_sahCost = ComputeSahCost(m_bvh, BuildSettings {}, pool);
+}
+
+void BottomLevel::UpdateTraversalLayout()
+{
+    // The vector kernels walk the quantized nodes instead of the wide ones when asked to.
+    if (m_options.flags & AS_BUILD_FLAG_QUANTIZED_NODES) {
+        BuildQuantizedBvh(m_bvh, m_quantizedBvh);
+        m_wideBvhs = WideBvhSet {};
+    } else {
+        m_wideBvhs.Update(m_bvh);
+        m_quantizedBvh = QuantizedBvh {};
+    }
+    // The scalar kernel reads the positions through the indices, so the blocks are only worth their memory
+    // when vector kernels run.
+    if (GetBvhWidth(GetSimdIsa()) == BINARY_BVH_WIDTH) {
+        m_triangleBlocks = TriangleBlocks {};
+    } else if (m_options.flags & AS_BUILD_FLAG_QUANTIZED_NODES) {
+        PackTriangleBlocks(m_quantizedBvh, m_positions, m_indices, m_triangleBlocks);
+    } else {
+        PackTriangleBlocks(m_bvh, m_positions, m_indices, m_triangleBlocks);
+    }
+}
+
+ASMemoryUsage BottomLevel::GetMemoryUsage() const
+{
+    ASMemoryUsage usage {};
+    CountBytes(m_positions, usage.geometryBytes, usage.slackBytes);
+    CountBytes(m_indices, usage.geometryBytes, usage.slackBytes);
+    CountBytes(m_bvh.nodes, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_bvh.primIndices, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_wideBvhs.bvh4.nodes, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_wideBvhs.bvh8.nodes, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_quantizedBvh.nodes, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_quantizedBvh.primIndices, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_triangleBlocks.blocks, usage.triangleBlockBytes, usage.slackBytes);
+    CountBytes(m_triangleBlocks.leafLanes, usage.triangleBlockBytes, usage.slackBytes);
+    CountBytes(m_parents, usage.refitBytes, usage.slackBytes);
+    CountBytes(m_wideBvhs.bvh4.sources, usage.refitBytes, usage.slackBytes);
+    CountBytes(m_wideBvhs.bvh8.sources, usage.refitBytes, usage.slackBytes);
+    CountBytes(m_quantizedBvh.sources, usage.refitBytes, usage.slackBytes);
+    return usage;
+}
+
+void BottomLevel::Compact()
+{
+    // The refit data goes first, so that the copies below need less memory at the peak.
+    Release(m_parents);
+    Release(m_wideBvhs.bvh4.sources);
+    Release(m_wideBvhs.bvh8.sources);
+    Release(m_quantizedBvh.sources);
+    ShrinkToSize(m_positions);
+    ShrinkToSize(m_indices);
+    ShrinkToSize(m_bvh.nodes);
+    ShrinkToSize(m_bvh.primIndices);
+    ShrinkToSize(m_wideBvhs.bvh4.nodes);
+    ShrinkToSize(m_wideBvhs.bvh8.nodes);
+    ShrinkToSize(m_quantizedBvh.nodes);
+    ShrinkToSize(m_quantizedBvh.primIndices);
+    ShrinkToSize(m_triangleBlocks.blocks);
+    ShrinkToSize(m_triangleBlocks.leafLanes);
+}
+} // namespace Cpu
+} // namespace RayShop
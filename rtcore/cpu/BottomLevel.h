@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Bottom level acceleration structure of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_BOTTOMLEVEL_H
+#define RAYSHOP_CPU_BOTTOMLEVEL_H
+
+#include "Traversal.h"
+#include "BVH.h"
+#include "QuantizedBvh.h"
+#include "ThreadPool.h"
+#include "TriangleBlock.h"
+#include "WideBvh.h"
+
+namespace RayShop {
+namespace Cpu {
+/// @brief A triangle mesh with its own copy of the positions and indices, plus the bvh over its triangles.
+class BottomLevel {
+public:
+    /**
+     * Copy the geometry and build the bvh.
+     * @param[in]   options     The build method and its settings.
+     * @param[in]   pool        The worker pool the build is spread across, may be nullptr.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    Result Build(const ASBuildOptions &options, const GeometryTriangleDescription2 &geometry, ThreadPool *pool);
+
+    /**
+     * Copy the updated geometry and refit the bvh and its traversal layout in place. The triangle count must not
+     * change. Refit cost grows with the whole tree, so every pass is spread across the pool.
+     * @param[in]   pool        The worker pool the refit is spread across, may be nullptr.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    Result Refit(const GeometryTriangleDescription2 &geometry, ThreadPool *pool);
+
+    /**
+     * Check and copy the geometry, e.g. before building the bvh with BuildBvh on another thread.
+     * @param[in]   pool        The worker pool the copy is spread across, may be nullptr.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    Result CopyGeometry(const GeometryTriangleDescription2 &geometry, ThreadPool *pool);
+
+    /**
+     * Copy the geometry another blas holds right now, e.g. to rebuild it with BuildBvh on another thread while
+     * that one goes on being refit.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    void CopyGeometry(const BottomLevel &source);
+
+    /**
+     * Build the bvh and its traversal layout over the geometry copied already.
+     * @param[in]   pool        The worker pool the build is spread across, may be nullptr.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    void BuildBvh(const ASBuildOptions &options, ThreadPool *pool);
+
+    /**
+     * Refit the bvh and its traversal layout to the geometry copied already, keeping the topology.
+     * @param[in]   pool        The worker pool the refit is spread across, may be nullptr.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    void UpdateBounds(ThreadPool *pool);
+
+    /**
+     * Write the geometry copy and the bvh to a file, e.g. to Load them on the next start instead of building.
+     * The file is written beside path and renamed over it, so that a reader never maps half of it.
+     * @return UNKNOWN_ERROR when the file cannot be written.
+     */
+    Result Save(const char *path) const;
+
+    /**
+     * Map a file written by Save and take the geometry and the bvh from it, deriving the rest in linear time.
+     * @param[in]   options     The build options the file has to be saved with; they are kept as with Build.
+     * @param[in]   geometry    The geometry the file has to be saved for.
+     * @return INVALID_PARAMETER when the file is missing, damaged, of another version, or saved for another
+     *         geometry or build. The blas is left untouched then.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    Result Load(const ASBuildOptions &options, const GeometryTriangleDescription2 &geometry, const char *path);
+
+    const ASBuildOptions &GetBuildOptions() const
+    {
+        return m_options;
+    }
+
+    /// @brief The SAH cost of the bvh over the one it had when it was built, which refits drive up.
+    float GetSahRatio() const
+    {
+        return m_builtSahCost > 0.0f ? m_sahCost / m_builtSahCost : 1.0f;
+    }
+
+    ASSahCosts GetSahCosts() const
+    {
+        return ASSahCosts {m_unoptimizedSahCost, m_builtSahCost, m_sahCost};
+    }
+
+    const Bvh &GetBvh() const
+    {
+        return m_bvh;
+    }
+
+    const WideBvhSet &GetWideBvhs() const
+    {
+        return m_wideBvhs;
+    }
+
+    const QuantizedBvh &GetQuantizedBvh() const
+    {
+        return m_quantizedBvh;
+    }
+
+    const TriangleBlocks &GetTriangleBlocks() const
+    {
+        return m_triangleBlocks;
+    }
+
+    /// @brief The bytes held by the geometry copy, the bvh layouts, the triangle blocks and the refit data.
+    ASMemoryUsage GetMemoryUsage() const;
+
+    /**
+     * Move every array into an allocation of its exact size and free the refit data, i.e. the parents and the
+     * sources of the layouts. The next UpdateBounds derives the refit data again.
+     * @note Throws std::bad_alloc when memory runs out. The blas stays whole then, only partly compacted.
+     */
+    void Compact();
+
+    Aabb GetBounds() const
+    {
+        return NodeBounds(m_bvh.nodes[0]);
+    }
+
+    uint32_t GetTriangleCount() const
+    {
+        return static_cast<uint32_t>(m_indices.size() / 3);
+    }
+
+    const float *GetVertex(uint32_t triangle, uint32_t corner) const
+    {
+        return &m_positions[m_indices[triangle * 3 + corner] * AXIS_COUNT];
+    }
+
+private:
+    void ComputeTriangleBounds(std::vector<Aabb> &bounds, ThreadPool *pool) const;
+    void UpdateTraversalLayout();
+
+    std::vector<float> m_positions;
+    std::vector<uint32_t> m_indices;
+    Bvh m_bvh;
+    std::vector<uint32_t> m_parents;    /* *< The parent of each m_bvh node, for the bottom-up refit. */
+    ASBuildOptions m_options;
+    float m_unoptimizedSahCost = 0.0f;  /* *< The SAH cost the build method left, before treelet optimization. */
+    float m_builtSahCost = 0.0f;        /* *< The SAH cost right after the last build. */
+    float m_sahCost = 0.0f;             /* *< The SAH cost after the last build or refit. */
+    WideBvhSet m_wideBvhs;          /* *< Collapsed from m_bvh after every build and refit, unless quantized. */
+    QuantizedBvh m_quantizedBvh;    /* *< Only with AS_BUILD_FLAG_QUANTIZED_NODES, then m_wideBvhs is empty. */
+    TriangleBlocks m_triangleBlocks; /* *< The leaves of whichever layout the vector kernels walk. */
+};
+
+/// @brief Check the parts of a geometry description the cpu backend relies on.
+bool IsValidGeometry(const GeometryTriangleDescription2 &geometry);
+
+/**
+ * Check a geometry description in any of its formats, and decode it to packed float positions and 32-bit indices.
+ * @param[in]   pool        The worker pool the decoding is spread across, may be nullptr.
+ * @return INVALID_PARAMETER when the description is not valid or an index is out of range. Nothing is written then.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+Result DecodeGeometry(const GeometryTriangleDescription2 &geometry, std::vector<float> &positions,
+                      std::vector<uint32_t> &indices, ThreadPool *pool);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_BOTTOMLEVEL_H
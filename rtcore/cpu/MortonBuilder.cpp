@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Morton curve based fast bvh builders (LBVH and PLOC) of the RayShop cpu backend.
+ */
+
+#include "BVHBuilder.h"
+
+#include <algorithm>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t MORTON_BITS_PER_AXIS = 10;
+constexpr float MORTON_GRID_MAX = static_cast<float>((1u << MORTON_BITS_PER_AXIS) - 1);
+constexpr uint32_t RADIX_BITS = 8;
+constexpr uint32_t RADIX_SIZE = 1u << RADIX_BITS;
+constexpr uint32_t RADIX_PASSES = (MORTON_BITS_PER_AXIS * AXIS_COUNT + RADIX_BITS - 1) / RADIX_BITS;
+constexpr uint32_t PARALLEL_GRAIN_SIZE = 4096;     /* *< Primitives per chunk of a parallel pass. */
+constexpr uint32_t PLOC_SEARCH_RADIUS = 8;         /* *< Clusters searched on each side for the nearest one. */
+
+uint32_t ChunkCount(uint32_t begin, uint32_t end)
+{
+    return (end - begin + PARALLEL_GRAIN_SIZE - 1) / PARALLEL_GRAIN_SIZE;
+}
+
+/// Run func on the chunks of [begin, end); per-chunk results are indexed by (first - begin) / PARALLEL_GRAIN_SIZE.
+template <typename Func>
+void ForEachChunk(ThreadPool *pool, uint32_t begin, uint32_t end, const Func &func)
+{
+    if (pool != nullptr) {
+        pool->ParallelFor(begin, end, PARALLEL_GRAIN_SIZE, func);
+        return;
+    }
+    for (uint32_t first = begin; first < end; first = std::min(end, first + PARALLEL_GRAIN_SIZE)) {
+        func(first, std::min(end, first + PARALLEL_GRAIN_SIZE));
+    }
+}
+
+uint32_t MortonCode(const Aabb &primBounds, const Aabb &centroidBounds)
+{
+    uint32_t code = 0;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        float extent = centroidBounds.upper[axis] - centroidBounds.lower[axis];
+        float scale = extent > 0.0f ? MORTON_GRID_MAX / extent : 0.0f;
+        float cell = (Center(primBounds, axis) - centroidBounds.lower[axis]) * scale;
+        uint32_t quantized = static_cast<uint32_t>(std::min(MORTON_GRID_MAX, std::max(0.0f, cell)));
+        code |= ExpandMortonBits(quantized) << (AXIS_COUNT - 1 - axis);
+    }
+    return code;
+}
+
+/**
+ * Compute the Morton code of every primitive centroid and sort the primitives by it.
+ * @param[out]  codes       The sorted codes.
+ * @param[out]  order       The primitive of each sorted code.
+ */
+void SortByMortonCode(const std::vector<Aabb> &primBounds, ThreadPool *pool, std::vector<uint32_t> &codes,
+                      std::vector<uint32_t> &order)
+{
+    uint32_t primCount = static_cast<uint32_t>(primBounds.size());
+    uint32_t chunkCount = ChunkCount(0, primCount);
+    std::vector<Aabb> partialBounds(chunkCount);
+    ForEachChunk(pool, 0, primCount, [&](uint32_t begin, uint32_t end) {
+        Aabb &bounds = partialBounds[begin / PARALLEL_GRAIN_SIZE];
+        bounds = EmptyAabb();
+        for (uint32_t i = begin; i < end; i++) {
+            const Aabb &box = primBounds[i];
+            float centroid[AXIS_COUNT] = {Center(box, 0), Center(box, 1), Center(box, 2)};
+            Grow(bounds, centroid);
+        }
+    });
+    Aabb centroidBounds = EmptyAabb();
+    for (const Aabb &bounds : partialBounds) {
+        Grow(centroidBounds, bounds);
+    }
+    codes.resize(primCount);
+    order.resize(primCount);
+    ForEachChunk(pool, 0, primCount, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            codes[i] = MortonCode(primBounds[i], centroidBounds);
+            order[i] = i;
+        }
+    });
+
+    // Least significant digit first radix sort; equal codes keep their primitive order. Every chunk counts its
+    // digits, and the offsets of a digit are laid out chunk by chunk, so each chunk scatters on its own.
+    std::vector<uint32_t> sortedCodes(primCount);
+    std::vector<uint32_t> sortedOrder(primCount);
+    std::vector<uint32_t> offsets(static_cast<size_t>(chunkCount) * RADIX_SIZE);
+    for (uint32_t pass = 0; pass < RADIX_PASSES; pass++) {
+        uint32_t shift = pass * RADIX_BITS;
+        ForEachChunk(pool, 0, primCount, [&](uint32_t begin, uint32_t end) {
+            uint32_t *counts = &offsets[static_cast<size_t>(begin / PARALLEL_GRAIN_SIZE) * RADIX_SIZE];
+            std::fill(counts, counts + RADIX_SIZE, 0u);
+            for (uint32_t i = begin; i < end; i++) {
+                counts[(codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+            }
+        });
+        uint32_t sum = 0;
+        for (uint32_t digit = 0; digit < RADIX_SIZE; digit++) {
+            for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+                uint32_t &offset = offsets[static_cast<size_t>(chunk) * RADIX_SIZE + digit];
+                uint32_t count = offset;
+                offset = sum;
+                sum += count;
+            }
+        }
+        ForEachChunk(pool, 0, primCount, [&](uint32_t begin, uint32_t end) {
+            uint32_t *chunkOffsets = &offsets[static_cast<size_t>(begin / PARALLEL_GRAIN_SIZE) * RADIX_SIZE];
+            for (uint32_t i = begin; i < end; i++) {
+                uint32_t slot = chunkOffsets[(codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+                sortedCodes[slot] = codes[i];
+                sortedOrder[slot] = order[i];
+            }
+        });
+        codes.swap(sortedCodes);
+        order.swap(sortedOrder);
+    }
+}
+
+void MakeEmpty(Bvh &bvh)
+{
+    bvh.nodes.assign(1, BvhNode {});
+    SetNodeBounds(bvh.nodes[0], EmptyAabb());
+    bvh.primIndices.clear();
+}
+
+struct SplitTask {
+    uint32_t nodeIndex;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t depth;
+};
+
+/// Split a sorted range where the highest bit that differs between its codes turns on.
+uint32_t FindMortonSplit(const std::vector<uint32_t> &codes, uint32_t begin, uint32_t end)
+{
+    uint32_t first = codes[begin];
+    uint32_t last = codes[end - 1];
+    if (first == last) {
+        return begin + (end - begin) / 2;
+    }
+    uint32_t highestBit = 1u << (31 - __builtin_clz(first ^ last));
+    auto middle = std::partition_point(codes.begin() + begin, codes.begin() + end,
+        [highestBit](uint32_t code) { return (code & highestBit) == 0; });
+    return static_cast<uint32_t>(middle - codes.begin());
+}
+
+/// @brief An intermediate PLOC node; children are INVALID_INDEX for a single primitive.
+struct Cluster {
+    Aabb bounds;
+    uint32_t children[2];
+    uint32_t prim;
+    uint32_t primCount;
+    float cost;
+    bool collapse;
+};
+
+struct EmitTask {
+    uint32_t nodeIndex;
+    uint32_t cluster;
+    uint32_t depth;
+};
+
+class PlocBuilder {
+public:
+    PlocBuilder(const std::vector<Aabb> &primBounds, const BuildSettings &settings, Bvh &bvh, ThreadPool *pool)
+        : m_primBounds(primBounds), m_settings(settings), m_bvh(bvh), m_pool(pool)
+    {}
+
+    void Build()
+    {
+        uint32_t primCount = static_cast<uint32_t>(m_primBounds.size());
+        if (primCount == 0) {
+            MakeEmpty(m_bvh);
+            return;
+        }
+        std::vector<uint32_t> codes;
+        std::vector<uint32_t> order;
+        SortByMortonCode(m_primBounds, m_pool, codes, order);
+
+        m_clusters.reserve(static_cast<size_t>(primCount) * 2 - 1);
+        m_clusters.resize(primCount);
+        // The active clusters and a copy of their bounds, kept in Morton order.
+        std::vector<uint32_t> active(primCount);
+        std::vector<Aabb> activeBounds(primCount);
+        ForEachChunk(m_pool, 0, primCount, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                m_clusters[i] = Cluster {m_primBounds[order[i]], {INVALID_INDEX, INVALID_INDEX}, order[i], 1,
+                                         0.0f, true};
+                active[i] = i;
+                activeBounds[i] = m_primBounds[order[i]];
+            }
+        });
+        m_levelEnds.assign(1, primCount);
+        while (active.size() > 1) {
+            MergeNearestPairs(active, activeBounds);
+            m_levelEnds.push_back(static_cast<uint32_t>(m_clusters.size()));
+        }
+        ChooseLeaves();
+        Emit(active[0], primCount);
+    }
+
+private:
+    /**
+     * Candidate pairs of cluster i are ordered by merged area, then by distance, then preferring pairs that
+     * start at an even position. The order only depends on the pair, so the smallest pair is always mutual,
+     * and runs of equal areas (duplicated or regular geometry) still merge pairwise instead of one at a time.
+     */
+    static bool BreaksTie(uint32_t i, uint32_t j, uint32_t best)
+    {
+        uint32_t distance = j > i ? j - i : i - j;
+        uint32_t bestDistance = best > i ? best - i : i - best;
+        if (distance != bestDistance) {
+            return distance < bestDistance;
+        }
+        uint32_t first = std::min(i, j);
+        uint32_t bestFirst = std::min(i, best);
+        if ((first & 1u) != (bestFirst & 1u)) {
+            return (first & 1u) == 0;
+        }
+        return first < bestFirst;
+    }
+
+    void MergeNearestPairs(std::vector<uint32_t> &active, std::vector<Aabb> &activeBounds)
+    {
+        uint32_t count = static_cast<uint32_t>(active.size());
+        // Each merged area is computed once, by the left cluster of the pair, for the search of both.
+        std::vector<float> areas(static_cast<size_t>(count) * PLOC_SEARCH_RADIUS);
+        ForEachChunk(m_pool, 0, count, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                float *rightAreas = &areas[static_cast<size_t>(i) * PLOC_SEARCH_RADIUS];
+                for (uint32_t k = 1; k <= PLOC_SEARCH_RADIUS; k++) {
+                    if (i + k >= count) {
+                        rightAreas[k - 1] = FLOAT_MAX;
+                        continue;
+                    }
+                    Aabb merged = activeBounds[i];
+                    Grow(merged, activeBounds[i + k]);
+                    rightAreas[k - 1] = HalfArea(merged);
+                }
+            }
+        });
+        std::vector<uint32_t> nearest(count);
+        ForEachChunk(m_pool, 0, count, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                uint32_t best = INVALID_INDEX;
+                float bestArea = FLOAT_MAX;
+                auto consider = [i, &best, &bestArea](uint32_t j, float area) {
+                    if (best == INVALID_INDEX || area < bestArea || (area == bestArea && BreaksTie(i, j, best))) {
+                        best = j;
+                        bestArea = area;
+                    }
+                };
+                for (uint32_t k = 1; k <= PLOC_SEARCH_RADIUS; k++) {
+                    if (k <= i) {
+                        consider(i - k, areas[static_cast<size_t>(i - k) * PLOC_SEARCH_RADIUS + k - 1]);
+                    }
+                    if (i + k < count) {
+                        consider(i + k, areas[static_cast<size_t>(i) * PLOC_SEARCH_RADIUS + k - 1]);
+                    }
+                }
+                nearest[i] = best;
+            }
+        });
+
+        // Merged clusters take the place of their left member, which keeps the array Morton ordered. Every chunk
+        // counts the clusters it keeps and creates, so the compaction runs in parallel in the serial order.
+        uint32_t chunkCount = ChunkCount(0, count);
+        std::vector<uint32_t> keptOffsets(chunkCount);
+        std::vector<uint32_t> mergedOffsets(chunkCount);
+        ForEachChunk(m_pool, 0, count, [&](uint32_t begin, uint32_t end) {
+            uint32_t kept = 0;
+            uint32_t merged = 0;
+            for (uint32_t i = begin; i < end; i++) {
+                uint32_t j = nearest[i];
+                kept += nearest[j] != i || i < j ? 1 : 0;
+                merged += nearest[j] == i && i < j ? 1 : 0;
+            }
+            keptOffsets[begin / PARALLEL_GRAIN_SIZE] = kept;
+            mergedOffsets[begin / PARALLEL_GRAIN_SIZE] = merged;
+        });
+        uint32_t keptTotal = 0;
+        uint32_t mergedTotal = 0;
+        for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+            uint32_t kept = keptOffsets[chunk];
+            uint32_t merged = mergedOffsets[chunk];
+            keptOffsets[chunk] = keptTotal;
+            mergedOffsets[chunk] = mergedTotal;
+            keptTotal += kept;
+            mergedTotal += merged;
+        }
+        uint32_t firstMerged = static_cast<uint32_t>(m_clusters.size());
+        m_clusters.resize(firstMerged + mergedTotal);
+        std::vector<uint32_t> nextActive(keptTotal);
+        std::vector<Aabb> nextBounds(keptTotal);
+        ForEachChunk(m_pool, 0, count, [&](uint32_t begin, uint32_t end) {
+            uint32_t kept = keptOffsets[begin / PARALLEL_GRAIN_SIZE];
+            uint32_t merged = firstMerged + mergedOffsets[begin / PARALLEL_GRAIN_SIZE];
+            for (uint32_t i = begin; i < end; i++) {
+                uint32_t j = nearest[i];
+                if (nearest[j] != i) {
+                    nextActive[kept] = active[i];
+                    nextBounds[kept++] = activeBounds[i];
+                } else if (i < j) {
+                    Cluster &cluster = m_clusters[merged];
+                    cluster = Cluster {activeBounds[i], {active[i], active[j]}, INVALID_INDEX, 0, 0.0f, false};
+                    Grow(cluster.bounds, activeBounds[j]);
+                    nextActive[kept] = merged++;
+                    nextBounds[kept++] = cluster.bounds;
+                }
+            }
+        });
+        active.swap(nextActive);
+        activeBounds.swap(nextBounds);
+    }
+
+    /// Children are created in an earlier merge round than their parents, so the SAH is computed bottom-up one
+    /// round at a time, with the clusters of a round in parallel.
+    void ChooseLeaves()
+    {
+        uint32_t levelBegin = 0;
+        for (uint32_t levelEnd : m_levelEnds) {
+            ForEachChunk(m_pool, levelBegin, levelEnd, [this](uint32_t begin, uint32_t end) {
+                for (uint32_t i = begin; i < end; i++) {
+                    ChooseLeaf(m_clusters[i]);
+                }
+            });
+            levelBegin = levelEnd;
+        }
+    }
+
+    void ChooseLeaf(Cluster &cluster)
+    {
+        float area = HalfArea(cluster.bounds);
+        if (cluster.children[0] == INVALID_INDEX) {
+            cluster.cost = m_settings.intersectionCost * area;
+            return;
+        }
+        const Cluster &left = m_clusters[cluster.children[0]];
+        const Cluster &right = m_clusters[cluster.children[1]];
+        cluster.primCount = left.primCount + right.primCount;
+        float innerCost = m_settings.traversalCost * area + left.cost + right.cost;
+        float leafCost = m_settings.intersectionCost * area * static_cast<float>(cluster.primCount);
+        cluster.collapse = cluster.primCount <= m_settings.maxLeafSize && leafCost <= innerCost;
+        cluster.cost = cluster.collapse ? leafCost : innerCost;
+    }
+
+    void GatherPrims(uint32_t root)
+    {
+        std::vector<uint32_t> stack(1, root);
+        while (!stack.empty()) {
+            const Cluster &cluster = m_clusters[stack.back()];
+            stack.pop_back();
+            if (cluster.children[0] == INVALID_INDEX) {
+                m_bvh.primIndices.push_back(cluster.prim);
+            } else {
+                stack.push_back(cluster.children[1]);
+                stack.push_back(cluster.children[0]);
+            }
+        }
+    }
+
+    /// Lay the clusters out depth-first with adjacent children, the format every other builder produces.
+    void Emit(uint32_t root, uint32_t primCount)
+    {
+        m_bvh.nodes.clear();
+        m_bvh.nodes.reserve(static_cast<size_t>(primCount) * 2 - 1);
+        m_bvh.primIndices.clear();
+        m_bvh.primIndices.reserve(primCount);
+        m_bvh.nodes.push_back(BvhNode {});
+        std::vector<EmitTask> stack;
+        stack.push_back(EmitTask {0, root, 0});
+        while (!stack.empty()) {
+            EmitTask task = stack.back();
+            stack.pop_back();
+            const Cluster &cluster = m_clusters[task.cluster];
+            SetNodeBounds(m_bvh.nodes[task.nodeIndex], cluster.bounds);
+            if (cluster.collapse || task.depth + 1 >= BVH_MAX_DEPTH) {
+                uint32_t first = static_cast<uint32_t>(m_bvh.primIndices.size());
+                GatherPrims(task.cluster);
+                m_bvh.nodes[task.nodeIndex].leftFirst = first;
+                m_bvh.nodes[task.nodeIndex].primCount = static_cast<uint32_t>(m_bvh.primIndices.size()) - first;
+                continue;
+            }
+            uint32_t left = static_cast<uint32_t>(m_bvh.nodes.size());
+            m_bvh.nodes.resize(left + 2);
+            m_bvh.nodes[task.nodeIndex].leftFirst = left;
+            m_bvh.nodes[task.nodeIndex].primCount = 0;
+            stack.push_back(EmitTask {left + 1, cluster.children[1], task.depth + 1});
+            stack.push_back(EmitTask {left, cluster.children[0], task.depth + 1});
+        }
+    }
+
+    const std::vector<Aabb> &m_primBounds;
+    const BuildSettings &m_settings;
+    Bvh &m_bvh;
+    ThreadPool *m_pool;
+    std::vector<Cluster> m_clusters;
+    std::vector<uint32_t> m_levelEnds;     /* *< The end of the clusters created by each merge round. */
+};
+} // namespace
+
+void BuildLbvh(const std::vector<Aabb> &primBounds, const BuildSettings &settings, Bvh &bvh, ThreadPool *pool)
+{
+    uint32_t primCount = static_cast<uint32_t>(primBounds.size());
+    if (primCount == 0) {
+        MakeEmpty(bvh);
+        return;
+    }
+    std::vector<uint32_t> codes;
+    SortByMortonCode(primBounds, pool, codes, bvh.primIndices);
+
+    bvh.nodes.clear();
+    bvh.nodes.reserve(static_cast<size_t>(primCount) * 2 - 1);
+    bvh.nodes.push_back(BvhNode {});
+    std::vector<SplitTask> stack;
+    stack.push_back(SplitTask {0, 0, primCount, 0});
+    while (!stack.empty()) {
+        SplitTask task = stack.back();
+        stack.pop_back();
+        if (task.end - task.begin <= settings.maxLeafSize || task.depth + 1 >= BVH_MAX_DEPTH) {
+            bvh.nodes[task.nodeIndex].leftFirst = task.begin;
+            bvh.nodes[task.nodeIndex].primCount = task.end - task.begin;
+            continue;
+        }
+        uint32_t middle = FindMortonSplit(codes, task.begin, task.end);
+        uint32_t left = static_cast<uint32_t>(bvh.nodes.size());
+        bvh.nodes.resize(left + 2);
+        bvh.nodes[task.nodeIndex].leftFirst = left;
+        bvh.nodes[task.nodeIndex].primCount = 0;
+        stack.push_back(SplitTask {left + 1, middle, task.end, task.depth + 1});
+        stack.push_back(SplitTask {left, task.begin, middle, task.depth + 1});
+    }
+    RefitBvh(primBounds, bvh);
+}
+
+void BuildPloc(const std::vector<Aabb> &primBounds, const BuildSettings &settings, Bvh &bvh, ThreadPool *pool)
+{
+    PlocBuilder builder(primBounds, settings, bvh, pool);
+    builder.Build();
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Ray packet traversal of the RayShop cpu backend, shared by the per instruction set kernels.
+ */
+
+#ifndef RAYSHOP_CPU_PACKETTRAVERSAL_H
+#define RAYSHOP_CPU_PACKETTRAVERSAL_H
+
+#include <algorithm>
+
+#include "RayKernels.h"
+#include "RayTracer.h"
+#include "TopLevel.h"
+
+// Like WideTraversal.h, this header is included inside the target region of each instruction set kernel. The
+// kernel supplies an Ops class with WIDTH lanes of Float and Load, Store, Set, Add, Sub, Mul, Div, Min, Max,
+// LessEqual, And, Or and MoveMask, which the templates below use to handle WIDTH rays per instruction.
+namespace RayShop {
+namespace Cpu {
+/// @brief The rays of a packet, structure-of-arrays in the space of the structure being traversed.
+/// Unused and finished lanes have tmax below tmin, so they never hit anything.
+struct RayPacket {
+    float origin[AXIS_COUNT][PACKET_SIZE];
+    float dir[AXIS_COUNT][PACKET_SIZE];
+    float invDir[AXIS_COUNT][PACKET_SIZE];
+    float tmin[PACKET_SIZE];
+    float tmax[PACKET_SIZE];
+    float shear[AXIS_COUNT][PACKET_SIZE];   /* *< LocalRay::shear of each ray. */
+    uint32_t axes[PACKET_SIZE];             /* *< LocalRay::kx, ky and kz of each ray, AXIS_BITS each. */
+    uint32_t sharedAxes;                    /* *< The axes of all live rays if they agree, else INVALID_INDEX. */
+    float rayBasis[AXIS_COUNT][AXIS_COUNT][PACKET_SIZE]; /* *< Without sharedAxes only: row r maps a vertex,
+                                                              relative to the origin, to coordinate r of ray space. */
+};
+
+/// @brief Interval bounds of the live rays of a packet. They cull a box for the whole packet at once,
+/// which only works when the direction sign of every axis is shared by all rays.
+struct PacketFrustum {
+    bool valid;
+    float originMin[AXIS_COUNT];
+    float originMax[AXIS_COUNT];
+    float invDirMin[AXIS_COUNT];
+    float invDirMax[AXIS_COUNT];
+    float tmin;
+    float tmax;
+};
+
+constexpr float RETIRED_TMAX = -FLOAT_MAX;
+constexpr uint32_t MASK_BITS = 32;
+constexpr uint32_t AXIS_BITS = 2;
+constexpr uint32_t AXIS_MASK = (1u << AXIS_BITS) - 1;
+
+inline void SetPacketLane(RayPacket &packet, uint32_t lane, const LocalRay &ray)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        packet.origin[axis][lane] = ray.origin[axis];
+        packet.dir[axis][lane] = ray.dir[axis];
+        packet.invDir[axis][lane] = ray.invDir[axis];
+    }
+    packet.tmin[lane] = ray.tmin;
+    packet.tmax[lane] = ray.tmax;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        packet.shear[axis][lane] = ray.shear[axis];
+    }
+    packet.axes[lane] = ray.kx | (ray.ky << AXIS_BITS) | (ray.kz << (AXIS_BITS * 2));
+}
+
+inline void RetirePacketLane(RayPacket &packet, uint32_t lane)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        packet.origin[axis][lane] = 0.0f;
+        packet.dir[axis][lane] = 1.0f;
+        packet.invDir[axis][lane] = 1.0f;
+    }
+    packet.tmin[lane] = 0.0f;
+    packet.tmax[lane] = RETIRED_TMAX;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        packet.shear[axis][lane] = 0.0f;
+    }
+    packet.axes[lane] = 0;
+}
+
+/**
+ * Prepare the triangle tests of the rays from first on. Rays of a coherent packet share kx, ky and kz, and
+ * are sheared like ShearVertex does. Otherwise the shear is spelled out as a matrix per ray; its products by
+ * 1 and 0 and its sums with 0 are exact, which leaves the same sheared coordinates.
+ */
+inline void PreparePacketShear(RayPacket &packet, uint32_t first)
+{
+    uint32_t axes = INVALID_INDEX;
+    bool shared = true;
+    for (uint32_t lane = first; lane < PACKET_SIZE; lane++) {
+        if (packet.tmax[lane] < packet.tmin[lane]) {
+            continue;
+        }
+        axes = axes == INVALID_INDEX ? packet.axes[lane] : axes;
+        shared = shared && packet.axes[lane] == axes;
+    }
+    if (shared) {
+        // Without a live ray any axes do.
+        packet.sharedAxes = axes == INVALID_INDEX ? 0 : axes;
+        return;
+    }
+    packet.sharedAxes = INVALID_INDEX;
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        uint32_t kx = packet.axes[lane] & AXIS_MASK;
+        uint32_t ky = (packet.axes[lane] >> AXIS_BITS) & AXIS_MASK;
+        uint32_t kz = packet.axes[lane] >> (AXIS_BITS * 2);
+        for (int row = 0; row < AXIS_COUNT; row++) {
+            for (int axis = 0; axis < AXIS_COUNT; axis++) {
+                packet.rayBasis[row][axis][lane] = 0.0f;
+            }
+        }
+        packet.rayBasis[0][kx][lane] = 1.0f;
+        packet.rayBasis[0][kz][lane] = -packet.shear[0][lane];
+        packet.rayBasis[1][ky][lane] = 1.0f;
+        packet.rayBasis[1][kz][lane] = -packet.shear[1][lane];
+        packet.rayBasis[2][kz][lane] = packet.shear[2][lane];
+    }
+}
+
+inline void ComputePacketFrustum(const RayPacket &packet, uint32_t first, PacketFrustum &frustum)
+{
+    frustum.valid = false;
+    frustum.tmin = FLOAT_MAX;
+    frustum.tmax = -FLOAT_MAX;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        frustum.originMin[axis] = FLOAT_MAX;
+        frustum.originMax[axis] = -FLOAT_MAX;
+        frustum.invDirMin[axis] = FLOAT_MAX;
+        frustum.invDirMax[axis] = -FLOAT_MAX;
+    }
+    for (uint32_t lane = first; lane < PACKET_SIZE; lane++) {
+        if (packet.tmax[lane] < packet.tmin[lane]) {
+            continue;
+        }
+        frustum.valid = true;
+        frustum.tmin = std::min(frustum.tmin, packet.tmin[lane]);
+        frustum.tmax = std::max(frustum.tmax, packet.tmax[lane]);
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            frustum.originMin[axis] = std::min(frustum.originMin[axis], packet.origin[axis][lane]);
+            frustum.originMax[axis] = std::max(frustum.originMax[axis], packet.origin[axis][lane]);
+            frustum.invDirMin[axis] = std::min(frustum.invDirMin[axis], packet.invDir[axis][lane]);
+            frustum.invDirMax[axis] = std::max(frustum.invDirMax[axis], packet.invDir[axis][lane]);
+        }
+    }
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        frustum.valid = frustum.valid && (frustum.invDirMin[axis] > 0.0f || frustum.invDirMax[axis] < 0.0f);
+    }
+}
+
+/**
+ * Check whether no ray of the frustum can enter a box. Float rounding is monotonic, so the interval
+ * products bound the distances every ray computes in IntersectBoxLanes: culling never drops a hit.
+ */
+inline bool FrustumMisses(const PacketFrustum &frustum, const BvhNode &node)
+{
+    float tNear = frustum.tmin;
+    float tFar = frustum.tmax;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        bool negative = frustum.invDirMax[axis] < 0.0f;
+        float nearPlane = negative ? node.upper[axis] : node.lower[axis];
+        float farPlane = negative ? node.lower[axis] : node.upper[axis];
+        float invMin = frustum.invDirMin[axis];
+        float invMax = frustum.invDirMax[axis];
+        float nearLow = nearPlane - frustum.originMax[axis];
+        float nearHigh = nearPlane - frustum.originMin[axis];
+        tNear = std::max(tNear, std::min(std::min(nearLow * invMin, nearLow * invMax),
+                                         std::min(nearHigh * invMin, nearHigh * invMax)));
+        float farLow = farPlane - frustum.originMax[axis];
+        float farHigh = farPlane - frustum.originMin[axis];
+        tFar = std::min(tFar, std::max(std::max(farLow * invMin, farLow * invMax),
+                                       std::max(farHigh * invMin, farHigh * invMax)));
+    }
+    return tNear > tFar * ROBUST_FAR_SCALE;
+}
+
+/// @return The mask of the rays lane0 to lane0 + WIDTH - 1 that enter the box.
+template <typename Ops>
+uint32_t IntersectBoxLanes(const RayPacket &packet, uint32_t lane0, const BvhNode &node)
+{
+    using Float = typename Ops::Float;
+    Float tNear = Ops::Load(&packet.tmin[lane0]);
+    Float tFar = Ops::Load(&packet.tmax[lane0]);
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        Float origin = Ops::Load(&packet.origin[axis][lane0]);
+        Float invDir = Ops::Load(&packet.invDir[axis][lane0]);
+        Float t0 = Ops::Mul(Ops::Sub(Ops::Set(node.lower[axis]), origin), invDir);
+        Float t1 = Ops::Mul(Ops::Sub(Ops::Set(node.upper[axis]), origin), invDir);
+        tNear = Ops::Max(tNear, Ops::Min(t0, t1));
+        tFar = Ops::Min(tFar, Ops::Max(t0, t1));
+    }
+    return Ops::MoveMask(Ops::LessEqual(tNear, Ops::Mul(tFar, Ops::Set(ROBUST_FAR_SCALE))));
+}
+
+/// @return The mask of the lanes of the group at lane0 that lie in [first, end).
+template <typename Ops>
+uint32_t GroupRangeMask(uint32_t lane0, uint32_t first, uint32_t end)
+{
+    uint32_t mask = (1u << Ops::WIDTH) - 1;
+    if (lane0 < first) {
+        mask &= ~0u << (first - lane0);
+    }
+    if (lane0 + Ops::WIDTH > end) {
+        mask &= (1u << (end - lane0)) - 1;
+    }
+    return mask;
+}
+
+/**
+ * Narrow the rays [first, end) down to those from the first to the last that enter a box. The group of the
+ * first ray is tested, then the frustum culls the box for the whole packet, and only then the remaining
+ * groups are searched from both ends.
+ * @return false when no ray enters the box.
+ */
+template <typename Ops>
+bool NarrowRayRange(const RayPacket &packet, const PacketFrustum &frustum, const BvhNode &node, uint32_t &first,
+                    uint32_t &end)
+{
+    uint32_t lane0 = first - first % Ops::WIDTH;
+    uint32_t mask = IntersectBoxLanes<Ops>(packet, lane0, node) & GroupRangeMask<Ops>(lane0, first, end);
+    if (mask == 0) {
+        if (frustum.valid && FrustumMisses(frustum, node)) {
+            return false;
+        }
+        for (lane0 += Ops::WIDTH; mask == 0 && lane0 < end; lane0 += Ops::WIDTH) {
+            mask = IntersectBoxLanes<Ops>(packet, lane0, node) & GroupRangeMask<Ops>(lane0, first, end);
+        }
+        if (mask == 0) {
+            return false;
+        }
+        lane0 -= Ops::WIDTH;
+    }
+    first = lane0 + static_cast<uint32_t>(__builtin_ctz(mask));
+    uint32_t firstGroup = lane0;
+    for (lane0 = (end - 1) - (end - 1) % Ops::WIDTH; lane0 > firstGroup; lane0 -= Ops::WIDTH) {
+        uint32_t lastMask = IntersectBoxLanes<Ops>(packet, lane0, node) & GroupRangeMask<Ops>(lane0, first, end);
+        if (lastMask != 0) {
+            end = lane0 + MASK_BITS - static_cast<uint32_t>(__builtin_clz(lastMask));
+            return true;
+        }
+    }
+    end = lane0 + MASK_BITS - static_cast<uint32_t>(__builtin_clz(mask));
+    return true;
+}
+
+/// Move a vertex into the ray space of the rays lane0 to lane0 + WIDTH - 1, see PreparePacketShear.
+template <typename Ops>
+void ShearVertexLanes(const RayPacket &packet, uint32_t lane0, const float *p, typename Ops::Float *sheared)
+{
+    using Float = typename Ops::Float;
+    Float rel[AXIS_COUNT];
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        rel[axis] = Ops::Sub(Ops::Set(p[axis]), Ops::Load(&packet.origin[axis][lane0]));
+    }
+    if (packet.sharedAxes != INVALID_INDEX) {
+        uint32_t kx = packet.sharedAxes & AXIS_MASK;
+        uint32_t ky = (packet.sharedAxes >> AXIS_BITS) & AXIS_MASK;
+        uint32_t kz = packet.sharedAxes >> (AXIS_BITS * 2);
+        sheared[0] = Ops::Sub(rel[kx], Ops::Mul(Ops::Load(&packet.shear[0][lane0]), rel[kz]));
+        sheared[1] = Ops::Sub(rel[ky], Ops::Mul(Ops::Load(&packet.shear[1][lane0]), rel[kz]));
+        sheared[2] = Ops::Mul(Ops::Load(&packet.shear[2][lane0]), rel[kz]);
+        return;
+    }
+    for (int row = 0; row < AXIS_COUNT; row++) {
+        const float (&basis)[AXIS_COUNT][PACKET_SIZE] = packet.rayBasis[row];
+        sheared[row] = Ops::Add(Ops::Add(Ops::Mul(Ops::Load(&basis[0][lane0]), rel[0]),
+                                         Ops::Mul(Ops::Load(&basis[1][lane0]), rel[1])),
+                                Ops::Mul(Ops::Load(&basis[2][lane0]), rel[2]));
+    }
+}
+
+/// IntersectTriangle for the rays lane0 to lane0 + WIDTH - 1, in the same order of operations.
+template <typename Ops, uint32_t FLAGS, bool COORDINATES>
+uint32_t IntersectTriangleLanes(const RayPacket &packet, uint32_t lane0, const float *v0, const float *v1,
+                                const float *v2, float *t, float *u, float *v)
+{
+    using Float = typename Ops::Float;
+    Float a[AXIS_COUNT];
+    Float b[AXIS_COUNT];
+    Float c[AXIS_COUNT];
+    ShearVertexLanes<Ops>(packet, lane0, v0, a);
+    ShearVertexLanes<Ops>(packet, lane0, v1, b);
+    ShearVertexLanes<Ops>(packet, lane0, v2, c);
+    Float edgeU = Ops::Sub(Ops::Mul(c[0], b[1]), Ops::Mul(c[1], b[0]));
+    Float edgeV = Ops::Sub(Ops::Mul(a[0], c[1]), Ops::Mul(a[1], c[0]));
+    Float edgeW = Ops::Sub(Ops::Mul(b[0], a[1]), Ops::Mul(b[1], a[0]));
+    Float zero = Ops::Set(0.0f);
+    Float notNegative = Ops::LessEqual(zero, Ops::Min(Ops::Min(edgeU, edgeV), edgeW));
+    Float notPositive = Ops::LessEqual(Ops::Max(Ops::Max(edgeU, edgeV), edgeW), zero);
+    Float valid = (FLAGS & TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES) ? notNegative :
+        (FLAGS & TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES) ? notPositive : Ops::Or(notNegative, notPositive);
+    Float det = Ops::Add(Ops::Add(edgeU, edgeV), edgeW);
+    Float invDet = Ops::Div(Ops::Set(1.0f), det);
+    Float dist = Ops::Mul(Ops::Add(Ops::Add(Ops::Mul(edgeU, a[2]), Ops::Mul(edgeV, b[2])), Ops::Mul(edgeW, c[2])),
+                          invDet);
+    valid = Ops::And(valid, Ops::And(Ops::LessEqual(Ops::Load(&packet.tmin[lane0]), dist),
+                                     Ops::LessEqual(dist, Ops::Load(&packet.tmax[lane0]))));
+    Ops::Store(t, dist);
+    if (COORDINATES) {
+        Ops::Store(u, Ops::Mul(edgeV, invDet));
+        Ops::Store(v, Ops::Mul(edgeW, invDet));
+    }
+    uint32_t flat = Ops::MoveMask(Ops::And(Ops::LessEqual(det, zero), Ops::LessEqual(zero, det)));
+    return Ops::MoveMask(valid) & ~flat;
+}
+
+/// @brief The state of one packet walking the scene.
+struct PacketState {
+    RayHit *hits;
+    uint32_t activeCount;           /* *< Rays without an any-hit yet, the walk ends at zero. */
+};
+
+/**
+ * Intersect the triangles of a leaf with the rays [first, end), shortening each ray at its hits.
+ * @return true when every ray is done, i.e. all any-hit queries found something.
+ */
+template <typename Ops, uint32_t FLAGS, TraceRayHitFormat FORMAT>
+bool IntersectLeafLanes(const BottomLevel &blas, const uint32_t *prims, uint32_t count, RayPacket &packet,
+                        uint32_t first, uint32_t end, uint32_t instId, PacketState &state)
+{
+    using Traits = HitFormatTraits<FORMAT>;
+    float t[Ops::WIDTH];
+    float u[Ops::WIDTH];
+    float v[Ops::WIDTH];
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t prim = prims[i];
+        const float *v0 = blas.GetVertex(prim, 0);
+        const float *v1 = blas.GetVertex(prim, 1);
+        const float *v2 = blas.GetVertex(prim, 2);
+        for (uint32_t lane0 = first - first % Ops::WIDTH; lane0 < end; lane0 += Ops::WIDTH) {
+            uint32_t mask = IntersectTriangleLanes<Ops, FLAGS, Traits::COORDINATES>(packet, lane0, v0, v1, v2, t, u, v);
+            mask &= GroupRangeMask<Ops>(lane0, first, end);
+            while (mask != 0) {
+                uint32_t slot = static_cast<uint32_t>(__builtin_ctz(mask));
+                mask &= mask - 1;
+                uint32_t lane = lane0 + slot;
+                RayHit &hit = state.hits[lane];
+                hit.t = t[slot];
+                if (Traits::PRIMITIVE) {
+                    hit.primId = prim;
+                }
+                if (Traits::INSTANCE) {
+                    hit.instId = instId;
+                }
+                if (Traits::COORDINATES) {
+                    hit.u = u[slot];
+                    hit.v = v[slot];
+                }
+                if (!(FLAGS & TRACERAY_FLAG_ANY_HIT)) {
+                    packet.tmax[lane] = t[slot];
+                    continue;
+                }
+                packet.tmax[lane] = RETIRED_TMAX;
+                if (--state.activeCount == 0) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Walk a binary bvh with a packet. Each stack entry keeps the range of rays that entered its parent, since
+ * the rays outside of it cannot enter the children either.
+ * leaf(firstPrim, primCount, first, end) intersects a leaf with the rays [first, end) and returns true to
+ * stop the walk.
+ * @return true when the leaf callback stopped the walk.
+ */
+template <typename Ops, typename LeafFunc>
+bool TraversePacket(const Bvh &bvh, const RayPacket &packet, const PacketFrustum &frustum, uint32_t first,
+                    const LeafFunc &leaf)
+{
+    struct StackEntry {
+        uint32_t nodeIndex;
+        uint32_t first;
+        uint32_t end;
+    };
+    StackEntry stack[BVH_MAX_DEPTH];
+    uint32_t stackSize = 0;
+    if (bvh.primIndices.empty()) {
+        return false;
+    }
+    const BvhNode *nodes = bvh.nodes.data();
+    uint32_t nodeIndex = 0;
+    uint32_t end = PACKET_SIZE;
+    for (;;) {
+        const BvhNode &node = nodes[nodeIndex];
+        if (NarrowRayRange<Ops>(packet, frustum, node, first, end)) {
+            if (!IsLeaf(node)) {
+                // Visit the child that is nearer along the first ray first.
+                const BvhNode &left = nodes[node.leftFirst];
+                const BvhNode &right = nodes[node.leftFirst + 1];
+                float along = 0.0f;
+                for (int axis = 0; axis < AXIS_COUNT; axis++) {
+                    float offset = right.lower[axis] + right.upper[axis] - left.lower[axis] - left.upper[axis];
+                    along += offset * packet.dir[axis][first];
+                }
+                bool leftFirst = along >= 0.0f;
+                stack[stackSize++] = StackEntry {leftFirst ? node.leftFirst + 1 : node.leftFirst, first, end};
+                nodeIndex = leftFirst ? node.leftFirst : node.leftFirst + 1;
+                continue;
+            }
+            if (leaf(node.leftFirst, node.primCount, first, end)) {
+                return true;
+            }
+        }
+        if (stackSize == 0) {
+            return false;
+        }
+        stackSize--;
+        nodeIndex = stack[stackSize].nodeIndex;
+        first = stack[stackSize].first;
+        end = stack[stackSize].end;
+    }
+}
+
+/// Trace a packet through the top level structure and the bottom levels of its instances.
+template <typename Ops, uint32_t FLAGS, TraceRayHitFormat FORMAT>
+void TracePacketBinary(const TopLevel &tlas, const Ray *rays, uint32_t count, void *packetHits)
+{
+    RayHit hits[PACKET_SIZE];
+    RayPacket world;
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+        hits[lane] = RayHit {MISS_DISTANCE, INVALID_INDEX, INVALID_INDEX, 0.0f, 0.0f};
+        if (lane < count) {
+            LocalRay ray;
+            PrepareRay(rays[lane].origin, rays[lane].dir, rays[lane].tmin, rays[lane].tmax, ray);
+            SetPacketLane(world, lane, ray);
+        } else {
+            RetirePacketLane(world, lane);
+        }
+    }
+    PacketFrustum worldFrustum;
+    ComputePacketFrustum(world, 0, worldFrustum);
+    PacketState state {hits, count};
+    const uint32_t *instIndices = tlas.GetBvh().primIndices.data();
+    RayPacket local;
+    auto intersectInstances = [&](uint32_t firstInst, uint32_t instCount, uint32_t first, uint32_t end) {
+        for (uint32_t i = 0; i < instCount; i++) {
+            uint32_t instId = instIndices[firstInst + i];
+            const Instance &instance = tlas.GetInstance(instId);
+            const BottomLevel &blas = *instance.blas;
+            for (uint32_t lane = 0; lane < PACKET_SIZE; lane++) {
+                if (lane < first || lane >= end || world.tmax[lane] < world.tmin[lane]) {
+                    RetirePacketLane(local, lane);
+                    continue;
+                }
+                float origin[AXIS_COUNT];
+                float dir[AXIS_COUNT];
+                TransformPoint(instance.worldToObject, rays[lane].origin, origin);
+                TransformVector(instance.worldToObject, rays[lane].dir, dir);
+                LocalRay ray;
+                PrepareRay(origin, dir, world.tmin[lane], world.tmax[lane], ray);
+                SetPacketLane(local, lane, ray);
+            }
+            PacketFrustum localFrustum;
+            ComputePacketFrustum(local, first, localFrustum);
+            PreparePacketShear(local, first);
+            const uint32_t *primIndices = blas.GetBvh().primIndices.data();
+            bool done = TraversePacket<Ops>(blas.GetBvh(), local, localFrustum, first,
+                [&](uint32_t firstPrim, uint32_t primCount, uint32_t firstRay, uint32_t endRay) {
+                    return IntersectLeafLanes<Ops, FLAGS, FORMAT>(blas, primIndices + firstPrim, primCount, local,
+                                                                  firstRay, endRay, instId, state);
+                });
+            std::copy(local.tmax + first, local.tmax + end, world.tmax + first);
+            if (done) {
+                return true;
+            }
+        }
+        return false;
+    };
+    TraversePacket<Ops>(tlas.GetBvh(), world, worldFrustum, 0, intersectInstances);
+    for (uint32_t lane = 0; lane < count; lane++) {
+        StoreHit<FORMAT>(hits[lane], packetHits, lane);
+    }
+}
+
+/// @brief The packet kernel of a flag and hit format combination, for SelectKernel.
+template <typename Ops>
+struct PacketRayKernel {
+    template <uint32_t FLAGS, TraceRayHitFormat FORMAT>
+    struct Kernel {
+        static void Run(const TopLevel &tlas, const Ray *rays, uint32_t count, void *hits)
+        {
+            TracePacketBinary<Ops, FLAGS, FORMAT>(tlas, rays, count, hits);
+        }
+    };
+};
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_PACKETTRAVERSAL_H
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Closest point and radius queries of the RayShop cpu backend.
+ */
+
+#include "PointQuery.h"
+#include "RayKernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t TRIANGLE_CORNERS = 3;
+
+/// @brief A subtree left for later, with the squared distance of its bounds when it was pushed.
+struct QueryEntry {
+    uint32_t node;
+    float distanceSquared;
+};
+
+inline float Dot(const float *a, const float *b)
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/// The squared distance from a point to a box, 0 inside of it.
+float BoxDistanceSquared(const float *point, const Aabb &box)
+{
+    float sum = 0.0f;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        float d = std::max(std::max(box.lower[axis] - point[axis], point[axis] - box.upper[axis]), 0.0f);
+        sum += d * d;
+    }
+    return sum;
+}
+
+/// The world space bounds of a node of an instance, from its transformed center and extent (Arvo 1990).
+Aabb TransformBounds(const float (&matrix)[AFFINE_ROWS][AFFINE_COLUMNS], const BvhNode &node)
+{
+    Aabb box;
+    for (int row = 0; row < AFFINE_ROWS; row++) {
+        float center = matrix[row][3];
+        float extent = 0.0f;
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            center += matrix[row][axis] * (node.lower[axis] + node.upper[axis]) * 0.5f;
+            extent += std::fabs(matrix[row][axis]) * (node.upper[axis] - node.lower[axis]) * 0.5f;
+        }
+        box.lower[row] = center - extent;
+        box.upper[row] = center + extent;
+    }
+    return box;
+}
+
+/**
+ * The barycentrics of the point of a triangle nearest to p, found by the Voronoi region of p (Ericson 2005,
+ * 5.1.5). A degenerate triangle that no region claims falls back to its vertex a.
+ * @param[out]  u, v    The barycentrics of b and c.
+ */
+void NearestBarycentrics(const float *p, const float *a, const float *b, const float *c, float &u, float &v)
+{
+    float ab[AXIS_COUNT] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    float ac[AXIS_COUNT] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    float ap[AXIS_COUNT] = {p[0] - a[0], p[1] - a[1], p[2] - a[2]};
+    float bp[AXIS_COUNT] = {p[0] - b[0], p[1] - b[1], p[2] - b[2]};
+    float cp[AXIS_COUNT] = {p[0] - c[0], p[1] - c[1], p[2] - c[2]};
+    float d1 = Dot(ab, ap);
+    float d2 = Dot(ac, ap);
+    float d3 = Dot(ab, bp);
+    float d4 = Dot(ac, bp);
+    float d5 = Dot(ab, cp);
+    float d6 = Dot(ac, cp);
+    u = 0.0f;
+    v = 0.0f;
+    if (d1 <= 0.0f && d2 <= 0.0f) {
+        return;
+    }
+    if (d3 >= 0.0f && d4 <= d3) {
+        u = 1.0f;
+        return;
+    }
+    if (d6 >= 0.0f && d5 <= d6) {
+        v = 1.0f;
+        return;
+    }
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+        u = d1 / (d1 - d3);
+        return;
+    }
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+        v = d2 / (d2 - d6);
+        return;
+    }
+    float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+        v = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        u = 1.0f - v;
+        return;
+    }
+    float sum = va + vb + vc;
+    if (sum > 0.0f) {
+        u = vb / sum;
+        v = vc / sum;
+    }
+}
+
+/**
+ * Walk the leaves of a bvh whose bounds lie within the radius of a point, nearer subtrees first.
+ * @param[in]   radiusSquared   Read again before every subtree, so that visitLeaf may shrink it.
+ * @param[in]   bounds          Maps a node to its bounds in the space of the point.
+ */
+template <typename Bounds, typename VisitLeaf>
+void WalkBvh(const Bvh &bvh, const float *point, const float &radiusSquared, Bounds &&bounds, VisitLeaf &&visitLeaf)
+{
+    if (bvh.primIndices.empty()) {
+        return;
+    }
+    const BvhNode *nodes = bvh.nodes.data();
+    // Every step pops one subtree and pushes at most its two children, so one more entry than levels suffices.
+    QueryEntry stack[BVH_MAX_DEPTH + 1];
+    uint32_t stackSize = 0;
+    stack[stackSize++] = QueryEntry {0, BoxDistanceSquared(point, bounds(nodes[0]))};
+    while (stackSize != 0) {
+        QueryEntry entry = stack[--stackSize];
+        if (entry.distanceSquared > radiusSquared) {
+            continue;
+        }
+        const BvhNode &node = nodes[entry.node];
+        if (IsLeaf(node)) {
+            visitLeaf(&bvh.primIndices[node.leftFirst], node.primCount);
+            continue;
+        }
+        QueryEntry left {node.leftFirst, BoxDistanceSquared(point, bounds(nodes[node.leftFirst]))};
+        QueryEntry right {node.leftFirst + 1, BoxDistanceSquared(point, bounds(nodes[node.leftFirst + 1]))};
+        if (right.distanceSquared < left.distanceSquared) {
+            std::swap(left, right);
+        }
+        // The farther child goes first, so that the nearer one is popped next.
+        if (right.distanceSquared <= radiusSquared) {
+            stack[stackSize++] = right;
+        }
+        if (left.distanceSquared <= radiusSquared) {
+            stack[stackSize++] = left;
+        }
+    }
+}
+
+/// The point of a triangle nearest to p, with its barycentrics; returns its squared distance to p.
+float NearestPointOnTriangle(const float *p, const float (&corners)[TRIANGLE_CORNERS][AXIS_COUNT], float *nearest,
+                             float &u, float &v)
+{
+    NearestBarycentrics(p, corners[0], corners[1], corners[2], u, v);
+    float offset[AXIS_COUNT];
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        nearest[axis] = corners[0][axis] + (corners[1][axis] - corners[0][axis]) * u +
+            (corners[2][axis] - corners[0][axis]) * v;
+        offset[axis] = nearest[axis] - p[axis];
+    }
+    return Dot(offset, offset);
+}
+
+/**
+ * Pass visit(instId, primId, nearest, distanceSquared, u, v) the nearest point of every triangle of an instance
+ * within the radius of a world space point.
+ * @param[in]   radiusSquared   Read again before every subtree, so that visit may shrink it.
+ */
+template <typename Visit>
+void VisitInstance(const Instance &instance, uint32_t instId, const float *point, const float &radiusSquared,
+                   Visit &visit)
+{
+    const BottomLevel &blas = *instance.blas;
+    float corners[TRIANGLE_CORNERS][AXIS_COUNT];
+    float nearest[AXIS_COUNT];
+    float u;
+    float v;
+    if (instance.similarityScale > 0.0f) {
+        // A similarity scales all distances alike, so the instance is searched in object space, where neither the
+        // boxes nor the triangles need transforming.
+        float localPoint[AXIS_COUNT];
+        TransformPoint(instance.worldToObject, point, localPoint);
+        float scaleSquared = instance.similarityScale * instance.similarityScale;
+        float localRadiusSquared = radiusSquared / scaleSquared;
+        WalkBvh(blas.GetBvh(), localPoint, localRadiusSquared, [](const BvhNode &node) { return NodeBounds(node); },
+            [&](const uint32_t *prims, uint32_t count) {
+                for (uint32_t i = 0; i < count; i++) {
+                    for (uint32_t corner = 0; corner < TRIANGLE_CORNERS; corner++) {
+                        std::copy_n(blas.GetVertex(prims[i], corner), AXIS_COUNT, corners[corner]);
+                    }
+                    float distanceSquared = NearestPointOnTriangle(localPoint, corners, nearest, u, v);
+                    if (distanceSquared > localRadiusSquared) {
+                        continue;
+                    }
+                    float worldNearest[AXIS_COUNT];
+                    TransformPoint(instance.objectToWorld, nearest, worldNearest);
+                    visit(instId, prims[i], worldNearest, distanceSquared * scaleSquared, u, v);
+                    localRadiusSquared = radiusSquared / scaleSquared;
+                }
+            });
+        return;
+    }
+    // Any other transform changes distances unevenly: the boxes and the triangles are moved to world space instead.
+    WalkBvh(blas.GetBvh(), point, radiusSquared,
+        [&instance](const BvhNode &node) { return TransformBounds(instance.objectToWorld, node); },
+        [&](const uint32_t *prims, uint32_t count) {
+            for (uint32_t i = 0; i < count; i++) {
+                for (uint32_t corner = 0; corner < TRIANGLE_CORNERS; corner++) {
+                    TransformPoint(instance.objectToWorld, blas.GetVertex(prims[i], corner), corners[corner]);
+                }
+                float distanceSquared = NearestPointOnTriangle(point, corners, nearest, u, v);
+                if (distanceSquared > radiusSquared) {
+                    continue;
+                }
+                visit(instId, prims[i], nearest, distanceSquared, u, v);
+            }
+        });
+}
+
+/// VisitInstance for every instance whose bounds lie within the radius of a point.
+template <typename Visit>
+void VisitTriangles(const TopLevel &tlas, const float *point, const float &radiusSquared, Visit &&visit)
+{
+    WalkBvh(tlas.GetBvh(), point, radiusSquared, [](const BvhNode &node) { return NodeBounds(node); },
+        [&](const uint32_t *instIds, uint32_t count) {
+            for (uint32_t i = 0; i < count; i++) {
+                VisitInstance(tlas.GetInstance(instIds[i]), instIds[i], point, radiusSquared, visit);
+            }
+        });
+}
+
+bool IsNearer(const RadiusQueryHit &a, const RadiusQueryHit &b)
+{
+    return a.distance < b.distance;
+}
+} // namespace
+
+void FindClosestPoint(const TopLevel &tlas, const PointQuery &query, ClosestPointHit &hit)
+{
+    hit = ClosestPointHit {MISS_DISTANCE, INVALID_INDEX, INVALID_INDEX, 0.0f, 0.0f, {0.0f, 0.0f, 0.0f}};
+    if (!(query.radius >= 0.0f)) {
+        return;
+    }
+    float radiusSquared = query.radius * query.radius;
+    VisitTriangles(tlas, query.point, radiusSquared,
+        [&](uint32_t instId, uint32_t primId, const float *nearest, float distanceSquared, float u, float v) {
+            radiusSquared = distanceSquared;
+            hit = ClosestPointHit {0.0f, primId, instId, u, v, {nearest[0], nearest[1], nearest[2]}};
+        });
+    if (hit.primId != INVALID_INDEX) {
+        hit.distance = std::sqrt(radiusSquared);
+    }
+}
+
+uint32_t FindTrianglesInRadius(const TopLevel &tlas, const PointQuery &query, uint32_t maxHits,
+                               RadiusQueryHit *hits, std::unordered_set<uint64_t> &seen)
+{
+    if (!(query.radius >= 0.0f)) {
+        return 0;
+    }
+    seen.clear();
+    float radiusSquared = query.radius * query.radius;
+    uint32_t count = 0;
+    // Once full, hits is a max-heap on the distance, so that its farthest hit is the one to give way.
+    VisitTriangles(tlas, query.point, radiusSquared,
+        [&](uint32_t instId, uint32_t primId, const float *nearest, float distanceSquared, float u, float v) {
+            (void)nearest;
+            (void)u;
+            (void)v;
+            const BottomLevel &blas = *tlas.GetInstance(instId).blas;
+            if (blas.GetBvh().primIndices.size() > blas.GetTriangleCount() &&
+                !seen.insert(static_cast<uint64_t>(instId) << 32 | primId).second) {
+                return;
+            }
+            uint32_t kept = count++;
+            if (maxHits == 0) {
+                return;
+            }
+            RadiusQueryHit hit {std::sqrt(distanceSquared), primId, instId};
+            if (kept < maxHits) {
+                hits[kept] = hit;
+                std::push_heap(hits, hits + kept + 1, IsNearer);
+            } else if (IsNearer(hit, hits[0])) {
+                std::pop_heap(hits, hits + maxHits, IsNearer);
+                hits[maxHits - 1] = hit;
+                std::push_heap(hits, hits + maxHits, IsNearer);
+            }
+        });
+    std::sort_heap(hits, hits + std::min(count, maxHits), IsNearer);
+    return count;
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Closest point and radius queries of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_POINTQUERY_H
+#define RAYSHOP_CPU_POINTQUERY_H
+
+#include <cstdint>
+#include <unordered_set>
+
+#include "Traversal.h"
+#include "TopLevel.h"
+
+namespace RayShop {
+namespace Cpu {
+/**
+ * Find the point of the scene nearest to the query point, at most the query radius away. The radius shrinks to
+ * the nearest triangle found so far, so the subtrees farther than it are skipped.
+ * @param[out]  hit         distance is MISS_DISTANCE and the ids INVALID_INDEX when no triangle lies within radius.
+ */
+void FindClosestPoint(const TopLevel &tlas, const PointQuery &query, ClosestPointHit &hit);
+
+/**
+ * Count the triangles within the query radius, and keep the nearest maxHits of them.
+ * @param[out]  hits        min(count, maxHits) triangles, nearest first.
+ * @param[in]   seen        Scratch space of the caller, reused across queries: the triangles of blases with spatial
+ *                          splits sit in several leaves, and count once.
+ * @return The count of all the triangles within the radius.
+ * @note Throws std::bad_alloc when seen cannot grow.
+ */
+uint32_t FindTrianglesInRadius(const TopLevel &tlas, const PointQuery &query, uint32_t maxHits,
+                               RadiusQueryHit *hits, std::unordered_set<uint64_t> &seen);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_POINTQUERY_H
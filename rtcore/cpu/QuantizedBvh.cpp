@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Quantized 4-wide bvh layout of the RayShop cpu backend, shared with the shaders.
+ */
+
+#include "QuantizedBvh.h"
+#include "WideBvh.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t MAX_QUANTIZED_LEAF_SIZE = 4;
+constexpr uint8_t QUANTIZED_GRID_MAX = 255;
+constexpr int EXPONENT_BIAS = 127;
+constexpr int MIN_BIASED_EXPONENT = 1;
+constexpr int MAX_BIASED_EXPONENT = 254;
+constexpr size_t QUANTIZED_NODE_BYTES = 64;
+constexpr uint32_t REFIT_GRAIN_SIZE = 1024;     /* *< Nodes per chunk of a parallel refit. */
+
+static_assert(sizeof(QuantizedBvhNode) == QUANTIZED_NODE_BYTES, "Shaders read a node as four uvec4");
+
+/// A future slot: a binary inner node, or a run of binary primIndices entries.
+struct QuantizedChild {
+    Aabb bounds;
+    uint32_t binaryIndex;           /* *< INVALID_INDEX for a run. */
+    uint32_t source;                /* *< The binary node the bounds come from; a run of a split leaf shares it. */
+    uint32_t first;
+    uint32_t count;
+};
+
+struct QuantizedTask {
+    QuantizedChild parent;
+    uint32_t nodeIndex;
+};
+
+bool IsQuantizedLeaf(const QuantizedChild &child)
+{
+    return child.binaryIndex == INVALID_INDEX && child.count <= MAX_QUANTIZED_LEAF_SIZE;
+}
+
+uint32_t GatherQuantizedChildren(const Bvh &bvh, const QuantizedChild &parent,
+                                 QuantizedChild (&children)[QUANTIZED_BVH_WIDTH])
+{
+    if (parent.binaryIndex == INVALID_INDEX) {
+        // An oversized run is cut into shorter ones that share its box.
+        uint32_t step = (parent.count + QUANTIZED_BVH_WIDTH - 1) / QUANTIZED_BVH_WIDTH;
+        uint32_t childCount = 0;
+        for (uint32_t offset = 0; offset < parent.count; offset += step) {
+            children[childCount++] = QuantizedChild {parent.bounds, INVALID_INDEX, parent.source,
+                                                     parent.first + offset, std::min(step, parent.count - offset)};
+        }
+        return childCount;
+    }
+    uint32_t binaryChildren[QUANTIZED_BVH_WIDTH];
+    uint32_t childCount = GatherWideChildren<QUANTIZED_BVH_WIDTH>(bvh, parent.binaryIndex, binaryChildren);
+    for (uint32_t slot = 0; slot < childCount; slot++) {
+        uint32_t source = binaryChildren[slot];
+        const BvhNode &node = bvh.nodes[source];
+        children[slot] = IsLeaf(node) ?
+            QuantizedChild {NodeBounds(node), INVALID_INDEX, source, node.leftFirst, node.primCount} :
+            QuantizedChild {NodeBounds(node), source, source, 0, 0};
+    }
+    return childCount;
+}
+
+float Decode(float origin, float scale, uint32_t q)
+{
+    return origin + static_cast<float>(q) * scale;
+}
+
+/// Pick the smallest power of two step whose 255 steps from the origin reach the upper bound.
+void SetGrid(const Aabb &bounds, QuantizedBvhNode &node)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        float extent = bounds.upper[axis] - bounds.lower[axis];
+        int exponent = MIN_BIASED_EXPONENT;
+        if (extent > 0.0f) {
+            int binaryExponent;
+            std::frexp(extent / QUANTIZED_GRID_MAX, &binaryExponent);
+            exponent = std::max(binaryExponent - 1 + EXPONENT_BIAS, MIN_BIASED_EXPONENT);
+        }
+        node.origin[axis] = bounds.lower[axis];
+        node.exponents[axis] = static_cast<uint8_t>(exponent);
+        while (exponent < MAX_BIASED_EXPONENT &&
+            Decode(node.origin[axis], QuantizedScale(node, axis), QUANTIZED_GRID_MAX) < bounds.upper[axis]) {
+            node.exponents[axis] = static_cast<uint8_t>(++exponent);
+        }
+    }
+}
+
+/// Round the child box outwards onto the grid of the node, checking the rounding of the decoder itself.
+void QuantizeChild(const Aabb &bounds, uint32_t slot, QuantizedBvhNode &node)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        float origin = node.origin[axis];
+        float scale = QuantizedScale(node, axis);
+        // The step is a power of two, so multiplying by its inverse rounds exactly like dividing. Clamping
+        // before the conversion lets truncation stand in for floor, which refits run for every node.
+        float invScale = 1.0f / scale;
+        float gridMax = QUANTIZED_GRID_MAX;
+        float lower = std::min(std::max((bounds.lower[axis] - origin) * invScale, 0.0f), gridMax);
+        float upper = std::min(std::max((bounds.upper[axis] - origin) * invScale, 0.0f), gridMax);
+        uint32_t qlower = static_cast<uint32_t>(lower);
+        uint32_t qupper = static_cast<uint32_t>(upper);
+        qupper += static_cast<float>(qupper) < upper ? 1 : 0;
+        while (qlower > 0 && Decode(origin, scale, qlower) > bounds.lower[axis]) {
+            qlower--;
+        }
+        while (qupper < QUANTIZED_GRID_MAX && Decode(origin, scale, qupper) < bounds.upper[axis]) {
+            qupper++;
+        }
+        node.qlower[axis][slot] = static_cast<uint8_t>(qlower);
+        node.qupper[axis][slot] = static_cast<uint8_t>(qupper);
+    }
+}
+
+QuantizedBvhNode EmptyQuantizedNode()
+{
+    QuantizedBvhNode node {};
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        for (uint32_t slot = 0; slot < QUANTIZED_BVH_WIDTH; slot++) {
+            node.qlower[axis][slot] = QUANTIZED_GRID_MAX;
+        }
+    }
+    return node;
+}
+} // namespace
+
+void BuildQuantizedBvh(const Bvh &bvh, QuantizedBvh &quantized)
+{
+    quantized.nodes.clear();
+    quantized.primIndices.clear();
+    quantized.sources.clear();
+    if (bvh.primIndices.empty()) {
+        return;
+    }
+    quantized.primIndices.reserve(bvh.primIndices.size());
+    quantized.nodes.emplace_back();
+    quantized.sources.resize(QUANTIZED_SOURCE_STRIDE, INVALID_INDEX);
+    std::vector<QuantizedTask> stack;
+    stack.push_back(QuantizedTask {QuantizedChild {NodeBounds(bvh.nodes[0]), 0, 0, 0, 0}, 0});
+    while (!stack.empty()) {
+        QuantizedTask task = stack.back();
+        stack.pop_back();
+        QuantizedChild children[QUANTIZED_BVH_WIDTH];
+        uint32_t childCount = GatherQuantizedChildren(bvh, task.parent, children);
+        QuantizedBvhNode node = EmptyQuantizedNode();
+        node.childBase = static_cast<uint32_t>(quantized.nodes.size());
+        node.primBase = static_cast<uint32_t>(quantized.primIndices.size());
+        SetGrid(task.parent.bounds, node);
+        uint32_t *sources = &quantized.sources[task.nodeIndex * QUANTIZED_SOURCE_STRIDE];
+        sources[0] = task.parent.source;
+        uint32_t innerCount = 0;
+        uint32_t primOffset = 0;
+        for (uint32_t slot = 0; slot < childCount; slot++) {
+            const QuantizedChild &child = children[slot];
+            QuantizeChild(child.bounds, slot, node);
+            sources[slot + 1] = child.source;
+            if (IsQuantizedLeaf(child)) {
+                node.meta[slot] = static_cast<uint8_t>((child.count << QUANTIZED_COUNT_SHIFT) | primOffset);
+                quantized.primIndices.insert(quantized.primIndices.end(), bvh.primIndices.begin() + child.first,
+                                             bvh.primIndices.begin() + child.first + child.count);
+                primOffset += child.count;
+            } else {
+                node.meta[slot] = static_cast<uint8_t>(QUANTIZED_INNER_BIT | innerCount);
+                stack.push_back(QuantizedTask {child, node.childBase + innerCount});
+                innerCount++;
+            }
+        }
+        quantized.nodes.resize(quantized.nodes.size() + innerCount);
+        quantized.sources.resize(quantized.nodes.size() * QUANTIZED_SOURCE_STRIDE, INVALID_INDEX);
+        quantized.nodes[task.nodeIndex] = node;
+    }
+}
+
+void RefitQuantizedBvh(const Bvh &bvh, QuantizedBvh &quantized, ThreadPool *pool)
+{
+    auto refitRange = [&bvh, &quantized](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            const uint32_t *sources = &quantized.sources[i * QUANTIZED_SOURCE_STRIDE];
+            QuantizedBvhNode &node = quantized.nodes[i];
+            SetGrid(NodeBounds(bvh.nodes[sources[0]]), node);
+            for (uint32_t slot = 0; slot < QUANTIZED_BVH_WIDTH && sources[slot + 1] != INVALID_INDEX; slot++) {
+                QuantizeChild(NodeBounds(bvh.nodes[sources[slot + 1]]), slot, node);
+            }
+        }
+    };
+    uint32_t nodeCount = static_cast<uint32_t>(quantized.nodes.size());
+    if (pool != nullptr) {
+        pool->ParallelFor(0, nodeCount, REFIT_GRAIN_SIZE, refitRange);
+    } else {
+        refitRange(0, nodeCount);
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Quantized 4-wide bvh layout of the RayShop cpu backend, shared with the shaders.
+ */
+
+#ifndef RAYSHOP_CPU_QUANTIZEDBVH_H
+#define RAYSHOP_CPU_QUANTIZEDBVH_H
+
+#include <cstring>
+
+#include "Traversal.h"
+#include "BVH.h"
+#include "ThreadPool.h"
+
+namespace RayShop {
+namespace Cpu {
+constexpr uint8_t QUANTIZED_INNER_BIT = 0x80;
+constexpr uint32_t QUANTIZED_COUNT_SHIFT = 4;
+constexpr uint8_t QUANTIZED_OFFSET_MASK = 0x0f;
+constexpr uint32_t QUANTIZED_EXPONENT_SHIFT = 23;
+/// @brief Entries of QuantizedBvh::sources per node: the binary node whose box the grid spans, then one per slot.
+constexpr uint32_t QUANTIZED_SOURCE_STRIDE = QUANTIZED_BVH_WIDTH + 1;
+/// @brief Levels that cutting a leaf of up to 2^32 primitives into runs of at most four adds below BVH_MAX_DEPTH.
+constexpr uint32_t QUANTIZED_RUN_SPLIT_DEPTH = 16;
+/// @brief The deepest a quantized bvh gets, which bounds the traversal stacks.
+constexpr uint32_t QUANTIZED_BVH_MAX_DEPTH = BVH_MAX_DEPTH + QUANTIZED_RUN_SPLIT_DEPTH;
+
+/// @brief The QuantizedBvhNode form of a binary bvh. Leaf triangles are reordered so that the leaves of a
+/// node are contiguous, hence the own primIndices.
+struct QuantizedBvh {
+    std::vector<QuantizedBvhNode> nodes;    /* *< The root is nodes[0]; empty when there is no primitive. */
+    std::vector<uint32_t> primIndices;
+    std::vector<uint32_t> sources;          /* *< Binary nodes of each grid and slot, for refits; not for shaders. */
+};
+
+/**
+ * Collapse a binary bvh into quantized 4-wide nodes, like CollapseBvh. Leaves of more than four
+ * primitives, which only occur at BVH_MAX_DEPTH, are spread over extra nodes, up to QUANTIZED_RUN_SPLIT_DEPTH
+ * levels of them.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void BuildQuantizedBvh(const Bvh &bvh, QuantizedBvh &quantized);
+
+/**
+ * Quantize the bounds of a refitted binary bvh again onto the nodes built from it, keeping the topology.
+ * Every node gets a fresh grid from its own sources, so the nodes are refitted in parallel.
+ * @param[in]   pool        The worker pool, nullptr to refit on the calling thread.
+ */
+void RefitQuantizedBvh(const Bvh &bvh, QuantizedBvh &quantized, ThreadPool *pool);
+
+/// @brief The grid step of an axis, a power of two.
+inline float QuantizedScale(const QuantizedBvhNode &node, int axis)
+{
+    uint32_t bits = static_cast<uint32_t>(node.exponents[axis]) << QUANTIZED_EXPONENT_SHIFT;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_QUANTIZEDBVH_H
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Ray, box and triangle tests shared by the traversal kernels of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_RAYKERNELS_H
+#define RAYSHOP_CPU_RAYKERNELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include "Traversal.h"
+#include "BottomLevel.h"
+
+namespace RayShop {
+namespace Cpu {
+constexpr float MISS_DISTANCE = -1.0f;
+constexpr float MIN_DIRECTION = 1e-20f;
+/// @brief Box exit distances are scaled by 1 + 2 * gamma(3) before the overlap test (Ize 2013), which covers the
+/// rounding of the slab tests, so that the traversal never skips a box whose triangle edge a ray grazes.
+constexpr float ROBUST_FAR_SCALE = 1.0f + 3.0f * std::numeric_limits<float>::epsilon();
+
+/// @brief The widest hit record; every TraceRayHitFormat is a prefix-compatible subset of it.
+struct RayHit {
+    float t;
+    uint32_t primId;
+    uint32_t instId;
+    float u;
+    float v;
+};
+
+/// @brief A ray prepared for slab and triangle tests, in the space of the structure being traversed.
+struct LocalRay {
+    float origin[AXIS_COUNT];
+    float dir[AXIS_COUNT];
+    float invDir[AXIS_COUNT];   /* *< Never infinite, tiny direction components are clamped. */
+    float tmin;
+    float tmax;
+    uint32_t kx;                /* *< The ray space of the watertight triangle test: kz is the axis of the */
+    uint32_t ky;                /* *< largest direction component, kx and ky follow it cyclically and are */
+    uint32_t kz;                /* *< swapped when it is negative, to keep the winding of the triangles. */
+    float shear[AXIS_COUNT];    /* *< dir[kx] / dir[kz], dir[ky] / dir[kz] and 1 / dir[kz]. */
+};
+
+inline void PrepareRay(const float *origin, const float *dir, float tmin, float tmax, LocalRay &ray)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        ray.origin[axis] = origin[axis];
+        ray.dir[axis] = dir[axis];
+        float d = std::fabs(dir[axis]) < MIN_DIRECTION ? std::copysign(MIN_DIRECTION, dir[axis]) : dir[axis];
+        ray.invDir[axis] = 1.0f / d;
+    }
+    ray.tmin = tmin;
+    ray.tmax = tmax;
+    uint32_t kz = std::fabs(dir[0]) >= std::fabs(dir[1]) ? 0 : 1;
+    kz = std::fabs(dir[kz]) >= std::fabs(dir[2]) ? kz : 2;
+    uint32_t kx = (kz + 1) % AXIS_COUNT;
+    uint32_t ky = (kx + 1) % AXIS_COUNT;
+    if (dir[kz] < 0.0f) {
+        std::swap(kx, ky);
+    }
+    ray.kx = kx;
+    ray.ky = ky;
+    ray.kz = kz;
+    ray.shear[0] = dir[kx] / dir[kz];
+    ray.shear[1] = dir[ky] / dir[kz];
+    ray.shear[2] = 1.0f / dir[kz];
+}
+
+/// @brief The TraceRayFlag bits a kernel is specialized on. Closest hit is the default, so
+/// TRACERAY_FLAG_CLOSEST_HIT needs no kernel of its own.
+constexpr uint32_t KERNEL_FLAGS = TRACERAY_FLAG_ANY_HIT | TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES |
+    TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES;
+
+/// @brief The fields a hit format keeps, so that kernels skip the bookkeeping of the others.
+template <TraceRayHitFormat FORMAT>
+struct HitFormatTraits;
+
+template <>
+struct HitFormatTraits<TraceRayHitFormat::T> {
+    using Record = HitDistance;
+    static constexpr bool PRIMITIVE = false;
+    static constexpr bool INSTANCE = false;
+    static constexpr bool COORDINATES = false;
+
+    static Record MakeRecord(const RayHit &hit)
+    {
+        return Record {hit.t};
+    }
+};
+
+template <>
+struct HitFormatTraits<TraceRayHitFormat::T_PRIMID> {
+    using Record = HitDistancePrimitive;
+    static constexpr bool PRIMITIVE = true;
+    static constexpr bool INSTANCE = false;
+    static constexpr bool COORDINATES = false;
+
+    static Record MakeRecord(const RayHit &hit)
+    {
+        return Record {hit.t, hit.primId};
+    }
+};
+
+template <>
+struct HitFormatTraits<TraceRayHitFormat::T_PRIMID_U_V> {
+    using Record = HitDistancePrimitiveCoordinates;
+    static constexpr bool PRIMITIVE = true;
+    static constexpr bool INSTANCE = false;
+    static constexpr bool COORDINATES = true;
+
+    static Record MakeRecord(const RayHit &hit)
+    {
+        return Record {hit.t, hit.primId, hit.u, hit.v};
+    }
+};
+
+template <>
+struct HitFormatTraits<TraceRayHitFormat::T_PRIMID_INSTID> {
+    using Record = HitDistancePrimitiveInstance;
+    static constexpr bool PRIMITIVE = true;
+    static constexpr bool INSTANCE = true;
+    static constexpr bool COORDINATES = false;
+
+    static Record MakeRecord(const RayHit &hit)
+    {
+        return Record {hit.t, hit.primId, hit.instId};
+    }
+};
+
+template <>
+struct HitFormatTraits<TraceRayHitFormat::T_PRIMID_INSTID_U_V> {
+    using Record = HitDistancePrimitiveInstanceCoordinates;
+    static constexpr bool PRIMITIVE = true;
+    static constexpr bool INSTANCE = true;
+    static constexpr bool COORDINATES = true;
+
+    static Record MakeRecord(const RayHit &hit)
+    {
+        return Record {hit.t, hit.primId, hit.instId, hit.u, hit.v};
+    }
+};
+
+/// @brief Bit-packed hits have no record, StoreHit sets the bit of each ray instead.
+template <>
+struct HitFormatTraits<TraceRayHitFormat::OCCLUDED_BITS> {
+    static constexpr bool PRIMITIVE = false;
+    static constexpr bool INSTANCE = false;
+    static constexpr bool COORDINATES = false;
+};
+
+/// Ids of a hit packed as HitDistancePackedPrimitiveInstance::primInstId; TraceRays checks beforehand that they fit.
+inline uint32_t PackPrimitiveInstance(const RayHit &hit)
+{
+    return (hit.primId & PACKED_PRIMITIVE_MASK) | (hit.instId << PACKED_PRIMITIVE_BITS);
+}
+
+/// Barycentrics as two unorm16, u in the low half, rounded to nearest like GLSL packUnorm2x16.
+inline uint32_t PackCoordinates(const RayHit &hit)
+{
+    const float unormMax = 65535.0f;
+    uint32_t u = static_cast<uint32_t>(std::min(std::max(hit.u, 0.0f), 1.0f) * unormMax + 0.5f);
+    uint32_t v = static_cast<uint32_t>(std::min(std::max(hit.v, 0.0f), 1.0f) * unormMax + 0.5f);
+    return u | (v << 16);
+}
+
+template <>
+struct HitFormatTraits<TraceRayHitFormat::T_PRIMID_INSTID_PACKED> {
+    using Record = HitDistancePackedPrimitiveInstance;
+    static constexpr bool PRIMITIVE = true;
+    static constexpr bool INSTANCE = true;
+    static constexpr bool COORDINATES = false;
+
+    static Record MakeRecord(const RayHit &hit)
+    {
+        return Record {hit.t, PackPrimitiveInstance(hit)};
+    }
+};
+
+template <>
+struct HitFormatTraits<TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED> {
+    using Record = HitDistancePackedPrimitiveInstanceCoordinates;
+    static constexpr bool PRIMITIVE = true;
+    static constexpr bool INSTANCE = true;
+    static constexpr bool COORDINATES = true;
+
+    static Record MakeRecord(const RayHit &hit)
+    {
+        return Record {hit.t, PackPrimitiveInstance(hit), PackCoordinates(hit)};
+    }
+};
+
+/// a * b - c * d. The products are separate statements so that no compiler fuses them into a multiply-add, whose
+/// different rounding would break the exact antisymmetry of the edge functions and the match with the vector kernels.
+inline float ProductDifference(float a, float b, float c, float d)
+{
+    float ab = a * b;
+    float cd = c * d;
+    return ab - cd;
+}
+
+/// Move a vertex, relative to the ray origin, into the ray space of LocalRay; z is left unscaled.
+inline void ShearVertex(const LocalRay &ray, const float *p, float &x, float &y)
+{
+    float dx = ray.shear[0] * p[ray.kz];
+    float dy = ray.shear[1] * p[ray.kz];
+    x = p[ray.kx] - dx;
+    y = p[ray.ky] - dy;
+}
+
+/**
+ * Watertight ray-triangle test (Woop, Benthin and Wald 2013). The vertices are moved into the ray space of
+ * LocalRay, where the ray runs along +z from the origin, and the signs of the 2D edge functions U, V and W
+ * decide the hit. A shared edge gives its two triangles edge functions of exactly opposite value, so a ray
+ * cannot slip between them. The front face is counter-clockwise, i.e. positive edge functions.
+ * The vector kernels repeat these operations in the same order, so every kernel reports the same hits.
+ * @param[out]  u, v    The barycentrics of v1 and v2, only written with COORDINATES.
+ */
+template <uint32_t FLAGS, bool COORDINATES>
+inline bool IntersectTriangle(const LocalRay &ray, const float *v0, const float *v1, const float *v2, float &t,
+                              float &u, float &v)
+{
+    float a[AXIS_COUNT] = {v0[0] - ray.origin[0], v0[1] - ray.origin[1], v0[2] - ray.origin[2]};
+    float b[AXIS_COUNT] = {v1[0] - ray.origin[0], v1[1] - ray.origin[1], v1[2] - ray.origin[2]};
+    float c[AXIS_COUNT] = {v2[0] - ray.origin[0], v2[1] - ray.origin[1], v2[2] - ray.origin[2]};
+    float ax;
+    float ay;
+    float bx;
+    float by;
+    float cx;
+    float cy;
+    ShearVertex(ray, a, ax, ay);
+    ShearVertex(ray, b, bx, by);
+    ShearVertex(ray, c, cx, cy);
+    float edgeU = ProductDifference(cx, by, cy, bx);
+    float edgeV = ProductDifference(ax, cy, ay, cx);
+    float edgeW = ProductDifference(bx, ay, by, ax);
+    bool negative = edgeU < 0.0f || edgeV < 0.0f || edgeW < 0.0f;
+    bool positive = edgeU > 0.0f || edgeV > 0.0f || edgeW > 0.0f;
+    if ((FLAGS & TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES) ? negative :
+        (FLAGS & TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES) ? positive : negative && positive) {
+        return false;
+    }
+    float det = edgeU + edgeV + edgeW;
+    if (det == 0.0f) {
+        return false;
+    }
+    float az = ray.shear[2] * a[ray.kz];
+    float bz = ray.shear[2] * b[ray.kz];
+    float cz = ray.shear[2] * c[ray.kz];
+    float termU = edgeU * az;
+    float termV = edgeV * bz;
+    float termW = edgeW * cz;
+    float invDet = 1.0f / det;
+    float dist = (termU + termV + termW) * invDet;
+    if (!(dist >= ray.tmin && dist <= ray.tmax)) {
+        return false;
+    }
+    t = dist;
+    if (COORDINATES) {
+        u = edgeV * invDet;
+        v = edgeW * invDet;
+    }
+    return true;
+}
+
+/**
+ * Intersect the triangles of a leaf, shortening the ray at every hit.
+ * @param[in]   prims       The triangles of the leaf, taken from the primIndices of the traversed layout.
+ * @param[out]  hit         Only t and the fields of FORMAT are written.
+ * @return true when the traversal should stop, i.e. an any-hit query found something.
+ */
+template <uint32_t FLAGS, TraceRayHitFormat FORMAT>
+inline bool IntersectLeaf(const BottomLevel &blas, const uint32_t *prims, uint32_t count, LocalRay &ray,
+                          uint32_t instId, RayHit &hit)
+{
+    using Traits = HitFormatTraits<FORMAT>;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t prim = prims[i];
+        float t;
+        float u;
+        float v;
+        if (!IntersectTriangle<FLAGS, Traits::COORDINATES>(ray, blas.GetVertex(prim, 0), blas.GetVertex(prim, 1),
+                                                           blas.GetVertex(prim, 2), t, u, v)) {
+            continue;
+        }
+        ray.tmax = t;
+        hit.t = t;
+        if (Traits::PRIMITIVE) {
+            hit.primId = prim;
+        }
+        if (Traits::INSTANCE) {
+            hit.instId = instId;
+        }
+        if (Traits::COORDINATES) {
+            hit.u = u;
+            hit.v = v;
+        }
+        if (FLAGS & TRACERAY_FLAG_ANY_HIT) {
+            return true;
+        }
+    }
+    return false;
+}
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_RAYKERNELS_H
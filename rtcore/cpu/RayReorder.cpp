@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Ray reordering of the RayShop cpu backend, which groups incoherent rays before tracing.
+ */
+
+#include "RayReorder.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t ORIGIN_BITS_PER_AXIS = 3;
+constexpr float ORIGIN_GRID_MAX = static_cast<float>((1u << ORIGIN_BITS_PER_AXIS) - 1);
+constexpr uint32_t OCTANT_SHIFT = ORIGIN_BITS_PER_AXIS * AXIS_COUNT;
+constexpr uint32_t KEY_COUNT = 1u << (OCTANT_SHIFT + AXIS_COUNT);
+constexpr uint32_t TRACE_BATCH_SIZE = 256;       /* *< Rays gathered into sorted order and traced at once. */
+static_assert(TRACE_BATCH_SIZE % HIT_WORD_BITS == 0, "a batch has to fill whole words of bit-packed hits");
+
+/// @brief Maps an origin to its cell of the Morton grid.
+struct OriginGrid {
+    float lower[AXIS_COUNT];
+    float scale[AXIS_COUNT];
+};
+
+/// The direction octant in the high bits, so that the origin order only applies among rays heading alike.
+uint32_t RayKey(const Ray &ray, const OriginGrid &grid)
+{
+    uint32_t key = 0;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        float cell = (ray.origin[axis] - grid.lower[axis]) * grid.scale[axis];
+        uint32_t quantized = static_cast<uint32_t>(std::min(ORIGIN_GRID_MAX, std::max(0.0f, cell)));
+        key |= ExpandMortonBits(quantized) << (AXIS_COUNT - 1 - axis);
+        key |= (ray.dir[axis] < 0.0f ? 1u : 0u) << (OCTANT_SHIFT + axis);
+    }
+    return key;
+}
+} // namespace
+
+void TraceRaysReordered(const TopLevel &tlas, TraceRaysFunc traceRays, TraceRayHitFormat hitFormat,
+                        const Aabb &originBounds, const Ray *rays, uint32_t count, void *hits)
+{
+    OriginGrid grid;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        float extent = originBounds.upper[axis] - originBounds.lower[axis];
+        grid.lower[axis] = originBounds.lower[axis];
+        grid.scale[axis] = extent > 0.0f ? ORIGIN_GRID_MAX / extent : 0.0f;
+    }
+    // A stable counting sort, so that equal keys keep the caller's order.
+    std::vector<uint16_t> keys(count);
+    std::vector<uint32_t> offsets(KEY_COUNT, 0u);
+    for (uint32_t i = 0; i < count; i++) {
+        keys[i] = static_cast<uint16_t>(RayKey(rays[i], grid));
+        offsets[keys[i]]++;
+    }
+    uint32_t sum = 0;
+    for (uint32_t &offset : offsets) {
+        uint32_t keyCount = offset;
+        offset = sum;
+        sum += keyCount;
+    }
+    std::vector<uint32_t> order(count);
+    for (uint32_t i = 0; i < count; i++) {
+        order[offsets[keys[i]]++] = i;
+    }
+
+    // Gather a batch at a time rather than the whole chunk, so that the sorted rays and hits stay in the L1.
+    size_t hitStride = Vulkan::Traversal::GetHitFormatBytes(hitFormat);
+    Ray batch[TRACE_BATCH_SIZE];
+    alignas(16) uint8_t batchHits[TRACE_BATCH_SIZE * sizeof(HitDistancePrimitiveInstanceCoordinates)] = {};
+    uint8_t *hitData = static_cast<uint8_t *>(hits);
+    for (uint32_t begin = 0; begin < count; begin += TRACE_BATCH_SIZE) {
+        uint32_t batchCount = std::min(TRACE_BATCH_SIZE, count - begin);
+        for (uint32_t i = 0; i < batchCount; i++) {
+            batch[i] = rays[order[begin + i]];
+        }
+        traceRays(tlas, batch, batchCount, batchHits);
+        if (hitFormat == TraceRayHitFormat::OCCLUDED_BITS) {
+            for (uint32_t i = 0; i < batchCount; i++) {
+                StoreHitBit(hitData, order[begin + i], LoadHitBit(batchHits, i));
+            }
+            continue;
+        }
+        for (uint32_t i = 0; i < batchCount; i++) {
+            memcpy(hitData + order[begin + i] * hitStride, batchHits + i * hitStride, hitStride);
+        }
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
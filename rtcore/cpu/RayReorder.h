@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Ray reordering of the RayShop cpu backend, which groups incoherent rays before tracing.
+ */
+
+#ifndef RAYSHOP_CPU_RAYREORDER_H
+#define RAYSHOP_CPU_RAYREORDER_H
+
+#include "Traversal.h"
+#include "BVH.h"
+#include "RayTracer.h"
+
+namespace RayShop {
+namespace Cpu {
+/// @brief Below this many rays, sorting costs more than the traversal saves.
+constexpr uint32_t MIN_REORDER_RAY_COUNT = 4096;
+/// @brief Rays sorted together, few enough that they, their index map and their hits stay in the L2.
+constexpr uint32_t MAX_REORDER_CHUNK_SIZE = 16384;
+
+/**
+ * Trace a chunk of rays sorted by a key of their direction octant followed by the Morton code of their origin,
+ * so that rays which start close to each other and head the same way are traced one after another. The key is
+ * coarse, an 8^3 grid, so that a single counting pass sorts it. Each chunk is sorted on its own: no pass over all
+ * the rays, and the gather and scatter stay within the caches of one thread.
+ * @param[in]   originBounds    The grid of the Morton codes, e.g. the scene bounds. Origins outside of it are
+ *                              clamped to its border cells, so it need not hold every ray.
+ * @param[out]  hits            count records of hitFormat, in the order of rays. For OCCLUDED_BITS, the chunk has
+ *                              to start on a word, and only its own words are written.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void TraceRaysReordered(const TopLevel &tlas, TraceRaysFunc traceRays, TraceRayHitFormat hitFormat,
+                        const Aabb &originBounds, const Ray *rays, uint32_t count, void *hits);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_RAYREORDER_H
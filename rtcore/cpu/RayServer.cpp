@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Serves the rays of other processes through a shared-memory segment in the RayShop cpu backend.
+ */
+
+#include "RayServer.h"
+
+#include <chrono>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+/// @brief How often the server looks for the slots of clients that died holding them.
+constexpr auto RECLAIM_INTERVAL = std::chrono::milliseconds(10);
+} // namespace
+
+RayServer::~RayServer() noexcept
+{
+    Stop();
+}
+
+Result RayServer::Start(const char *name, const RayServerOptions &options, TraceFunc trace)
+{
+    Result result = m_segment.Create(name, options);
+    if (result != Result::SUCCESS) {
+        return result;
+    }
+    m_trace = std::move(trace);
+    m_stop.store(false, std::memory_order_relaxed);
+    try {
+        m_thread = std::thread(&RayServer::Serve, this);
+    } catch (...) {
+        m_segment.Close();
+        throw;
+    }
+    return Result::SUCCESS;
+}
+
+void RayServer::Stop() noexcept
+{
+    if (!m_thread.joinable()) {
+        return;
+    }
+    m_stop.store(true, std::memory_order_release);
+    m_thread.join();
+    m_segment.Close();
+    m_trace = nullptr;
+}
+
+void RayServer::Serve()
+{
+    SharedHeader &header = *m_segment.GetHeader();
+    uint32_t mask = header.slotCount - 1;
+    Backoff backoff;
+    auto reclaimTime = std::chrono::steady_clock::now() + RECLAIM_INTERVAL;
+    while (!m_stop.load(std::memory_order_acquire)) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= reclaimTime) {
+            ReclaimSlots(header);
+            reclaimTime = now + RECLAIM_INTERVAL;
+        }
+        uint32_t index;
+        if (!PopRing(header.submittedSlots, mask, index)) {
+            backoff.Wait();
+            continue;
+        }
+        backoff.Reset();
+        // Clients write the whole segment, so nothing they put in a slot is trusted.
+        index &= mask;
+        SharedSlot &slot = header.slots[index];
+        TraceRayHitFormat hitFormat = static_cast<TraceRayHitFormat>(slot.hitFormat);
+        Result result = Result::INVALID_PARAMETER;
+        if (slot.rayCount <= header.slotRayCount && Vulkan::Traversal::GetHitFormatBytes(hitFormat) != 0) {
+            uint8_t *data = GetSlotData(header, index);
+            Buffer rays {BufferType::CPU, {data}};
+            Buffer hits {BufferType::CPU, {data + static_cast<size_t>(header.slotRayCount) * sizeof(Ray)}};
+            result = m_trace(slot.rayCount, slot.rayFlags, rays, hits, hitFormat);
+        }
+        slot.result = static_cast<int32_t>(result);
+        slot.state.store(SLOT_DONE, std::memory_order_release);
+    }
+}
+
+void RayServer::ReclaimSlots(SharedHeader &header)
+{
+    uint32_t mask = header.slotCount - 1;
+    RepairRing(header.submittedSlots, mask, m_submittedWatch);
+    RepairRing(header.freeSlots, mask, m_freeWatch);
+    for (uint32_t index = 0; index < header.slotCount; index++) {
+        SharedSlot &slot = header.slots[index];
+        int32_t owner = slot.owner.load(std::memory_order_relaxed);
+        if (owner == 0 || IsProcessAlive(owner)) {
+            continue;
+        }
+        // A submitted slot is freed once traced, on a later round, so that the server never traces a free one;
+        // unless its owner died before its push made it into the ring, as only this thread pops from it.
+        if (slot.state.load(std::memory_order_acquire) == SLOT_SUBMITTED && IsQueued(header.submittedSlots, mask,
+            index)) {
+            continue;
+        }
+        // The exchange fails when the owner released the slot before it exited, and another client took it since.
+        if (!slot.owner.compare_exchange_strong(owner, 0, std::memory_order_relaxed)) {
+            continue;
+        }
+        slot.state.store(SLOT_IDLE, std::memory_order_relaxed);
+        // The push fails while a client that died popping holds the cell, until RepairRing frees it. The slot keeps
+        // its dead owner meanwhile, so that a later round pushes it again.
+        if (!PushRing(header.freeSlots, mask, index)) {
+            slot.owner.store(owner, std::memory_order_relaxed);
+        }
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
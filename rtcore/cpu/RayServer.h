@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Serves the rays of other processes through a shared-memory segment in the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_RAYSERVER_H
+#define RAYSHOP_CPU_RAYSERVER_H
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "Traversal.h"
+#include "SharedSegment.h"
+
+namespace RayShop {
+namespace Cpu {
+/// @brief Traces the batches other processes submit through a SharedSegment, one after another on a thread of its
+/// own. The batches themselves are spread over the worker pool by the trace function.
+class RayServer {
+public:
+    using TraceFunc = std::function<Result(uint32_t rayCount, uint32_t rayFlags, const Buffer &rays,
+                                           const Buffer &hits, TraceRayHitFormat hitFormat)>;
+
+    RayServer() = default;
+    ~RayServer() noexcept;
+
+    /**
+     * Create the segment and start serving it.
+     * @param[in]   trace       Traces a batch; called on the thread of the server only.
+     * @return The results of SharedSegment::Create.
+     * @note Throws std::system_error when the thread cannot be started, the segment is removed again then.
+     */
+    Result Start(const char *name, const RayServerOptions &options, TraceFunc trace);
+
+    /**
+     * Finish the batch being traced and stop. Clients waiting for other batches get NOT_READY, and the name is
+     * unlinked, so that new clients cannot attach; those attached keep their mapping until they detach.
+     */
+    void Stop() noexcept;
+
+    bool IsRunning() const
+    {
+        return m_thread.joinable();
+    }
+
+    RayServer(const RayServer &) = delete;
+    RayServer &operator=(const RayServer &) = delete;
+
+private:
+    void Serve();
+
+    /**
+     * Repair the rings stalled by clients that died pushing or popping, and put the slots of clients that are gone
+     * back into the free ring, unless they still wait to be traced. A client killed between popping a free slot
+     * and marking it as its own leaks that slot.
+     */
+    void ReclaimSlots(SharedHeader &header);
+
+    SharedSegment m_segment;
+    TraceFunc m_trace;
+    std::atomic<bool> m_stop {false};
+    std::thread m_thread;
+    RingWatch m_freeWatch;          /* *< Touched by the server thread only, as the two below. */
+    RingWatch m_submittedWatch;
+};
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_RAYSERVER_H
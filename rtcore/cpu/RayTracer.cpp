@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Ray traversal kernels of the RayShop cpu backend.
+ */
+
+#include "RayTracer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t CULL_FLAGS = TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES | TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES;
+constexpr uint32_t HIT_FLAGS = TRACERAY_FLAG_ANY_HIT | TRACERAY_FLAG_CLOSEST_HIT;
+constexpr uint32_t SCHEDULING_FLAGS = TRACERAY_FLAG_REORDER_RAYS;
+
+bool IntersectBox(const LocalRay &ray, const BvhNode &node, float &tEntry)
+{
+    float t0 = ray.tmin;
+    float t1 = ray.tmax;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        float tNear = (node.lower[axis] - ray.origin[axis]) * ray.invDir[axis];
+        float tFar = (node.upper[axis] - ray.origin[axis]) * ray.invDir[axis];
+        if (tNear > tFar) {
+            std::swap(tNear, tFar);
+        }
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar < t1 ? tFar : t1;
+    }
+    tEntry = t0;
+    return t0 <= t1 * ROBUST_FAR_SCALE;
+}
+
+/// Returns true when the traversal should stop, i.e. an any-hit query found something.
+template <uint32_t FLAGS, TraceRayHitFormat FORMAT>
+bool IntersectBottomLevel(const BottomLevel &blas, LocalRay &ray, uint32_t instId, RayHit &hit)
+{
+    const Bvh &bvh = blas.GetBvh();
+    const BvhNode *nodes = bvh.nodes.data();
+    uint32_t stack[BVH_MAX_DEPTH];
+    uint32_t stackSize = 0;
+    uint32_t nodeIndex = 0;
+    float tEntry;
+    if (bvh.primIndices.empty() || !IntersectBox(ray, nodes[0], tEntry)) {
+        return false;
+    }
+    for (;;) {
+        const BvhNode &node = nodes[nodeIndex];
+        if (IsLeaf(node)) {
+            const uint32_t *prims = &bvh.primIndices[node.leftFirst];
+            if (IntersectLeaf<FLAGS, FORMAT>(blas, prims, node.primCount, ray, instId, hit)) {
+                return true;
+            }
+        } else {
+            float tLeft;
+            float tRight;
+            bool hitLeft = IntersectBox(ray, nodes[node.leftFirst], tLeft);
+            bool hitRight = IntersectBox(ray, nodes[node.leftFirst + 1], tRight);
+            if (hitLeft && hitRight) {
+                bool leftFirst = tLeft <= tRight;
+                stack[stackSize++] = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+                nodeIndex = leftFirst ? node.leftFirst : node.leftFirst + 1;
+                continue;
+            }
+            if (hitLeft || hitRight) {
+                nodeIndex = hitLeft ? node.leftFirst : node.leftFirst + 1;
+                continue;
+            }
+        }
+        if (stackSize == 0) {
+            return false;
+        }
+        nodeIndex = stack[--stackSize];
+    }
+}
+
+/// Trace one ray through the binary top level structure.
+template <uint32_t FLAGS, TraceRayHitFormat FORMAT>
+void TraceRay(const TopLevel &tlas, const Ray &ray, RayHit &hit)
+{
+    hit = RayHit {MISS_DISTANCE, INVALID_INDEX, INVALID_INDEX, 0.0f, 0.0f};
+    const Bvh &bvh = tlas.GetBvh();
+    const BvhNode *nodes = bvh.nodes.data();
+    LocalRay worldRay;
+    PrepareRay(ray.origin, ray.dir, ray.tmin, ray.tmax, worldRay);
+    uint32_t stack[BVH_MAX_DEPTH];
+    uint32_t stackSize = 0;
+    uint32_t nodeIndex = 0;
+    float tEntry;
+    if (bvh.primIndices.empty() || !IntersectBox(worldRay, nodes[0], tEntry)) {
+        return;
+    }
+    for (;;) {
+        const BvhNode &node = nodes[nodeIndex];
+        if (IsLeaf(node)) {
+            for (uint32_t i = 0; i < node.primCount; i++) {
+                uint32_t instId = bvh.primIndices[node.leftFirst + i];
+                const Instance &instance = tlas.GetInstance(instId);
+                float origin[AXIS_COUNT];
+                float dir[AXIS_COUNT];
+                TransformPoint(instance.worldToObject, ray.origin, origin);
+                TransformVector(instance.worldToObject, ray.dir, dir);
+                LocalRay localRay;
+                PrepareRay(origin, dir, worldRay.tmin, worldRay.tmax, localRay);
+                bool done = IntersectBottomLevel<FLAGS, FORMAT>(*instance.blas, localRay, instId, hit);
+                worldRay.tmax = localRay.tmax;
+                if (done) {
+                    return;
+                }
+            }
+        } else {
+            float tLeft;
+            float tRight;
+            bool hitLeft = IntersectBox(worldRay, nodes[node.leftFirst], tLeft);
+            bool hitRight = IntersectBox(worldRay, nodes[node.leftFirst + 1], tRight);
+            if (hitLeft && hitRight) {
+                bool leftFirst = tLeft <= tRight;
+                stack[stackSize++] = leftFirst ? node.leftFirst + 1 : node.leftFirst;
+                nodeIndex = leftFirst ? node.leftFirst : node.leftFirst + 1;
+                continue;
+            }
+            if (hitLeft || hitRight) {
+                nodeIndex = hitLeft ? node.leftFirst : node.leftFirst + 1;
+                continue;
+            }
+        }
+        if (stackSize == 0) {
+            return;
+        }
+        nodeIndex = stack[--stackSize];
+    }
+}
+
+/// @brief The scalar kernel of a flag and hit format combination.
+template <uint32_t FLAGS, TraceRayHitFormat FORMAT>
+struct ScalarRayKernel {
+    static void Run(const TopLevel &tlas, const Ray *rays, uint32_t count, void *hits)
+    {
+        for (uint32_t i = 0; i < count; i++) {
+            RayHit hit;
+            TraceRay<FLAGS, FORMAT>(tlas, rays[i], hit);
+            StoreHit<FORMAT>(hit, hits, i);
+        }
+    }
+};
+} // namespace
+
+bool IsValidRayFlags(uint32_t rayFlags)
+{
+    return (rayFlags & HIT_FLAGS) != HIT_FLAGS && (rayFlags & CULL_FLAGS) != CULL_FLAGS &&
+        (rayFlags & ~(HIT_FLAGS | CULL_FLAGS | SCHEDULING_FLAGS)) == 0;
+}
+
+TraceRaysFunc SelectTraceRaysScalar(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    return SelectKernel<ScalarRayKernel>(rayFlags, format);
+}
+
+TraceRaysFunc SelectTraceRays(SimdIsa isa, uint32_t rayFlags, TraceRayHitFormat format)
+{
+    switch (isa) {
+#if defined(RAYSHOP_CPU_X86)
+        case SimdIsa::SSE:
+            return SelectTraceRaysSse(rayFlags, format);
+        case SimdIsa::AVX2:
+            return SelectTraceRaysAvx2(rayFlags, format);
+#elif defined(RAYSHOP_CPU_NEON)
+        case SimdIsa::NEON:
+            return SelectTraceRaysNeon(rayFlags, format);
+#endif
+        default:
+            return SelectTraceRaysScalar(rayFlags, format);
+    }
+}
+
+TraceRaysFunc SelectTracePacket(SimdIsa isa, uint32_t rayFlags, TraceRayHitFormat format)
+{
+    switch (isa) {
+#if defined(RAYSHOP_CPU_X86)
+        case SimdIsa::SSE:
+            return SelectTracePacketSse(rayFlags, format);
+        case SimdIsa::AVX2:
+            return SelectTracePacketAvx2(rayFlags, format);
+#elif defined(RAYSHOP_CPU_NEON)
+        case SimdIsa::NEON:
+            return SelectTracePacketNeon(rayFlags, format);
+#endif
+        default:
+            return SelectTraceRaysScalar(rayFlags, format);
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Ray traversal kernels of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_RAYTRACER_H
+#define RAYSHOP_CPU_RAYTRACER_H
+
+#include <cstring>
+
+#include "Traversal.h"
+#include "RayKernels.h"
+#include "Simd.h"
+#include "TopLevel.h"
+
+namespace RayShop {
+namespace Cpu {
+constexpr uint32_t PACKET_TILE_SIZE = 8;
+constexpr uint32_t PACKET_SIZE = PACKET_TILE_SIZE * PACKET_TILE_SIZE;
+constexpr uint32_t HIT_WORD_BITS = 32;      /* *< Rays per uint32_t word of TraceRayHitFormat::OCCLUDED_BITS. */
+
+/// @brief Check that a combination of TraceRayFlag bits is meaningful.
+bool IsValidRayFlags(uint32_t rayFlags);
+
+/**
+ * Trace rays through the top level structure. Every kernel is specialized on the KERNEL_FLAGS bits of the ray
+ * flags and on the hit format, so that neither is looked at inside the traversal.
+ * @param[in]   tlas        The scene.
+ * @param[in]   rays        The world space rays.
+ * @param[in]   count       The ray count. Packet kernels take at most PACKET_SIZE rays, which should be coherent.
+ * @param[out]  hits        count records of the hit format of the kernel, tightly packed. t is MISS_DISTANCE
+ *                          on a miss. For OCCLUDED_BITS, count bits from the first bit of the first word.
+ */
+using TraceRaysFunc = void (*)(const TopLevel &tlas, const Ray *rays, uint32_t count, void *hits);
+
+/// Store the record of a hit at index of a tightly packed hit buffer.
+template <TraceRayHitFormat FORMAT>
+inline void StoreHit(const RayHit &hit, void *hits, uint32_t index)
+{
+    typename HitFormatTraits<FORMAT>::Record record = HitFormatTraits<FORMAT>::MakeRecord(hit);
+    memcpy(static_cast<uint8_t *>(hits) + static_cast<size_t>(index) * sizeof(record), &record, sizeof(record));
+}
+
+/// The bytes of the hits of count rays, i.e. the offset of the hit of ray count. Bit-packed hits are only split
+/// at multiples of HIT_WORD_BITS rays, so that every thread writes whole words.
+inline size_t GetHitBytes(TraceRayHitFormat hitFormat, uint32_t count)
+{
+    if (hitFormat == TraceRayHitFormat::OCCLUDED_BITS) {
+        return (static_cast<size_t>(count) + HIT_WORD_BITS - 1) / HIT_WORD_BITS * sizeof(uint32_t);
+    }
+    return static_cast<size_t>(count) * Vulkan::Traversal::GetHitFormatBytes(hitFormat);
+}
+
+inline bool LoadHitBit(const void *hits, uint32_t index)
+{
+    uint32_t word;
+    memcpy(&word, static_cast<const uint8_t *>(hits) + index / HIT_WORD_BITS * sizeof(word), sizeof(word));
+    return (word >> (index % HIT_WORD_BITS)) & 1u;
+}
+
+/// Set or clear the bit of a ray in a bit-packed hit buffer. The word is read and written back, so rays that
+/// share a word must be stored by the same thread.
+inline void StoreHitBit(void *hits, uint32_t index, bool occluded)
+{
+    uint8_t *address = static_cast<uint8_t *>(hits) + index / HIT_WORD_BITS * sizeof(uint32_t);
+    uint32_t word;
+    memcpy(&word, address, sizeof(word));
+    uint32_t bit = 1u << (index % HIT_WORD_BITS);
+    word = occluded ? (word | bit) : (word & ~bit);
+    memcpy(address, &word, sizeof(word));
+}
+
+template <>
+inline void StoreHit<TraceRayHitFormat::OCCLUDED_BITS>(const RayHit &hit, void *hits, uint32_t index)
+{
+    StoreHitBit(hits, index, hit.t >= 0.0f);
+}
+
+/// Pick Kernel<FLAGS, FORMAT>::Run for a hit format.
+template <template <uint32_t, TraceRayHitFormat> class Kernel, uint32_t FLAGS>
+TraceRaysFunc SelectKernelFormat(TraceRayHitFormat format)
+{
+    switch (format) {
+        case TraceRayHitFormat::T:
+            return Kernel<FLAGS, TraceRayHitFormat::T>::Run;
+        case TraceRayHitFormat::T_PRIMID:
+            return Kernel<FLAGS, TraceRayHitFormat::T_PRIMID>::Run;
+        case TraceRayHitFormat::T_PRIMID_U_V:
+            return Kernel<FLAGS, TraceRayHitFormat::T_PRIMID_U_V>::Run;
+        case TraceRayHitFormat::T_PRIMID_INSTID:
+            return Kernel<FLAGS, TraceRayHitFormat::T_PRIMID_INSTID>::Run;
+        case TraceRayHitFormat::T_PRIMID_INSTID_U_V:
+            return Kernel<FLAGS, TraceRayHitFormat::T_PRIMID_INSTID_U_V>::Run;
+        case TraceRayHitFormat::OCCLUDED_BITS:
+            // Any hit answers whether a ray is occluded, whatever the flags ask for.
+            return Kernel<FLAGS | TRACERAY_FLAG_ANY_HIT, TraceRayHitFormat::OCCLUDED_BITS>::Run;
+        case TraceRayHitFormat::T_PRIMID_INSTID_PACKED:
+            return Kernel<FLAGS, TraceRayHitFormat::T_PRIMID_INSTID_PACKED>::Run;
+        case TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED:
+            return Kernel<FLAGS, TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED>::Run;
+        default:
+            return nullptr;
+    }
+}
+
+/**
+ * Pick Kernel<FLAGS, FORMAT>::Run for the ray flags and the hit format of a call, instantiating one kernel per
+ * valid combination.
+ * @return nullptr for invalid ray flags or hit formats.
+ */
+template <template <uint32_t, TraceRayHitFormat> class Kernel>
+TraceRaysFunc SelectKernel(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    constexpr uint32_t anyHit = TRACERAY_FLAG_ANY_HIT;
+    constexpr uint32_t cullBack = TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES;
+    constexpr uint32_t cullFront = TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES;
+    switch (rayFlags & KERNEL_FLAGS) {
+        case 0:
+            return SelectKernelFormat<Kernel, 0>(format);
+        case cullBack:
+            return SelectKernelFormat<Kernel, cullBack>(format);
+        case cullFront:
+            return SelectKernelFormat<Kernel, cullFront>(format);
+        case anyHit:
+            return SelectKernelFormat<Kernel, anyHit>(format);
+        case anyHit | cullBack:
+            return SelectKernelFormat<Kernel, anyHit | cullBack>(format);
+        case anyHit | cullFront:
+            return SelectKernelFormat<Kernel, anyHit | cullFront>(format);
+        default:
+            return nullptr;
+    }
+}
+
+/// @brief Traverse the binary bvhs without vector instructions, one ray at a time.
+TraceRaysFunc SelectTraceRaysScalar(uint32_t rayFlags, TraceRayHitFormat format);
+
+/// @brief Traverse the 4-wide bvhs with SSE. Only built for x86.
+TraceRaysFunc SelectTraceRaysSse(uint32_t rayFlags, TraceRayHitFormat format);
+
+/// @brief Traverse the 8-wide bvhs with AVX2. Only built for x86, only callable when the cpu supports AVX2.
+TraceRaysFunc SelectTraceRaysAvx2(uint32_t rayFlags, TraceRayHitFormat format);
+
+/// @brief Traverse the 4-wide bvhs with NEON. Only built for arm.
+TraceRaysFunc SelectTraceRaysNeon(uint32_t rayFlags, TraceRayHitFormat format);
+
+/// @brief The kernel of an instruction set; its bvh width matches GetBvhWidth(isa).
+TraceRaysFunc SelectTraceRays(SimdIsa isa, uint32_t rayFlags, TraceRayHitFormat format);
+
+/// @brief Trace a packet through the binary bvhs with SSE, four rays per instruction. Only built for x86.
+TraceRaysFunc SelectTracePacketSse(uint32_t rayFlags, TraceRayHitFormat format);
+
+/// @brief Ditto with AVX2, eight rays per instruction. Only callable when the cpu supports AVX2.
+TraceRaysFunc SelectTracePacketAvx2(uint32_t rayFlags, TraceRayHitFormat format);
+
+/// @brief Ditto with NEON. Only built for arm.
+TraceRaysFunc SelectTracePacketNeon(uint32_t rayFlags, TraceRayHitFormat format);
+
+/// @brief The packet kernel of an instruction set. Without vector instructions the rays are traced one by one.
+TraceRaysFunc SelectTracePacket(SimdIsa isa, uint32_t rayFlags, TraceRayHitFormat format);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_RAYTRACER_H
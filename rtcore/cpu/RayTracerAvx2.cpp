@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: AVX2 traversal kernel of the RayShop cpu backend.
+ */
+
+#include "RayTracer.h"
+
+#if defined(RAYSHOP_CPU_X86)
+#include <immintrin.h>
+#include <cstring>
+
+// Everything shared with the other translation units is included above, so only the code below is compiled
+// for AVX2 and the rest of the library still runs on cpus without it.
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+#include "PacketTraversal.h"
+#include "SseOps.h"
+#include "WideTraversal.h"
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t AVX2_WIDTH = 8;
+
+/// Widen four grid coordinates and turn them into ray distances.
+__m128 GridDistances(const uint8_t *grid, __m128 step, __m128 base)
+{
+    int32_t packed;
+    memcpy(&packed, grid, sizeof(packed));
+    __m128i widened = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+    return _mm_add_ps(base, _mm_mul_ps(_mm_cvtepi32_ps(widened), step));
+}
+
+struct Avx2NodeTest {
+    static uint32_t Intersect(const WideNode<AVX2_WIDTH> &node, const LocalRay &ray, float *tEntries)
+    {
+        __m256 tNear = _mm256_set1_ps(ray.tmin);
+        __m256 tFar = _mm256_set1_ps(ray.tmax);
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            // Picking the planes by direction sign keeps empty slots (lower > upper) from ever hitting.
+            bool negative = ray.invDir[axis] < 0.0f;
+            __m256 nearPlane = _mm256_loadu_ps(negative ? node.upper[axis] : node.lower[axis]);
+            __m256 farPlane = _mm256_loadu_ps(negative ? node.lower[axis] : node.upper[axis]);
+            __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+            __m256 invDir = _mm256_set1_ps(ray.invDir[axis]);
+            tNear = _mm256_max_ps(tNear, _mm256_mul_ps(_mm256_sub_ps(nearPlane, origin), invDir));
+            tFar = _mm256_min_ps(tFar, _mm256_mul_ps(_mm256_sub_ps(farPlane, origin), invDir));
+        }
+        _mm256_storeu_ps(tEntries, tNear);
+        tFar = _mm256_mul_ps(tFar, _mm256_set1_ps(ROBUST_FAR_SCALE));
+        return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)));
+    }
+
+    /// Quantized nodes are 4-wide, so they take the 128-bit half of the instruction set.
+    static uint32_t IntersectQuantized(const QuantizedBvhNode &node, const LocalRay &ray, float *tEntries)
+    {
+        __m128 tNear = _mm_set1_ps(ray.tmin);
+        __m128 tFar = _mm_set1_ps(ray.tmax);
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            // Distances are affine in the grid coordinates: t = q * scale * invDir + (origin - rayOrigin) * invDir.
+            bool negative = ray.invDir[axis] < 0.0f;
+            __m128 step = _mm_set1_ps(QuantizedScale(node, axis) * ray.invDir[axis]);
+            __m128 base = _mm_set1_ps((node.origin[axis] - ray.origin[axis]) * ray.invDir[axis]);
+            tNear = _mm_max_ps(tNear, GridDistances(negative ? node.qupper[axis] : node.qlower[axis], step, base));
+            tFar = _mm_min_ps(tFar, GridDistances(negative ? node.qlower[axis] : node.qupper[axis], step, base));
+        }
+        _mm_storeu_ps(tEntries, tNear);
+        tFar = _mm_mul_ps(tFar, _mm_set1_ps(ROBUST_FAR_SCALE));
+        return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)));
+    }
+};
+
+struct Avx2Ops {
+    static constexpr uint32_t WIDTH = AVX2_WIDTH;
+    using Float = __m256;
+
+    static Float Load(const float *src)
+    {
+        return _mm256_loadu_ps(src);
+    }
+
+    static void Store(float *dst, Float a)
+    {
+        _mm256_storeu_ps(dst, a);
+    }
+
+    static Float Set(float a)
+    {
+        return _mm256_set1_ps(a);
+    }
+
+    static Float Add(Float a, Float b)
+    {
+        return _mm256_add_ps(a, b);
+    }
+
+    static Float Sub(Float a, Float b)
+    {
+        return _mm256_sub_ps(a, b);
+    }
+
+    static Float Mul(Float a, Float b)
+    {
+        return _mm256_mul_ps(a, b);
+    }
+
+    static Float Div(Float a, Float b)
+    {
+        return _mm256_div_ps(a, b);
+    }
+
+    static Float Min(Float a, Float b)
+    {
+        return _mm256_min_ps(a, b);
+    }
+
+    static Float Max(Float a, Float b)
+    {
+        return _mm256_max_ps(a, b);
+    }
+
+    static Float LessEqual(Float a, Float b)
+    {
+        return _mm256_cmp_ps(a, b, _CMP_LE_OQ);
+    }
+
+    static Float And(Float a, Float b)
+    {
+        return _mm256_and_ps(a, b);
+    }
+
+    static Float Or(Float a, Float b)
+    {
+        return _mm256_or_ps(a, b);
+    }
+
+    static uint32_t MoveMask(Float a)
+    {
+        return static_cast<uint32_t>(_mm256_movemask_ps(a));
+    }
+};
+} // namespace
+
+TraceRaysFunc SelectTraceRaysAvx2(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    return SelectKernel<WideRayKernel<AVX2_WIDTH, Avx2NodeTest, SseOps>::Kernel>(rayFlags, format);
+}
+
+TraceRaysFunc SelectTracePacketAvx2(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    return SelectKernel<PacketRayKernel<Avx2Ops>::Kernel>(rayFlags, format);
+}
+} // namespace Cpu
+} // namespace RayShop
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: NEON traversal kernel of the RayShop cpu backend.
+ */
+
+#include "RayTracer.h"
+
+#if defined(RAYSHOP_CPU_NEON)
+#include <arm_neon.h>
+#include <cstring>
+
+#include "PacketTraversal.h"
+#include "WideTraversal.h"
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t NEON_WIDTH = 4;
+
+/// Keep one bit per lane, then fold the lanes into a movemask style integer.
+uint32_t MoveMask(uint32x4_t lanes)
+{
+    const uint32_t laneBitsData[NEON_WIDTH] = {1, 2, 4, 8};
+    uint32x4_t laneBits = vandq_u32(lanes, vld1q_u32(laneBitsData));
+    uint32x2_t folded = vorr_u32(vget_low_u32(laneBits), vget_high_u32(laneBits));
+    return vget_lane_u32(folded, 0) | vget_lane_u32(folded, 1);
+}
+
+/// Widen four grid coordinates and turn them into ray distances.
+float32x4_t GridDistances(const uint8_t *grid, float32x4_t step, float32x4_t base)
+{
+    uint32_t packed;
+    memcpy(&packed, grid, sizeof(packed));
+    uint16x8_t widened = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(packed)));
+    float32x4_t q = vcvtq_f32_u32(vmovl_u16(vget_low_u16(widened)));
+    return vaddq_f32(base, vmulq_f32(q, step));
+}
+
+struct NeonNodeTest {
+    static uint32_t Intersect(const WideNode<NEON_WIDTH> &node, const LocalRay &ray, float *tEntries)
+    {
+        float32x4_t tNear = vdupq_n_f32(ray.tmin);
+        float32x4_t tFar = vdupq_n_f32(ray.tmax);
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            // Picking the planes by direction sign keeps empty slots (lower > upper) from ever hitting.
+            bool negative = ray.invDir[axis] < 0.0f;
+            float32x4_t nearPlane = vld1q_f32(negative ? node.upper[axis] : node.lower[axis]);
+            float32x4_t farPlane = vld1q_f32(negative ? node.lower[axis] : node.upper[axis]);
+            float32x4_t origin = vdupq_n_f32(ray.origin[axis]);
+            float32x4_t invDir = vdupq_n_f32(ray.invDir[axis]);
+            tNear = vmaxq_f32(tNear, vmulq_f32(vsubq_f32(nearPlane, origin), invDir));
+            tFar = vminq_f32(tFar, vmulq_f32(vsubq_f32(farPlane, origin), invDir));
+        }
+        vst1q_f32(tEntries, tNear);
+        tFar = vmulq_n_f32(tFar, ROBUST_FAR_SCALE);
+        return MoveMask(vcleq_f32(tNear, tFar));
+    }
+
+    static uint32_t IntersectQuantized(const QuantizedBvhNode &node, const LocalRay &ray, float *tEntries)
+    {
+        float32x4_t tNear = vdupq_n_f32(ray.tmin);
+        float32x4_t tFar = vdupq_n_f32(ray.tmax);
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            // Distances are affine in the grid coordinates: t = q * scale * invDir + (origin - rayOrigin) * invDir.
+            bool negative = ray.invDir[axis] < 0.0f;
+            float32x4_t step = vdupq_n_f32(QuantizedScale(node, axis) * ray.invDir[axis]);
+            float32x4_t base = vdupq_n_f32((node.origin[axis] - ray.origin[axis]) * ray.invDir[axis]);
+            const uint8_t *nearGrid = negative ? node.qupper[axis] : node.qlower[axis];
+            const uint8_t *farGrid = negative ? node.qlower[axis] : node.qupper[axis];
+            tNear = vmaxq_f32(tNear, GridDistances(nearGrid, step, base));
+            tFar = vminq_f32(tFar, GridDistances(farGrid, step, base));
+        }
+        vst1q_f32(tEntries, tNear);
+        tFar = vmulq_n_f32(tFar, ROBUST_FAR_SCALE);
+        return MoveMask(vcleq_f32(tNear, tFar));
+    }
+};
+
+/// Comparison results stay float vectors, so that the templates can treat them like the x86 masks.
+struct NeonOps {
+    static constexpr uint32_t WIDTH = NEON_WIDTH;
+    using Float = float32x4_t;
+
+    static Float Load(const float *src)
+    {
+        return vld1q_f32(src);
+    }
+
+    static void Store(float *dst, Float a)
+    {
+        vst1q_f32(dst, a);
+    }
+
+    static Float Set(float a)
+    {
+        return vdupq_n_f32(a);
+    }
+
+    static Float Add(Float a, Float b)
+    {
+        return vaddq_f32(a, b);
+    }
+
+    static Float Sub(Float a, Float b)
+    {
+        return vsubq_f32(a, b);
+    }
+
+    static Float Mul(Float a, Float b)
+    {
+        return vmulq_f32(a, b);
+    }
+
+    static Float Div(Float a, Float b)
+    {
+#if defined(__aarch64__)
+        return vdivq_f32(a, b);
+#else
+        float lanesA[NEON_WIDTH];
+        float lanesB[NEON_WIDTH];
+        vst1q_f32(lanesA, a);
+        vst1q_f32(lanesB, b);
+        for (uint32_t lane = 0; lane < NEON_WIDTH; lane++) {
+            lanesA[lane] /= lanesB[lane];
+        }
+        return vld1q_f32(lanesA);
+#endif
+    }
+
+    static Float Min(Float a, Float b)
+    {
+        return vminq_f32(a, b);
+    }
+
+    static Float Max(Float a, Float b)
+    {
+        return vmaxq_f32(a, b);
+    }
+
+    static Float LessEqual(Float a, Float b)
+    {
+        return vreinterpretq_f32_u32(vcleq_f32(a, b));
+    }
+
+    static Float And(Float a, Float b)
+    {
+        return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b)));
+    }
+
+    static Float Or(Float a, Float b)
+    {
+        return vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b)));
+    }
+
+    static uint32_t MoveMask(Float a)
+    {
+        return Cpu::MoveMask(vreinterpretq_u32_f32(a));
+    }
+};
+} // namespace
+
+TraceRaysFunc SelectTraceRaysNeon(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    return SelectKernel<WideRayKernel<NEON_WIDTH, NeonNodeTest, NeonOps>::Kernel>(rayFlags, format);
+}
+
+TraceRaysFunc SelectTracePacketNeon(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    return SelectKernel<PacketRayKernel<NeonOps>::Kernel>(rayFlags, format);
+}
+} // namespace Cpu
+} // namespace RayShop
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: SSE traversal kernel of the RayShop cpu backend.
+ */
+
+#include "RayTracer.h"
+
+#if defined(RAYSHOP_CPU_X86) && defined(__SSE2__)
+#include <emmintrin.h>
+#include <cstring>
+
+#include "PacketTraversal.h"
+#include "SseOps.h"
+#include "WideTraversal.h"
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t SSE_WIDTH = 4;
+
+/// Widen four grid coordinates and turn them into ray distances.
+__m128 GridDistances(const uint8_t *grid, __m128 step, __m128 base)
+{
+    int32_t packed;
+    memcpy(&packed, grid, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i widened = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_add_ps(base, _mm_mul_ps(_mm_cvtepi32_ps(widened), step));
+}
+
+struct SseNodeTest {
+    static uint32_t Intersect(const WideNode<SSE_WIDTH> &node, const LocalRay &ray, float *tEntries)
+    {
+        __m128 tNear = _mm_set1_ps(ray.tmin);
+        __m128 tFar = _mm_set1_ps(ray.tmax);
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            // Picking the planes by direction sign keeps empty slots (lower > upper) from ever hitting.
+            bool negative = ray.invDir[axis] < 0.0f;
+            __m128 nearPlane = _mm_loadu_ps(negative ? node.upper[axis] : node.lower[axis]);
+            __m128 farPlane = _mm_loadu_ps(negative ? node.lower[axis] : node.upper[axis]);
+            __m128 origin = _mm_set1_ps(ray.origin[axis]);
+            __m128 invDir = _mm_set1_ps(ray.invDir[axis]);
+            tNear = _mm_max_ps(tNear, _mm_mul_ps(_mm_sub_ps(nearPlane, origin), invDir));
+            tFar = _mm_min_ps(tFar, _mm_mul_ps(_mm_sub_ps(farPlane, origin), invDir));
+        }
+        _mm_storeu_ps(tEntries, tNear);
+        tFar = _mm_mul_ps(tFar, _mm_set1_ps(ROBUST_FAR_SCALE));
+        return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)));
+    }
+
+    static uint32_t IntersectQuantized(const QuantizedBvhNode &node, const LocalRay &ray, float *tEntries)
+    {
+        __m128 tNear = _mm_set1_ps(ray.tmin);
+        __m128 tFar = _mm_set1_ps(ray.tmax);
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            // Distances are affine in the grid coordinates: t = q * scale * invDir + (origin - rayOrigin) * invDir.
+            bool negative = ray.invDir[axis] < 0.0f;
+            __m128 step = _mm_set1_ps(QuantizedScale(node, axis) * ray.invDir[axis]);
+            __m128 base = _mm_set1_ps((node.origin[axis] - ray.origin[axis]) * ray.invDir[axis]);
+            tNear = _mm_max_ps(tNear, GridDistances(negative ? node.qupper[axis] : node.qlower[axis], step, base));
+            tFar = _mm_min_ps(tFar, GridDistances(negative ? node.qlower[axis] : node.qupper[axis], step, base));
+        }
+        _mm_storeu_ps(tEntries, tNear);
+        tFar = _mm_mul_ps(tFar, _mm_set1_ps(ROBUST_FAR_SCALE));
+        return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tNear, tFar)));
+    }
+};
+} // namespace
+
+TraceRaysFunc SelectTraceRaysSse(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    return SelectKernel<WideRayKernel<SSE_WIDTH, SseNodeTest, SseOps>::Kernel>(rayFlags, format);
+}
+
+TraceRaysFunc SelectTracePacketSse(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    return SelectKernel<PacketRayKernel<SseOps>::Kernel>(rayFlags, format);
+}
+} // namespace Cpu
+} // namespace RayShop
+#endif
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: The POSIX shared-memory segment through which the RayShop cpu backend serves other processes.
+ */
+
+#include "SharedSegment.h"
+#include "RayTracer.h"
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t SPIN_ROUNDS = 64;
+constexpr uint32_t YIELD_ROUNDS = 256;
+constexpr auto IDLE_SLEEP = std::chrono::microseconds(50);
+constexpr uint32_t MAX_SLOT_RAY_COUNT = 1u << 24;   /* *< Keeps a slot below 1 GB. */
+constexpr uint32_t RING_HOLE = 0xFFFFFFFFu;          /* *< The value of a push RepairRing skipped. */
+constexpr uint32_t CELL_SEQUENCE_SHIFT = 32;
+
+uint64_t PackCell(uint32_t sequence, uint32_t value)
+{
+    return static_cast<uint64_t>(sequence) << CELL_SEQUENCE_SHIFT | value;
+}
+
+uint32_t GetCellSequence(uint64_t word)
+{
+    return static_cast<uint32_t>(word >> CELL_SEQUENCE_SHIFT);
+}
+
+uint32_t GetCellValue(uint64_t word)
+{
+    return static_cast<uint32_t>(word);
+}
+
+uint64_t RoundUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+bool IsValidName(const char *name)
+{
+    // One leading slash and no other is the only form every POSIX system accepts.
+    if (name == nullptr || name[0] != '/') {
+        return false;
+    }
+    size_t length = strnlen(name, RAY_SERVER_MAX_NAME_LENGTH + 1);
+    return length > 1 && length <= RAY_SERVER_MAX_NAME_LENGTH && strchr(name + 1, '/') == nullptr;
+}
+
+#ifndef __ANDROID__
+uint64_t GetSegmentBytes(uint32_t slotCount, uint32_t slotRayCount)
+{
+    return RoundUp(sizeof(SharedHeader), SHARED_CACHE_LINE) + slotCount * GetSlotBytes(slotRayCount);
+}
+
+void InitRing(SharedRing &ring)
+{
+    ring.head.store(0, std::memory_order_relaxed);
+    ring.tail.store(0, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < MAX_SHARED_SLOTS; i++) {
+        ring.cells[i].word.store(PackCell(i, 0), std::memory_order_relaxed);
+    }
+}
+
+/// Whether a segment of this name was left behind by a server that is gone, or never finished setting it up.
+bool IsAbandoned(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    bool abandoned = fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) < sizeof(SharedHeader);
+    if (!abandoned) {
+        void *memory = mmap(nullptr, sizeof(SharedHeader), PROT_READ, MAP_SHARED, fd, 0);
+        if (memory != MAP_FAILED) {
+            const SharedHeader *header = static_cast<const SharedHeader *>(memory);
+            abandoned = header->magic.load(std::memory_order_acquire) != SHARED_MAGIC ||
+                header->serverState.load(std::memory_order_acquire) != SERVER_RUNNING ||
+                !IsProcessAlive(header->serverPid);
+            munmap(memory, sizeof(SharedHeader));
+        }
+    }
+    close(fd);
+    return abandoned;
+}
+#endif
+} // namespace
+
+uint64_t GetSlotBytes(uint32_t slotRayCount)
+{
+    return RoundUp(static_cast<uint64_t>(slotRayCount) *
+        (sizeof(Ray) + sizeof(HitDistancePrimitiveInstanceCoordinates)), SHARED_CACHE_LINE);
+}
+
+bool PushRing(SharedRing &ring, uint32_t mask, uint32_t value)
+{
+    uint32_t position = ring.head.load(std::memory_order_relaxed);
+    for (;;) {
+        SharedRingCell &cell = ring.cells[position & mask];
+        uint64_t word = cell.word.load(std::memory_order_acquire);
+        int32_t lag = static_cast<int32_t>(GetCellSequence(word) - position);
+        if (lag == 0) {
+            if (ring.head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                // Fails only when RepairRing skipped the cell while this process stalled, then push again.
+                if (cell.word.compare_exchange_strong(word, PackCell(position + 1, value), std::memory_order_release,
+                    std::memory_order_relaxed)) {
+                    return true;
+                }
+                position = ring.head.load(std::memory_order_relaxed);
+            }
+        } else if (lag < 0) {
+            return false;
+        } else {
+            position = ring.head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool PopRing(SharedRing &ring, uint32_t mask, uint32_t &value)
+{
+    uint32_t position = ring.tail.load(std::memory_order_relaxed);
+    for (;;) {
+        SharedRingCell &cell = ring.cells[position & mask];
+        uint64_t word = cell.word.load(std::memory_order_acquire);
+        int32_t lag = static_cast<int32_t>(GetCellSequence(word) - (position + 1));
+        if (lag == 0) {
+            if (ring.tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                // The cell is free for the push one lap later. The exchange fails only when RepairRing freed it
+                // while this process stalled, the value read above is still the one of this position.
+                uint32_t popped = GetCellValue(word);
+                cell.word.compare_exchange_strong(word, PackCell(position + mask + 1, popped),
+                    std::memory_order_release, std::memory_order_relaxed);
+                if (popped != RING_HOLE) {
+                    value = popped;
+                    return true;
+                }
+                position = ring.tail.load(std::memory_order_relaxed);
+            }
+        } else if (lag < 0) {
+            return false;
+        } else {
+            position = ring.tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool RepairRing(SharedRing &ring, uint32_t mask, RingWatch &watch)
+{
+    uint32_t tail = ring.tail.load(std::memory_order_acquire);
+    uint32_t head = ring.head.load(std::memory_order_acquire);
+    SharedRingCell *cell = &ring.cells[tail & mask];
+    uint64_t word = cell->word.load(std::memory_order_acquire);
+    uint32_t position = tail;
+    uint64_t finished = PackCell(tail + 1, RING_HOLE);
+    if (head == tail || GetCellSequence(word) != tail) {
+        // The next push waits for the cell of the pop one lap before it.
+        position = head - mask - 1;
+        cell = &ring.cells[head & mask];
+        word = cell->word.load(std::memory_order_acquire);
+        finished = PackCell(head, GetCellValue(word));
+        if (GetCellSequence(word) != position + 1 || static_cast<int32_t>(tail - position) <= 0) {
+            watch.claimed = false;
+            return false;
+        }
+    }
+    bool stalled = watch.claimed && watch.position == position && watch.word == word;
+    watch.claimed = !stalled;
+    watch.position = position;
+    watch.word = word;
+    return stalled && cell->word.compare_exchange_strong(word, finished, std::memory_order_release,
+        std::memory_order_relaxed);
+}
+
+bool IsQueued(const SharedRing &ring, uint32_t mask, uint32_t value)
+{
+    uint32_t tail = ring.tail.load(std::memory_order_acquire);
+    uint32_t head = ring.head.load(std::memory_order_acquire);
+    // Clients write the whole segment, so the cursors may be anything; a ring holds one lap at most.
+    for (uint32_t position = tail; position != head && position - tail <= mask; position++) {
+        uint64_t word = ring.cells[position & mask].word.load(std::memory_order_acquire);
+        if (GetCellSequence(word) == position + 1 && GetCellValue(word) == value) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool IsProcessAlive(int32_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+void Backoff::Wait()
+{
+    if (m_rounds < SPIN_ROUNDS) {
+        m_rounds++;
+    } else if (m_rounds < SPIN_ROUNDS + YIELD_ROUNDS) {
+        m_rounds++;
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(IDLE_SLEEP);
+    }
+}
+
+bool Backoff::IsSleeping() const
+{
+    return m_rounds >= SPIN_ROUNDS + YIELD_ROUNDS;
+}
+
+SharedSegment::~SharedSegment() noexcept
+{
+    Close();
+}
+
+Result SharedSegment::Create(const char *name, const RayServerOptions &options)
+{
+    if (!IsValidName(name) || options.slotCount == 0 || options.slotCount > MAX_SHARED_SLOTS ||
+        options.slotRayCount == 0 || options.slotRayCount > MAX_SLOT_RAY_COUNT) {
+        return Result::INVALID_PARAMETER;
+    }
+#ifdef __ANDROID__
+    // Bionic has no shm_open; its ashmem regions are shared by passing descriptors, not by name.
+    return Result::NOT_READY;
+#else
+    uint32_t slotCount = 1;
+    while (slotCount < options.slotCount) {
+        slotCount *= 2;
+    }
+    uint32_t slotRayCount = static_cast<uint32_t>(RoundUp(options.slotRayCount, HIT_WORD_BITS));
+    uint64_t bytes = GetSegmentBytes(slotCount, slotRayCount);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0 && errno == EEXIST && IsAbandoned(name)) {
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+    }
+    if (fd < 0) {
+        return errno == ENOMEM || errno == ENFILE || errno == EMFILE ? Result::OUT_OF_MEMORY :
+            Result::INVALID_PARAMETER;
+    }
+    void *memory = ftruncate(fd, static_cast<off_t>(bytes)) == 0 ?
+        mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(name);
+        return Result::OUT_OF_MEMORY;
+    }
+    Close();
+    m_header = new (memory) SharedHeader();
+    m_bytes = bytes;
+    strncpy(m_name, name, RAY_SERVER_MAX_NAME_LENGTH);
+    m_header->version = SHARED_VERSION;
+    m_header->slotCount = slotCount;
+    m_header->slotRayCount = slotRayCount;
+    m_header->slotBytes = GetSlotBytes(slotRayCount);
+    m_header->segmentBytes = bytes;
+    m_header->serverPid = static_cast<int32_t>(getpid());
+    m_header->serverState.store(SERVER_RUNNING, std::memory_order_relaxed);
+    InitRing(m_header->freeSlots);
+    InitRing(m_header->submittedSlots);
+    for (uint32_t slot = 0; slot < slotCount; slot++) {
+        m_header->slots[slot].state.store(SLOT_IDLE, std::memory_order_relaxed);
+        m_header->slots[slot].owner.store(0, std::memory_order_relaxed);
+        PushRing(m_header->freeSlots, slotCount - 1, slot);
+    }
+    // Clients check the magic before anything else, so it publishes the rest.
+    m_header->magic.store(SHARED_MAGIC, std::memory_order_release);
+    return Result::SUCCESS;
+#endif
+}
+
+Result SharedSegment::Open(const char *name)
+{
+    if (!IsValidName(name)) {
+        return Result::INVALID_PARAMETER;
+    }
+#ifdef __ANDROID__
+    return Result::NOT_READY;
+#else
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return errno == ENOENT ? Result::NOT_READY : Result::INVALID_PARAMETER;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SharedHeader)) {
+        close(fd);
+        return Result::NOT_READY;
+    }
+    size_t bytes = static_cast<size_t>(info.st_size);
+    void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return Result::OUT_OF_MEMORY;
+    }
+    SharedHeader *header = static_cast<SharedHeader *>(memory);
+    Result result = Result::SUCCESS;
+    if (header->magic.load(std::memory_order_acquire) != SHARED_MAGIC) {
+        result = Result::NOT_READY;
+    } else if (header->version != SHARED_VERSION || header->segmentBytes != bytes) {
+        result = Result::INVALID_PARAMETER;
+    } else if (header->serverState.load(std::memory_order_acquire) != SERVER_RUNNING ||
+        !IsProcessAlive(header->serverPid)) {
+        result = Result::NOT_READY;
+    }
+    if (result != Result::SUCCESS) {
+        munmap(memory, bytes);
+        return result;
+    }
+    Close();
+    m_header = header;
+    m_bytes = bytes;
+    return Result::SUCCESS;
+#endif
+}
+
+void SharedSegment::Close() noexcept
+{
+#ifndef __ANDROID__
+    if (m_header == nullptr) {
+        return;
+    }
+    if (m_name[0] != '\0') {
+        m_header->serverState.store(SERVER_STOPPED, std::memory_order_release);
+        shm_unlink(m_name);
+        m_name[0] = '\0';
+    }
+    munmap(m_header, m_bytes);
+    m_header = nullptr;
+    m_bytes = 0;
+#endif
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: The POSIX shared-memory segment through which the RayShop cpu backend serves other processes.
+ */
+
+#ifndef RAYSHOP_CPU_SHAREDSEGMENT_H
+#define RAYSHOP_CPU_SHAREDSEGMENT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "Traversal.h"
+
+namespace RayShop {
+namespace Cpu {
+constexpr uint32_t SHARED_MAGIC = 0x56525352u;  /* *< "RSRV", stored last by the server once the segment is set up. */
+constexpr uint32_t SHARED_VERSION = 3;
+constexpr uint32_t MAX_SHARED_SLOTS = 64;
+constexpr size_t SHARED_CACHE_LINE = 64;
+
+/// @brief The states of a slot, advanced by release stores and read with acquire loads.
+enum SharedSlotState : uint32_t {
+    SLOT_IDLE = 0,          /* *< In the free ring, or being filled by its owner. */
+    SLOT_SUBMITTED = 1,     /* *< In the submitted ring, or being traced. */
+    SLOT_DONE = 2,          /* *< Traced, its owner reads the hits and puts it back in the free ring. */
+};
+
+enum SharedServerState : uint32_t {
+    SERVER_RUNNING = 1,
+    SERVER_STOPPED = 2,
+};
+
+struct SharedRingCell {
+    std::atomic<uint64_t> word;     /* *< The sequence in the high half and the value in the low half, so that one
+                                     *   compare-and-swap publishes a cell, or skips it in RepairRing. */
+};
+
+/**
+ * @brief A bounded multi-producer multi-consumer queue of slot indices (Vyukov 2010). Producers and consumers
+ * claim a position with one compare-and-swap on their own cursor, then finish it with another on the cell, whose
+ * sequence tells whether it is ready for them. A claimed position is a lock all the same: a process that dies
+ * before finishing it stalls every pop behind its push, or every push a lap behind its pop. RepairRing moves such
+ * a cell on; a process that was only slow finds its push skipped and pushes again.
+ */
+struct SharedRing {
+    alignas(SHARED_CACHE_LINE) std::atomic<uint32_t> head;     /* *< The next position to push to. */
+    alignas(SHARED_CACHE_LINE) std::atomic<uint32_t> tail;     /* *< The next position to pop from. */
+    alignas(SHARED_CACHE_LINE) SharedRingCell cells[MAX_SHARED_SLOTS];
+};
+
+/// @brief The request and the result of the batch in a slot; the rays and hits are in the data of the slot.
+struct alignas(SHARED_CACHE_LINE) SharedSlot {
+    std::atomic<uint32_t> state;
+    std::atomic<int32_t> owner;     /* *< The process id of the client that took it, 0 while it is free. The server
+                                     *   frees the slots of clients that are gone. */
+    uint32_t rayCount;
+    uint32_t rayFlags;
+    uint32_t hitFormat;
+    int32_t result;
+};
+
+/// @brief The start of the segment. The slot data follows at GetSlotData, slotBytes apart.
+struct SharedHeader {
+    std::atomic<uint32_t> magic;
+    uint32_t version;
+    uint32_t slotCount;         /* *< A power of two, at most MAX_SHARED_SLOTS. */
+    uint32_t slotRayCount;      /* *< A multiple of 32, so that bit-packed hits of a batch are whole words. */
+    uint64_t slotBytes;
+    uint64_t segmentBytes;
+    int32_t serverPid;
+    std::atomic<uint32_t> serverState;
+    SharedRing freeSlots;       /* *< Taken by clients to fill, returned by them once the hits are read. */
+    SharedRing submittedSlots;  /* *< Pushed by clients, popped by the server. */
+    SharedSlot slots[MAX_SHARED_SLOTS];
+};
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "atomics shared between processes have to be lock-free");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "atomics shared between processes have to be lock-free");
+static_assert(std::is_standard_layout<SharedHeader>::value, "the segment is mapped by other builds as well");
+
+/// The bytes of the data of a slot of slotRayCount rays: the rays, then room for hits of the widest format.
+uint64_t GetSlotBytes(uint32_t slotRayCount);
+
+inline uint8_t *GetSlotData(SharedHeader &header, uint32_t slot)
+{
+    size_t dataOffset = (sizeof(SharedHeader) + SHARED_CACHE_LINE - 1) / SHARED_CACHE_LINE * SHARED_CACHE_LINE;
+    return reinterpret_cast<uint8_t *>(&header) + dataOffset + slot * header.slotBytes;
+}
+
+/// Push a value; false when the ring is full. A ring of slot indices has room for all of them, but is full
+/// as well while a stalled pop holds the cell of the next push.
+bool PushRing(SharedRing &ring, uint32_t mask, uint32_t value);
+
+/// Pop the oldest value, passing over the cells RepairRing skipped; false when the ring is empty.
+bool PopRing(SharedRing &ring, uint32_t mask, uint32_t &value);
+
+/// @brief What RepairRing saw of a ring on its previous call.
+struct RingWatch {
+    bool claimed = false;       /* *< Whether a position blocking the ring was claimed and not finished. */
+    uint32_t position = 0;
+    uint64_t word = 0;          /* *< The cell of that position. */
+};
+
+/**
+ * Finish a position that holds up the ring: a push claimed at the tail but never published, or a pop claimed a
+ * lap before the head that never freed its cell. Only one that stays unfinished from one call to the next is
+ * finished, so the calls should be far enough apart that a live process would have finished it meanwhile. The
+ * value of a skipped push is lost, that of a skipped pop stays with the process that popped it.
+ * @return Whether a position was finished.
+ */
+bool RepairRing(SharedRing &ring, uint32_t mask, RingWatch &watch);
+
+/// Whether a value waits in the ring; exact while nothing else pops from it, as from the submitted slots for the
+/// server.
+bool IsQueued(const SharedRing &ring, uint32_t mask, uint32_t value);
+
+/// Whether a process of this id still runs, e.g. the server a client waits for.
+bool IsProcessAlive(int32_t pid);
+
+/// @brief Waits for another process: spins first, then yields, then sleeps, so that short waits stay fast and
+/// long ones leave the core to others.
+class Backoff {
+public:
+    void Wait();
+
+    /// @brief Whether the waits have become long, when it is time to check that the other side is still there.
+    bool IsSleeping() const;
+
+    void Reset()
+    {
+        m_rounds = 0;
+    }
+
+private:
+    uint32_t m_rounds = 0;
+};
+
+/**
+ * @brief A mapping of a shared-memory segment, unmapped on destruction. The server creates the segment and
+ * unlinks its name when it closes; clients open it while the name exists.
+ */
+class SharedSegment {
+public:
+    SharedSegment() = default;
+    ~SharedSegment() noexcept;
+
+    /**
+     * Create and set up a segment for the server of this process. A segment of the same name left behind by a
+     * server that is gone is replaced.
+     * @return INVALID_PARAMETER when the name is taken by a running server or is not valid, OUT_OF_MEMORY when the
+     *         segment cannot be sized or mapped, NOT_READY where there is no POSIX shared memory.
+     */
+    Result Create(const char *name, const RayServerOptions &options);
+
+    /**
+     * Map the segment of a running server.
+     * @return NOT_READY when there is no such segment or its server is gone, INVALID_PARAMETER when it is of
+     *         another version.
+     */
+    Result Open(const char *name);
+
+    /// Unmap the segment, and unlink its name when this process created it.
+    void Close() noexcept;
+
+    SharedHeader *GetHeader() const
+    {
+        return m_header;
+    }
+
+    SharedSegment(const SharedSegment &) = delete;
+    SharedSegment &operator=(const SharedSegment &) = delete;
+
+private:
+    SharedHeader *m_header = nullptr;
+    size_t m_bytes = 0;
+    char m_name[RAY_SERVER_MAX_NAME_LENGTH + 1] = {};   /* *< Set while this process owns the name. */
+};
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_SHAREDSEGMENT_H
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Instruction set detection of the RayShop cpu backend.
+ */
+
+#include "Simd.h"
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t BINARY_WIDTH = 2;
+constexpr uint32_t SSE_WIDTH = 4;
+constexpr uint32_t AVX2_WIDTH = 8;
+constexpr uint32_t NEON_WIDTH = 4;
+
+SimdIsa DetectSimdIsa()
+{
+#if defined(RAYSHOP_CPU_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdIsa::AVX2;
+    }
+#if defined(__SSE2__)
+    return SimdIsa::SSE;
+#else
+    return SimdIsa::SCALAR;
+#endif
+#elif defined(RAYSHOP_CPU_NEON)
+    return SimdIsa::NEON;
+#else
+    return SimdIsa::SCALAR;
+#endif
+}
+} // namespace
+
+SimdIsa GetSimdIsa()
+{
+    static const SimdIsa isa = DetectSimdIsa();
+    return isa;
+}
+
+uint32_t GetBvhWidth(SimdIsa isa)
+{
+    switch (isa) {
+        case SimdIsa::SSE:
+            return SSE_WIDTH;
+        case SimdIsa::AVX2:
+            return AVX2_WIDTH;
+        case SimdIsa::NEON:
+            return NEON_WIDTH;
+        default:
+            return BINARY_WIDTH;
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
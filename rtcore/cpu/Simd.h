@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Instruction set detection of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_SIMD_H
+#define RAYSHOP_CPU_SIMD_H
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RAYSHOP_CPU_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RAYSHOP_CPU_NEON 1
+#endif
+
+namespace RayShop {
+namespace Cpu {
+/// @brief The vector instruction sets the traversal kernels are written for.
+enum class SimdIsa {
+    SCALAR,                         /* *< Binary bvh, no vector instructions. */
+    SSE,                            /* *< 4-wide bvh, x86 SSE. */
+    AVX2,                           /* *< 8-wide bvh, x86 AVX2, checked at runtime. */
+    NEON,                           /* *< 4-wide bvh, arm NEON. */
+};
+
+/// @brief The best instruction set of the running cpu, detected once.
+SimdIsa GetSimdIsa();
+
+/// @brief The bvh branching factor the kernels of an instruction set traverse: 2, 4 or 8.
+uint32_t GetBvhWidth(SimdIsa isa);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_SIMD_H
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Spatial split bvh (SBVH) builder of the RayShop cpu backend.
+ */
+
+#include "BVHBuilder.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t OBJECT_BIN_COUNT = 32;
+constexpr uint32_t SPATIAL_BIN_COUNT = 32;
+constexpr float MIN_SPLIT_OVERLAP = 1.0e-5f;   /* *< Child overlap, relative to the root area, that makes spatial
+                                                      splits worth trying. */
+
+/// @brief A triangle, or the part of it inside the bounds.
+struct Reference {
+    Aabb bounds;
+    uint32_t prim;
+};
+
+struct SplitTask {
+    uint32_t nodeIndex;
+    uint32_t depth;
+    std::vector<Reference> refs;
+};
+
+struct ObjectSplit {
+    int axis = -1;
+    uint32_t bin = 0;
+    float cost = FLOAT_MAX;
+    Aabb left;
+    Aabb right;
+};
+
+struct SpatialSplit {
+    int axis = -1;
+    float position = 0.0f;
+    float cost = FLOAT_MAX;
+};
+
+struct ObjectBin {
+    Aabb bounds;
+    uint32_t count;
+};
+
+struct SpatialBin {
+    Aabb bounds;
+    uint32_t enter;
+    uint32_t exit;
+};
+
+Aabb Intersection(const Aabb &a, const Aabb &b)
+{
+    Aabb box;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        box.lower[axis] = std::max(a.lower[axis], b.lower[axis]);
+        box.upper[axis] = std::min(a.upper[axis], b.upper[axis]);
+    }
+    return box;
+}
+
+Aabb Union(const Aabb &a, const Aabb &b)
+{
+    Aabb box = a;
+    Grow(box, b);
+    return box;
+}
+
+float Centroid(const Reference &ref, int axis)
+{
+    return Center(ref.bounds, axis);
+}
+
+class SpatialSplitBuilder {
+public:
+    SpatialSplitBuilder(const std::vector<Aabb> &primBounds, const IndexedTriangles &triangles,
+                        const BuildSettings &settings, float splitBudget, Bvh &bvh)
+        : m_primBounds(primBounds), m_triangles(triangles), m_settings(settings), m_splitBudget(splitBudget),
+          m_bvh(bvh)
+    {}
+
+    void Build()
+    {
+        uint32_t primCount = static_cast<uint32_t>(m_primBounds.size());
+        m_bvh.nodes.clear();
+        m_bvh.primIndices.clear();
+        m_bvh.nodes.push_back(BvhNode {});
+        if (primCount == 0) {
+            SetNodeBounds(m_bvh.nodes[0], EmptyAabb());
+            return;
+        }
+        m_refCount = primCount;
+        m_refLimit = primCount + static_cast<size_t>(m_splitBudget * static_cast<float>(primCount));
+        m_bvh.primIndices.reserve(m_refLimit);
+
+        std::vector<SplitTask> stack;
+        stack.push_back(SplitTask {0, 0, std::vector<Reference>(primCount)});
+        Aabb rootBounds = EmptyAabb();
+        for (uint32_t i = 0; i < primCount; i++) {
+            stack[0].refs[i] = Reference {m_primBounds[i], i};
+            Grow(rootBounds, m_primBounds[i]);
+        }
+        m_rootArea = HalfArea(rootBounds);
+        while (!stack.empty()) {
+            SplitTask task = std::move(stack.back());
+            stack.pop_back();
+            BuildNode(task, stack);
+        }
+    }
+
+private:
+    const float *Vertex(uint32_t prim, uint32_t corner) const
+    {
+        return m_triangles.positions + static_cast<size_t>(m_triangles.indices[prim * 3 + corner]) * AXIS_COUNT;
+    }
+
+    void BuildNode(SplitTask &task, std::vector<SplitTask> &stack)
+    {
+        std::vector<Reference> &refs = task.refs;
+        Aabb bounds = EmptyAabb();
+        Aabb centroidBounds = EmptyAabb();
+        for (const Reference &ref : refs) {
+            Grow(bounds, ref.bounds);
+            float centroid[AXIS_COUNT] = {Centroid(ref, 0), Centroid(ref, 1), Centroid(ref, 2)};
+            Grow(centroidBounds, centroid);
+        }
+        SetNodeBounds(m_bvh.nodes[task.nodeIndex], bounds);
+
+        uint32_t count = static_cast<uint32_t>(refs.size());
+        if (count <= 1 || task.depth + 1 >= BVH_MAX_DEPTH) {
+            MakeLeaf(task);
+            return;
+        }
+        float invArea = HalfArea(bounds) > 0.0f ? 1.0f / HalfArea(bounds) : 0.0f;
+        ObjectSplit object = FindObjectSplit(refs, centroidBounds, invArea);
+        SpatialSplit spatial;
+        if (object.axis >= 0 && m_refCount < m_refLimit) {
+            Aabb overlap = Intersection(object.left, object.right);
+            if (!IsEmpty(overlap) && HalfArea(overlap) > MIN_SPLIT_OVERLAP * m_rootArea) {
+                spatial = FindSpatialSplit(refs, bounds, invArea);
+            }
+        }
+        float leafCost = m_settings.intersectionCost * static_cast<float>(count);
+        if (count <= m_settings.maxLeafSize && leafCost <= std::min(object.cost, spatial.cost)) {
+            MakeLeaf(task);
+            return;
+        }
+
+        std::vector<Reference> left;
+        std::vector<Reference> right;
+        if (spatial.axis >= 0 && spatial.cost < object.cost) {
+            PerformSpatialSplit(refs, spatial, left, right);
+        } else if (object.axis >= 0) {
+            PerformObjectSplit(refs, centroidBounds, object, left, right);
+        }
+        if (left.empty() || right.empty()) {
+            if (count <= m_settings.maxLeafSize) {
+                MakeLeaf(task);
+                return;
+            }
+            SplitAtMedian(refs, centroidBounds, left, right);
+        }
+        std::vector<Reference>().swap(refs);
+
+        uint32_t leftIndex = static_cast<uint32_t>(m_bvh.nodes.size());
+        m_bvh.nodes.resize(leftIndex + 2);
+        m_bvh.nodes[task.nodeIndex].leftFirst = leftIndex;
+        m_bvh.nodes[task.nodeIndex].primCount = 0;
+        stack.push_back(SplitTask {leftIndex + 1, task.depth + 1, std::move(right)});
+        stack.push_back(SplitTask {leftIndex, task.depth + 1, std::move(left)});
+    }
+
+    void MakeLeaf(const SplitTask &task)
+    {
+        BvhNode &node = m_bvh.nodes[task.nodeIndex];
+        node.leftFirst = static_cast<uint32_t>(m_bvh.primIndices.size());
+        node.primCount = static_cast<uint32_t>(task.refs.size());
+        for (const Reference &ref : task.refs) {
+            m_bvh.primIndices.push_back(ref.prim);
+        }
+    }
+
+    float SplitCost(const Aabb &left, uint32_t leftCount, const Aabb &right, uint32_t rightCount,
+                    float invArea) const
+    {
+        return m_settings.traversalCost + m_settings.intersectionCost * invArea *
+            (HalfArea(left) * static_cast<float>(leftCount) + HalfArea(right) * static_cast<float>(rightCount));
+    }
+
+    static uint32_t ObjectBinOf(const Reference &ref, const Aabb &centroidBounds, int axis)
+    {
+        float extent = centroidBounds.upper[axis] - centroidBounds.lower[axis];
+        float position = (Centroid(ref, axis) - centroidBounds.lower[axis]) * static_cast<float>(OBJECT_BIN_COUNT) /
+            extent;
+        return std::min(OBJECT_BIN_COUNT - 1, static_cast<uint32_t>(std::max(0.0f, position)));
+    }
+
+    ObjectSplit FindObjectSplit(const std::vector<Reference> &refs, const Aabb &centroidBounds, float invArea) const
+    {
+        ObjectSplit best;
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            if (!(centroidBounds.upper[axis] > centroidBounds.lower[axis])) {
+                continue;
+            }
+            ObjectBin bins[OBJECT_BIN_COUNT];
+            for (ObjectBin &bin : bins) {
+                bin = ObjectBin {EmptyAabb(), 0};
+            }
+            for (const Reference &ref : refs) {
+                ObjectBin &bin = bins[ObjectBinOf(ref, centroidBounds, axis)];
+                Grow(bin.bounds, ref.bounds);
+                bin.count++;
+            }
+            Aabb rightBounds[OBJECT_BIN_COUNT];
+            uint32_t rightCounts[OBJECT_BIN_COUNT];
+            Aabb accumulated = EmptyAabb();
+            uint32_t accumulatedCount = 0;
+            for (uint32_t i = OBJECT_BIN_COUNT - 1; i > 0; i--) {
+                Grow(accumulated, bins[i].bounds);
+                accumulatedCount += bins[i].count;
+                rightBounds[i] = accumulated;
+                rightCounts[i] = accumulatedCount;
+            }
+            Aabb leftBounds = EmptyAabb();
+            uint32_t leftCount = 0;
+            for (uint32_t i = 0; i + 1 < OBJECT_BIN_COUNT; i++) {
+                Grow(leftBounds, bins[i].bounds);
+                leftCount += bins[i].count;
+                if (leftCount == 0 || rightCounts[i + 1] == 0) {
+                    continue;
+                }
+                float cost = SplitCost(leftBounds, leftCount, rightBounds[i + 1], rightCounts[i + 1], invArea);
+                if (cost < best.cost) {
+                    best.axis = axis;
+                    best.bin = i;
+                    best.cost = cost;
+                    best.left = leftBounds;
+                    best.right = rightBounds[i + 1];
+                }
+            }
+        }
+        return best;
+    }
+
+    /// Clip the triangle of a reference at an axis aligned plane, keeping both halves inside the reference.
+    void SplitReference(const Reference &ref, int axis, float position, Aabb &left, Aabb &right) const
+    {
+        left = EmptyAabb();
+        right = EmptyAabb();
+        for (uint32_t corner = 0; corner < 3; corner++) {
+            const float *from = Vertex(ref.prim, corner);
+            const float *to = Vertex(ref.prim, (corner + 1) % 3);
+            if (from[axis] <= position) {
+                Grow(left, from);
+            }
+            if (from[axis] >= position) {
+                Grow(right, from);
+            }
+            if ((from[axis] < position && to[axis] > position) || (from[axis] > position && to[axis] < position)) {
+                float t = (position - from[axis]) / (to[axis] - from[axis]);
+                float crossing[AXIS_COUNT];
+                for (int i = 0; i < AXIS_COUNT; i++) {
+                    crossing[i] = from[i] + (to[i] - from[i]) * t;
+                }
+                crossing[axis] = position;
+                Grow(left, crossing);
+                Grow(right, crossing);
+            }
+        }
+        left = Intersection(left, ref.bounds);
+        right = Intersection(right, ref.bounds);
+    }
+
+    SpatialSplit FindSpatialSplit(const std::vector<Reference> &refs, const Aabb &bounds, float invArea) const
+    {
+        SpatialSplit best;
+        uint32_t count = static_cast<uint32_t>(refs.size());
+        size_t remaining = m_refLimit - m_refCount;
+        for (int axis = 0; axis < AXIS_COUNT; axis++) {
+            float origin = bounds.lower[axis];
+            float binWidth = (bounds.upper[axis] - origin) / static_cast<float>(SPATIAL_BIN_COUNT);
+            if (!(binWidth > 0.0f)) {
+                continue;
+            }
+            auto binOf = [origin, binWidth](float position) {
+                float bin = (position - origin) / binWidth;
+                return std::min(SPATIAL_BIN_COUNT - 1, static_cast<uint32_t>(std::max(0.0f, bin)));
+            };
+            SpatialBin bins[SPATIAL_BIN_COUNT];
+            for (SpatialBin &bin : bins) {
+                bin = SpatialBin {EmptyAabb(), 0, 0};
+            }
+            for (const Reference &ref : refs) {
+                uint32_t first = binOf(ref.bounds.lower[axis]);
+                uint32_t last = std::max(first, binOf(ref.bounds.upper[axis]));
+                Reference rest = ref;
+                for (uint32_t bin = first; bin < last; bin++) {
+                    Aabb leftPart;
+                    Aabb rightPart;
+                    SplitReference(rest, axis, origin + binWidth * static_cast<float>(bin + 1), leftPart, rightPart);
+                    Grow(bins[bin].bounds, leftPart);
+                    rest.bounds = rightPart;
+                }
+                Grow(bins[last].bounds, rest.bounds);
+                bins[first].enter++;
+                bins[last].exit++;
+            }
+
+            Aabb rightBounds[SPATIAL_BIN_COUNT];
+            uint32_t rightCounts[SPATIAL_BIN_COUNT];
+            Aabb accumulated = EmptyAabb();
+            uint32_t accumulatedCount = 0;
+            for (uint32_t i = SPATIAL_BIN_COUNT - 1; i > 0; i--) {
+                Grow(accumulated, bins[i].bounds);
+                accumulatedCount += bins[i].exit;
+                rightBounds[i] = accumulated;
+                rightCounts[i] = accumulatedCount;
+            }
+            Aabb leftBounds = EmptyAabb();
+            uint32_t leftCount = 0;
+            for (uint32_t i = 0; i + 1 < SPATIAL_BIN_COUNT; i++) {
+                Grow(leftBounds, bins[i].bounds);
+                leftCount += bins[i].enter;
+                uint32_t rightCount = rightCounts[i + 1];
+                if (leftCount == 0 || rightCount == 0 || leftCount + rightCount - count > remaining) {
+                    continue;
+                }
+                float cost = SplitCost(leftBounds, leftCount, rightBounds[i + 1], rightCount, invArea);
+                if (cost < best.cost) {
+                    best.axis = axis;
+                    best.position = origin + binWidth * static_cast<float>(i + 1);
+                    best.cost = cost;
+                }
+            }
+        }
+        return best;
+    }
+
+    void PerformSpatialSplit(const std::vector<Reference> &refs, const SpatialSplit &split,
+                             std::vector<Reference> &left, std::vector<Reference> &right)
+    {
+        int axis = split.axis;
+        Aabb leftBounds = EmptyAabb();
+        Aabb rightBounds = EmptyAabb();
+        std::vector<const Reference *> straddling;
+        for (const Reference &ref : refs) {
+            if (ref.bounds.upper[axis] <= split.position) {
+                left.push_back(ref);
+                Grow(leftBounds, ref.bounds);
+            } else if (ref.bounds.lower[axis] >= split.position) {
+                right.push_back(ref);
+                Grow(rightBounds, ref.bounds);
+            } else {
+                straddling.push_back(&ref);
+            }
+        }
+
+        // Duplicate a straddling reference only when that beats moving it whole to one side.
+        for (const Reference *ref : straddling) {
+            Aabb leftPart;
+            Aabb rightPart;
+            SplitReference(*ref, axis, split.position, leftPart, rightPart);
+            float leftCount = static_cast<float>(left.size());
+            float rightCount = static_cast<float>(right.size());
+            float duplicateCost = HalfArea(Union(leftBounds, leftPart)) * (leftCount + 1.0f) +
+                HalfArea(Union(rightBounds, rightPart)) * (rightCount + 1.0f);
+            float leftCost = HalfArea(Union(leftBounds, ref->bounds)) * (leftCount + 1.0f) +
+                HalfArea(rightBounds) * rightCount;
+            float rightCost = HalfArea(leftBounds) * leftCount +
+                HalfArea(Union(rightBounds, ref->bounds)) * (rightCount + 1.0f);
+            if (IsEmpty(rightPart) || (leftCost <= duplicateCost && leftCost <= rightCost)) {
+                left.push_back(*ref);
+                Grow(leftBounds, ref->bounds);
+            } else if (IsEmpty(leftPart) || rightCost <= duplicateCost) {
+                right.push_back(*ref);
+                Grow(rightBounds, ref->bounds);
+            } else {
+                left.push_back(Reference {leftPart, ref->prim});
+                right.push_back(Reference {rightPart, ref->prim});
+                Grow(leftBounds, leftPart);
+                Grow(rightBounds, rightPart);
+                m_refCount++;
+            }
+        }
+    }
+
+    static void PerformObjectSplit(const std::vector<Reference> &refs, const Aabb &centroidBounds,
+                                   const ObjectSplit &split, std::vector<Reference> &left,
+                                   std::vector<Reference> &right)
+    {
+        for (const Reference &ref : refs) {
+            if (ObjectBinOf(ref, centroidBounds, split.axis) <= split.bin) {
+                left.push_back(ref);
+            } else {
+                right.push_back(ref);
+            }
+        }
+    }
+
+    static void SplitAtMedian(std::vector<Reference> &refs, const Aabb &centroidBounds,
+                              std::vector<Reference> &left, std::vector<Reference> &right)
+    {
+        int axis = 0;
+        for (int i = 1; i < AXIS_COUNT; i++) {
+            if (centroidBounds.upper[i] - centroidBounds.lower[i] >
+                centroidBounds.upper[axis] - centroidBounds.lower[axis]) {
+                axis = i;
+            }
+        }
+        auto middle = refs.begin() + refs.size() / 2;
+        std::nth_element(refs.begin(), middle, refs.end(),
+            [axis](const Reference &a, const Reference &b) { return Centroid(a, axis) < Centroid(b, axis); });
+        left.assign(refs.begin(), middle);
+        right.assign(middle, refs.end());
+    }
+
+    const std::vector<Aabb> &m_primBounds;
+    const IndexedTriangles &m_triangles;
+    const BuildSettings &m_settings;
+    float m_splitBudget;
+    Bvh &m_bvh;
+    size_t m_refCount = 0;
+    size_t m_refLimit = 0;
+    float m_rootArea = 0.0f;
+};
+} // namespace
+
+void BuildSpatialSplitSah(const std::vector<Aabb> &primBounds, const IndexedTriangles &triangles,
+                          const BuildSettings &settings, float splitBudget, Bvh &bvh)
+{
+    SpatialSplitBuilder builder(primBounds, triangles, settings, splitBudget, bvh);
+    builder.Build();
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: 4-lane SSE operations of the RayShop cpu backend, shared by the SSE and AVX2 kernels.
+ */
+
+#ifndef RAYSHOP_CPU_SSEOPS_H
+#define RAYSHOP_CPU_SSEOPS_H
+
+#include <emmintrin.h>
+
+#include "Simd.h"
+
+// Included inside the target region of a kernel, like PacketTraversal.h, so the AVX2 kernel gets the VEX
+// forms of these instructions for its four triangle wide blocks.
+namespace RayShop {
+namespace Cpu {
+namespace {
+struct SseOps {
+    static constexpr uint32_t WIDTH = 4;
+    using Float = __m128;
+
+    static Float Load(const float *src)
+    {
+        return _mm_loadu_ps(src);
+    }
+
+    static void Store(float *dst, Float a)
+    {
+        _mm_storeu_ps(dst, a);
+    }
+
+    static Float Set(float a)
+    {
+        return _mm_set1_ps(a);
+    }
+
+    static Float Add(Float a, Float b)
+    {
+        return _mm_add_ps(a, b);
+    }
+
+    static Float Sub(Float a, Float b)
+    {
+        return _mm_sub_ps(a, b);
+    }
+
+    static Float Mul(Float a, Float b)
+    {
+        return _mm_mul_ps(a, b);
+    }
+
+    static Float Div(Float a, Float b)
+    {
+        return _mm_div_ps(a, b);
+    }
+
+    static Float Min(Float a, Float b)
+    {
+        return _mm_min_ps(a, b);
+    }
+
+    static Float Max(Float a, Float b)
+    {
+        return _mm_max_ps(a, b);
+    }
+
+    static Float LessEqual(Float a, Float b)
+    {
+        return _mm_cmple_ps(a, b);
+    }
+
+    static Float And(Float a, Float b)
+    {
+        return _mm_and_ps(a, b);
+    }
+
+    static Float Or(Float a, Float b)
+    {
+        return _mm_or_ps(a, b);
+    }
+
+    static uint32_t MoveMask(Float a)
+    {
+        return static_cast<uint32_t>(_mm_movemask_ps(a));
+    }
+};
+} // namespace
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_SSEOPS_H
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Worker thread pool of the RayShop cpu backend.
+ */
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+struct ParallelForState {
+    std::atomic<uint32_t> next {0};
+    std::atomic<uint32_t> finished {0};
+    uint32_t chunkCount = 0;
+};
+
+void RunChunks(ParallelForState &state, uint32_t begin, uint32_t end, uint32_t grainSize,
+               const ThreadPool::RangeFunc &func)
+{
+    for (;;) {
+        uint32_t chunk = state.next.fetch_add(1);
+        if (chunk >= state.chunkCount) {
+            return;
+        }
+        uint32_t chunkBegin = begin + chunk * grainSize;
+        uint32_t chunkEnd = std::min(end, chunkBegin + grainSize);
+        func(chunkBegin, chunkEnd);
+        state.finished.fetch_add(1, std::memory_order_release);
+    }
+}
+} // namespace
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+{
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (uint32_t i = 1; i < threadCount; i++) {
+        m_workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+    for (auto &worker : m_workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_condition.notify_one();
+}
+
+bool ThreadPool::RunPendingTask()
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_tasks.empty()) {
+            return false;
+        }
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::WorkerLoop()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+            if (m_stopping && m_tasks.empty()) {
+                return;
+            }
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::Run(TaskGroup &group, std::function<void()> task)
+{
+    group.m_pending.fetch_add(1);
+    TaskGroup *owner = &group;
+    Submit([owner, task]() {
+        task();
+        owner->m_pending.fetch_sub(1, std::memory_order_release);
+    });
+}
+
+void ThreadPool::Wait(TaskGroup &group)
+{
+    while (group.m_pending.load(std::memory_order_acquire) != 0) {
+        if (!RunPendingTask()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ThreadPool::ParallelFor(uint32_t begin, uint32_t end, uint32_t grainSize, const RangeFunc &func)
+{
+    if (begin >= end) {
+        return;
+    }
+    grainSize = std::max(1u, grainSize);
+    uint32_t chunkCount = (end - begin + grainSize - 1) / grainSize;
+    if (m_workers.empty()) {
+        // Keep the chunk boundaries so callers may index per-chunk results by (first - begin) / grainSize.
+        for (uint32_t first = begin; first < end; first = std::min(end, first + grainSize)) {
+            func(first, std::min(end, first + grainSize));
+        }
+        return;
+    }
+    if (chunkCount == 1) {
+        func(begin, end);
+        return;
+    }
+
+    // Helpers that start after all chunks are claimed return without touching func, so the shared
+    // state is the only thing that has to outlive this call.
+    auto state = std::make_shared<ParallelForState>();
+    state->chunkCount = chunkCount;
+    uint32_t helperCount = std::min(static_cast<uint32_t>(m_workers.size()), chunkCount - 1);
+    try {
+        for (uint32_t i = 0; i < helperCount; i++) {
+            Submit([state, begin, end, grainSize, &func]() { RunChunks(*state, begin, end, grainSize, func); });
+        }
+    } catch (const std::bad_alloc &) {
+        // Fewer helpers only mean less parallelism, the calling thread runs whatever they leave.
+    }
+    RunChunks(*state, begin, end, grainSize, func);
+    // Every chunk is claimed by now, and the ones left run on threads busy with them. Waiting for those alone,
+    // rather than running other queued tasks, keeps this call from being held up by work of other callers.
+    while (state->finished.load(std::memory_order_acquire) < chunkCount) {
+        std::this_thread::yield();
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Worker thread pool of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_THREADPOOL_H
+#define RAYSHOP_CPU_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace RayShop {
+namespace Cpu {
+/// @brief A set of tasks that can be waited for together.
+class TaskGroup {
+public:
+    TaskGroup() = default;
+    ~TaskGroup() = default;
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+private:
+    friend class ThreadPool;
+    std::atomic<uint32_t> m_pending {0};
+};
+
+/// @brief A fixed set of worker threads sharing one task queue. The calling thread always takes part
+/// in the work it submits, so a pool with zero workers still makes progress.
+class ThreadPool {
+public:
+    using RangeFunc = std::function<void(uint32_t begin, uint32_t end)>;
+
+    /**
+     * @param[in]   threadCount     The total number of threads including the caller, 0 for all cores.
+     */
+    explicit ThreadPool(uint32_t threadCount = 0);
+    ~ThreadPool() noexcept;
+
+    uint32_t GetThreadCount() const
+    {
+        return static_cast<uint32_t>(m_workers.size()) + 1;
+    }
+
+    /**
+     * Split [begin, end) into chunks of grainSize and run func on them from all threads. Every call of func
+     * covers exactly one chunk. Returns when every chunk has finished, and func is not called afterwards even
+     * when helpers could not be queued. The calling thread helps with these chunks only. The tasks must not throw.
+     */
+    void ParallelFor(uint32_t begin, uint32_t end, uint32_t grainSize, const RangeFunc &func);
+
+    /**
+     * Queue a task of a group. Tasks may spawn further tasks into the same group. The task must not throw.
+     */
+    void Run(TaskGroup &group, std::function<void()> task);
+
+    /**
+     * Return when all tasks of the group have finished, running queued tasks meanwhile.
+     */
+    void Wait(TaskGroup &group);
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+private:
+    void Submit(std::function<void()> task);
+    bool RunPendingTask();
+    void WorkerLoop();
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopping = false;
+};
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_THREADPOOL_H
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Top level acceleration structure of the RayShop cpu backend.
+ */
+
+#include "TopLevel.h"
+#include "BVHBuilder.h"
+
+#include <cmath>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr float MIN_DETERMINANT = 1e-20f;
+constexpr int CORNER_COUNT = 8;
+constexpr float SIMILARITY_TOLERANCE = 1e-5f;   /* *< Relative, well above the rounding of a float rotation. */
+
+bool InvertAffine(const float (&matrix)[AFFINE_ROWS][AFFINE_COLUMNS], float (&inverse)[AFFINE_ROWS][AFFINE_COLUMNS])
+{
+    const float (&m)[AFFINE_ROWS][AFFINE_COLUMNS] = matrix;
+    float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if (std::fabs(det) < MIN_DETERMINANT) {
+        return false;
+    }
+    float invDet = 1.0f / det;
+    inverse[0][0] = c00 * invDet;
+    inverse[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+    inverse[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+    inverse[1][0] = c01 * invDet;
+    inverse[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+    inverse[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+    inverse[2][0] = c02 * invDet;
+    inverse[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+    inverse[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+    for (int row = 0; row < AFFINE_ROWS; row++) {
+        inverse[row][3] = -(inverse[row][0] * m[0][3] + inverse[row][1] * m[1][3] + inverse[row][2] * m[2][3]);
+    }
+    return true;
+}
+
+/// The common length of the columns of the linear part when they are orthogonal to each other, 0 otherwise.
+float SimilarityScale(const float (&matrix)[AFFINE_ROWS][AFFINE_COLUMNS])
+{
+    float dots[AXIS_COUNT][AXIS_COUNT];
+    for (int i = 0; i < AXIS_COUNT; i++) {
+        for (int j = 0; j < AXIS_COUNT; j++) {
+            dots[i][j] = matrix[0][i] * matrix[0][j] + matrix[1][i] * matrix[1][j] + matrix[2][i] * matrix[2][j];
+        }
+    }
+    float scaleSquared = (dots[0][0] + dots[1][1] + dots[2][2]) / AXIS_COUNT;
+    for (int i = 0; i < AXIS_COUNT; i++) {
+        for (int j = 0; j < AXIS_COUNT; j++) {
+            float expected = i == j ? scaleSquared : 0.0f;
+            if (std::fabs(dots[i][j] - expected) > SIMILARITY_TOLERANCE * scaleSquared) {
+                return 0.0f;
+            }
+        }
+    }
+    return std::sqrt(scaleSquared);
+}
+
+BuildSettings TopLevelSettings()
+{
+    BuildSettings settings;
+    settings.maxLeafSize = 1;
+    return settings;
+}
+
+float RootHalfArea(const Bvh &bvh)
+{
+    return bvh.primIndices.empty() ? 0.0f : HalfArea(NodeBounds(bvh.nodes[0]));
+}
+
+bool IsSameAabb(const Aabb &a, const Aabb &b)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        if (a.lower[axis] != b.lower[axis] || a.upper[axis] != b.upper[axis]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Resolve an instance description; false when its blas is unknown or its transform cannot be inverted.
+bool ResolveInstance(const InstanceDescription &desc, const std::vector<std::shared_ptr<BottomLevel>> &blases,
+                     Instance &instance)
+{
+    if (desc.blas >= blases.size() || !blases[desc.blas]) {
+        return false;
+    }
+    // The transform is laid out like glm::mat4, i.e. transform[column][row].
+    for (int row = 0; row < AFFINE_ROWS; row++) {
+        for (int column = 0; column < AFFINE_COLUMNS; column++) {
+            instance.objectToWorld[row][column] = desc.transform[column][row];
+        }
+    }
+    if (!InvertAffine(instance.objectToWorld, instance.worldToObject)) {
+        return false;
+    }
+    instance.similarityScale = SimilarityScale(instance.objectToWorld);
+    instance.blas = blases[desc.blas];
+    return true;
+}
+
+/// The world space bounds of the corners of the blas bounds.
+Aabb InstanceBounds(const Instance &instance)
+{
+    Aabb local = instance.blas->GetBounds();
+    Aabb world = EmptyAabb();
+    if (!IsEmpty(local)) {
+        for (int corner = 0; corner < CORNER_COUNT; corner++) {
+            float point[AXIS_COUNT] = {(corner & 1) ? local.upper[0] : local.lower[0],
+                                       (corner & 2) ? local.upper[1] : local.lower[1],
+                                       (corner & 4) ? local.upper[2] : local.lower[2]};
+            float transformed[AXIS_COUNT];
+            TransformPoint(instance.objectToWorld, point, transformed);
+            Grow(world, transformed);
+        }
+    }
+    return world;
+}
+} // namespace
+
+void TransformPoint(const float (&matrix)[AFFINE_ROWS][AFFINE_COLUMNS], const float *point, float *result)
+{
+    for (int row = 0; row < AFFINE_ROWS; row++) {
+        result[row] = matrix[row][0] * point[0] + matrix[row][1] * point[1] + matrix[row][2] * point[2] +
+            matrix[row][3];
+    }
+}
+
+void TransformVector(const float (&matrix)[AFFINE_ROWS][AFFINE_COLUMNS], const float *vector, float *result)
+{
+    for (int row = 0; row < AFFINE_ROWS; row++) {
+        result[row] = matrix[row][0] * vector[0] + matrix[row][1] * vector[1] + matrix[row][2] * vector[2];
+    }
+}
+
+Result TopLevel::Build(uint32_t instancesCount, const InstanceDescription *instances,
+                       const std::vector<std::shared_ptr<BottomLevel>> &blases)
+{
+    std::vector<Instance> resolved(instancesCount);
+    for (uint32_t i = 0; i < instancesCount; i++) {
+        if (!ResolveInstance(instances[i], blases, resolved[i])) {
+            return Result::INVALID_PARAMETER;
+        }
+    }
+    m_instances.swap(resolved);
+    ComputeInstanceBounds();
+    BuildBvh();
+    return Result::SUCCESS;
+}
+
+Result TopLevel::Update(uint32_t instancesCount, const uint32_t *instanceIds, const InstanceDescription *instances,
+                        const std::vector<std::shared_ptr<BottomLevel>> &blases)
+{
+    std::vector<Instance> resolved(instancesCount);
+    for (uint32_t i = 0; i < instancesCount; i++) {
+        if (instanceIds[i] >= m_instances.size() || !ResolveInstance(instances[i], blases, resolved[i])) {
+            return Result::INVALID_PARAMETER;
+        }
+    }
+    for (uint32_t i = 0; i < instancesCount; i++) {
+        uint32_t id = instanceIds[i];
+        m_instances[id] = std::move(resolved[i]);
+        m_instanceBounds[id] = InstanceBounds(m_instances[id]);
+        RefitPath(m_instanceLeaves[id]);
+    }
+    if (GetSahRatio() > TLAS_REBUILD_SAH_RATIO) {
+        BuildBvh();
+    }
+    return Result::SUCCESS;
+}
+
+void TopLevel::Refit()
+{
+    ComputeInstanceBounds();
+    RefitBvh(m_instanceBounds, m_bvh);
+    m_sahArea = static_cast<double>(ComputeSahCost(m_bvh, TopLevelSettings())) * RootHalfArea(m_bvh);
+    if (GetSahRatio() > TLAS_REBUILD_SAH_RATIO) {
+        BuildBvh();
+        return;
+    }
+    m_wideBvhs.Refit(m_bvh, nullptr);
+}
+
+bool TopLevel::References(const BottomLevel *blas) const
+{
+    for (const auto &instance : m_instances) {
+        if (instance.blas.get() == blas) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ASMemoryUsage TopLevel::GetMemoryUsage() const
+{
+    ASMemoryUsage usage {};
+    CountBytes(m_instances, usage.geometryBytes, usage.slackBytes);
+    CountBytes(m_instanceBounds, usage.geometryBytes, usage.slackBytes);
+    CountBytes(m_bvh.nodes, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_bvh.primIndices, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_wideBvhs.bvh4.nodes, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_wideBvhs.bvh8.nodes, usage.bvhBytes, usage.slackBytes);
+    CountBytes(m_parents, usage.refitBytes, usage.slackBytes);
+    CountBytes(m_instanceLeaves, usage.refitBytes, usage.slackBytes);
+    CountBytes(m_wideSlots, usage.refitBytes, usage.slackBytes);
+    CountBytes(m_wideBvhs.bvh4.sources, usage.refitBytes, usage.slackBytes);
+    CountBytes(m_wideBvhs.bvh8.sources, usage.refitBytes, usage.slackBytes);
+    return usage;
+}
+
+void TopLevel::ReplaceBlas(const BottomLevel *blas, const std::shared_ptr<const BottomLevel> &replacement)
+{
+    for (auto &instance : m_instances) {
+        if (instance.blas.get() == blas) {
+            instance.blas = replacement;
+        }
+    }
+}
+
+void TopLevel::ComputeInstanceBounds()
+{
+    m_instanceBounds.resize(m_instances.size());
+    for (size_t i = 0; i < m_instances.size(); i++) {
+        m_instanceBounds[i] = InstanceBounds(m_instances[i]);
+    }
+}
+
+void TopLevel::BuildBvh()
+{
+    BuildSettings settings = TopLevelSettings();
+    BuildBinnedSah(m_instanceBounds, settings, m_bvh);
+    ComputeBvhParents(m_bvh, m_parents);
+    m_instanceLeaves.assign(m_instances.size(), INVALID_INDEX);
+    for (uint32_t i = 0; i < m_bvh.nodes.size(); i++) {
+        const BvhNode &node = m_bvh.nodes[i];
+        for (uint32_t j = 0; j < node.primCount; j++) {
+            m_instanceLeaves[m_bvh.primIndices[node.leftFirst + j]] = i;
+        }
+    }
+    m_wideBvhs.Update(m_bvh);
+    m_wideBvhs.MapSlots(static_cast<uint32_t>(m_bvh.nodes.size()), m_wideSlots);
+    m_builtSahCost = ComputeSahCost(m_bvh, settings);
+    m_sahArea = static_cast<double>(m_builtSahCost) * RootHalfArea(m_bvh);
+}
+
+void TopLevel::RefitPath(uint32_t leaf)
+{
+    BuildSettings settings = TopLevelSettings();
+    for (uint32_t index = leaf; index != INVALID_INDEX; index = m_parents[index]) {
+        BvhNode &node = m_bvh.nodes[index];
+        Aabb bounds = EmptyAabb();
+        if (IsLeaf(node)) {
+            for (uint32_t j = 0; j < node.primCount; j++) {
+                Grow(bounds, m_instanceBounds[m_bvh.primIndices[node.leftFirst + j]]);
+            }
+        } else {
+            Grow(bounds, NodeBounds(m_bvh.nodes[node.leftFirst]));
+            Grow(bounds, NodeBounds(m_bvh.nodes[node.leftFirst + 1]));
+        }
+        Aabb old = NodeBounds(node);
+        if (IsSameAabb(bounds, old)) {
+            // Nothing above changes either; other moved leaves climb their own paths.
+            return;
+        }
+        m_sahArea += (static_cast<double>(HalfArea(bounds)) - HalfArea(old)) * NodeSahCost(node, settings);
+        SetNodeBounds(node, bounds);
+        m_wideBvhs.RefitSlot(m_bvh, m_wideSlots, index);
+    }
+}
+
+float TopLevel::GetSahRatio() const
+{
+    float rootArea = RootHalfArea(m_bvh);
+    if (!(rootArea > 0.0f) || !(m_builtSahCost > 0.0f)) {
+        return 1.0f;
+    }
+    return static_cast<float>(m_sahArea / rootArea) / m_builtSahCost;
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Top level acceleration structure of the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_TOPLEVEL_H
+#define RAYSHOP_CPU_TOPLEVEL_H
+
+#include <memory>
+
+#include "Traversal.h"
+#include "BottomLevel.h"
+#include "WideBvh.h"
+
+namespace RayShop {
+namespace Cpu {
+constexpr int AFFINE_ROWS = 3;
+constexpr int AFFINE_COLUMNS = 4;
+/// @brief Refits of the tlas give way to a rebuild once they double its SAH cost.
+constexpr float TLAS_REBUILD_SAH_RATIO = 2.0f;
+
+/// @brief An instance resolved against its blas. Matrices are row-major 3x4 affine transforms.
+struct Instance {
+    float objectToWorld[AFFINE_ROWS][AFFINE_COLUMNS];
+    float worldToObject[AFFINE_ROWS][AFFINE_COLUMNS];
+    float similarityScale;  /* *< The world distance of a unit object distance when objectToWorld keeps the ratio
+                             *   of all distances, i.e. is a rotation, uniform scale and translation; 0 otherwise. */
+    std::shared_ptr<const BottomLevel> blas;
+};
+
+/// @brief The instances of a scene and the bvh over their world space bounds.
+class TopLevel {
+public:
+    /**
+     * Resolve the instances and build the bvh.
+     * @param[in]   blases      The blas table of the traversal, indexed by BLAS handle.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    Result Build(uint32_t instancesCount, const InstanceDescription *instances,
+                 const std::vector<std::shared_ptr<BottomLevel>> &blases);
+
+    /**
+     * Move some instances or point them at other blases, in time proportional to their count: only the paths from
+     * their leaves to the root are refit, together with the wide slots collapsed from those nodes. Once the refits
+     * let the SAH cost pass TLAS_REBUILD_SAH_RATIO times the one of the last build, the bvh is rebuilt instead.
+     * @param[in]   instanceIds The index of each instance in the array given to Build.
+     * @param[in]   blases      The blas table of the traversal, indexed by BLAS handle.
+     * @note Throws std::bad_alloc when memory runs out. Nothing changes when a parameter is invalid.
+     */
+    Result Update(uint32_t instancesCount, const uint32_t *instanceIds, const InstanceDescription *instances,
+                  const std::vector<std::shared_ptr<BottomLevel>> &blases);
+
+    /**
+     * Recompute the instance bounds after some of the referenced blases were refit.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    void Refit();
+
+    const Bvh &GetBvh() const
+    {
+        return m_bvh;
+    }
+
+    const WideBvhSet &GetWideBvhs() const
+    {
+        return m_wideBvhs;
+    }
+
+    const Instance &GetInstance(uint32_t index) const
+    {
+        return m_instances[index];
+    }
+
+    uint32_t GetInstanceCount() const
+    {
+        return static_cast<uint32_t>(m_instances.size());
+    }
+
+    /// @brief The bytes held by the instances, the bvh layouts and the refit data; the blases are not counted.
+    ASMemoryUsage GetMemoryUsage() const;
+
+    bool References(const BottomLevel *blas) const;
+
+    /**
+     * Point the instances of a blas at another one over the same geometry, e.g. its rebuilt tree. The bounds
+     * stay the same, so the bvh needs no refit.
+     */
+    void ReplaceBlas(const BottomLevel *blas, const std::shared_ptr<const BottomLevel> &replacement);
+
+private:
+    void ComputeInstanceBounds();
+    void BuildBvh();
+    void RefitPath(uint32_t leaf);
+    float GetSahRatio() const;
+
+    std::vector<Instance> m_instances;
+    std::vector<Aabb> m_instanceBounds;     /* *< World space bounds of every instance. */
+    Bvh m_bvh;
+    std::vector<uint32_t> m_parents;        /* *< The parent of each m_bvh node. */
+    std::vector<uint32_t> m_instanceLeaves; /* *< The m_bvh leaf of each instance. */
+    WideBvhSet m_wideBvhs;                  /* *< Collapsed from m_bvh after every build, refit since. */
+    std::vector<uint32_t> m_wideSlots;      /* *< The m_wideBvhs slot of each m_bvh node. @see WideBvhSet::MapSlots */
+    double m_sahArea = 0.0;     /* *< The SAH cost times the root area, kept up to date by every refit. */
+    float m_builtSahCost = 0.0f;
+};
+
+/// @brief Apply a row-major 3x4 affine transform to a point or a direction.
+void TransformPoint(const float (&matrix)[AFFINE_ROWS][AFFINE_COLUMNS], const float *point, float *result);
+void TransformVector(const float (&matrix)[AFFINE_ROWS][AFFINE_COLUMNS], const float *vector, float *result);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_TOPLEVEL_H
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: RayShop Traversal entry points of the cpu backend.
+ */
+
+#include "Traversal.h"
+#include "TraversalClientImpl.h"
+#include "TraversalImpl.h"
+
+#include <vector>
+
+namespace RayShop {
+namespace Vulkan {
+namespace {
+GeometryTriangleDescription2 Widen(const GeometryTriangleDescription &geometry)
+{
+    GeometryTriangleDescription2 widened {};
+    widened.vertices = geometry.vertices;
+    // A stride past 4 GB cannot be valid, 0 makes sure it is rejected.
+    widened.vertexStrideBytes = geometry.stride <= UINT32_MAX / sizeof(float) ?
+        static_cast<uint32_t>(geometry.stride * sizeof(float)) : 0;
+    widened.verticesCount = geometry.verticesCount;
+    widened.indices = geometry.indices;
+    widened.indicesCount = geometry.indicesCount;
+    return widened;
+}
+
+/// @note Throws std::bad_alloc when memory runs out. Stays empty for null geometries, which the callee rejects.
+std::vector<GeometryTriangleDescription2> Widen(uint32_t geometriesCount, const GeometryTriangleDescription *geometries)
+{
+    std::vector<GeometryTriangleDescription2> widened;
+    if (geometries != nullptr) {
+        widened.reserve(geometriesCount);
+        for (uint32_t i = 0; i < geometriesCount; i++) {
+            widened.push_back(Widen(geometries[i]));
+        }
+    }
+    return widened;
+}
+} // namespace
+
+Traversal::Traversal() : m_impl(std::make_unique<TraversalImpl>())
+{}
+
+Traversal::~Traversal()
+{
+    m_impl->Destroy();
+}
+
+#ifdef __ANDROID__
+Result Traversal::Setup(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue computeQueue,
+                        uint32_t computeIndices, JNIEnv *env) const noexcept
+{
+    (void)env;
+    return Setup(physicalDevice, device, computeQueue, computeIndices);
+}
+#endif
+
+Result Traversal::Setup(VkPhysicalDevice physicalDevice, VkDevice device, VkQueue computeQueue,
+                        uint32_t computeIndices) const noexcept
+{
+    // The cpu backend runs headless, the Vulkan handles may all be VK_NULL_HANDLE.
+    (void)physicalDevice;
+    (void)device;
+    (void)computeQueue;
+    (void)computeIndices;
+    return m_impl->Setup();
+}
+
+void Traversal::Destroy() const noexcept
+{
+    m_impl->Destroy();
+}
+
+Result Traversal::CreateBLAS(ASBuildMethod method, uint32_t geometriesCount,
+                             const GeometryTriangleDescription *geometries, BLAS *blases) const noexcept
+{
+    ASBuildOptions options;
+    options.method = method;
+    return CreateBLAS(options, geometriesCount, geometries, blases);
+}
+
+Result Traversal::CreateBLAS(const ASBuildOptions &options, uint32_t geometriesCount,
+                             const GeometryTriangleDescription *geometries, BLAS *blases) const noexcept
+{
+    try {
+        return m_impl->CreateBLAS(options, geometriesCount, Widen(geometriesCount, geometries).data(), blases);
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+}
+
+Result Traversal::CreateBLAS(const ASBuildOptions &options, uint32_t geometriesCount,
+                             const GeometryTriangleDescription2 *geometries, BLAS *blases) const noexcept
+{
+    return m_impl->CreateBLAS(options, geometriesCount, geometries, blases);
+}
+
+Result Traversal::CreateBLASAsync(const ASBuildOptions &options, uint32_t geometriesCount,
+                                  const GeometryTriangleDescription *geometries, BLAS *blases,
+                                  ASBuildJob *job) const noexcept
+{
+    try {
+        return m_impl->CreateBLASAsync(options, geometriesCount, Widen(geometriesCount, geometries).data(), blases,
+                                       job);
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+}
+
+Result Traversal::CreateBLASAsync(const ASBuildOptions &options, uint32_t geometriesCount,
+                                  const GeometryTriangleDescription2 *geometries, BLAS *blases,
+                                  ASBuildJob *job) const noexcept
+{
+    return m_impl->CreateBLASAsync(options, geometriesCount, geometries, blases, job);
+}
+
+Result Traversal::GetQuantizedBLAS(BLAS blas, uint32_t *nodesCount, QuantizedBvhNode *nodes,
+                                   uint32_t *primIndicesCount, uint32_t *primIndices) const noexcept
+{
+    return m_impl->GetQuantizedBLAS(blas, nodesCount, nodes, primIndicesCount, primIndices);
+}
+
+Result Traversal::GetBLASMemoryUsage(BLAS blas, ASMemoryUsage *usage) const noexcept
+{
+    return m_impl->GetBLASMemoryUsage(blas, usage);
+}
+
+Result Traversal::GetMemoryStats(ASMemoryStats *stats) const noexcept
+{
+    return m_impl->GetMemoryStats(stats);
+}
+
+Result Traversal::CompactBLAS(uint32_t blasesCount, const BLAS *blases) const noexcept
+{
+    return m_impl->CompactBLAS(blasesCount, blases);
+}
+
+Result Traversal::GetBLASSahRatio(BLAS blas, float *ratio) const noexcept
+{
+    return m_impl->GetBLASSahRatio(blas, ratio);
+}
+
+Result Traversal::GetBLASSahCosts(BLAS blas, ASSahCosts *costs) const noexcept
+{
+    return m_impl->GetBLASSahCosts(blas, costs);
+}
+
+Result Traversal::SaveBLAS(BLAS blas, const char *path) const noexcept
+{
+    return m_impl->SaveBLAS(blas, path);
+}
+
+Result Traversal::LoadBLAS(const ASBuildOptions &options, const GeometryTriangleDescription &geometry,
+                           const char *path, BLAS *blas) const noexcept
+{
+    return m_impl->LoadBLAS(options, Widen(geometry), path, blas);
+}
+
+Result Traversal::LoadBLAS(const ASBuildOptions &options, const GeometryTriangleDescription2 &geometry,
+                           const char *path, BLAS *blas) const noexcept
+{
+    return m_impl->LoadBLAS(options, geometry, path, blas);
+}
+
+Result Traversal::CreateTLAS(uint32_t instancesCount, const InstanceDescription *instances) const noexcept
+{
+    return m_impl->CreateTLAS(instancesCount, instances);
+}
+
+Result Traversal::UpdateTLAS(uint32_t instancesCount, const uint32_t *instanceIds,
+                             const InstanceDescription *instances) const noexcept
+{
+    return m_impl->UpdateTLAS(instancesCount, instanceIds, instances);
+}
+
+Result Traversal::CreateTLASAsync(uint32_t instancesCount, const InstanceDescription *instances,
+                                  ASBuildJob *job) const noexcept
+{
+    return m_impl->CreateTLASAsync(instancesCount, instances, job);
+}
+
+Result Traversal::GetBuildStatus(ASBuildJob job) const noexcept
+{
+    return m_impl->GetBuildStatus(job);
+}
+
+Result Traversal::WaitBuild(ASBuildJob job) const noexcept
+{
+    return m_impl->WaitBuild(job);
+}
+
+Result Traversal::RefitBLAS(uint32_t geometriesCount, const GeometryTriangleDescription *geometries,
+                            const BLAS *blases, VkCommandBuffer cmdBuffer) const noexcept
+{
+    (void)cmdBuffer;
+    try {
+        return m_impl->RefitBLAS(geometriesCount, Widen(geometriesCount, geometries).data(), blases);
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+}
+
+Result Traversal::RefitBLAS(uint32_t geometriesCount, const GeometryTriangleDescription2 *geometries,
+                            const BLAS *blases, VkCommandBuffer cmdBuffer) const noexcept
+{
+    (void)cmdBuffer;
+    return m_impl->RefitBLAS(geometriesCount, geometries, blases);
+}
+
+Result Traversal::DestroyBLAS(uint32_t geometriesCount, const uint32_t *blas) const noexcept
+{
+    return m_impl->DestroyBLAS(geometriesCount, blas);
+}
+
+Result Traversal::GetTraversalDescBufferInfos(VkDescriptorBufferInfo *bvhTree, VkDescriptorBufferInfo *triangles,
+                                              VkDescriptorBufferInfo *tlasInfo,
+                                              VkDescriptorBufferInfo *uniforms) noexcept
+{
+    // Nothing lives in device memory on the cpu backend.
+    (void)bvhTree;
+    (void)triangles;
+    (void)tlasInfo;
+    (void)uniforms;
+    return Result::NOT_READY;
+}
+
+Result Traversal::CreateRayTracingShaderModule(const RayTracingShaderModuleCreateInfo *createInfo,
+                                               ShaderModule *shaderModule) const noexcept
+{
+    (void)createInfo;
+    (void)shaderModule;
+    return Result::NOT_READY;
+}
+
+Result Traversal::TraceRays(uint32_t rayCount, uint32_t rayFlags, const Buffer rays, Buffer hits,
+                            TraceRayHitFormat hitFormat, VkCommandBuffer cmdBuf) const noexcept
+{
+    (void)cmdBuf;
+    return m_impl->TraceRays(rayCount, rayFlags, rays, hits, hitFormat);
+}
+
+Result Traversal::TraceRays(const Size &region, uint32_t rayFlags, const Buffer rays, Buffer hits,
+                            TraceRayHitFormat hitFormat, VkCommandBuffer cmdBuf) const noexcept
+{
+    (void)cmdBuf;
+    return m_impl->TraceRays(region, rayFlags, rays, hits, hitFormat);
+}
+
+Result Traversal::TraceRays(const RaysMeshDescription &rayMesh, const std::vector<Buffer> &hits,
+                            VkContext vkContext) const noexcept
+{
+    // Rays generated by rasterizing a mesh need a graphics pipeline.
+    (void)rayMesh;
+    (void)hits;
+    (void)vkContext;
+    return Result::NOT_READY;
+}
+
+Result Traversal::Intersect(const Ray &ray, uint32_t rayFlags,
+                            HitDistancePrimitiveInstanceCoordinates *hit) const noexcept
+{
+    return m_impl->Intersect(1, &ray, rayFlags, hit);
+}
+
+Result Traversal::Intersect(uint32_t rayCount, const Ray *rays, uint32_t rayFlags,
+                            HitDistancePrimitiveInstanceCoordinates *hits) const noexcept
+{
+    return m_impl->Intersect(rayCount, rays, rayFlags, hits);
+}
+
+Result Traversal::ClosestPoint(uint32_t queryCount, const PointQuery *queries,
+                               ClosestPointHit *hits) const noexcept
+{
+    return m_impl->ClosestPoint(queryCount, queries, hits);
+}
+
+Result Traversal::RadiusQuery(uint32_t queryCount, const PointQuery *queries, uint32_t maxHitsPerQuery,
+                              uint32_t *hitCounts, RadiusQueryHit *hits) const noexcept
+{
+    return m_impl->RadiusQuery(queryCount, queries, maxHitsPerQuery, hitCounts, hits);
+}
+
+Result Traversal::StartServer(const char *name, const RayServerOptions &options) const noexcept
+{
+    return m_impl->StartServer(name, options);
+}
+
+Result Traversal::StopServer() const noexcept
+{
+    return m_impl->StopServer();
+}
+
+uint32_t Traversal::GetHitFormatBytes(TraceRayHitFormat hitFormat) noexcept
+{
+    switch (hitFormat) {
+        case TraceRayHitFormat::T:
+            return sizeof(HitDistance);
+        case TraceRayHitFormat::T_PRIMID:
+            return sizeof(HitDistancePrimitive);
+        case TraceRayHitFormat::T_PRIMID_U_V:
+            return sizeof(HitDistancePrimitiveCoordinates);
+        case TraceRayHitFormat::T_PRIMID_INSTID:
+            return sizeof(HitDistancePrimitiveInstance);
+        case TraceRayHitFormat::T_PRIMID_INSTID_U_V:
+            return sizeof(HitDistancePrimitiveInstanceCoordinates);
+        case TraceRayHitFormat::OCCLUDED_BITS:
+            return sizeof(uint32_t);
+        case TraceRayHitFormat::T_PRIMID_INSTID_PACKED:
+            return sizeof(HitDistancePackedPrimitiveInstance);
+        case TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED:
+            return sizeof(HitDistancePackedPrimitiveInstanceCoordinates);
+        default:
+            return 0;
+    }
+}
+
+const char *Traversal::GetErrorCodeString(Result err) noexcept
+{
+    switch (err) {
+        case Result::SUCCESS:
+            return "SUCCESS";
+        case Result::NOT_READY:
+            return "NOT_READY";
+        case Result::INVALID_PARAMETER:
+            return "INVALID_PARAMETER";
+        case Result::OUT_OF_MEMORY:
+            return "OUT_OF_MEMORY";
+        case Result::SHADER_COMPILE_ERROR:
+            return "SHADER_COMPILE_ERROR";
+        case Result::UNKNOWN_ERROR:
+            return "UNKNOWN_ERROR";
+        case Result::BUILD_IN_PROGRESS:
+            return "BUILD_IN_PROGRESS";
+        default:
+            return "UNDEFINED_ERROR";
+    }
+}
+
+TraversalClient::TraversalClient() : m_impl(std::make_unique<TraversalClientImpl>())
+{}
+
+TraversalClient::~TraversalClient()
+{
+    m_impl->Detach();
+}
+
+Result TraversalClient::Attach(const char *name) const noexcept
+{
+    return m_impl->Attach(name);
+}
+
+void TraversalClient::Detach() const noexcept
+{
+    m_impl->Detach();
+}
+
+Result TraversalClient::TraceRays(uint32_t rayCount, uint32_t rayFlags, const Buffer rays, Buffer hits,
+                                  TraceRayHitFormat hitFormat) const noexcept
+{
+    return m_impl->TraceRays(rayCount, rayFlags, rays, hits, hitFormat);
+}
+} // namespace Vulkan
+} // namespace RayShop
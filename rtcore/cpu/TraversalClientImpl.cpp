@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: RayShop traversal client, tracing through the server of another process on the cpu backend.
+ */
+
+#include "TraversalClientImpl.h"
+#include "RayTracer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <system_error>
+
+#include <unistd.h>
+
+namespace RayShop {
+namespace Vulkan {
+namespace {
+/// @brief Batches of a call in flight at once: the server traces one while the hits of the other are copied out.
+/// More would only take slots from other clients.
+constexpr uint32_t MAX_CLIENT_BATCHES = 2;
+
+/// @brief A part of the rays of a call, in a slot of the segment.
+struct ClientBatch {
+    uint32_t slot;
+    uint32_t begin;
+    uint32_t count;
+};
+
+bool IsServing(const Cpu::SharedHeader &header)
+{
+    return header.serverState.load(std::memory_order_acquire) == Cpu::SERVER_RUNNING &&
+        Cpu::IsProcessAlive(header.serverPid);
+}
+
+/// Take a free slot if there is one, and mark it as held by this process.
+bool TakeSlot(Cpu::SharedHeader &header, uint32_t &slot)
+{
+    if (!Cpu::PopRing(header.freeSlots, header.slotCount - 1, slot)) {
+        return false;
+    }
+    header.slots[slot].owner.store(static_cast<int32_t>(getpid()), std::memory_order_relaxed);
+    return true;
+}
+
+/// Take a free slot, waiting while other clients hold them all; false once the server is gone.
+bool WaitForSlot(Cpu::SharedHeader &header, uint32_t &slot)
+{
+    Cpu::Backoff backoff;
+    while (!TakeSlot(header, slot)) {
+        if (backoff.IsSleeping() && !IsServing(header)) {
+            return false;
+        }
+        backoff.Wait();
+    }
+    return true;
+}
+
+/// Push a slot to a ring of the server. The ring has room for every slot, but refuses them while the cell of the
+/// push is held by a process that died popping it, until the server repairs it; gives up once the server is gone.
+void PushSlot(Cpu::SharedHeader &header, Cpu::SharedRing &ring, uint32_t slot)
+{
+    Cpu::Backoff backoff;
+    while (!Cpu::PushRing(ring, header.slotCount - 1, slot)) {
+        if (backoff.IsSleeping() && !IsServing(header)) {
+            return;
+        }
+        backoff.Wait();
+    }
+}
+
+/// Wait for the server to trace a slot; NOT_READY once it is gone, else the result of the trace.
+Result WaitForBatch(Cpu::SharedHeader &header, uint32_t slot)
+{
+    Cpu::SharedSlot &control = header.slots[slot];
+    Cpu::Backoff backoff;
+    while (control.state.load(std::memory_order_acquire) != Cpu::SLOT_DONE) {
+        if (backoff.IsSleeping() && !IsServing(header)) {
+            return Result::NOT_READY;
+        }
+        backoff.Wait();
+    }
+    return static_cast<Result>(control.result);
+}
+
+void Submit(Cpu::SharedHeader &header, const ClientBatch &batch, const Ray *rays, uint32_t rayFlags,
+            TraceRayHitFormat hitFormat)
+{
+    Cpu::SharedSlot &control = header.slots[batch.slot];
+    memcpy(Cpu::GetSlotData(header, batch.slot), rays + batch.begin, static_cast<size_t>(batch.count) * sizeof(Ray));
+    control.rayCount = batch.count;
+    control.rayFlags = rayFlags;
+    control.hitFormat = static_cast<uint32_t>(hitFormat);
+    control.state.store(Cpu::SLOT_SUBMITTED, std::memory_order_relaxed);
+    // The push publishes the request, the server pops it with an acquire load. If the server is gone before it,
+    // WaitForBatch tells.
+    PushSlot(header, header.submittedSlots, batch.slot);
+}
+
+/// Copy the hits of a batch out of its slot. A batch starts on a word of bit-packed hits, and the bits of the
+/// caller past its last ray keep their value.
+void CopyHits(Cpu::SharedHeader &header, const ClientBatch &batch, uint8_t *hits, TraceRayHitFormat hitFormat)
+{
+    const uint8_t *slotHits = Cpu::GetSlotData(header, batch.slot) + static_cast<size_t>(header.slotRayCount) *
+        sizeof(Ray);
+    uint8_t *batchHits = hits + Cpu::GetHitBytes(hitFormat, batch.begin);
+    if (hitFormat != TraceRayHitFormat::OCCLUDED_BITS) {
+        memcpy(batchHits, slotHits, Cpu::GetHitBytes(hitFormat, batch.count));
+        return;
+    }
+    uint32_t wholeWords = batch.count / Cpu::HIT_WORD_BITS;
+    memcpy(batchHits, slotHits, wholeWords * sizeof(uint32_t));
+    for (uint32_t i = wholeWords * Cpu::HIT_WORD_BITS; i < batch.count; i++) {
+        Cpu::StoreHitBit(batchHits, i, Cpu::LoadHitBit(slotHits, i));
+    }
+}
+
+void Release(Cpu::SharedHeader &header, uint32_t slot)
+{
+    header.slots[slot].state.store(Cpu::SLOT_IDLE, std::memory_order_relaxed);
+    header.slots[slot].owner.store(0, std::memory_order_relaxed);
+    PushSlot(header, header.freeSlots, slot);
+}
+} // namespace
+
+Result TraversalClientImpl::Attach(const char *name) noexcept
+{
+    try {
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        return m_segment.Open(name);
+    } catch (const std::system_error &) {
+        return Result::UNKNOWN_ERROR;
+    }
+}
+
+void TraversalClientImpl::Detach() noexcept
+{
+    std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+    m_segment.Close();
+}
+
+Result TraversalClientImpl::TraceRays(uint32_t rayCount, uint32_t rayFlags, const Buffer &rays, const Buffer &hits,
+                                      TraceRayHitFormat hitFormat) noexcept
+{
+    if (rays.type != BufferType::CPU || hits.type != BufferType::CPU || rays.cpuBuffer == nullptr ||
+        hits.cpuBuffer == nullptr || !Cpu::IsValidRayFlags(rayFlags) || Traversal::GetHitFormatBytes(hitFormat) == 0) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    Cpu::SharedHeader *header = m_segment.GetHeader();
+    if (header == nullptr) {
+        return Result::NOT_READY;
+    }
+    const Ray *rayData = static_cast<const Ray *>(rays.cpuBuffer);
+    uint8_t *hitData = static_cast<uint8_t *>(hits.cpuBuffer);
+    for (uint32_t begin = 0; begin < rayCount;) {
+        ClientBatch batches[MAX_CLIENT_BATCHES];
+        uint32_t batchCount = 0;
+        while (batchCount < MAX_CLIENT_BATCHES && begin < rayCount) {
+            // Only the first batch waits for a slot, the others go when one is free right away.
+            uint32_t slot;
+            if (!TakeSlot(*header, slot)) {
+                if (batchCount != 0) {
+                    break;
+                }
+                if (!WaitForSlot(*header, slot)) {
+                    return Result::NOT_READY;
+                }
+            }
+            batches[batchCount] = ClientBatch {slot, begin, std::min(rayCount - begin, header->slotRayCount)};
+            Submit(*header, batches[batchCount], rayData, rayFlags, hitFormat);
+            begin += batches[batchCount++].count;
+        }
+        Result result = Result::SUCCESS;
+        for (uint32_t i = 0; i < batchCount; i++) {
+            Result traced = WaitForBatch(*header, batches[i].slot);
+            if (traced == Result::NOT_READY && !IsServing(*header)) {
+                // The slots are left behind with the server.
+                return Result::NOT_READY;
+            }
+            if (traced == Result::SUCCESS) {
+                CopyHits(*header, batches[i], hitData, hitFormat);
+            }
+            result = result == Result::SUCCESS ? traced : result;
+            Release(*header, batches[i].slot);
+        }
+        if (result != Result::SUCCESS) {
+            return result;
+        }
+    }
+    return Result::SUCCESS;
+}
+} // namespace Vulkan
+} // namespace RayShop
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: RayShop traversal client, tracing through the server of another process on the cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_TRAVERSALCLIENTIMPL_H
+#define RAYSHOP_CPU_TRAVERSALCLIENTIMPL_H
+
+#include <shared_mutex>
+
+#include "Traversal.h"
+#include "SharedSegment.h"
+
+namespace RayShop {
+namespace Vulkan {
+/// @brief The cpu backend behind TraversalClient. Rays and hits are copied through the slots of the segment of a
+/// RayServer; the client holds no scene at all.
+class TraversalClientImpl {
+public:
+    TraversalClientImpl() = default;
+    ~TraversalClientImpl() noexcept = default;
+
+    Result Attach(const char *name) noexcept;
+    void Detach() noexcept;
+    Result TraceRays(uint32_t rayCount, uint32_t rayFlags, const Buffer &rays, const Buffer &hits,
+                     TraceRayHitFormat hitFormat) noexcept;
+
+    TraversalClientImpl(const TraversalClientImpl &) = delete;
+    TraversalClientImpl &operator=(const TraversalClientImpl &) = delete;
+
+private:
+    Cpu::SharedSegment m_segment;
+    std::shared_timed_mutex m_mutex;    /* *< Shared for tracing, exclusive for attaching and detaching. */
+};
+} // namespace Vulkan
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_TRAVERSALCLIENTIMPL_H
@@ -0,0 +1,908 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: RayShop traversal implemented on the cpu.
+ */
+
+#include "TraversalImpl.h"
+#include "PointQuery.h"
+#include "RayReorder.h"
+#include "RayTracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <unordered_set>
+
+namespace RayShop {
+namespace Vulkan {
+namespace {
+constexpr uint32_t TRACE_GRAIN_SIZE = 256;
+constexpr uint32_t QUERY_GRAIN_SIZE = 64;       /* *< Points per chunk, a query visits far more nodes than a ray. */
+constexpr float MAX_SPLIT_BUDGET = 4.0f;   /* *< Caps the reference growth of spatial splits at five times. */
+constexpr uint32_t SUPPORTED_BUILD_FLAGS = AS_BUILD_FLAG_QUANTIZED_NODES | AS_BUILD_FLAG_OPTIMIZE_TREELETS;
+
+template <typename Future>
+bool IsReady(const Future &future)
+{
+    return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+bool IsValidBuildOptions(const ASBuildOptions &options)
+{
+    return options.splitBudget >= 0.0f && options.splitBudget <= MAX_SPLIT_BUDGET &&
+        (options.flags & ~SUPPORTED_BUILD_FLAGS) == 0 && options.rebuildSahRatio >= 0.0f;
+}
+
+bool IsValidTraceParameters(uint32_t rayFlags, const Buffer &rays, const Buffer &hits, TraceRayHitFormat hitFormat)
+{
+    return rays.type == BufferType::CPU && hits.type == BufferType::CPU && rays.cpuBuffer != nullptr &&
+        hits.cpuBuffer != nullptr && Cpu::IsValidRayFlags(rayFlags) && Traversal::GetHitFormatBytes(hitFormat) != 0;
+}
+
+/// Whether the ids of every hit in the tlas fit the packed formats; the others have room for any.
+bool FitsHitFormat(TraceRayHitFormat hitFormat, const Cpu::TopLevel &tlas)
+{
+    if (hitFormat != TraceRayHitFormat::T_PRIMID_INSTID_PACKED &&
+        hitFormat != TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED) {
+        return true;
+    }
+    if (tlas.GetInstanceCount() > (1u << (32 - PACKED_PRIMITIVE_BITS))) {
+        return false;
+    }
+    for (uint32_t i = 0; i < tlas.GetInstanceCount(); i++) {
+        if (tlas.GetInstance(i).blas->GetTriangleCount() > PACKED_PRIMITIVE_MASK + 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(TRACE_GRAIN_SIZE % Cpu::HIT_WORD_BITS == 0, "ray chunks have to start on a word of bit-packed hits");
+static_assert(Cpu::HIT_WORD_BITS % Cpu::PACKET_TILE_SIZE == 0, "tile rows have to make up whole bands of words");
+} // namespace
+
+Result TraversalImpl::Setup() noexcept
+{
+    try {
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_threadPool) {
+            m_threadPool = std::make_shared<Cpu::ThreadPool>();
+        }
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    } catch (...) {
+        return Result::UNKNOWN_ERROR;
+    }
+    return Result::SUCCESS;
+}
+
+void TraversalImpl::Destroy() noexcept
+{
+    StopServer();
+    // Async builds take the lock to finish, so they are waited for before it is locked here.
+    std::unordered_map<ASBuildJob, std::shared_future<Result>> jobs;
+    {
+        std::lock_guard<std::mutex> lock(m_jobMutex);
+        jobs.swap(m_jobs);
+    }
+    for (auto &job : jobs) {
+        job.second.wait();
+    }
+    std::unordered_map<BLAS, BackgroundRebuild> rebuilds;
+    {
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        m_tlas.reset();
+        m_blases.clear();
+        m_pendingBlases.clear();
+        m_threadPool.reset();
+        m_buildPool.reset();
+        rebuilds.swap(m_rebuilds);
+    }
+    // Running rebuilds are waited for as their futures go, out here rather than under the lock.
+}
+
+std::shared_ptr<Cpu::ThreadPool> TraversalImpl::GetThreadPool()
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    return m_threadPool;
+}
+
+BLAS TraversalImpl::AllocateHandle()
+{
+    for (size_t i = 0; i < m_blases.size(); i++) {
+        if (!m_blases[i] && m_pendingBlases.count(static_cast<BLAS>(i)) == 0) {
+            return static_cast<BLAS>(i);
+        }
+    }
+    m_blases.emplace_back();
+    return static_cast<BLAS>(m_blases.size() - 1);
+}
+
+Result TraversalImpl::CreateBLAS(const ASBuildOptions &options, uint32_t geometriesCount,
+                                 const GeometryTriangleDescription2 *geometries, BLAS *blases) noexcept
+{
+    if (geometriesCount == 0 || geometries == nullptr || blases == nullptr || !IsValidBuildOptions(options)) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        std::shared_ptr<Cpu::ThreadPool> pool = GetThreadPool();
+        if (!pool) {
+            return Result::NOT_READY;
+        }
+        // Build without holding the lock so that tracing the current scene can go on meanwhile.
+        // Geometries are built side by side, and each build spreads further across the pool.
+        std::vector<std::shared_ptr<Cpu::BottomLevel>> built(geometriesCount);
+        std::vector<Result> results(geometriesCount, Result::SUCCESS);
+        for (uint32_t i = 0; i < geometriesCount; i++) {
+            built[i] = std::make_shared<Cpu::BottomLevel>();
+        }
+        pool->ParallelFor(0, geometriesCount, 1, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                try {
+                    results[i] = built[i]->Build(options, geometries[i], pool.get());
+                } catch (const std::bad_alloc &) {
+                    results[i] = Result::OUT_OF_MEMORY;
+                }
+            }
+        });
+        for (Result res : results) {
+            if (res != Result::SUCCESS) {
+                return res;
+            }
+        }
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_threadPool) {
+            // Destroyed while building.
+            return Result::NOT_READY;
+        }
+        for (uint32_t i = 0; i < geometriesCount; i++) {
+            BLAS handle = AllocateHandle();
+            m_blases[handle] = std::move(built[i]);
+            blases[i] = handle;
+        }
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::CreateBLASAsync(const ASBuildOptions &options, uint32_t geometriesCount,
+                                      const GeometryTriangleDescription2 *geometries, BLAS *blases,
+                                      ASBuildJob *job) noexcept
+{
+    if (geometriesCount == 0 || geometries == nullptr || blases == nullptr || job == nullptr ||
+        !IsValidBuildOptions(options)) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        std::shared_ptr<Cpu::ThreadPool> copyPool = GetThreadPool();
+        if (!copyPool) {
+            return Result::NOT_READY;
+        }
+        // Copy the geometry here, so that bad input is reported at once and the caller may free it right away.
+        std::vector<std::shared_ptr<Cpu::BottomLevel>> built(geometriesCount);
+        for (uint32_t i = 0; i < geometriesCount; i++) {
+            built[i] = std::make_shared<Cpu::BottomLevel>();
+            Result res = built[i]->CopyGeometry(geometries[i], copyPool.get());
+            if (res != Result::SUCCESS) {
+                return res;
+            }
+        }
+        std::vector<BLAS> handles(geometriesCount);
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_threadPool) {
+            return Result::NOT_READY;
+        }
+        if (!m_buildPool) {
+            m_buildPool = std::make_unique<Cpu::ThreadPool>();
+        }
+        std::lock_guard<std::mutex> jobLock(m_jobMutex);
+        ASBuildJob id = m_nextJob;
+        // Every step that may throw goes before the launch: once the build runs, unwinding past its future would
+        // wait for it while holding the lock it needs to finish.
+        auto inserted = m_jobs.emplace(id, std::shared_future<Result>());
+        try {
+            for (uint32_t i = 0; i < geometriesCount; i++) {
+                handles[i] = AllocateHandle();
+                m_pendingBlases[handles[i]] = id;
+            }
+            Cpu::ThreadPool *pool = m_buildPool.get();
+            auto build = [this, id, options, handles, built, pool]() mutable {
+                return BuildBlasJob(id, options, handles, built, pool);
+            };
+            inserted.first->second = std::async(std::launch::async, std::move(build)).share();
+        } catch (...) {
+            for (uint32_t i = 0; i < geometriesCount; i++) {
+                auto found = m_pendingBlases.find(handles[i]);
+                if (found != m_pendingBlases.end() && found->second == id) {
+                    m_pendingBlases.erase(found);
+                }
+            }
+            m_jobs.erase(inserted.first);
+            throw;
+        }
+        m_nextJob++;
+        std::copy(handles.begin(), handles.end(), blases);
+        *job = id;
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    } catch (const std::system_error &) {
+        return Result::UNKNOWN_ERROR;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::BuildBlasJob(ASBuildJob job, const ASBuildOptions &options, const std::vector<BLAS> &handles,
+                                   std::vector<std::shared_ptr<Cpu::BottomLevel>> &built,
+                                   Cpu::ThreadPool *pool) noexcept
+{
+    std::atomic<bool> outOfMemory {false};
+    pool->ParallelFor(0, static_cast<uint32_t>(built.size()), 1, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            try {
+                built[i]->BuildBvh(options, pool);
+            } catch (const std::bad_alloc &) {
+                outOfMemory = true;
+            }
+        }
+    });
+    std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+    for (size_t i = 0; i < handles.size(); i++) {
+        // A handle destroyed meanwhile is no longer pending, or pending for a later job by now.
+        auto found = m_pendingBlases.find(handles[i]);
+        if (found == m_pendingBlases.end() || found->second != job) {
+            continue;
+        }
+        m_pendingBlases.erase(found);
+        if (!outOfMemory) {
+            m_blases[handles[i]] = std::move(built[i]);
+        }
+    }
+    return outOfMemory ? Result::OUT_OF_MEMORY : Result::SUCCESS;
+}
+
+Result TraversalImpl::GetQuantizedBLAS(BLAS blas, uint32_t *nodesCount, QuantizedBvhNode *nodes,
+                                       uint32_t *primIndicesCount, uint32_t *primIndices) noexcept
+{
+    if (nodesCount == nullptr || primIndicesCount == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (blas >= m_blases.size() || !m_blases[blas]) {
+        return Result::INVALID_PARAMETER;
+    }
+    const Cpu::QuantizedBvh &quantized = m_blases[blas]->GetQuantizedBvh();
+    if (quantized.nodes.empty() && m_blases[blas]->GetTriangleCount() != 0) {
+        // Built without AS_BUILD_FLAG_QUANTIZED_NODES.
+        return Result::INVALID_PARAMETER;
+    }
+    uint32_t nodeTotal = static_cast<uint32_t>(quantized.nodes.size());
+    uint32_t primTotal = static_cast<uint32_t>(quantized.primIndices.size());
+    if ((nodes != nullptr && *nodesCount < nodeTotal) || (primIndices != nullptr && *primIndicesCount < primTotal)) {
+        return Result::INVALID_PARAMETER;
+    }
+    if (nodes != nullptr) {
+        std::copy(quantized.nodes.begin(), quantized.nodes.end(), nodes);
+    }
+    if (primIndices != nullptr) {
+        std::copy(quantized.primIndices.begin(), quantized.primIndices.end(), primIndices);
+    }
+    *nodesCount = nodeTotal;
+    *primIndicesCount = primTotal;
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::GetBLASMemoryUsage(BLAS blas, ASMemoryUsage *usage) noexcept
+{
+    if (usage == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (blas >= m_blases.size() || !m_blases[blas]) {
+        return Result::INVALID_PARAMETER;
+    }
+    *usage = m_blases[blas]->GetMemoryUsage();
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::GetMemoryStats(ASMemoryStats *stats) noexcept
+{
+    if (stats == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        // A destroyed blas lives on as long as the tlas refers to it, and several instances may share one.
+        std::unordered_set<const Cpu::BottomLevel *> counted;
+        for (const auto &blas : m_blases) {
+            if (blas) {
+                counted.insert(blas.get());
+            }
+        }
+        if (m_tlas) {
+            for (uint32_t i = 0; i < m_tlas->GetInstanceCount(); i++) {
+                counted.insert(m_tlas->GetInstance(i).blas.get());
+            }
+        }
+        ASMemoryStats total {};
+        for (const Cpu::BottomLevel *blas : counted) {
+            ASMemoryUsage usage = blas->GetMemoryUsage();
+            total.blases.geometryBytes += usage.geometryBytes;
+            total.blases.bvhBytes += usage.bvhBytes;
+            total.blases.triangleBlockBytes += usage.triangleBlockBytes;
+            total.blases.refitBytes += usage.refitBytes;
+            total.blases.slackBytes += usage.slackBytes;
+        }
+        total.blasCount = static_cast<uint32_t>(counted.size());
+        if (m_tlas) {
+            total.tlas = m_tlas->GetMemoryUsage();
+        }
+        *stats = total;
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::CompactBLAS(uint32_t blasesCount, const BLAS *blases) noexcept
+{
+    if (blasesCount == 0 || blases == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        // The tlas and tracing threads refer to the blases, so they are compacted in place under the lock.
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        for (uint32_t i = 0; i < blasesCount; i++) {
+            if (blases[i] >= m_blases.size() || !m_blases[blases[i]]) {
+                return Result::INVALID_PARAMETER;
+            }
+        }
+        for (uint32_t i = 0; i < blasesCount; i++) {
+            m_blases[blases[i]]->Compact();
+        }
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::GetBLASSahRatio(BLAS blas, float *ratio) noexcept
+{
+    if (ratio == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (blas >= m_blases.size() || !m_blases[blas]) {
+        return Result::INVALID_PARAMETER;
+    }
+    *ratio = m_blases[blas]->GetSahRatio();
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::GetBLASSahCosts(BLAS blas, ASSahCosts *costs) noexcept
+{
+    if (costs == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (blas >= m_blases.size() || !m_blases[blas]) {
+        return Result::INVALID_PARAMETER;
+    }
+    *costs = m_blases[blas]->GetSahCosts();
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::SaveBLAS(BLAS blas, const char *path) noexcept
+{
+    if (path == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        // Refits change the blas in place, so it is written under the shared lock rather than from a copy.
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        if (blas >= m_blases.size() || !m_blases[blas]) {
+            return Result::INVALID_PARAMETER;
+        }
+        return m_blases[blas]->Save(path);
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+}
+
+Result TraversalImpl::LoadBLAS(const ASBuildOptions &options, const GeometryTriangleDescription2 &geometry,
+                               const char *path, BLAS *blas) noexcept
+{
+    if (path == nullptr || blas == nullptr || !IsValidBuildOptions(options)) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        if (!GetThreadPool()) {
+            return Result::NOT_READY;
+        }
+        // Load without holding the lock, like a build, so that tracing the current scene goes on meanwhile.
+        auto loaded = std::make_shared<Cpu::BottomLevel>();
+        Result res = loaded->Load(options, geometry, path);
+        if (res != Result::SUCCESS) {
+            return res;
+        }
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_threadPool) {
+            return Result::NOT_READY;
+        }
+        BLAS handle = AllocateHandle();
+        m_blases[handle] = std::move(loaded);
+        *blas = handle;
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::CreateTLAS(uint32_t instancesCount, const InstanceDescription *instances) noexcept
+{
+    if (instancesCount != 0 && instances == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_threadPool) {
+            return Result::NOT_READY;
+        }
+        for (uint32_t i = 0; i < instancesCount; i++) {
+            if (m_pendingBlases.count(instances[i].blas) != 0) {
+                return Result::NOT_READY;
+            }
+        }
+        auto tlas = std::make_unique<Cpu::TopLevel>();
+        Result res = tlas->Build(instancesCount, instances, m_blases);
+        if (res != Result::SUCCESS) {
+            return res;
+        }
+        m_tlas = std::move(tlas);
+        m_tlasVersion++;
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::UpdateTLAS(uint32_t instancesCount, const uint32_t *instanceIds,
+                                 const InstanceDescription *instances) noexcept
+{
+    if (instancesCount != 0 && (instanceIds == nullptr || instances == nullptr)) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_threadPool || !m_tlas) {
+            return Result::NOT_READY;
+        }
+        for (uint32_t i = 0; i < instancesCount; i++) {
+            if (m_pendingBlases.count(instances[i].blas) != 0) {
+                return Result::NOT_READY;
+            }
+        }
+        return m_tlas->Update(instancesCount, instanceIds, instances, m_blases);
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+}
+
+Result TraversalImpl::CreateTLASAsync(uint32_t instancesCount, const InstanceDescription *instances,
+                                      ASBuildJob *job) noexcept
+{
+    if ((instancesCount != 0 && instances == nullptr) || job == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        std::vector<InstanceDescription> copied(instances, instances + instancesCount);
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_threadPool) {
+            return Result::NOT_READY;
+        }
+        std::lock_guard<std::mutex> jobLock(m_jobMutex);
+        std::vector<std::shared_future<Result>> earlier;
+        earlier.reserve(m_jobs.size());
+        for (const auto &running : m_jobs) {
+            earlier.push_back(running.second);
+        }
+        ASBuildJob id = m_nextJob;
+        uint64_t version = m_tlasVersion + 1;
+        auto inserted = m_jobs.emplace(id, std::shared_future<Result>());
+        try {
+            inserted.first->second = std::async(std::launch::async, [this, copied, earlier, version]() {
+                return BuildTlasJob(copied, earlier, version);
+            }).share();
+        } catch (...) {
+            m_jobs.erase(inserted.first);
+            throw;
+        }
+        m_nextJob++;
+        m_tlasVersion = version;
+        *job = id;
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    } catch (const std::system_error &) {
+        return Result::UNKNOWN_ERROR;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::BuildTlasJob(const std::vector<InstanceDescription> &instances,
+                                   const std::vector<std::shared_future<Result>> &earlier, uint64_t version) noexcept
+{
+    for (const auto &build : earlier) {
+        build.wait();
+    }
+    try {
+        // Built under the lock like CreateTLAS, so that no refit or rebuild swap of its blases slips in between.
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (m_tlasVersion != version) {
+            // A newer tlas was created meanwhile.
+            return Result::SUCCESS;
+        }
+        auto tlas = std::make_unique<Cpu::TopLevel>();
+        Result res = tlas->Build(static_cast<uint32_t>(instances.size()), instances.data(), m_blases);
+        if (res != Result::SUCCESS) {
+            return res;
+        }
+        m_tlas = std::move(tlas);
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::GetBuildStatus(ASBuildJob job) noexcept
+{
+    std::lock_guard<std::mutex> lock(m_jobMutex);
+    auto found = m_jobs.find(job);
+    if (found == m_jobs.end()) {
+        return Result::INVALID_PARAMETER;
+    }
+    return IsReady(found->second) ? found->second.get() : Result::BUILD_IN_PROGRESS;
+}
+
+Result TraversalImpl::WaitBuild(ASBuildJob job) noexcept
+{
+    std::shared_future<Result> build;
+    {
+        std::lock_guard<std::mutex> lock(m_jobMutex);
+        auto found = m_jobs.find(job);
+        if (found == m_jobs.end()) {
+            return Result::INVALID_PARAMETER;
+        }
+        build = found->second;
+    }
+    Result res = build.get();
+    std::lock_guard<std::mutex> lock(m_jobMutex);
+    m_jobs.erase(job);
+    return res;
+}
+
+Result TraversalImpl::RefitBLAS(uint32_t geometriesCount, const GeometryTriangleDescription2 *geometries,
+                                const BLAS *blases) noexcept
+{
+    if (geometriesCount == 0 || geometries == nullptr || blases == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    try {
+        std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+        if (!m_threadPool) {
+            return Result::NOT_READY;
+        }
+        bool tlasChanged = false;
+        for (uint32_t i = 0; i < geometriesCount; i++) {
+            if (blases[i] >= m_blases.size() || !m_blases[blases[i]]) {
+                return Result::INVALID_PARAMETER;
+            }
+            SwapRebuilt(blases[i]);
+            Result res = m_blases[blases[i]]->Refit(geometries[i], m_threadPool.get());
+            if (res != Result::SUCCESS) {
+                return res;
+            }
+            tlasChanged = tlasChanged || (m_tlas && m_tlas->References(m_blases[blases[i]].get()));
+            StartRebuild(blases[i]);
+        }
+        if (tlasChanged) {
+            m_tlas->Refit();
+        }
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+void TraversalImpl::StartRebuild(BLAS blas)
+{
+    const std::shared_ptr<Cpu::BottomLevel> &current = m_blases[blas];
+    const ASBuildOptions &options = current->GetBuildOptions();
+    if (options.rebuildSahRatio <= 0.0f || current->GetSahRatio() <= options.rebuildSahRatio ||
+        m_rebuilds.count(blas) != 0) {
+        return;
+    }
+    // The geometry is copied under the lock, as refits go on changing it meanwhile. The build gets a thread of
+    // its own: as a task of the pool it might be picked up by a tracing thread waiting for its last chunks.
+    auto rebuilt = std::make_shared<Cpu::BottomLevel>();
+    rebuilt->CopyGeometry(*current);
+    BackgroundRebuild rebuild;
+    rebuild.source = current;
+    try {
+        rebuild.rebuilt = std::async(std::launch::async, [rebuilt, options]() {
+            rebuilt->BuildBvh(options, nullptr);
+            return rebuilt;
+        });
+    } catch (const std::system_error &) {
+        // No thread to spare; the next refit tries again.
+        return;
+    }
+    m_rebuilds.emplace(blas, std::move(rebuild));
+}
+
+void TraversalImpl::SwapRebuilt(BLAS blas)
+{
+    auto found = m_rebuilds.find(blas);
+    if (found == m_rebuilds.end() || !IsReady(found->second.rebuilt)) {
+        return;
+    }
+    BackgroundRebuild rebuild = std::move(found->second);
+    m_rebuilds.erase(found);
+    std::shared_ptr<Cpu::BottomLevel> rebuilt;
+    try {
+        rebuilt = rebuild.rebuilt.get();
+    } catch (const std::bad_alloc &) {
+        // The refit tree stays, and a later refit starts over.
+        return;
+    }
+    std::shared_ptr<Cpu::BottomLevel> &current = m_blases[blas];
+    if (rebuild.source.lock() != current) {
+        // Destroyed meanwhile, maybe with the handle given to another blas.
+        return;
+    }
+    // Refits went on while the tree was built, so bring it to the current geometry first; then the swap changes
+    // nothing but the tree, and not the bounds the tlas holds.
+    rebuilt->CopyGeometry(*current);
+    rebuilt->UpdateBounds(m_threadPool.get());
+    if (m_tlas) {
+        m_tlas->ReplaceBlas(current.get(), rebuilt);
+    }
+    current = std::move(rebuilt);
+}
+
+Result TraversalImpl::DestroyBLAS(uint32_t geometriesCount, const BLAS *blases) noexcept
+{
+    if (geometriesCount != 0 && blases == nullptr) {
+        return Result::INVALID_PARAMETER;
+    }
+    // Instances keep their blas alive, so the current tlas stays valid until it is rebuilt.
+    std::lock_guard<std::shared_timed_mutex> lock(m_mutex);
+    for (uint32_t i = 0; i < geometriesCount; i++) {
+        if (blases[i] < m_blases.size()) {
+            m_blases[blases[i]].reset();
+        }
+        // A blas still being built is dropped once its build finds the handle no longer pending.
+        m_pendingBlases.erase(blases[i]);
+        // A finished rebuild goes now, a running one once it is found stale; waiting for it would block tracing.
+        auto found = m_rebuilds.find(blases[i]);
+        if (found != m_rebuilds.end() && IsReady(found->second.rebuilt)) {
+            m_rebuilds.erase(found);
+        }
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::TraceRays(uint32_t rayCount, uint32_t rayFlags, const Buffer &rays, const Buffer &hits,
+                                TraceRayHitFormat hitFormat) noexcept
+{
+    if (!IsValidTraceParameters(rayFlags, rays, hits, hitFormat)) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (!m_threadPool || !m_tlas) {
+        return Result::NOT_READY;
+    }
+    const Ray *rayData = static_cast<const Ray *>(rays.cpuBuffer);
+    uint8_t *hitData = static_cast<uint8_t *>(hits.cpuBuffer);
+    const Cpu::TopLevel &tlas = *m_tlas;
+    if (!FitsHitFormat(hitFormat, tlas)) {
+        return Result::INVALID_PARAMETER;
+    }
+    Cpu::TraceRaysFunc traceRays = Cpu::SelectTraceRays(Cpu::GetSimdIsa(), rayFlags, hitFormat);
+    try {
+        const Cpu::Bvh &bvh = tlas.GetBvh();
+        if ((rayFlags & TRACERAY_FLAG_REORDER_RAYS) && rayCount >= Cpu::MIN_REORDER_RAY_COUNT && !bvh.nodes.empty()) {
+            // Rays that hit anything start near the scene, so its bounds make a good enough sort grid.
+            Cpu::Aabb originBounds = Cpu::NodeBounds(bvh.nodes[0]);
+            uint32_t chunkSize = (rayCount + m_threadPool->GetThreadCount() - 1) / m_threadPool->GetThreadCount();
+            chunkSize = std::min(Cpu::MAX_REORDER_CHUNK_SIZE, std::max(Cpu::MIN_REORDER_RAY_COUNT, chunkSize));
+            chunkSize = (chunkSize + Cpu::HIT_WORD_BITS - 1) / Cpu::HIT_WORD_BITS * Cpu::HIT_WORD_BITS;
+            m_threadPool->ParallelFor(0, rayCount, chunkSize, [&](uint32_t begin, uint32_t end) {
+                Cpu::TraceRaysReordered(tlas, traceRays, hitFormat, originBounds, rayData + begin, end - begin,
+                                        hitData + Cpu::GetHitBytes(hitFormat, begin));
+            });
+            return Result::SUCCESS;
+        }
+        m_threadPool->ParallelFor(0, rayCount, TRACE_GRAIN_SIZE, [&](uint32_t begin, uint32_t end) {
+            traceRays(tlas, rayData + begin, end - begin, hitData + Cpu::GetHitBytes(hitFormat, begin));
+        });
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::TraceRays(const Size &region, uint32_t rayFlags, const Buffer &rays, const Buffer &hits,
+                                TraceRayHitFormat hitFormat) noexcept
+{
+    if (!IsValidTraceParameters(rayFlags, rays, hits, hitFormat) ||
+        static_cast<uint64_t>(region.width) * region.height > UINT32_MAX) {
+        return Result::INVALID_PARAMETER;
+    }
+    uint32_t hitStride = Traversal::GetHitFormatBytes(hitFormat);
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (!m_threadPool || !m_tlas) {
+        return Result::NOT_READY;
+    }
+    const Ray *rayData = static_cast<const Ray *>(rays.cpuBuffer);
+    uint8_t *hitData = static_cast<uint8_t *>(hits.cpuBuffer);
+    const Cpu::TopLevel &tlas = *m_tlas;
+    if (!FitsHitFormat(hitFormat, tlas)) {
+        return Result::INVALID_PARAMETER;
+    }
+    // The tiles are coherent already, so TRACERAY_FLAG_REORDER_RAYS has nothing to do here.
+    Cpu::TraceRaysFunc tracePacket = Cpu::SelectTracePacket(Cpu::GetSimdIsa(), rayFlags, hitFormat);
+    uint32_t tilesX = (region.width + Cpu::PACKET_TILE_SIZE - 1) / Cpu::PACKET_TILE_SIZE;
+    uint32_t tilesY = (region.height + Cpu::PACKET_TILE_SIZE - 1) / Cpu::PACKET_TILE_SIZE;
+    bool bits = hitFormat == TraceRayHitFormat::OCCLUDED_BITS;
+    // A band of HIT_WORD_BITS image rows starts and ends on a word boundary whatever the width, so bit-packed
+    // hits are split into such bands and every thread writes whole words.
+    uint32_t grainSize = bits ? tilesX * (Cpu::HIT_WORD_BITS / Cpu::PACKET_TILE_SIZE) :
+        TRACE_GRAIN_SIZE / Cpu::PACKET_SIZE;
+    try {
+        m_threadPool->ParallelFor(0, tilesX * tilesY, grainSize,
+            [&](uint32_t begin, uint32_t end) {
+                Ray packet[Cpu::PACKET_SIZE];
+                uint8_t packetHits[Cpu::PACKET_SIZE * sizeof(HitDistancePrimitiveInstanceCoordinates)];
+                for (uint32_t tile = begin; tile < end; tile++) {
+                    // Gather the rays of the tile row by row, clipped at the right and bottom edges.
+                    uint32_t x0 = (tile % tilesX) * Cpu::PACKET_TILE_SIZE;
+                    uint32_t y0 = (tile / tilesX) * Cpu::PACKET_TILE_SIZE;
+                    uint32_t x1 = std::min(x0 + Cpu::PACKET_TILE_SIZE, region.width);
+                    uint32_t y1 = std::min(y0 + Cpu::PACKET_TILE_SIZE, region.height);
+                    uint32_t rowSize = x1 - x0;
+                    for (uint32_t y = y0; y < y1; y++) {
+                        std::copy(rayData + y * region.width + x0, rayData + y * region.width + x1,
+                                  packet + (y - y0) * rowSize);
+                    }
+                    tracePacket(tlas, packet, rowSize * (y1 - y0), packetHits);
+                    for (uint32_t y = y0; y < y1; y++) {
+                        if (!bits) {
+                            memcpy(hitData + (static_cast<size_t>(y) * region.width + x0) * hitStride,
+                                   packetHits + (y - y0) * rowSize * hitStride, rowSize * hitStride);
+                            continue;
+                        }
+                        for (uint32_t x = x0; x < x1; x++) {
+                            Cpu::StoreHitBit(hitData, y * region.width + x,
+                                             Cpu::LoadHitBit(packetHits, (y - y0) * rowSize + x - x0));
+                        }
+                    }
+                }
+            });
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::Intersect(uint32_t rayCount, const Ray *rays, uint32_t rayFlags,
+                                HitDistancePrimitiveInstanceCoordinates *hits) noexcept
+{
+    if ((rayCount != 0 && (rays == nullptr || hits == nullptr)) || !Cpu::IsValidRayFlags(rayFlags)) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (!m_tlas) {
+        return Result::NOT_READY;
+    }
+    // Traced right here: waking the pool would take longer than the few rays themselves.
+    Cpu::TraceRaysFunc traceRays =
+        Cpu::SelectTraceRays(Cpu::GetSimdIsa(), rayFlags, TraceRayHitFormat::T_PRIMID_INSTID_U_V);
+    traceRays(*m_tlas, rays, rayCount, hits);
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::ClosestPoint(uint32_t queryCount, const PointQuery *queries, ClosestPointHit *hits) noexcept
+{
+    if (queryCount != 0 && (queries == nullptr || hits == nullptr)) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (!m_threadPool || !m_tlas) {
+        return Result::NOT_READY;
+    }
+    const Cpu::TopLevel &tlas = *m_tlas;
+    try {
+        m_threadPool->ParallelFor(0, queryCount, QUERY_GRAIN_SIZE, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                Cpu::FindClosestPoint(tlas, queries[i], hits[i]);
+            }
+        });
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return Result::SUCCESS;
+}
+
+Result TraversalImpl::RadiusQuery(uint32_t queryCount, const PointQuery *queries, uint32_t maxHitsPerQuery,
+                                  uint32_t *hitCounts, RadiusQueryHit *hits) noexcept
+{
+    if (queryCount != 0 && (queries == nullptr || hitCounts == nullptr || (maxHitsPerQuery != 0 && hits == nullptr))) {
+        return Result::INVALID_PARAMETER;
+    }
+    std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+    if (!m_threadPool || !m_tlas) {
+        return Result::NOT_READY;
+    }
+    const Cpu::TopLevel &tlas = *m_tlas;
+    std::atomic<bool> outOfMemory {false};
+    try {
+        m_threadPool->ParallelFor(0, queryCount, QUERY_GRAIN_SIZE, [&](uint32_t begin, uint32_t end) {
+            try {
+                std::unordered_set<uint64_t> seen;
+                for (uint32_t i = begin; i < end; i++) {
+                    RadiusQueryHit *queryHits = maxHitsPerQuery != 0 ?
+                        hits + static_cast<size_t>(i) * maxHitsPerQuery : nullptr;
+                    hitCounts[i] = Cpu::FindTrianglesInRadius(tlas, queries[i], maxHitsPerQuery, queryHits, seen);
+                }
+            } catch (const std::bad_alloc &) {
+                outOfMemory = true;
+            }
+        });
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    }
+    return outOfMemory ? Result::OUT_OF_MEMORY : Result::SUCCESS;
+}
+
+Result TraversalImpl::StartServer(const char *name, const RayServerOptions &options) noexcept
+{
+    try {
+        std::lock_guard<std::mutex> lock(m_serverMutex);
+        if (m_server) {
+            return Result::INVALID_PARAMETER;
+        }
+        auto server = std::make_unique<Cpu::RayServer>();
+        Result result = server->Start(name, options,
+            [this](uint32_t rayCount, uint32_t rayFlags, const Buffer &rays, const Buffer &hits,
+                   TraceRayHitFormat hitFormat) { return TraceRays(rayCount, rayFlags, rays, hits, hitFormat); });
+        if (result == Result::SUCCESS) {
+            m_server = std::move(server);
+        }
+        return result;
+    } catch (const std::bad_alloc &) {
+        return Result::OUT_OF_MEMORY;
+    } catch (const std::system_error &) {
+        return Result::UNKNOWN_ERROR;
+    }
+}
+
+Result TraversalImpl::StopServer() noexcept
+{
+    // Stopped outside of the lock, since the batch being traced may take a while.
+    std::unique_ptr<Cpu::RayServer> server;
+    {
+        std::lock_guard<std::mutex> lock(m_serverMutex);
+        server.swap(m_server);
+    }
+    if (!server) {
+        return Result::NOT_READY;
+    }
+    server->Stop();
+    return Result::SUCCESS;
+}
+} // namespace Vulkan
+} // namespace RayShop
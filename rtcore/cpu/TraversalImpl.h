@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: RayShop traversal implemented on the cpu.
+ */
+
+#ifndef RAYSHOP_CPU_TRAVERSALIMPL_H
+#define RAYSHOP_CPU_TRAVERSALIMPL_H
+
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "Traversal.h"
+#include "BottomLevel.h"
+#include "RayServer.h"
+#include "ThreadPool.h"
+#include "TopLevel.h"
+
+namespace RayShop {
+namespace Vulkan {
+/// @brief The cpu backend behind Traversal. Structures are built and traced on the host with a worker
+/// pool; only BufferType::CPU buffers are accepted and no Vulkan object is ever touched.
+class TraversalImpl {
+public:
+    TraversalImpl() = default;
+    ~TraversalImpl() noexcept = default;
+
+    Result Setup() noexcept;
+    void Destroy() noexcept;
+    Result CreateBLAS(const ASBuildOptions &options, uint32_t geometriesCount,
+                      const GeometryTriangleDescription2 *geometries, BLAS *blases) noexcept;
+    Result CreateBLASAsync(const ASBuildOptions &options, uint32_t geometriesCount,
+                           const GeometryTriangleDescription2 *geometries, BLAS *blases, ASBuildJob *job) noexcept;
+    Result GetQuantizedBLAS(BLAS blas, uint32_t *nodesCount, QuantizedBvhNode *nodes, uint32_t *primIndicesCount,
+                            uint32_t *primIndices) noexcept;
+    Result GetBLASMemoryUsage(BLAS blas, ASMemoryUsage *usage) noexcept;
+    Result GetMemoryStats(ASMemoryStats *stats) noexcept;
+    Result CompactBLAS(uint32_t blasesCount, const BLAS *blases) noexcept;
+    Result GetBLASSahRatio(BLAS blas, float *ratio) noexcept;
+    Result GetBLASSahCosts(BLAS blas, ASSahCosts *costs) noexcept;
+    Result SaveBLAS(BLAS blas, const char *path) noexcept;
+    Result LoadBLAS(const ASBuildOptions &options, const GeometryTriangleDescription2 &geometry, const char *path,
+                    BLAS *blas) noexcept;
+    Result CreateTLAS(uint32_t instancesCount, const InstanceDescription *instances) noexcept;
+    Result UpdateTLAS(uint32_t instancesCount, const uint32_t *instanceIds,
+                      const InstanceDescription *instances) noexcept;
+    Result CreateTLASAsync(uint32_t instancesCount, const InstanceDescription *instances, ASBuildJob *job) noexcept;
+    Result GetBuildStatus(ASBuildJob job) noexcept;
+    Result WaitBuild(ASBuildJob job) noexcept;
+    Result RefitBLAS(uint32_t geometriesCount, const GeometryTriangleDescription2 *geometries,
+                     const BLAS *blases) noexcept;
+    Result DestroyBLAS(uint32_t geometriesCount, const BLAS *blases) noexcept;
+    Result TraceRays(uint32_t rayCount, uint32_t rayFlags, const Buffer &rays, const Buffer &hits,
+                     TraceRayHitFormat hitFormat) noexcept;
+    Result TraceRays(const Size &region, uint32_t rayFlags, const Buffer &rays, const Buffer &hits,
+                     TraceRayHitFormat hitFormat) noexcept;
+    Result Intersect(uint32_t rayCount, const Ray *rays, uint32_t rayFlags,
+                     HitDistancePrimitiveInstanceCoordinates *hits) noexcept;
+    Result ClosestPoint(uint32_t queryCount, const PointQuery *queries, ClosestPointHit *hits) noexcept;
+    Result RadiusQuery(uint32_t queryCount, const PointQuery *queries, uint32_t maxHitsPerQuery, uint32_t *hitCounts,
+                       RadiusQueryHit *hits) noexcept;
+    Result StartServer(const char *name, const RayServerOptions &options) noexcept;
+    Result StopServer() noexcept;
+
+    TraversalImpl(const TraversalImpl &) = delete;
+    TraversalImpl &operator=(const TraversalImpl &) = delete;
+
+private:
+    /// @brief A blas being rebuilt on a background thread, swapped in by a RefitBLAS once done.
+    struct BackgroundRebuild {
+        std::weak_ptr<Cpu::BottomLevel> source;                 /* *< The tree to replace. */
+        std::future<std::shared_ptr<Cpu::BottomLevel>> rebuilt;
+    };
+
+    BLAS AllocateHandle();
+    std::shared_ptr<Cpu::ThreadPool> GetThreadPool();
+    void StartRebuild(BLAS blas);
+    void SwapRebuilt(BLAS blas);
+    Result BuildBlasJob(ASBuildJob job, const ASBuildOptions &options, const std::vector<BLAS> &handles,
+                        std::vector<std::shared_ptr<Cpu::BottomLevel>> &built, Cpu::ThreadPool *pool) noexcept;
+    Result BuildTlasJob(const std::vector<InstanceDescription> &instances,
+                        const std::vector<std::shared_future<Result>> &earlier, uint64_t version) noexcept;
+
+    std::shared_ptr<Cpu::ThreadPool> m_threadPool;  /* *< Shared with the builds running outside the lock, so that a
+                                                     *   Destroy meanwhile does not pull it from under them. */
+    std::vector<std::shared_ptr<Cpu::BottomLevel>> m_blases;  /* *< Indexed by BLAS handle, null once destroyed. */
+    std::unordered_map<BLAS, BackgroundRebuild> m_rebuilds;   /* *< At most one per handle. */
+    std::unordered_map<BLAS, ASBuildJob> m_pendingBlases;     /* *< Handles of CreateBLASAsync, by the job that fills
+                                                               *   them in. */
+    std::unique_ptr<Cpu::TopLevel> m_tlas;
+    uint64_t m_tlasVersion = 0;     /* *< Counts the tlas builds, so that a late async one never replaces a newer. */
+    std::unique_ptr<Cpu::ThreadPool> m_buildPool;   /* *< Spreads the async builds. A pool of its own, so that tracing
+                                                     *   threads never end up running their tasks. */
+    std::shared_timed_mutex m_mutex;                          /* *< Shared for tracing, exclusive for changes. */
+    std::unordered_map<ASBuildJob, std::shared_future<Result>> m_jobs;
+    ASBuildJob m_nextJob = 0;
+    std::mutex m_jobMutex;          /* *< Guards m_jobs apart from m_mutex, which running jobs take to finish. */
+    std::unique_ptr<Cpu::RayServer> m_server;
+    std::mutex m_serverMutex;       /* *< Guards m_server apart from m_mutex, which the server takes to trace. */
+};
+} // namespace Vulkan
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_TRAVERSALIMPL_H
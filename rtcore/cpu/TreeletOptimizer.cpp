@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Treelet restructuring (TRBVH) of the bvhs built by the RayShop cpu backend.
+ */
+
+#include "BVHBuilder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t TREELET_LEAVES = 7;                     /* *< As in the paper; 127 subsets keep the search cheap. */
+constexpr uint32_t TREELET_SUBSETS = 1u << TREELET_LEAVES;
+constexpr uint32_t TREELET_PASSES = 3;                     /* *< Later passes gain little over the third. */
+constexpr uint32_t OPTIMIZE_GRAIN_SIZE = 1024;             /* *< Leaves per chunk of a parallel pass. */
+constexpr float MIN_TREELET_GAIN = 1e-5f;   /* *< Relative gain below which a treelet is left alone, so that rounding
+                                             *   alone never reshuffles it. */
+
+/// @brief A treelet and the best topology over its leaves, found by dynamic programming over the leaf subsets.
+struct TreeletPlan {
+    uint32_t leafCount;
+    uint32_t leaves[TREELET_LEAVES];            /* *< The roots of the subtrees hanging off the treelet. */
+    uint32_t pairs[TREELET_LEAVES - 1];         /* *< The first slot of each child pair the treelet frees. */
+    BvhNode leafNodes[TREELET_LEAVES];          /* *< Copies of the leaves, as Emit may overwrite their slots. */
+    Aabb bounds[TREELET_SUBSETS];
+    float costs[TREELET_SUBSETS];               /* *< The SAH cost times the area of the best subtree over a subset. */
+    uint32_t heights[TREELET_SUBSETS];
+    uint8_t lefts[TREELET_SUBSETS];             /* *< The left side of the best split of a subset. */
+};
+
+uint32_t LowestLeaf(uint32_t subset)
+{
+    uint32_t leaf = 0;
+    while ((subset & (1u << leaf)) == 0) {
+        leaf++;
+    }
+    return leaf;
+}
+
+/**
+ * @brief One bottom-up pass of Karras and Aila 2013 over a bvh. Every inner node, once both of its subtrees are
+ * done, grows a treelet of up to TREELET_LEAVES leaves below it and rebuilds the treelet in the topology of the
+ * lowest SAH cost. Treelets never reach outside the finished subtree of their root, so threads climbing other
+ * subtrees never touch them, and the result does not depend on the thread count.
+ */
+class TreeletPass {
+public:
+    TreeletPass(const BuildSettings &settings, Bvh &bvh) : m_settings(settings), m_bvh(bvh)
+    {
+        uint32_t nodeCount = static_cast<uint32_t>(bvh.nodes.size());
+        ComputeBvhParents(bvh, m_parents);
+        m_costs.resize(nodeCount);
+        m_heights.resize(nodeCount);
+        m_depths.resize(nodeCount);
+        m_depths[0] = 0;
+        for (uint32_t i = 0; i < nodeCount; i++) {
+            const BvhNode &node = bvh.nodes[i];
+            if (IsLeaf(node)) {
+                m_leaves.push_back(i);
+            } else {
+                m_depths[node.leftFirst] = m_depths[i] + 1;
+                m_depths[node.leftFirst + 1] = m_depths[i] + 1;
+            }
+        }
+        m_arrivals.reset(new std::atomic<uint32_t>[nodeCount]());
+    }
+
+    /// @return The number of treelets restructured.
+    uint32_t Run(ThreadPool *pool)
+    {
+        auto climbRange = [this](uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++) {
+                uint32_t leaf = m_leaves[i];
+                const BvhNode &node = m_bvh.nodes[leaf];
+                m_costs[leaf] = m_settings.intersectionCost * node.primCount * HalfArea(NodeBounds(node));
+                m_heights[leaf] = 1;
+                // As in RefitBvh, the second child to arrive at a parent sees the subtree of its sibling done.
+                for (uint32_t parent = m_parents[leaf]; parent != INVALID_INDEX; parent = m_parents[parent]) {
+                    if (m_arrivals[parent].fetch_add(1, std::memory_order_acq_rel) == 0) {
+                        break;
+                    }
+                    Optimize(parent);
+                }
+            }
+        };
+        uint32_t leafCount = static_cast<uint32_t>(m_leaves.size());
+        if (pool != nullptr) {
+            pool->ParallelFor(0, leafCount, OPTIMIZE_GRAIN_SIZE, climbRange);
+        } else {
+            climbRange(0, leafCount);
+        }
+        return m_restructured.load(std::memory_order_relaxed);
+    }
+
+private:
+    /// Grow the treelet from the two children of root, always expanding the largest leaf that is an inner node.
+    bool FormTreelet(uint32_t root, TreeletPlan &plan) const
+    {
+        uint32_t first = m_bvh.nodes[root].leftFirst;
+        plan.leaves[0] = first;
+        plan.leaves[1] = first + 1;
+        plan.pairs[0] = first;
+        plan.leafCount = 2;
+        while (plan.leafCount < TREELET_LEAVES) {
+            uint32_t expanded = INVALID_INDEX;
+            float largestArea = -1.0f;
+            for (uint32_t i = 0; i < plan.leafCount; i++) {
+                const BvhNode &node = m_bvh.nodes[plan.leaves[i]];
+                float area = HalfArea(NodeBounds(node));
+                if (!IsLeaf(node) && area > largestArea) {
+                    expanded = i;
+                    largestArea = area;
+                }
+            }
+            if (expanded == INVALID_INDEX) {
+                break;
+            }
+            uint32_t children = m_bvh.nodes[plan.leaves[expanded]].leftFirst;
+            plan.pairs[plan.leafCount - 1] = children;
+            plan.leaves[expanded] = children;
+            plan.leaves[plan.leafCount++] = children + 1;
+        }
+        // Two leaves only have one topology.
+        return plan.leafCount > 2;
+    }
+
+    void FindBestTopology(TreeletPlan &plan) const
+    {
+        for (uint32_t i = 0; i < plan.leafCount; i++) {
+            uint32_t leaf = plan.leaves[i];
+            plan.leafNodes[i] = m_bvh.nodes[leaf];
+            plan.bounds[1u << i] = NodeBounds(m_bvh.nodes[leaf]);
+            plan.costs[1u << i] = m_costs[leaf];
+            plan.heights[1u << i] = m_heights[leaf];
+        }
+        uint32_t full = (1u << plan.leafCount) - 1;
+        for (uint32_t subset = 1; subset <= full; subset++) {
+            uint32_t lowest = subset & (0u - subset);
+            if (subset == lowest) {
+                continue;
+            }
+            plan.bounds[subset] = plan.bounds[subset ^ lowest];
+            Grow(plan.bounds[subset], plan.bounds[lowest]);
+            // Keeping the lowest leaf on the left visits every split once; the smaller subsets are all done.
+            float bestCost = FLOAT_MAX;
+            uint32_t bestLeft = lowest;
+            for (uint32_t left = (subset - 1) & subset; left != 0; left = (left - 1) & subset) {
+                float cost = plan.costs[left] + plan.costs[subset ^ left];
+                if ((left & lowest) != 0 && cost < bestCost) {
+                    bestCost = cost;
+                    bestLeft = left;
+                }
+            }
+            plan.costs[subset] = m_settings.traversalCost * HalfArea(plan.bounds[subset]) + bestCost;
+            plan.heights[subset] = 1 + std::max(plan.heights[bestLeft], plan.heights[subset ^ bestLeft]);
+            plan.lefts[subset] = static_cast<uint8_t>(bestLeft);
+        }
+    }
+
+    /// Write the node over a subset to index, taking the child pairs of new inner nodes from the freed ones.
+    void Emit(const TreeletPlan &plan, uint32_t subset, uint32_t index, uint32_t &nextPair)
+    {
+        m_costs[index] = plan.costs[subset];
+        m_heights[index] = plan.heights[subset];
+        if ((subset & (subset - 1)) == 0) {
+            const BvhNode &node = plan.leafNodes[LowestLeaf(subset)];
+            m_bvh.nodes[index] = node;
+            if (!IsLeaf(node)) {
+                m_parents[node.leftFirst] = index;
+                m_parents[node.leftFirst + 1] = index;
+            }
+            return;
+        }
+        uint32_t pair = plan.pairs[nextPair++];
+        BvhNode &node = m_bvh.nodes[index];
+        SetNodeBounds(node, plan.bounds[subset]);
+        node.leftFirst = pair;
+        node.primCount = 0;
+        m_parents[pair] = index;
+        m_parents[pair + 1] = index;
+        Emit(plan, plan.lefts[subset], pair, nextPair);
+        Emit(plan, subset ^ plan.lefts[subset], pair + 1, nextPair);
+    }
+
+    void Optimize(uint32_t root)
+    {
+        const BvhNode &node = m_bvh.nodes[root];
+        uint32_t left = node.leftFirst;
+        m_costs[root] = m_settings.traversalCost * HalfArea(NodeBounds(node)) + m_costs[left] + m_costs[left + 1];
+        m_heights[root] = 1 + std::max(m_heights[left], m_heights[left + 1]);
+        TreeletPlan plan;
+        if (!FormTreelet(root, plan)) {
+            return;
+        }
+        FindBestTopology(plan);
+        uint32_t full = (1u << plan.leafCount) - 1;
+        // The depth of the root is final, as its ancestors are only restructured later; staying within
+        // BVH_MAX_DEPTH here keeps the whole tree within it, which the traversal stacks rely on.
+        if (!(plan.costs[full] < m_costs[root] * (1.0f - MIN_TREELET_GAIN)) ||
+            m_depths[root] + plan.heights[full] > BVH_MAX_DEPTH) {
+            return;
+        }
+        uint32_t nextPair = 0;
+        Emit(plan, full, root, nextPair);
+        m_restructured.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    const BuildSettings &m_settings;
+    Bvh &m_bvh;
+    std::vector<uint32_t> m_parents;
+    std::vector<uint32_t> m_leaves;
+    std::vector<float> m_costs;         /* *< The SAH cost times the area of each subtree, filled in bottom-up. */
+    std::vector<uint32_t> m_heights;    /* *< The nodes on the longest path down from each node. */
+    std::vector<uint32_t> m_depths;     /* *< The depth of each node when the pass started. */
+    std::unique_ptr<std::atomic<uint32_t>[]> m_arrivals;
+    std::atomic<uint32_t> m_restructured {0};
+};
+
+/// Store the nodes again in depth-first order, so that children follow their parent as the builders leave them.
+void SortNodesDepthFirst(Bvh &bvh)
+{
+    std::vector<BvhNode> sorted;
+    sorted.reserve(bvh.nodes.size());
+    sorted.push_back(bvh.nodes[0]);
+    std::vector<uint32_t> stack {0};
+    while (!stack.empty()) {
+        uint32_t index = stack.back();
+        stack.pop_back();
+        if (IsLeaf(sorted[index])) {
+            continue;
+        }
+        uint32_t first = sorted[index].leftFirst;
+        uint32_t pair = static_cast<uint32_t>(sorted.size());
+        sorted.push_back(bvh.nodes[first]);
+        sorted.push_back(bvh.nodes[first + 1]);
+        sorted[index].leftFirst = pair;
+        stack.push_back(pair + 1);
+        stack.push_back(pair);
+    }
+    bvh.nodes.swap(sorted);
+}
+} // namespace
+
+void OptimizeTreelets(const BuildSettings &settings, Bvh &bvh, ThreadPool *pool)
+{
+    if (bvh.primIndices.empty() || IsLeaf(bvh.nodes[0])) {
+        return;
+    }
+    for (uint32_t pass = 0; pass < TREELET_PASSES; pass++) {
+        TreeletPass treeletPass(settings, bvh);
+        uint32_t restructured = treeletPass.Run(pool);
+        if (restructured == 0) {
+            break;
+        }
+        SortNodesDepthFirst(bvh);
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Packed leaf triangles of the RayShop cpu backend, read by the vector traversal kernels.
+ */
+
+#include "TriangleBlock.h"
+
+#include <algorithm>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t REFRESH_GRAIN_SIZE = 4096;   /* *< Blocks per chunk of a parallel refresh. */
+
+struct LeafRange {
+    uint32_t first;
+    uint32_t count;
+};
+
+void SetLaneVertices(const std::vector<float> &positions, const std::vector<uint32_t> &indices, uint32_t prim,
+                     uint32_t lane, TriangleBlock &block)
+{
+    const float *v0 = &positions[indices[prim * 3] * AXIS_COUNT];
+    const float *v1 = &positions[indices[prim * 3 + 1] * AXIS_COUNT];
+    const float *v2 = &positions[indices[prim * 3 + 2] * AXIS_COUNT];
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        block.v0[axis][lane] = v0[axis];
+        block.v1[axis][lane] = v1[axis];
+        block.v2[axis][lane] = v2[axis];
+    }
+}
+
+void PackLeaves(std::vector<LeafRange> &leaves, const std::vector<uint32_t> &primIndices,
+                const std::vector<float> &positions, const std::vector<uint32_t> &indices, TriangleBlocks &packed)
+{
+    // Blocks follow the primIndices order, which keeps the leaves of a subtree close in memory.
+    std::sort(leaves.begin(), leaves.end(), [](const LeafRange &a, const LeafRange &b) {
+        return a.first < b.first;
+    });
+    packed.leafLanes.assign(primIndices.size(), INVALID_INDEX);
+    uint32_t laneCount = 0;
+    for (const LeafRange &leaf : leaves) {
+        uint32_t lane = laneCount % TRIANGLE_BLOCK_WIDTH;
+        if (lane != 0 && lane + leaf.count > TRIANGLE_BLOCK_WIDTH) {
+            laneCount += TRIANGLE_BLOCK_WIDTH - lane;
+        }
+        packed.leafLanes[leaf.first] = laneCount;
+        laneCount += leaf.count;
+    }
+    TriangleBlock unused {};
+    for (uint32_t lane = 0; lane < TRIANGLE_BLOCK_WIDTH; lane++) {
+        unused.primIds[lane] = INVALID_INDEX;
+    }
+    packed.blocks.assign((laneCount + TRIANGLE_BLOCK_WIDTH - 1) / TRIANGLE_BLOCK_WIDTH, unused);
+    for (const LeafRange &leaf : leaves) {
+        uint32_t firstLane = packed.leafLanes[leaf.first];
+        for (uint32_t i = 0; i < leaf.count; i++) {
+            TriangleBlock &block = packed.blocks[(firstLane + i) / TRIANGLE_BLOCK_WIDTH];
+            uint32_t lane = (firstLane + i) % TRIANGLE_BLOCK_WIDTH;
+            uint32_t prim = primIndices[leaf.first + i];
+            SetLaneVertices(positions, indices, prim, lane, block);
+            block.primIds[lane] = prim;
+        }
+    }
+}
+} // namespace
+
+void PackTriangleBlocks(const Bvh &bvh, const std::vector<float> &positions, const std::vector<uint32_t> &indices,
+                        TriangleBlocks &packed)
+{
+    std::vector<LeafRange> leaves;
+    for (const BvhNode &node : bvh.nodes) {
+        if (IsLeaf(node)) {
+            leaves.push_back(LeafRange {node.leftFirst, node.primCount});
+        }
+    }
+    PackLeaves(leaves, bvh.primIndices, positions, indices, packed);
+}
+
+void PackTriangleBlocks(const QuantizedBvh &quantized, const std::vector<float> &positions,
+                        const std::vector<uint32_t> &indices, TriangleBlocks &packed)
+{
+    std::vector<LeafRange> leaves;
+    for (const QuantizedBvhNode &node : quantized.nodes) {
+        for (uint32_t slot = 0; slot < QUANTIZED_BVH_WIDTH; slot++) {
+            uint32_t meta = node.meta[slot];
+            if (meta != 0 && !(meta & QUANTIZED_INNER_BIT)) {
+                leaves.push_back(LeafRange {node.primBase + (meta & QUANTIZED_OFFSET_MASK),
+                                           meta >> QUANTIZED_COUNT_SHIFT});
+            }
+        }
+    }
+    PackLeaves(leaves, quantized.primIndices, positions, indices, packed);
+}
+
+void RefreshTriangleBlocks(const std::vector<float> &positions, const std::vector<uint32_t> &indices,
+                           TriangleBlocks &packed, ThreadPool *pool)
+{
+    auto refreshRange = [&positions, &indices, &packed](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            TriangleBlock &block = packed.blocks[i];
+            for (uint32_t lane = 0; lane < TRIANGLE_BLOCK_WIDTH; lane++) {
+                if (block.primIds[lane] != INVALID_INDEX) {
+                    SetLaneVertices(positions, indices, block.primIds[lane], lane, block);
+                }
+            }
+        }
+    };
+    uint32_t blockCount = static_cast<uint32_t>(packed.blocks.size());
+    if (pool != nullptr) {
+        pool->ParallelFor(0, blockCount, REFRESH_GRAIN_SIZE, refreshRange);
+    } else {
+        refreshRange(0, blockCount);
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Packed leaf triangles of the RayShop cpu backend, read by the vector traversal kernels.
+ */
+
+#ifndef RAYSHOP_CPU_TRIANGLEBLOCK_H
+#define RAYSHOP_CPU_TRIANGLEBLOCK_H
+
+#include "BVH.h"
+#include "QuantizedBvh.h"
+#include "ThreadPool.h"
+
+namespace RayShop {
+namespace Cpu {
+constexpr uint32_t TRIANGLE_BLOCK_WIDTH = 4;
+
+/// @brief Four leaf triangles, structure-of-arrays so that one vector instruction handles the same coordinate
+/// of every triangle. The watertight test needs the vertices themselves rather than edges.
+struct TriangleBlock {
+    float v0[AXIS_COUNT][TRIANGLE_BLOCK_WIDTH];
+    float v1[AXIS_COUNT][TRIANGLE_BLOCK_WIDTH];
+    float v2[AXIS_COUNT][TRIANGLE_BLOCK_WIDTH];
+    uint32_t primIds[TRIANGLE_BLOCK_WIDTH]; /* *< INVALID_INDEX, and zero vertices, in the unused lanes. */
+};
+
+/// @brief The triangles of every leaf of one bvh layout in consecutive lanes. Small leaves share blocks but
+/// never straddle two, so that a leaf of up to four triangles costs one block test.
+struct TriangleBlocks {
+    std::vector<TriangleBlock> blocks;
+    std::vector<uint32_t> leafLanes;    /* *< block * 4 + lane of the leaf starting at each primIndices entry. */
+};
+
+/**
+ * Pack the leaves of the binary bvh, whose wide forms share its primIndices, or of the quantized bvh.
+ * @param[in]   positions, indices      The triangle mesh the primIndices refer to.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+void PackTriangleBlocks(const Bvh &bvh, const std::vector<float> &positions, const std::vector<uint32_t> &indices,
+                        TriangleBlocks &packed);
+void PackTriangleBlocks(const QuantizedBvh &quantized, const std::vector<float> &positions,
+                        const std::vector<uint32_t> &indices, TriangleBlocks &packed);
+
+/**
+ * Copy moved vertices into the blocks in place, keeping the lanes, as a refit leaves the leaves as they are.
+ * @param[in]   pool        The worker pool, nullptr to refresh on the calling thread.
+ */
+void RefreshTriangleBlocks(const std::vector<float> &positions, const std::vector<uint32_t> &indices,
+                           TriangleBlocks &packed, ThreadPool *pool);
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_TRIANGLEBLOCK_H
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Wide bvh layout traversed with vector instructions by the RayShop cpu backend.
+ */
+
+#include "WideBvh.h"
+#include "Simd.h"
+
+#include <utility>
+
+namespace RayShop {
+namespace Cpu {
+namespace {
+constexpr uint32_t WIDTH_4 = 4;
+constexpr uint32_t WIDTH_8 = 8;
+constexpr uint32_t REFIT_GRAIN_SIZE = 1024;     /* *< Wide nodes per chunk of a parallel refit. */
+
+template <uint32_t WIDTH>
+WideNode<WIDTH> EmptyWideNode()
+{
+    WideNode<WIDTH> node;
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        for (uint32_t slot = 0; slot < WIDTH; slot++) {
+            node.lower[axis][slot] = FLOAT_MAX;
+            node.upper[axis][slot] = -FLOAT_MAX;
+        }
+    }
+    for (uint32_t slot = 0; slot < WIDTH; slot++) {
+        node.children[slot] = INVALID_INDEX;
+        node.primCounts[slot] = 0;
+    }
+    return node;
+}
+
+template <uint32_t WIDTH>
+void SetSlotBounds(const BvhNode &child, uint32_t slot, WideNode<WIDTH> &node)
+{
+    for (int axis = 0; axis < AXIS_COUNT; axis++) {
+        node.lower[axis][slot] = child.lower[axis];
+        node.upper[axis][slot] = child.upper[axis];
+    }
+}
+
+template <uint32_t WIDTH>
+void MapWideSlots(const WideBvh<WIDTH> &wide, uint32_t binaryNodeCount, std::vector<uint32_t> &slots)
+{
+    slots.assign(binaryNodeCount, INVALID_INDEX);
+    for (uint32_t i = 0; i < wide.sources.size(); i++) {
+        if (wide.sources[i] != INVALID_INDEX) {
+            slots[wide.sources[i]] = i;
+        }
+    }
+}
+
+template <uint32_t WIDTH>
+void RefitWideSlot(const Bvh &bvh, const std::vector<uint32_t> &slots, uint32_t binaryIndex, WideBvh<WIDTH> &wide)
+{
+    uint32_t slot = slots[binaryIndex];
+    if (slot != INVALID_INDEX) {
+        SetSlotBounds(bvh.nodes[binaryIndex], slot % WIDTH, wide.nodes[slot / WIDTH]);
+    }
+}
+} // namespace
+
+template <uint32_t WIDTH>
+uint32_t GatherWideChildren(const Bvh &bvh, uint32_t binaryIndex, uint32_t (&children)[WIDTH])
+{
+    const BvhNode &node = bvh.nodes[binaryIndex];
+    if (IsLeaf(node)) {
+        children[0] = binaryIndex;
+        return 1;
+    }
+    children[0] = node.leftFirst;
+    children[1] = node.leftFirst + 1;
+    uint32_t childCount = 2;
+    while (childCount < WIDTH) {
+        uint32_t largest = INVALID_INDEX;
+        float largestArea = -1.0f;
+        for (uint32_t i = 0; i < childCount; i++) {
+            const BvhNode &child = bvh.nodes[children[i]];
+            float area = HalfArea(NodeBounds(child));
+            if (!IsLeaf(child) && area > largestArea) {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest == INVALID_INDEX) {
+            break;
+        }
+        uint32_t opened = bvh.nodes[children[largest]].leftFirst;
+        children[largest] = opened;
+        children[childCount++] = opened + 1;
+    }
+    return childCount;
+}
+
+template <uint32_t WIDTH>
+void CollapseBvh(const Bvh &bvh, WideBvh<WIDTH> &wide)
+{
+    wide.nodes.clear();
+    wide.nodes.push_back(EmptyWideNode<WIDTH>());
+    wide.sources.assign(WIDTH, INVALID_INDEX);
+    if (bvh.primIndices.empty()) {
+        return;
+    }
+    // Pairs of binary node and the wide node it turns into.
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    stack.emplace_back(0, 0);
+    while (!stack.empty()) {
+        uint32_t binaryIndex = stack.back().first;
+        uint32_t wideIndex = stack.back().second;
+        stack.pop_back();
+        uint32_t children[WIDTH];
+        uint32_t childCount = GatherWideChildren<WIDTH>(bvh, binaryIndex, children);
+        for (uint32_t slot = 0; slot < childCount; slot++) {
+            const BvhNode &child = bvh.nodes[children[slot]];
+            uint32_t target = child.leftFirst;
+            if (!IsLeaf(child)) {
+                target = static_cast<uint32_t>(wide.nodes.size());
+                wide.nodes.push_back(EmptyWideNode<WIDTH>());
+                wide.sources.insert(wide.sources.end(), WIDTH, INVALID_INDEX);
+                stack.emplace_back(children[slot], target);
+            }
+            WideNode<WIDTH> &node = wide.nodes[wideIndex];
+            SetSlotBounds(child, slot, node);
+            wide.sources[wideIndex * WIDTH + slot] = children[slot];
+            node.children[slot] = target;
+            node.primCounts[slot] = child.primCount;
+        }
+    }
+}
+
+template <uint32_t WIDTH>
+void RefitWideBvh(const Bvh &bvh, WideBvh<WIDTH> &wide, ThreadPool *pool)
+{
+    auto refitRange = [&bvh, &wide](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            const uint32_t *sources = &wide.sources[i * WIDTH];
+            for (uint32_t slot = 0; slot < WIDTH && sources[slot] != INVALID_INDEX; slot++) {
+                SetSlotBounds(bvh.nodes[sources[slot]], slot, wide.nodes[i]);
+            }
+        }
+    };
+    uint32_t nodeCount = static_cast<uint32_t>(wide.nodes.size());
+    if (pool != nullptr) {
+        pool->ParallelFor(0, nodeCount, REFIT_GRAIN_SIZE, refitRange);
+    } else {
+        refitRange(0, nodeCount);
+    }
+}
+
+template uint32_t GatherWideChildren<WIDTH_4>(const Bvh &bvh, uint32_t binaryIndex, uint32_t (&children)[WIDTH_4]);
+template uint32_t GatherWideChildren<WIDTH_8>(const Bvh &bvh, uint32_t binaryIndex, uint32_t (&children)[WIDTH_8]);
+template void CollapseBvh<WIDTH_4>(const Bvh &bvh, WideBvh<WIDTH_4> &wide);
+template void CollapseBvh<WIDTH_8>(const Bvh &bvh, WideBvh<WIDTH_8> &wide);
+template void RefitWideBvh<WIDTH_4>(const Bvh &bvh, WideBvh<WIDTH_4> &wide, ThreadPool *pool);
+template void RefitWideBvh<WIDTH_8>(const Bvh &bvh, WideBvh<WIDTH_8> &wide, ThreadPool *pool);
+
+void WideBvhSet::Update(const Bvh &bvh)
+{
+    uint32_t width = GetBvhWidth(GetSimdIsa());
+    if (width == WIDTH_8) {
+        CollapseBvh(bvh, bvh8);
+    } else {
+        bvh8 = WideBvh<WIDTH_8> {};
+    }
+    if (width == WIDTH_4) {
+        CollapseBvh(bvh, bvh4);
+    } else {
+        bvh4 = WideBvh<WIDTH_4> {};
+    }
+}
+
+void WideBvhSet::Refit(const Bvh &bvh, ThreadPool *pool)
+{
+    // Only the width collapsed by Update has nodes.
+    RefitWideBvh(bvh, bvh8, pool);
+    RefitWideBvh(bvh, bvh4, pool);
+}
+
+void WideBvhSet::MapSlots(uint32_t binaryNodeCount, std::vector<uint32_t> &slots) const
+{
+    if (!bvh8.nodes.empty()) {
+        MapWideSlots(bvh8, binaryNodeCount, slots);
+    } else {
+        MapWideSlots(bvh4, binaryNodeCount, slots);
+    }
+}
+
+void WideBvhSet::RefitSlot(const Bvh &bvh, const std::vector<uint32_t> &slots, uint32_t binaryIndex)
+{
+    if (!bvh8.nodes.empty()) {
+        RefitWideSlot(bvh, slots, binaryIndex, bvh8);
+    } else {
+        RefitWideSlot(bvh, slots, binaryIndex, bvh4);
+    }
+}
+} // namespace Cpu
+} // namespace RayShop
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Wide bvh layout traversed with vector instructions by the RayShop cpu backend.
+ */
+
+#ifndef RAYSHOP_CPU_WIDEBVH_H
+#define RAYSHOP_CPU_WIDEBVH_H
+
+#include "BVH.h"
+#include "ThreadPool.h"
+
+namespace RayShop {
+namespace Cpu {
+/// @brief A node with up to WIDTH children, bounds stored structure-of-arrays so that one vector
+/// instruction handles the same plane of every child. Unused slots have empty bounds.
+template <uint32_t WIDTH>
+struct WideNode {
+    float lower[AXIS_COUNT][WIDTH];
+    float upper[AXIS_COUNT][WIDTH];
+    uint32_t children[WIDTH];       /* *< Wide node index of an inner child, first primIndices entry of a leaf. */
+    uint32_t primCounts[WIDTH];     /* *< Primitive count of a leaf child, 0 for an inner child or an unused slot. */
+};
+
+/// @brief The wide form of a binary bvh. Leaves keep referring to the primIndices of the binary bvh.
+template <uint32_t WIDTH>
+struct WideBvh {
+    std::vector<WideNode<WIDTH>> nodes;     /* *< The root is nodes[0]. */
+    std::vector<uint32_t> sources;          /* *< The binary node of every slot, WIDTH per node, for refits. */
+};
+
+/**
+ * Gather the binary nodes that become the children of one wide node: the children of the binary node,
+ * opening the inner child with the largest surface area until WIDTH slots are used.
+ * @return The child count; a leaf gathers only itself.
+ */
+template <uint32_t WIDTH>
+uint32_t GatherWideChildren(const Bvh &bvh, uint32_t binaryIndex, uint32_t (&children)[WIDTH]);
+
+/**
+ * Collapse a binary bvh into a wide one, each wide node taking the children gathered by GatherWideChildren.
+ * @note Throws std::bad_alloc when memory runs out.
+ */
+template <uint32_t WIDTH>
+void CollapseBvh(const Bvh &bvh, WideBvh<WIDTH> &wide);
+
+/**
+ * Copy the bounds of a refitted binary bvh into the slots collapsed from it, keeping the wide topology.
+ * Every node only reads its own sources, so the nodes are refitted in parallel.
+ * @param[in]   pool        The worker pool, nullptr to refit on the calling thread.
+ */
+template <uint32_t WIDTH>
+void RefitWideBvh(const Bvh &bvh, WideBvh<WIDTH> &wide, ThreadPool *pool);
+
+/// @brief The wide bvh of whichever width the kernels of the running cpu traverse; the other stays empty.
+struct WideBvhSet {
+    WideBvh<4> bvh4;
+    WideBvh<8> bvh8;
+
+    /**
+     * Collapse the binary bvh for the detected instruction set.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    void Update(const Bvh &bvh);
+
+    /**
+     * Refit the collapsed bvh after RefitBvh, without collapsing it again.
+     * @param[in]   pool        The worker pool, nullptr to refit on the calling thread.
+     */
+    void Refit(const Bvh &bvh, ThreadPool *pool);
+
+    /**
+     * Store the slot of the collapsed bvh that every binary node feeds, as wide node index * WIDTH + slot, or
+     * INVALID_INDEX for the nodes opened into the slots of their parent.
+     * @note Throws std::bad_alloc when memory runs out.
+     */
+    void MapSlots(uint32_t binaryNodeCount, std::vector<uint32_t> &slots) const;
+
+    /**
+     * Refit only the slot fed by a refitted binary node, e.g. on the path from a moved leaf to the root.
+     * @param[in]   slots       The map from MapSlots.
+     */
+    void RefitSlot(const Bvh &bvh, const std::vector<uint32_t> &slots, uint32_t binaryIndex);
+};
+
+template <uint32_t WIDTH>
+const WideBvh<WIDTH> &GetWideBvh(const WideBvhSet &set);
+
+template <>
+inline const WideBvh<4> &GetWideBvh<4>(const WideBvhSet &set)
+{
+    return set.bvh4;
+}
+
+template <>
+inline const WideBvh<8> &GetWideBvh<8>(const WideBvhSet &set)
+{
+    return set.bvh8;
+}
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_WIDEBVH_H
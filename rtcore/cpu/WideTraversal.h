@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Wide bvh traversal of the RayShop cpu backend, shared by the per instruction set kernels.
+ */
+
+#ifndef RAYSHOP_CPU_WIDETRAVERSAL_H
+#define RAYSHOP_CPU_WIDETRAVERSAL_H
+
+#include <algorithm>
+
+#include "QuantizedBvh.h"
+#include "RayKernels.h"
+#include "RayTracer.h"
+#include "TopLevel.h"
+#include "TriangleBlock.h"
+#include "WideBvh.h"
+
+// Each instruction set kernel includes this header inside its target region and instantiates the
+// templates with a node test and an Ops class of internal linkage, so no vector code leaks into other
+// translation units. The Ops class is the one of PacketTraversal.h, four lanes wide here.
+namespace RayShop {
+namespace Cpu {
+/// @brief A child waiting on the traversal stack.
+struct WideStackEntry {
+    uint32_t index;                 /* *< Wide node index, or first primIndices entry of a leaf. */
+    uint32_t primCount;             /* *< 0 for an inner node. */
+    float tEntry;                   /* *< Where the ray enters the child, to skip it once a closer hit exists. */
+};
+
+/**
+ * Walk a wide bvh nearest child first.
+ * NodeTest::Intersect(node, ray, tEntries) tests all children of a node at once and returns the mask of
+ * hit slots; leaf(first, count) intersects a leaf and returns true to stop the walk.
+ * @return true when the leaf callback stopped the walk.
+ */
+template <uint32_t WIDTH, typename NodeTest, typename LeafFunc>
+bool TraverseWideBvh(const WideBvh<WIDTH> &wide, LocalRay &ray, const LeafFunc &leaf)
+{
+    // Every pop pushes at most WIDTH children and the tree is no deeper than BVH_MAX_DEPTH.
+    constexpr uint32_t stackCapacity = BVH_MAX_DEPTH * (WIDTH - 1) + 1;
+    WideStackEntry stack[stackCapacity];
+    if (wide.nodes.empty()) {
+        return false;
+    }
+    uint32_t stackSize = 0;
+    stack[stackSize++] = WideStackEntry {0, 0, ray.tmin};
+    while (stackSize != 0) {
+        WideStackEntry entry = stack[--stackSize];
+        if (entry.tEntry > ray.tmax) {
+            continue;
+        }
+        if (entry.primCount != 0) {
+            if (leaf(entry.index, entry.primCount)) {
+                return true;
+            }
+            continue;
+        }
+        const WideNode<WIDTH> &node = wide.nodes[entry.index];
+        float tEntries[WIDTH];
+        uint32_t mask = NodeTest::Intersect(node, ray, tEntries);
+        // Insert the hit children farthest first, so that the nearest one is popped next.
+        uint32_t first = stackSize;
+        while (mask != 0) {
+            uint32_t slot = static_cast<uint32_t>(__builtin_ctz(mask));
+            mask &= mask - 1;
+            WideStackEntry child {node.children[slot], node.primCounts[slot], tEntries[slot]};
+            uint32_t position = stackSize++;
+            while (position > first && stack[position - 1].tEntry < child.tEntry) {
+                stack[position] = stack[position - 1];
+                position--;
+            }
+            stack[position] = child;
+        }
+    }
+    return false;
+}
+
+/**
+ * Walk a quantized bvh nearest child first, like TraverseWideBvh.
+ * NodeTest::IntersectQuantized(node, ray, tEntries) decodes and tests the four children of a node at once;
+ * leaf(first, count) intersects quantized.primIndices[first] to quantized.primIndices[first + count - 1].
+ * @return true when the leaf callback stopped the walk.
+ */
+template <typename NodeTest, typename LeafFunc>
+bool TraverseQuantizedBvh(const QuantizedBvh &quantized, LocalRay &ray, const LeafFunc &leaf)
+{
+    // Oversized leaves are cut into runs on extra levels below BVH_MAX_DEPTH, which push children as well.
+    constexpr uint32_t stackCapacity = QUANTIZED_BVH_MAX_DEPTH * (QUANTIZED_BVH_WIDTH - 1) + 1;
+    WideStackEntry stack[stackCapacity];
+    if (quantized.nodes.empty()) {
+        return false;
+    }
+    uint32_t stackSize = 0;
+    stack[stackSize++] = WideStackEntry {0, 0, ray.tmin};
+    while (stackSize != 0) {
+        WideStackEntry entry = stack[--stackSize];
+        if (entry.tEntry > ray.tmax) {
+            continue;
+        }
+        if (entry.primCount != 0) {
+            if (leaf(entry.index, entry.primCount)) {
+                return true;
+            }
+            continue;
+        }
+        const QuantizedBvhNode &node = quantized.nodes[entry.index];
+        float tEntries[QUANTIZED_BVH_WIDTH];
+        uint32_t mask = NodeTest::IntersectQuantized(node, ray, tEntries);
+        uint32_t first = stackSize;
+        while (mask != 0) {
+            uint32_t slot = static_cast<uint32_t>(__builtin_ctz(mask));
+            mask &= mask - 1;
+            uint32_t meta = node.meta[slot];
+            WideStackEntry child = (meta & QUANTIZED_INNER_BIT) ?
+                WideStackEntry {node.childBase + (meta & ~QUANTIZED_INNER_BIT), 0, tEntries[slot]} :
+                WideStackEntry {node.primBase + (meta & QUANTIZED_OFFSET_MASK), meta >> QUANTIZED_COUNT_SHIFT,
+                                tEntries[slot]};
+            uint32_t position = stackSize++;
+            while (position > first && stack[position - 1].tEntry < child.tEntry) {
+                stack[position] = stack[position - 1];
+                position--;
+            }
+            stack[position] = child;
+        }
+    }
+    return false;
+}
+
+/**
+ * IntersectTriangle for the four triangles of a block, in the same order of operations.
+ * @return The mask of the lanes that hit.
+ */
+template <typename Ops, uint32_t FLAGS, bool COORDINATES>
+uint32_t IntersectTriangleBlock(const TriangleBlock &block, const LocalRay &ray, float *t, float *u, float *v)
+{
+    static_assert(Ops::WIDTH == TRIANGLE_BLOCK_WIDTH, "a block is tested in one go");
+    using Float = typename Ops::Float;
+    Float shearX = Ops::Set(ray.shear[0]);
+    Float shearY = Ops::Set(ray.shear[1]);
+    Float shearZ = Ops::Set(ray.shear[2]);
+    Float originX = Ops::Set(ray.origin[ray.kx]);
+    Float originY = Ops::Set(ray.origin[ray.ky]);
+    Float originZ = Ops::Set(ray.origin[ray.kz]);
+    Float az = Ops::Sub(Ops::Load(block.v0[ray.kz]), originZ);
+    Float bz = Ops::Sub(Ops::Load(block.v1[ray.kz]), originZ);
+    Float cz = Ops::Sub(Ops::Load(block.v2[ray.kz]), originZ);
+    Float ax = Ops::Sub(Ops::Sub(Ops::Load(block.v0[ray.kx]), originX), Ops::Mul(shearX, az));
+    Float ay = Ops::Sub(Ops::Sub(Ops::Load(block.v0[ray.ky]), originY), Ops::Mul(shearY, az));
+    Float bx = Ops::Sub(Ops::Sub(Ops::Load(block.v1[ray.kx]), originX), Ops::Mul(shearX, bz));
+    Float by = Ops::Sub(Ops::Sub(Ops::Load(block.v1[ray.ky]), originY), Ops::Mul(shearY, bz));
+    Float cx = Ops::Sub(Ops::Sub(Ops::Load(block.v2[ray.kx]), originX), Ops::Mul(shearX, cz));
+    Float cy = Ops::Sub(Ops::Sub(Ops::Load(block.v2[ray.ky]), originY), Ops::Mul(shearY, cz));
+    Float edgeU = Ops::Sub(Ops::Mul(cx, by), Ops::Mul(cy, bx));
+    Float edgeV = Ops::Sub(Ops::Mul(ax, cy), Ops::Mul(ay, cx));
+    Float edgeW = Ops::Sub(Ops::Mul(bx, ay), Ops::Mul(by, ax));
+    Float zero = Ops::Set(0.0f);
+    Float notNegative = Ops::LessEqual(zero, Ops::Min(Ops::Min(edgeU, edgeV), edgeW));
+    Float notPositive = Ops::LessEqual(Ops::Max(Ops::Max(edgeU, edgeV), edgeW), zero);
+    Float valid = (FLAGS & TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES) ? notNegative :
+        (FLAGS & TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES) ? notPositive : Ops::Or(notNegative, notPositive);
+    Float det = Ops::Add(Ops::Add(edgeU, edgeV), edgeW);
+    Float invDet = Ops::Div(Ops::Set(1.0f), det);
+    Float termU = Ops::Mul(edgeU, Ops::Mul(shearZ, az));
+    Float termV = Ops::Mul(edgeV, Ops::Mul(shearZ, bz));
+    Float termW = Ops::Mul(edgeW, Ops::Mul(shearZ, cz));
+    Float dist = Ops::Mul(Ops::Add(Ops::Add(termU, termV), termW), invDet);
+    Float inRange = Ops::And(Ops::LessEqual(Ops::Set(ray.tmin), dist), Ops::LessEqual(dist, Ops::Set(ray.tmax)));
+    valid = Ops::And(valid, inRange);
+    Ops::Store(t, dist);
+    if (COORDINATES) {
+        Ops::Store(u, Ops::Mul(edgeV, invDet));
+        Ops::Store(v, Ops::Mul(edgeW, invDet));
+    }
+    uint32_t flat = Ops::MoveMask(Ops::And(Ops::LessEqual(det, zero), Ops::LessEqual(zero, det)));
+    return Ops::MoveMask(valid) & ~flat;
+}
+
+/**
+ * IntersectLeaf over the triangle blocks of a leaf. Of the hits of one block the nearest is kept, the last one
+ * on a tie, and an any-hit query takes the first one, as IntersectLeaf visiting the triangles in order would.
+ * @param[in]   firstLane   The TriangleBlocks::leafLanes entry of the leaf.
+ */
+template <typename Ops, uint32_t FLAGS, TraceRayHitFormat FORMAT>
+bool IntersectLeafBlocks(const TriangleBlock *blocks, uint32_t firstLane, uint32_t count, LocalRay &ray,
+                         uint32_t instId, RayHit &hit)
+{
+    using Traits = HitFormatTraits<FORMAT>;
+    float t[TRIANGLE_BLOCK_WIDTH];
+    float u[TRIANGLE_BLOCK_WIDTH];
+    float v[TRIANGLE_BLOCK_WIDTH];
+    const TriangleBlock *block = &blocks[firstLane / TRIANGLE_BLOCK_WIDTH];
+    uint32_t lane0 = firstLane % TRIANGLE_BLOCK_WIDTH;
+    for (uint32_t remaining = count; remaining != 0; block++) {
+        uint32_t laneEnd = std::min(TRIANGLE_BLOCK_WIDTH, lane0 + remaining);
+        uint32_t mask = IntersectTriangleBlock<Ops, FLAGS, Traits::COORDINATES>(*block, ray, t, u, v);
+        mask &= ((1u << laneEnd) - 1) & ~((1u << lane0) - 1);
+        remaining -= laneEnd - lane0;
+        lane0 = 0;
+        if (mask == 0) {
+            continue;
+        }
+        uint32_t lane = static_cast<uint32_t>(__builtin_ctz(mask));
+        if (!(FLAGS & TRACERAY_FLAG_ANY_HIT)) {
+            for (mask &= mask - 1; mask != 0; mask &= mask - 1) {
+                uint32_t other = static_cast<uint32_t>(__builtin_ctz(mask));
+                lane = t[other] <= t[lane] ? other : lane;
+            }
+        }
+        ray.tmax = t[lane];
+        hit.t = t[lane];
+        if (Traits::PRIMITIVE) {
+            hit.primId = block->primIds[lane];
+        }
+        if (Traits::INSTANCE) {
+            hit.instId = instId;
+        }
+        if (Traits::COORDINATES) {
+            hit.u = u[lane];
+            hit.v = v[lane];
+        }
+        if (FLAGS & TRACERAY_FLAG_ANY_HIT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Trace one ray through the wide top level structure and the wide bottom levels of its instances.
+template <uint32_t WIDTH, typename NodeTest, typename BlockOps, uint32_t FLAGS, TraceRayHitFormat FORMAT>
+void TraceRayWide(const TopLevel &tlas, const Ray &ray, RayHit &hit)
+{
+    hit = RayHit {MISS_DISTANCE, INVALID_INDEX, INVALID_INDEX, 0.0f, 0.0f};
+    const uint32_t *instIndices = tlas.GetBvh().primIndices.data();
+    LocalRay worldRay;
+    PrepareRay(ray.origin, ray.dir, ray.tmin, ray.tmax, worldRay);
+    auto intersectInstances = [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t instId = instIndices[first + i];
+            const Instance &instance = tlas.GetInstance(instId);
+            const BottomLevel &blas = *instance.blas;
+            float origin[AXIS_COUNT];
+            float dir[AXIS_COUNT];
+            TransformPoint(instance.worldToObject, ray.origin, origin);
+            TransformVector(instance.worldToObject, ray.dir, dir);
+            LocalRay localRay;
+            PrepareRay(origin, dir, worldRay.tmin, worldRay.tmax, localRay);
+            const QuantizedBvh &quantized = blas.GetQuantizedBvh();
+            const TriangleBlocks &packed = blas.GetTriangleBlocks();
+            auto intersectLeaf = [&](uint32_t firstPrim, uint32_t primCount) {
+                return IntersectLeafBlocks<BlockOps, FLAGS, FORMAT>(packed.blocks.data(), packed.leafLanes[firstPrim],
+                                                                    primCount, localRay, instId, hit);
+            };
+            bool done = quantized.nodes.empty() ?
+                TraverseWideBvh<WIDTH, NodeTest>(GetWideBvh<WIDTH>(blas.GetWideBvhs()), localRay, intersectLeaf) :
+                TraverseQuantizedBvh<NodeTest>(quantized, localRay, intersectLeaf);
+            worldRay.tmax = localRay.tmax;
+            if (done) {
+                return true;
+            }
+        }
+        return false;
+    };
+    TraverseWideBvh<WIDTH, NodeTest>(GetWideBvh<WIDTH>(tlas.GetWideBvhs()), worldRay, intersectInstances);
+}
+
+/// @brief The wide kernel of a flag and hit format combination, for SelectKernel.
+template <uint32_t WIDTH, typename NodeTest, typename BlockOps>
+struct WideRayKernel {
+    template <uint32_t FLAGS, TraceRayHitFormat FORMAT>
+    struct Kernel {
+        static void Run(const TopLevel &tlas, const Ray *rays, uint32_t count, void *hits)
+        {
+            for (uint32_t i = 0; i < count; i++) {
+                RayHit hit;
+                TraceRayWide<WIDTH, NodeTest, BlockOps, FLAGS, FORMAT>(tlas, rays[i], hit);
+                StoreHit<FORMAT>(hit, hits, i);
+            }
+        }
+    };
+};
+} // namespace Cpu
+} // namespace RayShop
+
+#endif // RAYSHOP_CPU_WIDETRAVERSAL_H
@@ -0,0 +1,1835 @@
+/*
+ * Copyright (c) Huawei Technologies Co., Ltd. 2019-2021. All rights reserved.
+ * Description: Tests of the RayShop cpu backend against a brute-force reference.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Traversal.h"
+#include "../BlasFile.h"
+#include "../SharedSegment.h"
+
+using namespace RayShop;
+using namespace RayShop::Vulkan;
+
+namespace {
+constexpr uint32_t RAY_COUNT = 5003;        /* *< Past the reordering threshold, and not a multiple of 32. */
+constexpr uint32_t REORDER_RAY_COUNT = 40003;   /* *< Two whole chunks of reordered rays, and a partial one. */
+constexpr uint32_t REGION_WIDTH = 67;       /* *< Not a multiple of the 8x8 packets. */
+constexpr uint32_t REGION_HEIGHT = 45;
+constexpr double EDGE_EPSILON = 1e-5;       /* *< Barycentrics this close to an edge may go either way. */
+constexpr double DISTANCE_EPSILON = 1e-4;   /* *< Relative, between the float kernels and the reference. */
+constexpr double GRAZING_COSINE = 1e-3;     /* *< Below it, the float rounding of the ray shifts the barycentrics. */
+constexpr float UV_TOLERANCE = 1e-3f;
+constexpr double MAX_AMBIGUOUS_FRACTION = 0.02;
+constexpr uint32_t MAX_REPORTS = 20;
+constexpr uint32_t SLOW_BUILD_TRIANGLES = 20000;
+constexpr uint32_t SCRAMBLE_STRIDE = 7919;  /* *< A prime, so that every vertex moves toward a different one. */
+constexpr float REBUILD_SAH_RATIO = 2.0f;
+constexpr auto REBUILD_TIMEOUT = std::chrono::seconds(20);
+constexpr uint32_t QUANTIZED_TREE_MAX_DEPTH = 80;  /* *< BVH_MAX_DEPTH and the levels of cut leaves. */
+constexpr uint8_t HIT_FILL = 0xA5;          /* *< Hit buffers start out with it, to catch bytes left unwritten. */
+constexpr double PI = 3.14159265358979323846;
+
+int g_failures = 0;
+
+void Expect(bool ok, const std::string &what, const char *file, int line)
+{
+    if (!ok) {
+        if (++g_failures <= static_cast<int>(MAX_REPORTS)) {
+            printf("%s:%d: %s\n", file, line, what.c_str());
+        }
+    }
+}
+
+#define EXPECT(condition, context) Expect((condition), std::string(#condition) + " [" + (context) + "]", \
+                                          __FILE__, __LINE__)
+
+struct TestMesh {
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+
+    GeometryTriangleDescription Describe() const
+    {
+        GeometryTriangleDescription geometry {};
+        geometry.vertices.type = BufferType::CPU;
+        geometry.vertices.cpuBuffer = const_cast<float *>(positions.data());
+        geometry.stride = 3;
+        geometry.verticesCount = static_cast<uint32_t>(positions.size() / 3);
+        geometry.indices.type = BufferType::CPU;
+        // An empty mesh still has to pass an index buffer.
+        static uint32_t noIndices[1] = {};
+        geometry.indices.cpuBuffer = indices.empty() ? noIndices : const_cast<uint32_t *>(indices.data());
+        geometry.indicesCount = static_cast<uint32_t>(indices.size());
+        return geometry;
+    }
+};
+
+struct TestInstance {
+    float transform[NUM_MAT][NUM_MAT];
+    uint32_t mesh;
+};
+
+struct Vec3 {
+    double x;
+    double y;
+    double z;
+};
+
+Vec3 Sub(const Vec3 &a, const Vec3 &b)
+{
+    return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+Vec3 Cross(const Vec3 &a, const Vec3 &b)
+{
+    return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+double Dot(const Vec3 &a, const Vec3 &b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+double Length(const Vec3 &a)
+{
+    return std::sqrt(Dot(a, a));
+}
+
+struct WorldTriangle {
+    Vec3 v[3];
+    uint32_t primId;
+    uint32_t instId;
+};
+
+/// @brief The world space triangles of a scene, the same for every build method.
+struct Scene {
+    std::vector<TestMesh> meshes;
+    std::vector<TestInstance> instances;
+    std::vector<WorldTriangle> triangles;
+
+    void Update()
+    {
+        triangles.clear();
+        for (uint32_t inst = 0; inst < instances.size(); inst++) {
+            const TestInstance &instance = instances[inst];
+            const TestMesh &mesh = meshes[instance.mesh];
+            for (uint32_t prim = 0; prim < mesh.indices.size() / 3; prim++) {
+                WorldTriangle triangle;
+                for (int corner = 0; corner < 3; corner++) {
+                    const float *p = &mesh.positions[mesh.indices[prim * 3 + corner] * 3];
+                    double world[3];
+                    for (int row = 0; row < 3; row++) {
+                        world[row] = instance.transform[3][row];
+                        for (int col = 0; col < 3; col++) {
+                            world[row] += static_cast<double>(instance.transform[col][row]) * p[col];
+                        }
+                    }
+                    triangle.v[corner] = {world[0], world[1], world[2]};
+                }
+                triangle.primId = prim;
+                triangle.instId = inst;
+                triangles.push_back(triangle);
+            }
+        }
+    }
+
+    std::vector<InstanceDescription> Describe(const std::vector<BLAS> &blases) const
+    {
+        std::vector<InstanceDescription> descriptions(instances.size());
+        for (size_t i = 0; i < instances.size(); i++) {
+            memcpy(descriptions[i].transform, instances[i].transform, sizeof(descriptions[i].transform));
+            descriptions[i].blas = blases[instances[i].mesh];
+        }
+        return descriptions;
+    }
+};
+
+/// A scale, a rotation about an axis and a translation, as a column-major 4x4 matrix.
+void MakeTransform(const float scale[3], int axis, double angle, const float translation[3],
+                   float transform[NUM_MAT][NUM_MAT])
+{
+    double rotation[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    int a = (axis + 1) % 3;
+    int b = (axis + 2) % 3;
+    rotation[a][a] = std::cos(angle);
+    rotation[a][b] = std::sin(angle);
+    rotation[b][a] = -std::sin(angle);
+    rotation[b][b] = std::cos(angle);
+    memset(transform, 0, sizeof(float) * NUM_MAT * NUM_MAT);
+    for (int col = 0; col < 3; col++) {
+        for (int row = 0; row < 3; row++) {
+            transform[col][row] = static_cast<float>(rotation[col][row] * scale[col]);
+        }
+        transform[3][col] = translation[col];
+    }
+    transform[3][3] = 1.0f;
+}
+
+TestMesh MakeTriangleSoup(uint32_t triangleCount, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> center(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> offset(-0.2f, 0.2f);
+    TestMesh mesh;
+    for (uint32_t i = 0; i < triangleCount; i++) {
+        float c[3] = {center(rng), center(rng), center(rng)};
+        for (int corner = 0; corner < 3; corner++) {
+            mesh.indices.push_back(static_cast<uint32_t>(mesh.positions.size() / 3));
+            for (int axis = 0; axis < 3; axis++) {
+                mesh.positions.push_back(c[axis] + offset(rng));
+            }
+        }
+    }
+    return mesh;
+}
+
+/// A closed sphere of shared vertices, counter-clockwise seen from outside.
+TestMesh MakeSphere(uint32_t stacks, uint32_t slices)
+{
+    TestMesh mesh;
+    for (uint32_t i = 0; i <= stacks; i++) {
+        double theta = PI * i / stacks;
+        for (uint32_t j = 0; j < slices; j++) {
+            double phi = 2.0 * PI * j / slices;
+            mesh.positions.push_back(static_cast<float>(std::sin(theta) * std::cos(phi)));
+            mesh.positions.push_back(static_cast<float>(std::cos(theta)));
+            mesh.positions.push_back(static_cast<float>(-std::sin(theta) * std::sin(phi)));
+        }
+    }
+    for (uint32_t i = 0; i < stacks; i++) {
+        for (uint32_t j = 0; j < slices; j++) {
+            uint32_t a = i * slices + j;
+            uint32_t b = i * slices + (j + 1) % slices;
+            uint32_t c = a + slices;
+            uint32_t d = b + slices;
+            if (i != 0) {
+                mesh.indices.insert(mesh.indices.end(), {a, c, b});
+            }
+            if (i + 1 != stacks) {
+                mesh.indices.insert(mesh.indices.end(), {b, c, d});
+            }
+        }
+    }
+    return mesh;
+}
+
+Scene MakeScene()
+{
+    Scene scene;
+    scene.meshes.push_back(MakeTriangleSoup(400, 1));
+    scene.meshes.push_back(MakeSphere(24, 32));
+    const float unit[3] = {1.0f, 1.0f, 1.0f};
+    const float origin[3] = {0.0f, 0.0f, 0.0f};
+    const float sphereScale[3] = {0.8f, 0.8f, 0.8f};
+    const float sphereTranslation[3] = {2.5f, 0.0f, 0.0f};
+    const float soupScale[3] = {1.5f, 0.5f, 1.0f};
+    const float soupTranslation[3] = {-2.0f, 1.0f, 0.5f};
+    TestInstance instance;
+    instance.mesh = 0;
+    MakeTransform(unit, 0, 0.0, origin, instance.transform);
+    scene.instances.push_back(instance);
+    instance.mesh = 1;
+    MakeTransform(sphereScale, 1, PI / 6, sphereTranslation, instance.transform);
+    scene.instances.push_back(instance);
+    instance.mesh = 0;
+    MakeTransform(soupScale, 2, PI / 3, soupTranslation, instance.transform);
+    scene.instances.push_back(instance);
+    scene.Update();
+    return scene;
+}
+
+/// A scene with an extra instance of a mesh without triangles.
+Scene MakeSceneWithEmptyMesh()
+{
+    Scene scene = MakeScene();
+    scene.meshes.emplace_back();
+    scene.meshes.back().positions = {0.0f, 0.0f, 0.0f};
+    TestInstance instance = scene.instances[0];
+    instance.mesh = static_cast<uint32_t>(scene.meshes.size() - 1);
+    scene.instances.push_back(instance);
+    scene.Update();
+    return scene;
+}
+
+/// Incoherent rays: half of them aimed at a point of a random triangle, some not normalized or cut short.
+std::vector<Ray> MakeRays(const Scene &scene, uint32_t count, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<Ray> rays(count);
+    for (Ray &ray : rays) {
+        Vec3 origin = {-4.0 + 8.5 * unit(rng), -2.5 + 5.5 * unit(rng), -2.5 + 5.0 * unit(rng)};
+        Vec3 dir;
+        if (unit(rng) < 0.5) {
+            const WorldTriangle &target = scene.triangles[rng() % scene.triangles.size()];
+            double u = unit(rng);
+            double v = unit(rng) * (1.0 - u);
+            Vec3 e1 = Sub(target.v[1], target.v[0]);
+            Vec3 e2 = Sub(target.v[2], target.v[0]);
+            Vec3 point = {target.v[0].x + u * e1.x + v * e2.x, target.v[0].y + u * e1.y + v * e2.y,
+                          target.v[0].z + u * e1.z + v * e2.z};
+            dir = Sub(point, origin);
+        } else {
+            dir = {unit(rng) * 2.0 - 1.0, unit(rng) * 2.0 - 1.0, unit(rng) * 2.0 - 1.0};
+        }
+        double scale = (0.5 + 1.5 * unit(rng)) / Length(dir);
+        ray.origin[0] = static_cast<float>(origin.x);
+        ray.origin[1] = static_cast<float>(origin.y);
+        ray.origin[2] = static_cast<float>(origin.z);
+        ray.dir[0] = static_cast<float>(dir.x * scale);
+        ray.dir[1] = static_cast<float>(dir.y * scale);
+        ray.dir[2] = static_cast<float>(dir.z * scale);
+        ray.tmin = unit(rng) < 0.125 ? static_cast<float>(unit(rng)) : 0.0f;
+        ray.tmax = unit(rng) < 0.25 ? static_cast<float>(0.5 + 5.5 * unit(rng)) : std::numeric_limits<float>::max();
+    }
+    return rays;
+}
+
+/// The primary rays of a pinhole camera in front of the scene, row by row.
+std::vector<Ray> MakeCameraRays()
+{
+    std::vector<Ray> rays(REGION_WIDTH * REGION_HEIGHT);
+    for (uint32_t y = 0; y < REGION_HEIGHT; y++) {
+        for (uint32_t x = 0; x < REGION_WIDTH; x++) {
+            Ray &ray = rays[y * REGION_WIDTH + x];
+            ray.origin[0] = 0.3f;
+            ray.origin[1] = 0.4f;
+            ray.origin[2] = 8.0f;
+            ray.dir[0] = (x + 0.5f) / REGION_WIDTH * 1.2f - 0.6f;
+            ray.dir[1] = 0.4f - (y + 0.5f) / REGION_HEIGHT * 0.8f;
+            ray.dir[2] = -1.0f;
+            ray.tmin = 0.0f;
+            ray.tmax = std::numeric_limits<float>::max();
+        }
+    }
+    return rays;
+}
+
+enum class Candidate {
+    NONE,
+    HIT,
+    UNSURE,     /* *< Too close to an edge, to tmin or tmax, or too grazing to tell apart. */
+};
+
+/// Möller-Trumbore in double precision. The front face is counter-clockwise seen from the ray origin.
+Candidate IntersectReference(const Ray &ray, const WorldTriangle &triangle, uint32_t rayFlags, double &t, double &u,
+                             double &v)
+{
+    Vec3 origin = {ray.origin[0], ray.origin[1], ray.origin[2]};
+    Vec3 dir = {ray.dir[0], ray.dir[1], ray.dir[2]};
+    Vec3 e1 = Sub(triangle.v[1], triangle.v[0]);
+    Vec3 e2 = Sub(triangle.v[2], triangle.v[0]);
+    Vec3 p = Cross(dir, e2);
+    double det = Dot(e1, p);
+    double cosine = std::fabs(det) / (Length(dir) * Length(Cross(e1, e2)));
+    if (!(cosine > 1e-9)) {
+        t = -std::numeric_limits<double>::infinity();
+        u = v = 0.0;
+        return Candidate::UNSURE;
+    }
+    Vec3 s = Sub(origin, triangle.v[0]);
+    Vec3 q = Cross(s, e1);
+    u = Dot(s, p) / det;
+    v = Dot(dir, q) / det;
+    t = Dot(e2, q) / det;
+    double margin = std::min(std::min(u, v), 1.0 - u - v);
+    double tolerance = DISTANCE_EPSILON * std::max(1.0, std::fabs(t));
+    if (margin < -EDGE_EPSILON || t < ray.tmin - tolerance || t > ray.tmax + tolerance) {
+        return Candidate::NONE;
+    }
+    bool front = det > 0.0;
+    if (((rayFlags & TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES) && !front) ||
+        ((rayFlags & TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES) && front)) {
+        return Candidate::NONE;
+    }
+    if (margin < EDGE_EPSILON || cosine < GRAZING_COSINE || std::fabs(t - ray.tmin) < tolerance ||
+        std::fabs(t - ray.tmax) < tolerance) {
+        return Candidate::UNSURE;
+    }
+    return Candidate::HIT;
+}
+
+/// @brief The closest hit of a ray, and whether float rounding may legitimately change it.
+struct ReferenceHit {
+    bool hit;
+    double t;
+    uint32_t primId;
+    uint32_t instId;
+    double u;
+    double v;
+    bool ambiguous;
+};
+
+ReferenceHit TraceReference(const Scene &scene, const Ray &ray, uint32_t rayFlags)
+{
+    ReferenceHit closest {false, std::numeric_limits<double>::infinity(), 0, 0, 0.0, 0.0, false};
+    double second = std::numeric_limits<double>::infinity();
+    double unsure = std::numeric_limits<double>::infinity();
+    for (const WorldTriangle &triangle : scene.triangles) {
+        double t;
+        double u;
+        double v;
+        Candidate candidate = IntersectReference(ray, triangle, rayFlags, t, u, v);
+        if (candidate == Candidate::UNSURE) {
+            unsure = std::min(unsure, t);
+        } else if (candidate == Candidate::HIT) {
+            if (t < closest.t) {
+                second = closest.t;
+                closest = {true, t, triangle.primId, triangle.instId, u, v, false};
+            } else {
+                second = std::min(second, t);
+            }
+        }
+    }
+    if (closest.hit) {
+        double tolerance = DISTANCE_EPSILON * std::max(1.0, closest.t);
+        closest.ambiguous = unsure <= closest.t + tolerance || second - closest.t <= tolerance;
+    } else {
+        closest.ambiguous = unsure != std::numeric_limits<double>::infinity();
+    }
+    return closest;
+}
+
+std::vector<ReferenceHit> TraceReference(const Scene &scene, const std::vector<Ray> &rays, uint32_t rayFlags)
+{
+    std::vector<ReferenceHit> hits(rays.size());
+    uint32_t ambiguous = 0;
+    for (size_t i = 0; i < rays.size(); i++) {
+        hits[i] = TraceReference(scene, rays[i], rayFlags);
+        ambiguous += hits[i].ambiguous ? 1 : 0;
+    }
+    EXPECT(ambiguous <= MAX_AMBIGUOUS_FRACTION * rays.size(), "too few rays left to compare");
+    return hits;
+}
+
+/// @brief A hit record of any format but OCCLUDED_BITS, widened.
+struct DecodedHit {
+    float t;
+    bool hasPrimitive;
+    bool hasInstance;
+    bool hasCoordinates;
+    uint32_t primId;
+    uint32_t instId;
+    float u;
+    float v;
+};
+
+DecodedHit DecodeHit(TraceRayHitFormat format, const uint8_t *hits, uint32_t index)
+{
+    DecodedHit decoded {};
+    const uint8_t *record = hits + static_cast<size_t>(index) * Traversal::GetHitFormatBytes(format);
+    memcpy(&decoded.t, record, sizeof(float));
+    uint32_t words[4] = {};
+    memcpy(words, record + sizeof(float), Traversal::GetHitFormatBytes(format) - sizeof(float));
+    switch (format) {
+        case TraceRayHitFormat::T_PRIMID:
+            decoded.hasPrimitive = true;
+            decoded.primId = words[0];
+            break;
+        case TraceRayHitFormat::T_PRIMID_U_V:
+            decoded.hasPrimitive = decoded.hasCoordinates = true;
+            decoded.primId = words[0];
+            memcpy(&decoded.u, &words[1], sizeof(float));
+            memcpy(&decoded.v, &words[2], sizeof(float));
+            break;
+        case TraceRayHitFormat::T_PRIMID_INSTID:
+            decoded.hasPrimitive = decoded.hasInstance = true;
+            decoded.primId = words[0];
+            decoded.instId = words[1];
+            break;
+        case TraceRayHitFormat::T_PRIMID_INSTID_U_V:
+            decoded.hasPrimitive = decoded.hasInstance = decoded.hasCoordinates = true;
+            decoded.primId = words[0];
+            decoded.instId = words[1];
+            memcpy(&decoded.u, &words[2], sizeof(float));
+            memcpy(&decoded.v, &words[3], sizeof(float));
+            break;
+        case TraceRayHitFormat::T_PRIMID_INSTID_PACKED:
+        case TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED:
+            decoded.hasPrimitive = decoded.hasInstance = true;
+            decoded.primId = words[0] & PACKED_PRIMITIVE_MASK;
+            decoded.instId = words[0] >> PACKED_PRIMITIVE_BITS;
+            if (format == TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED) {
+                decoded.hasCoordinates = true;
+                decoded.u = (words[1] & 0xFFFFu) / 65535.0f;
+                decoded.v = (words[1] >> 16) / 65535.0f;
+            }
+            break;
+        default:
+            break;
+    }
+    return decoded;
+}
+
+/// Whether a hit an any-hit query reported lies on the triangle it names, of any instance when it names none.
+bool IsOnTriangle(const Scene &scene, const Ray &ray, uint32_t rayFlags, const DecodedHit &hit)
+{
+    for (const WorldTriangle &triangle : scene.triangles) {
+        if ((hit.hasPrimitive && triangle.primId != hit.primId) || (hit.hasInstance && triangle.instId != hit.instId)) {
+            continue;
+        }
+        double t;
+        double u;
+        double v;
+        if (IntersectReference(ray, triangle, rayFlags, t, u, v) == Candidate::NONE ||
+            std::fabs(hit.t - t) > DISTANCE_EPSILON * std::max(1.0, t)) {
+            continue;
+        }
+        if (!hit.hasCoordinates || (std::fabs(hit.u - u) <= UV_TOLERANCE && std::fabs(hit.v - v) <= UV_TOLERANCE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Compare the hits of a trace with the reference, and count the mismatches.
+uint32_t CompareHits(const Scene &scene, const std::vector<Ray> &rays, const std::vector<ReferenceHit> &reference,
+                     uint32_t rayFlags, TraceRayHitFormat format, const std::vector<uint8_t> &hits)
+{
+    uint32_t rayCount = static_cast<uint32_t>(rays.size());
+    uint32_t mismatches = 0;
+    if (format == TraceRayHitFormat::OCCLUDED_BITS) {
+        for (uint32_t i = 0; i < rayCount; i++) {
+            bool occluded = ((hits[i / 8] >> (i % 8)) & 1u) != 0;
+            mismatches += !reference[i].ambiguous && occluded != reference[i].hit ? 1 : 0;
+        }
+        // The bits past the last ray keep their value.
+        for (uint32_t i = rayCount; i < (rayCount + 31) / 32 * 32; i++) {
+            mismatches += ((hits[i / 8] >> (i % 8)) & 1u) != ((HIT_FILL >> (i % 8)) & 1u) ? 1 : 0;
+        }
+        return mismatches;
+    }
+    for (uint32_t i = 0; i < rayCount; i++) {
+        const ReferenceHit &expected = reference[i];
+        if (expected.ambiguous) {
+            continue;
+        }
+        DecodedHit hit = DecodeHit(format, hits.data(), i);
+        bool ok;
+        if (!expected.hit) {
+            ok = hit.t < 0.0f;
+        } else if (rayFlags & TRACERAY_FLAG_ANY_HIT) {
+            ok = hit.t >= 0.0f && IsOnTriangle(scene, rays[i], rayFlags, hit);
+        } else {
+            ok = std::fabs(hit.t - expected.t) <= DISTANCE_EPSILON * std::max(1.0, expected.t) &&
+                (!hit.hasPrimitive || hit.primId == expected.primId) &&
+                (!hit.hasInstance || hit.instId == expected.instId) &&
+                (!hit.hasCoordinates || (std::fabs(hit.u - expected.u) <= UV_TOLERANCE &&
+                                         std::fabs(hit.v - expected.v) <= UV_TOLERANCE));
+        }
+        mismatches += ok ? 0 : 1;
+    }
+    return mismatches;
+}
+
+size_t GetHitBufferBytes(TraceRayHitFormat format, uint32_t rayCount)
+{
+    uint32_t bytes = Traversal::GetHitFormatBytes(format);
+    return format == TraceRayHitFormat::OCCLUDED_BITS ? (rayCount + 31) / 32 * bytes :
+        static_cast<size_t>(rayCount) * bytes;
+}
+
+const TraceRayHitFormat HIT_FORMATS[] = {
+    TraceRayHitFormat::T,
+    TraceRayHitFormat::T_PRIMID,
+    TraceRayHitFormat::T_PRIMID_U_V,
+    TraceRayHitFormat::T_PRIMID_INSTID,
+    TraceRayHitFormat::T_PRIMID_INSTID_U_V,
+    TraceRayHitFormat::OCCLUDED_BITS,
+    TraceRayHitFormat::T_PRIMID_INSTID_PACKED,
+    TraceRayHitFormat::T_PRIMID_INSTID_U_V_PACKED,
+};
+
+const uint32_t RAY_FLAGS[] = {
+    TRACERAY_FLAG_INTERSECT_DEFAULT,
+    TRACERAY_FLAG_CLOSEST_HIT,
+    TRACERAY_FLAG_ANY_HIT,
+    TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES,
+    TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES,
+    TRACERAY_FLAG_ANY_HIT | TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES,
+    TRACERAY_FLAG_CLOSEST_HIT | TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES,
+    TRACERAY_FLAG_REORDER_RAYS,
+    TRACERAY_FLAG_REORDER_RAYS | TRACERAY_FLAG_ANY_HIT | TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES,
+};
+
+const ASBuildMethod BUILD_METHODS[] = {
+    ASBuildMethod::SAH_CPU,
+    ASBuildMethod::SAH_GPU,
+    ASBuildMethod::LBVH_CPU,
+    ASBuildMethod::PLOC_CPU,
+    ASBuildMethod::SAH_SPATIAL_SPLITS,
+};
+
+const uint32_t BUILD_FLAGS[] = {
+    AS_BUILD_FLAG_NONE,
+    AS_BUILD_FLAG_QUANTIZED_NODES,
+    AS_BUILD_FLAG_OPTIMIZE_TREELETS,
+    AS_BUILD_FLAG_QUANTIZED_NODES | AS_BUILD_FLAG_OPTIMIZE_TREELETS,
+};
+
+/// The culling flags decide the reference, any and closest hit share it.
+uint32_t GetReferenceFlags(uint32_t rayFlags)
+{
+    return rayFlags & (TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES | TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES);
+}
+
+std::string Describe(const ASBuildOptions &options)
+{
+    return "method " + std::to_string(static_cast<int>(options.method)) + " build flags " +
+        std::to_string(options.flags);
+}
+
+std::string Describe(uint32_t rayFlags, TraceRayHitFormat format)
+{
+    return "ray flags " + std::to_string(rayFlags) + " format " + std::to_string(static_cast<int>(format));
+}
+
+/// @brief A traversal set up for the cpu backend, with a blas per mesh of the scene and a tlas over them.
+class TestTraversal {
+public:
+    explicit TestTraversal(const Scene &scene, const ASBuildOptions &options = ASBuildOptions())
+    {
+        EXPECT(m_traversal.Setup(VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE, 0) == Result::SUCCESS, "setup");
+        std::vector<GeometryTriangleDescription> geometries;
+        for (const TestMesh &mesh : scene.meshes) {
+            geometries.push_back(mesh.Describe());
+        }
+        m_blases.resize(scene.meshes.size());
+        EXPECT(m_traversal.CreateBLAS(options, static_cast<uint32_t>(geometries.size()), geometries.data(),
+                                      m_blases.data()) == Result::SUCCESS, Describe(options));
+        CreateTLAS(scene);
+    }
+
+    explicit TestTraversal()
+    {
+        EXPECT(m_traversal.Setup(VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE, 0) == Result::SUCCESS, "setup");
+    }
+
+    void CreateTLAS(const Scene &scene)
+    {
+        std::vector<InstanceDescription> instances = scene.Describe(m_blases);
+        EXPECT(m_traversal.CreateTLAS(static_cast<uint32_t>(instances.size()), instances.data()) == Result::SUCCESS,
+               "tlas");
+    }
+
+    Result Trace(const std::vector<Ray> &rays, uint32_t rayFlags, TraceRayHitFormat format,
+                 std::vector<uint8_t> &hits, const Size *region = nullptr) const
+    {
+        hits.assign(GetHitBufferBytes(format, static_cast<uint32_t>(rays.size())), HIT_FILL);
+        Buffer rayBuffer {BufferType::CPU, {const_cast<Ray *>(rays.data())}};
+        Buffer hitBuffer {BufferType::CPU, {hits.data()}};
+        if (region != nullptr) {
+            return m_traversal.TraceRays(*region, rayFlags, rayBuffer, hitBuffer, format);
+        }
+        return m_traversal.TraceRays(static_cast<uint32_t>(rays.size()), rayFlags, rayBuffer, hitBuffer, format);
+    }
+
+    const Traversal &Get() const
+    {
+        return m_traversal;
+    }
+
+    std::vector<BLAS> &GetBlases()
+    {
+        return m_blases;
+    }
+
+private:
+    Traversal m_traversal;
+    std::vector<BLAS> m_blases;
+};
+
+/// Trace the rays in every format with the given flags, and compare the hits with the reference.
+void ExpectMatchesReference(const TestTraversal &traversal, const Scene &scene, const std::vector<Ray> &rays,
+                            const std::vector<ReferenceHit> &reference, uint32_t rayFlags, const std::string &context,
+                            const Size *region = nullptr)
+{
+    for (TraceRayHitFormat format : HIT_FORMATS) {
+        std::vector<uint8_t> hits;
+        std::string what = context + " " + Describe(rayFlags, format);
+        EXPECT(traversal.Trace(rays, rayFlags, format, hits, region) == Result::SUCCESS, what);
+        uint32_t mismatches = CompareHits(scene, rays, reference, rayFlags, format, hits);
+        EXPECT(mismatches == 0, what + ", " + std::to_string(mismatches) + " rays");
+    }
+}
+
+/// Trace with the closest hit flags of each culling mode.
+void ExpectClosestHitsMatch(const TestTraversal &traversal, const Scene &scene, const std::vector<Ray> &rays,
+                            const std::string &context)
+{
+    const uint32_t cullFlags[] = {0, TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES};
+    for (uint32_t rayFlags : cullFlags) {
+        std::vector<ReferenceHit> reference = TraceReference(scene, rays, rayFlags);
+        std::vector<uint8_t> hits;
+        TraceRayHitFormat format = TraceRayHitFormat::T_PRIMID_INSTID_U_V;
+        std::string what = context + " " + Describe(rayFlags, format);
+        EXPECT(traversal.Trace(rays, rayFlags, format, hits) == Result::SUCCESS, what);
+        uint32_t mismatches = CompareHits(scene, rays, reference, rayFlags, format, hits);
+        EXPECT(mismatches == 0, what + ", " + std::to_string(mismatches) + " rays");
+    }
+}
+
+void TestBuildMethods()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT, 2);
+    std::vector<std::vector<ReferenceHit>> references;
+    for (uint32_t rayFlags : RAY_FLAGS) {
+        references.push_back(TraceReference(scene, rays, GetReferenceFlags(rayFlags)));
+    }
+    for (ASBuildMethod method : BUILD_METHODS) {
+        for (uint32_t buildFlags : BUILD_FLAGS) {
+            ASBuildOptions options;
+            options.method = method;
+            options.flags = buildFlags;
+            TestTraversal traversal(scene, options);
+            for (size_t i = 0; i < sizeof(RAY_FLAGS) / sizeof(RAY_FLAGS[0]); i++) {
+                ExpectMatchesReference(traversal, scene, rays, references[i], RAY_FLAGS[i], Describe(options));
+            }
+        }
+    }
+}
+
+void TestImageRegions()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeCameraRays();
+    Size region {REGION_WIDTH, REGION_HEIGHT};
+    const uint32_t rayFlagsList[] = {0, TRACERAY_FLAG_ANY_HIT, TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES,
+                                     TRACERAY_FLAG_REORDER_RAYS};
+    for (ASBuildMethod method : BUILD_METHODS) {
+        for (uint32_t buildFlags : BUILD_FLAGS) {
+            ASBuildOptions options;
+            options.method = method;
+            options.flags = buildFlags;
+            TestTraversal traversal(scene, options);
+            for (uint32_t rayFlags : rayFlagsList) {
+                std::vector<ReferenceHit> reference = TraceReference(scene, rays, GetReferenceFlags(rayFlags));
+                ExpectMatchesReference(traversal, scene, rays, reference, rayFlags, "region " + Describe(options),
+                                       &region);
+            }
+        }
+    }
+}
+
+/// Reordered hits have to be those of the rays as given, byte for byte, across several sorted chunks.
+void TestReorderRays()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, REORDER_RAY_COUNT, 12);
+    TestTraversal traversal(scene);
+    const uint32_t rayFlagsList[] = {TRACERAY_FLAG_CLOSEST_HIT, TRACERAY_FLAG_ANY_HIT};
+    for (uint32_t rayFlags : rayFlagsList) {
+        for (TraceRayHitFormat format : HIT_FORMATS) {
+            std::vector<uint8_t> hits;
+            std::vector<uint8_t> reordered;
+            std::string what = Describe(rayFlags | TRACERAY_FLAG_REORDER_RAYS, format);
+            EXPECT(traversal.Trace(rays, rayFlags, format, hits) == Result::SUCCESS, what);
+            EXPECT(traversal.Trace(rays, rayFlags | TRACERAY_FLAG_REORDER_RAYS, format, reordered) ==
+                   Result::SUCCESS, what);
+            EXPECT(hits == reordered, what);
+        }
+    }
+}
+
+void TestIntersect()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 4, 3);
+    TestTraversal traversal(scene);
+    const uint32_t rayFlagsList[] = {0, TRACERAY_FLAG_ANY_HIT, TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES};
+    for (uint32_t rayFlags : rayFlagsList) {
+        std::vector<ReferenceHit> reference = TraceReference(scene, rays, GetReferenceFlags(rayFlags));
+        std::vector<HitDistancePrimitiveInstanceCoordinates> batch(rays.size());
+        EXPECT(traversal.Get().Intersect(static_cast<uint32_t>(rays.size()), rays.data(), rayFlags, batch.data()) ==
+               Result::SUCCESS, "batch");
+        std::vector<uint8_t> hits(rays.size() * sizeof(HitDistancePrimitiveInstanceCoordinates));
+        memcpy(hits.data(), batch.data(), hits.size());
+        TraceRayHitFormat format = TraceRayHitFormat::T_PRIMID_INSTID_U_V;
+        uint32_t mismatches = CompareHits(scene, rays, reference, rayFlags, format, hits);
+        EXPECT(mismatches == 0, "batch " + Describe(rayFlags, format));
+        for (size_t i = 0; i < rays.size(); i++) {
+            HitDistancePrimitiveInstanceCoordinates hit;
+            EXPECT(traversal.Get().Intersect(rays[i], rayFlags, &hit) == Result::SUCCESS, "single");
+            EXPECT(memcmp(&hit, &batch[i], sizeof(hit)) == 0, "single ray " + std::to_string(i));
+        }
+    }
+}
+
+/// The point of a triangle nearest to p in double precision, by the Voronoi region of p (Ericson 2005, 5.1.5).
+Vec3 NearestPointReference(const Vec3 &p, const WorldTriangle &triangle)
+{
+    const Vec3 &a = triangle.v[0];
+    const Vec3 &b = triangle.v[1];
+    const Vec3 &c = triangle.v[2];
+    Vec3 ab = Sub(b, a);
+    Vec3 ac = Sub(c, a);
+    auto along = [&a, &ab, &ac](double u, double v) {
+        return Vec3 {a.x + ab.x * u + ac.x * v, a.y + ab.y * u + ac.y * v, a.z + ab.z * u + ac.z * v};
+    };
+    double d1 = Dot(ab, Sub(p, a));
+    double d2 = Dot(ac, Sub(p, a));
+    double d3 = Dot(ab, Sub(p, b));
+    double d4 = Dot(ac, Sub(p, b));
+    double d5 = Dot(ab, Sub(p, c));
+    double d6 = Dot(ac, Sub(p, c));
+    double vc = d1 * d4 - d3 * d2;
+    double vb = d5 * d2 - d1 * d6;
+    double va = d3 * d6 - d5 * d4;
+    if (d1 <= 0.0 && d2 <= 0.0) {
+        return a;
+    }
+    if (d3 >= 0.0 && d4 <= d3) {
+        return b;
+    }
+    if (d6 >= 0.0 && d5 <= d6) {
+        return c;
+    }
+    if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0) {
+        return along(d1 / (d1 - d3), 0.0);
+    }
+    if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0) {
+        return along(0.0, d2 / (d2 - d6));
+    }
+    if (va <= 0.0 && d4 - d3 >= 0.0 && d5 - d6 >= 0.0) {
+        double w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        return along(1.0 - w, w);
+    }
+    return along(vb / (va + vb + vc), vc / (va + vb + vc));
+}
+
+/// The distance of every triangle of the scene to a point, in the order of scene.triangles.
+std::vector<double> TriangleDistances(const Scene &scene, const PointQuery &query)
+{
+    Vec3 p = {query.point[0], query.point[1], query.point[2]};
+    std::vector<double> distances;
+    for (const WorldTriangle &triangle : scene.triangles) {
+        distances.push_back(Length(Sub(NearestPointReference(p, triangle), p)));
+    }
+    return distances;
+}
+
+/// Points all over the scene and around it, with radii from none to infinite.
+std::vector<PointQuery> MakePointQueries(uint32_t count, uint32_t seed)
+{
+    const float radii[] = {0.0f, 0.05f, 0.3f, 1.0f, std::numeric_limits<float>::infinity()};
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<PointQuery> queries(count);
+    for (uint32_t i = 0; i < count; i++) {
+        queries[i].point[0] = -4.5f + 9.0f * unit(rng);
+        queries[i].point[1] = -3.0f + 6.0f * unit(rng);
+        queries[i].point[2] = -3.0f + 6.0f * unit(rng);
+        queries[i].radius = radii[i % (sizeof(radii) / sizeof(radii[0]))];
+    }
+    return queries;
+}
+
+/// Compare ClosestPoint and RadiusQuery with the distances to every triangle. Distances this close to the radius
+/// or to each other may go either way in float.
+void ExpectPointQueriesMatch(const TestTraversal &traversal, const Scene &scene,
+                             const std::vector<PointQuery> &queries, const std::string &context)
+{
+    const uint32_t maxHits = 8;
+    uint32_t queryCount = static_cast<uint32_t>(queries.size());
+    std::vector<ClosestPointHit> closest(queryCount);
+    std::vector<uint32_t> counts(queryCount);
+    std::vector<RadiusQueryHit> hits(static_cast<size_t>(queryCount) * maxHits);
+    EXPECT(traversal.Get().ClosestPoint(queryCount, queries.data(), closest.data()) == Result::SUCCESS, context);
+    EXPECT(traversal.Get().RadiusQuery(queryCount, queries.data(), maxHits, counts.data(), hits.data()) ==
+           Result::SUCCESS, context);
+    std::vector<uint32_t> firstTriangle(scene.instances.size() + 1, 0);
+    for (const WorldTriangle &triangle : scene.triangles) {
+        firstTriangle[triangle.instId + 1]++;
+    }
+    for (size_t i = 1; i < firstTriangle.size(); i++) {
+        firstTriangle[i] += firstTriangle[i - 1];
+    }
+    uint32_t mismatches = 0;
+    for (uint32_t q = 0; q < queryCount; q++) {
+        const PointQuery &query = queries[q];
+        std::vector<double> distances = TriangleDistances(scene, query);
+        auto tolerance = [](double distance) { return DISTANCE_EPSILON * std::max(1.0, distance); };
+        auto distanceOf = [&](uint32_t instId, uint32_t primId) {
+            bool valid = instId < scene.instances.size() && firstTriangle[instId] + primId < firstTriangle[instId + 1];
+            return valid ? distances[firstTriangle[instId] + primId] : -1.0;
+        };
+        std::vector<double> sorted = distances;
+        std::sort(sorted.begin(), sorted.end());
+        double radius = query.radius;
+        bool ok = true;
+
+        const ClosestPointHit &hit = closest[q];
+        double nearest = sorted.empty() ? std::numeric_limits<double>::infinity() : sorted[0];
+        if (hit.distance < 0.0f) {
+            ok = ok && nearest >= radius - tolerance(radius);
+        } else {
+            double reported = distanceOf(hit.instId, hit.primId);
+            Vec3 point = {hit.point[0], hit.point[1], hit.point[2]};
+            Vec3 p = {query.point[0], query.point[1], query.point[2]};
+            ok = ok && nearest <= radius + tolerance(radius) &&
+                std::fabs(hit.distance - nearest) <= tolerance(nearest) &&
+                std::fabs(reported - nearest) <= tolerance(nearest) &&
+                std::fabs(Length(Sub(point, p)) - hit.distance) <= tolerance(nearest);
+        }
+
+        uint32_t surelyInside = 0;
+        uint32_t maybeInside = 0;
+        for (double distance : distances) {
+            surelyInside += distance < radius - tolerance(radius) ? 1 : 0;
+            maybeInside += distance <= radius + tolerance(radius) ? 1 : 0;
+        }
+        uint32_t count = counts[q];
+        ok = ok && count >= surelyInside && count <= maybeInside;
+        const RadiusQueryHit *queryHits = &hits[static_cast<size_t>(q) * maxHits];
+        for (uint32_t k = 0; k < std::min(count, maxHits); k++) {
+            double reference = distanceOf(queryHits[k].instId, queryHits[k].primId);
+            ok = ok && std::fabs(queryHits[k].distance - reference) <= tolerance(reference) &&
+                queryHits[k].distance <= sorted[k] + tolerance(sorted[k]) &&
+                (k == 0 || queryHits[k - 1].distance <= queryHits[k].distance);
+            for (uint32_t j = 0; j < k; j++) {
+                ok = ok && (queryHits[j].instId != queryHits[k].instId || queryHits[j].primId != queryHits[k].primId);
+            }
+        }
+        mismatches += ok ? 0 : 1;
+    }
+    EXPECT(mismatches == 0, context + ", " + std::to_string(mismatches) + " queries");
+}
+
+void TestPointQueries()
+{
+    // The scene holds similarities, searched in object space, and a non-uniform scale, searched in world space.
+    Scene scene = MakeScene();
+    std::vector<PointQuery> queries = MakePointQueries(300, 13);
+    for (ASBuildMethod method : BUILD_METHODS) {
+        ASBuildOptions options;
+        options.method = method;
+        TestTraversal traversal(scene, options);
+        ExpectPointQueriesMatch(traversal, scene, queries, "point queries " + Describe(options));
+    }
+    // Spatial splits put a triangle into several leaves, but it counts once.
+    Scene soup;
+    soup.meshes.push_back(MakeTriangleSoup(2000, 14));
+    TestInstance instance;
+    instance.mesh = 0;
+    const float unit[3] = {1.0f, 1.0f, 1.0f};
+    const float origin[3] = {0.0f, 0.0f, 0.0f};
+    MakeTransform(unit, 0, 0.0, origin, instance.transform);
+    soup.instances.push_back(instance);
+    soup.Update();
+    ASBuildOptions options;
+    options.method = ASBuildMethod::SAH_SPATIAL_SPLITS;
+    TestTraversal split(soup, options);
+    ExpectPointQueriesMatch(split, soup, MakePointQueries(100, 15), "split soup");
+}
+
+/// Start a spatial split build of a large soup, which runs far longer than it takes to poll the jobs after it.
+BLAS StartSlowBuild(const TestTraversal &traversal, const TestMesh &mesh, ASBuildJob &job)
+{
+    ASBuildOptions options;
+    options.method = ASBuildMethod::SAH_SPATIAL_SPLITS;
+    GeometryTriangleDescription geometry = mesh.Describe();
+    BLAS blas = 0;
+    EXPECT(traversal.Get().CreateBLASAsync(options, 1, &geometry, &blas, &job) == Result::SUCCESS, "slow build");
+    return blas;
+}
+
+void TestAsyncBuild()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 4, 13);
+    TestMesh slowMesh = MakeTriangleSoup(SLOW_BUILD_TRIANGLES, 15);
+    TestTraversal traversal;
+    ASBuildJob slowJob = 0;
+    StartSlowBuild(traversal, slowMesh, slowJob);
+    EXPECT(traversal.Get().GetBuildStatus(slowJob) == Result::BUILD_IN_PROGRESS, "status of a running build");
+
+    std::vector<GeometryTriangleDescription> geometries;
+    for (const TestMesh &mesh : scene.meshes) {
+        geometries.push_back(mesh.Describe());
+    }
+    std::vector<BLAS> &blases = traversal.GetBlases();
+    blases.resize(scene.meshes.size());
+    ASBuildJob blasJob = 0;
+    EXPECT(traversal.Get().CreateBLASAsync(ASBuildOptions(), static_cast<uint32_t>(geometries.size()),
+                                           geometries.data(), blases.data(), &blasJob) == Result::SUCCESS, "blases");
+    // The handles can be instanced at once, the tlas job waits for every build started before it.
+    std::vector<InstanceDescription> instances = scene.Describe(blases);
+    ASBuildJob tlasJob = 0;
+    EXPECT(traversal.Get().CreateTLASAsync(static_cast<uint32_t>(instances.size()), instances.data(), &tlasJob) ==
+           Result::SUCCESS, "tlas");
+    EXPECT(traversal.Get().GetBuildStatus(tlasJob) == Result::BUILD_IN_PROGRESS, "status of a waiting tlas build");
+    EXPECT(traversal.Get().WaitBuild(tlasJob) == Result::SUCCESS, "wait for the tlas");
+    EXPECT(traversal.Get().GetBuildStatus(blasJob) == Result::SUCCESS, "status of a finished build");
+    EXPECT(traversal.Get().GetBuildStatus(slowJob) == Result::SUCCESS, "status of a finished slow build");
+    EXPECT(traversal.Get().WaitBuild(blasJob) == Result::SUCCESS, "wait for the blases");
+    EXPECT(traversal.Get().WaitBuild(slowJob) == Result::SUCCESS, "wait for the slow build");
+    EXPECT(traversal.Get().GetBuildStatus(blasJob) == Result::INVALID_PARAMETER, "status of a released job");
+    ExpectClosestHitsMatch(traversal, scene, rays, "async build");
+
+    // A tlas created while an async one waits wins, although the async one finishes last.
+    StartSlowBuild(traversal, slowMesh, slowJob);
+    EXPECT(traversal.Get().CreateTLASAsync(static_cast<uint32_t>(instances.size()), instances.data(), &tlasJob) ==
+           Result::SUCCESS, "superseded tlas");
+    const float scale[3] = {1.0f, 1.0f, 1.0f};
+    const float translation[3] = {0.0f, 2.0f, 0.0f};
+    MakeTransform(scale, 1, PI / 3, translation, scene.instances[1].transform);
+    scene.Update();
+    traversal.CreateTLAS(scene);
+    EXPECT(traversal.Get().GetBuildStatus(tlasJob) == Result::BUILD_IN_PROGRESS, "status of a superseded build");
+    EXPECT(traversal.Get().WaitBuild(tlasJob) == Result::SUCCESS, "wait for the superseded tlas");
+    EXPECT(traversal.Get().WaitBuild(slowJob) == Result::SUCCESS, "wait for the second slow build");
+    ExpectClosestHitsMatch(traversal, scene, rays, "newer tlas");
+}
+
+/// @brief The quantized nodes of a blas and the mesh they were built over.
+struct QuantizedTree {
+    const TestMesh &mesh;
+    std::vector<QuantizedBvhNode> nodes;
+    std::vector<uint32_t> primIndices;
+    std::vector<uint32_t> references;       /* *< Per triangle, the leaf slots that hold it. */
+    bool clipped;                           /* *< Spatial splits, where a leaf holds only part of a triangle. */
+};
+
+/// Decode a slot of a node as the header describes it, rather than through the library.
+void DecodeQuantizedSlot(const QuantizedBvhNode &node, uint32_t slot, float (&lower)[3], float (&upper)[3])
+{
+    for (int axis = 0; axis < 3; axis++) {
+        uint32_t bits = static_cast<uint32_t>(node.exponents[axis]) << 23;
+        float scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        lower[axis] = node.origin[axis] + static_cast<float>(node.qlower[axis][slot]) * scale;
+        upper[axis] = node.origin[axis] + static_cast<float>(node.qupper[axis][slot]) * scale;
+    }
+}
+
+/// Check that every slot of the subtree encloses the triangles below it, and return their exact box.
+bool CheckQuantizedNode(QuantizedTree &tree, uint32_t nodeIndex, uint32_t depth, float (&lower)[3],
+                        float (&upper)[3])
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    std::fill(lower, lower + 3, inf);
+    std::fill(upper, upper + 3, -inf);
+    if (nodeIndex >= tree.nodes.size() || depth > QUANTIZED_TREE_MAX_DEPTH) {
+        return false;
+    }
+    const QuantizedBvhNode &node = tree.nodes[nodeIndex];
+    bool ok = true;
+    for (uint32_t slot = 0; slot < QUANTIZED_BVH_WIDTH; slot++) {
+        uint32_t meta = node.meta[slot];
+        if (meta == 0) {
+            continue;
+        }
+        float exactLower[3] = {inf, inf, inf};
+        float exactUpper[3] = {-inf, -inf, -inf};
+        if (meta & 0x80) {
+            ok = CheckQuantizedNode(tree, node.childBase + (meta & 0x7f), depth + 1, exactLower, exactUpper) && ok;
+        } else {
+            for (uint32_t k = 0; k < (meta >> 4); k++) {
+                uint32_t entry = node.primBase + (meta & 0x0f) + k;
+                uint32_t prim = entry < tree.primIndices.size() ? tree.primIndices[entry] : UINT32_MAX;
+                if (prim >= tree.references.size()) {
+                    return false;
+                }
+                tree.references[prim]++;
+                for (int corner = 0; corner < 3; corner++) {
+                    const float *p = &tree.mesh.positions[tree.mesh.indices[prim * 3 + corner] * 3];
+                    for (int axis = 0; axis < 3; axis++) {
+                        exactLower[axis] = std::min(exactLower[axis], p[axis]);
+                        exactUpper[axis] = std::max(exactUpper[axis], p[axis]);
+                    }
+                }
+            }
+        }
+        float slotLower[3];
+        float slotUpper[3];
+        DecodeQuantizedSlot(node, slot, slotLower, slotUpper);
+        bool leaf = (meta & 0x80) == 0;
+        for (int axis = 0; axis < 3; axis++) {
+            if (tree.clipped) {
+                // A leaf holds the part of a triangle within its box, which is not known here, but it overlaps
+                // the triangle's box.
+                ok = ok && (!leaf || (slotLower[axis] <= exactUpper[axis] && slotUpper[axis] >= exactLower[axis]));
+                continue;
+            }
+            ok = ok && slotLower[axis] <= exactLower[axis] && slotUpper[axis] >= exactUpper[axis];
+            lower[axis] = std::min(lower[axis], exactLower[axis]);
+            upper[axis] = std::max(upper[axis], exactUpper[axis]);
+        }
+    }
+    return ok;
+}
+
+/// The quantized boxes enclose the exact ones, and every triangle is in a leaf.
+void ExpectQuantizedBoxesEnclose(const TestTraversal &traversal, BLAS blas, const TestMesh &mesh, bool clipped,
+                                 const std::string &context)
+{
+    QuantizedTree tree {mesh, {}, {}, std::vector<uint32_t>(mesh.indices.size() / 3), clipped};
+    uint32_t nodeCount = 0;
+    uint32_t primCount = 0;
+    EXPECT(traversal.Get().GetQuantizedBLAS(blas, &nodeCount, nullptr, &primCount, nullptr) == Result::SUCCESS,
+           context + " counts");
+    tree.nodes.resize(nodeCount);
+    tree.primIndices.resize(primCount);
+    EXPECT(traversal.Get().GetQuantizedBLAS(blas, &nodeCount, tree.nodes.data(), &primCount,
+                                            tree.primIndices.data()) == Result::SUCCESS, context + " nodes");
+    float lower[3];
+    float upper[3];
+    EXPECT(nodeCount != 0 && CheckQuantizedNode(tree, 0, 0, lower, upper), context + " boxes");
+    EXPECT(std::count(tree.references.begin(), tree.references.end(), 0u) == 0, context + " triangles");
+}
+
+void TestQuantizedNodes()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 2, 16);
+    for (ASBuildMethod method : BUILD_METHODS) {
+        ASBuildOptions options;
+        options.method = method;
+        TestTraversal exact(scene, options);
+        options.flags = AS_BUILD_FLAG_QUANTIZED_NODES;
+        TestTraversal quantized(scene, options);
+        for (size_t mesh = 0; mesh < scene.meshes.size(); mesh++) {
+            ExpectQuantizedBoxesEnclose(quantized, quantized.GetBlases()[mesh], scene.meshes[mesh],
+                                        method == ASBuildMethod::SAH_SPATIAL_SPLITS,
+                                        Describe(options) + " mesh " + std::to_string(mesh));
+        }
+        // The looser boxes only change the order of the leaves, which the closest hit and occlusion do not see.
+        const uint32_t rayFlagsList[] = {TRACERAY_FLAG_CLOSEST_HIT, TRACERAY_FLAG_ANY_HIT};
+        for (uint32_t rayFlags : rayFlagsList) {
+            TraceRayHitFormat format = rayFlags == TRACERAY_FLAG_ANY_HIT ? TraceRayHitFormat::OCCLUDED_BITS :
+                TraceRayHitFormat::T;
+            std::string what = Describe(options) + " " + Describe(rayFlags, format);
+            std::vector<uint8_t> exactHits;
+            std::vector<uint8_t> quantizedHits;
+            EXPECT(exact.Trace(rays, rayFlags, format, exactHits) == Result::SUCCESS, what);
+            EXPECT(quantized.Trace(rays, rayFlags, format, quantizedHits) == Result::SUCCESS, what);
+            EXPECT(exactHits == quantizedHits, what);
+        }
+    }
+}
+
+void TestInvalidParameters()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, 64, 4);
+    std::vector<uint8_t> hits;
+    TestTraversal empty;
+    EXPECT(empty.Trace(rays, 0, TraceRayHitFormat::T, hits) == Result::NOT_READY, "no tlas");
+
+    TestTraversal traversal(scene);
+    const uint32_t badFlags[] = {
+        TRACERAY_FLAG_ANY_HIT | TRACERAY_FLAG_CLOSEST_HIT,
+        TRACERAY_FLAG_CULL_BACK_FACING_TRIANGLES | TRACERAY_FLAG_CULL_FRONT_FACING_TRIANGLES,
+        0x100,
+    };
+    for (uint32_t rayFlags : badFlags) {
+        EXPECT(traversal.Trace(rays, rayFlags, TraceRayHitFormat::T, hits) == Result::INVALID_PARAMETER,
+               "ray flags " + std::to_string(rayFlags));
+    }
+    Buffer rayBuffer {BufferType::CPU, {rays.data()}};
+    Buffer noHits {BufferType::CPU, {nullptr}};
+    EXPECT(traversal.Get().TraceRays(64, 0, rayBuffer, noHits, TraceRayHitFormat::T) == Result::INVALID_PARAMETER,
+           "null hits");
+    Buffer gpuHits {BufferType::GPU, {nullptr}};
+    EXPECT(traversal.Get().TraceRays(64, 0, rayBuffer, gpuHits, TraceRayHitFormat::T) != Result::SUCCESS,
+           "gpu hits");
+
+    TestMesh mesh = scene.meshes[0];
+    mesh.indices.back() = static_cast<uint32_t>(mesh.positions.size() / 3);
+    GeometryTriangleDescription geometry = mesh.Describe();
+    BLAS blas;
+    EXPECT(traversal.Get().CreateBLAS(ASBuildOptions(), 1, &geometry, &blas) == Result::INVALID_PARAMETER,
+           "index out of range");
+    InstanceDescription instance = scene.Describe(traversal.GetBlases())[0];
+    instance.blas = 1000;
+    EXPECT(traversal.Get().CreateTLAS(1, &instance) == Result::INVALID_PARAMETER, "unknown blas");
+}
+
+void TestRefit()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 2, 5);
+    ASBuildOptions options;
+    options.rebuildSahRatio = 1.05f;    // Rebuild in the background and swap in along the way.
+    TestTraversal traversal(scene, options);
+    TestMesh rest = scene.meshes[1];
+    for (int step = 1; step <= 6; step++) {
+        TestMesh &sphere = scene.meshes[1];
+        for (size_t i = 0; i < sphere.positions.size(); i += 3) {
+            float wave = 1.0f + 0.4f * std::sin(step * 0.9f + rest.positions[i] * 3.0f);
+            sphere.positions[i] = rest.positions[i] * wave;
+            sphere.positions[i + 1] = rest.positions[i + 1] + 0.3f * step * rest.positions[i];
+            sphere.positions[i + 2] = rest.positions[i + 2] / wave;
+        }
+        scene.Update();
+        GeometryTriangleDescription geometry = sphere.Describe();
+        EXPECT(traversal.Get().RefitBLAS(1, &geometry, &traversal.GetBlases()[1]) == Result::SUCCESS, "refit");
+        traversal.CreateTLAS(scene);
+        ExpectClosestHitsMatch(traversal, scene, rays, "refit step " + std::to_string(step));
+    }
+
+    // Rebuilding from scratch gives the same hits.
+    TestTraversal rebuilt(scene, options);
+    ExpectClosestHitsMatch(rebuilt, scene, rays, "rebuilt");
+}
+
+/// Move each vertex of the mesh toward the rest position of another one, which stretches the boxes of the kept tree.
+void ScrambleMesh(const TestMesh &rest, float amount, TestMesh &mesh)
+{
+    uint32_t vertexCount = static_cast<uint32_t>(rest.positions.size() / 3);
+    for (uint32_t v = 0; v < vertexCount; v++) {
+        uint32_t other = (v * SCRAMBLE_STRIDE + vertexCount / 2) % vertexCount;
+        for (int axis = 0; axis < 3; axis++) {
+            mesh.positions[v * 3 + axis] = rest.positions[v * 3 + axis] * (1.0f - amount) +
+                rest.positions[other * 3 + axis] * amount;
+        }
+    }
+}
+
+void TestSahRatio()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 4, 14);
+    TestMesh rest = scene.meshes[1];
+    ASBuildOptions options;
+    options.rebuildSahRatio = 0.0f;
+    TestTraversal refitOnly(scene, options);
+    BLAS sphere = refitOnly.GetBlases()[1];
+    float ratio = 0.0f;
+    EXPECT(refitOnly.Get().GetBLASSahRatio(sphere, &ratio) == Result::SUCCESS && ratio == 1.0f, "after the build");
+    for (int step = 1; step <= 3; step++) {
+        ScrambleMesh(rest, step / 3.0f, scene.meshes[1]);
+        GeometryTriangleDescription geometry = scene.meshes[1].Describe();
+        EXPECT(refitOnly.Get().RefitBLAS(1, &geometry, &sphere) == Result::SUCCESS, "refit");
+        float lastRatio = ratio;
+        EXPECT(refitOnly.Get().GetBLASSahRatio(sphere, &ratio) == Result::SUCCESS && ratio > lastRatio,
+               "refit step " + std::to_string(step) + ", ratio " + std::to_string(ratio));
+    }
+    EXPECT(ratio > REBUILD_SAH_RATIO, "scrambled, ratio " + std::to_string(ratio));
+
+    // Past rebuildSahRatio, a refit starts a rebuild and a later one swaps it in, which takes the ratio back to 1.
+    scene.meshes[1] = rest;
+    scene.Update();
+    options.rebuildSahRatio = REBUILD_SAH_RATIO;
+    TestTraversal traversal(scene, options);
+    sphere = traversal.GetBlases()[1];
+    ScrambleMesh(rest, 1.0f, scene.meshes[1]);
+    scene.Update();
+    GeometryTriangleDescription geometry = scene.meshes[1].Describe();
+    auto deadline = std::chrono::steady_clock::now() + REBUILD_TIMEOUT;
+    do {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT(traversal.Get().RefitBLAS(1, &geometry, &sphere) == Result::SUCCESS, "refit");
+        EXPECT(traversal.Get().GetBLASSahRatio(sphere, &ratio) == Result::SUCCESS, "ratio");
+    } while (ratio > REBUILD_SAH_RATIO && std::chrono::steady_clock::now() < deadline);
+    EXPECT(std::fabs(ratio - 1.0f) < 1e-3f, "rebuilt, ratio " + std::to_string(ratio));
+    ExpectClosestHitsMatch(traversal, scene, rays, "swapped in rebuild");
+}
+
+void TestSahCosts()
+{
+    Scene scene = MakeSceneWithEmptyMesh();
+    const uint32_t treeletFlags[] = {AS_BUILD_FLAG_NONE, AS_BUILD_FLAG_OPTIMIZE_TREELETS};
+    for (ASBuildMethod method : BUILD_METHODS) {
+        for (uint32_t flags : treeletFlags) {
+            ASBuildOptions options;
+            options.method = method;
+            options.flags = flags;
+            TestTraversal traversal(scene, options);
+            const std::vector<BLAS> &blases = traversal.GetBlases();
+            for (size_t mesh = 0; mesh < blases.size(); mesh++) {
+                std::string what = Describe(options) + " mesh " + std::to_string(mesh);
+                ASSahCosts costs {};
+                EXPECT(traversal.Get().GetBLASSahCosts(blases[mesh], &costs) == Result::SUCCESS, what);
+                if (scene.meshes[mesh].indices.empty()) {
+                    EXPECT(costs.built == 0.0f && costs.optimized == 0.0f && costs.current == 0.0f, what);
+                    continue;
+                }
+                // The treelet pass keeps a treelet as it was unless its new topology costs less.
+                bool optimized = flags == AS_BUILD_FLAG_OPTIMIZE_TREELETS;
+                EXPECT(costs.built > 0.0f && (optimized ? costs.optimized <= costs.built :
+                                              costs.optimized == costs.built), what);
+                EXPECT(costs.current == costs.optimized, what);
+                // The soup leaves the Morton curve of LBVH a lot to improve.
+                if (optimized && method == ASBuildMethod::LBVH_CPU && mesh == 0) {
+                    EXPECT(costs.optimized < costs.built, what);
+                }
+            }
+        }
+    }
+
+    // Refits change only the current cost.
+    TestTraversal traversal(scene);
+    BLAS sphere = traversal.GetBlases()[1];
+    ASSahCosts built {};
+    EXPECT(traversal.Get().GetBLASSahCosts(sphere, &built) == Result::SUCCESS, "sah costs");
+    TestMesh scrambled = scene.meshes[1];
+    ScrambleMesh(scene.meshes[1], 1.0f, scrambled);
+    GeometryTriangleDescription geometry = scrambled.Describe();
+    EXPECT(traversal.Get().RefitBLAS(1, &geometry, &sphere) == Result::SUCCESS, "refit");
+    ASSahCosts refit {};
+    EXPECT(traversal.Get().GetBLASSahCosts(sphere, &refit) == Result::SUCCESS, "sah costs");
+    EXPECT(refit.built == built.built && refit.optimized == built.optimized && refit.current > built.current,
+           "after a refit");
+}
+
+void TestUpdateTLAS()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 2, 6);
+    TestTraversal traversal(scene);
+    const float scale[3] = {0.6f, 1.2f, 0.9f};
+    const float translation[3] = {0.5f, -1.0f, 1.5f};
+    TestInstance &moved = scene.instances[2];
+    MakeTransform(scale, 0, PI / 4, translation, moved.transform);
+    moved.mesh = 1;
+    scene.Update();
+    uint32_t instanceId = 2;
+    InstanceDescription instance = scene.Describe(traversal.GetBlases())[instanceId];
+    EXPECT(traversal.Get().UpdateTLAS(1, &instanceId, &instance) == Result::SUCCESS, "update");
+    ExpectClosestHitsMatch(traversal, scene, rays, "updated tlas");
+}
+
+/// Change the first coordinate of the positions saved in a blas file, leaving its key as it was.
+bool CorruptSavedPositions(const std::string &path)
+{
+    std::FILE *file = std::fopen(path.c_str(), "r+b");
+    if (file == nullptr) {
+        return false;
+    }
+    Cpu::BlasFileHeader header;
+    float coordinate;
+    bool corrupted = std::fread(&header, sizeof(header), 1, file) == 1 &&
+        std::fseek(file, static_cast<long>(header.offsets[Cpu::BLAS_SECTION_POSITIONS]), SEEK_SET) == 0 &&
+        std::fread(&coordinate, sizeof(coordinate), 1, file) == 1;
+    coordinate += 1.0f;
+    corrupted = corrupted && std::fseek(file, static_cast<long>(header.offsets[Cpu::BLAS_SECTION_POSITIONS]),
+                                        SEEK_SET) == 0 && std::fwrite(&coordinate, sizeof(coordinate), 1, file) == 1;
+    return std::fclose(file) == 0 && corrupted;
+}
+
+void TestSaveLoad()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 2, 7);
+    const std::string paths[] = {"TraversalTest_blas0.bin", "TraversalTest_blas1.bin"};
+    const ASBuildMethod methods[] = {ASBuildMethod::SAH_CPU, ASBuildMethod::SAH_SPATIAL_SPLITS};
+    const uint32_t buildFlags[] = {AS_BUILD_FLAG_NONE, AS_BUILD_FLAG_QUANTIZED_NODES | AS_BUILD_FLAG_OPTIMIZE_TREELETS};
+    for (ASBuildMethod method : methods) {
+        for (uint32_t flags : buildFlags) {
+            ASBuildOptions options;
+            options.method = method;
+            options.flags = flags;
+            {
+                TestTraversal saved(scene, options);
+                for (size_t i = 0; i < scene.meshes.size(); i++) {
+                    EXPECT(saved.Get().SaveBLAS(saved.GetBlases()[i], paths[i].c_str()) == Result::SUCCESS, "save");
+                }
+            }
+            TestTraversal loaded;
+            loaded.GetBlases().resize(scene.meshes.size());
+            for (size_t i = 0; i < scene.meshes.size(); i++) {
+                EXPECT(loaded.Get().LoadBLAS(options, scene.meshes[i].Describe(), paths[i].c_str(),
+                                             &loaded.GetBlases()[i]) == Result::SUCCESS, "load " + Describe(options));
+            }
+            loaded.CreateTLAS(scene);
+            ExpectClosestHitsMatch(loaded, scene, rays, "loaded " + Describe(options));
+
+            // A file only loads for the geometry and options it was saved with.
+            BLAS blas;
+            ASBuildOptions other = options;
+            other.method = ASBuildMethod::LBVH_CPU;
+            EXPECT(loaded.Get().LoadBLAS(other, scene.meshes[0].Describe(), paths[0].c_str(), &blas) ==
+                   Result::INVALID_PARAMETER, "other options");
+            EXPECT(loaded.Get().LoadBLAS(options, scene.meshes[1].Describe(), paths[0].c_str(), &blas) ==
+                   Result::INVALID_PARAMETER, "other geometry");
+            // Nor for geometry that only has the same key, as if the hash collided.
+            EXPECT(CorruptSavedPositions(paths[0]), "corrupt positions");
+            EXPECT(loaded.Get().LoadBLAS(options, scene.meshes[0].Describe(), paths[0].c_str(), &blas) ==
+                   Result::INVALID_PARAMETER, "colliding geometry");
+        }
+    }
+    for (const std::string &path : paths) {
+        remove(path.c_str());
+    }
+    TestTraversal traversal;
+    BLAS blas;
+    EXPECT(traversal.Get().LoadBLAS(ASBuildOptions(), scene.meshes[0].Describe(), paths[0].c_str(), &blas) ==
+           Result::INVALID_PARAMETER, "missing file");
+}
+
+void TestCompact()
+{
+    Scene scene = MakeSceneWithEmptyMesh();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 2, 8);
+    for (uint32_t flags : BUILD_FLAGS) {
+        ASBuildOptions options;
+        options.flags = flags;
+        TestTraversal traversal(scene, options);
+        std::vector<BLAS> &blases = traversal.GetBlases();
+        EXPECT(traversal.Get().CompactBLAS(static_cast<uint32_t>(blases.size()), blases.data()) == Result::SUCCESS,
+               "compact");
+        for (BLAS blas : blases) {
+            ASMemoryUsage usage;
+            EXPECT(traversal.Get().GetBLASMemoryUsage(blas, &usage) == Result::SUCCESS, "usage");
+            EXPECT(usage.slackBytes == 0 && usage.refitBytes == 0, "compacted usage");
+        }
+        ExpectClosestHitsMatch(traversal, scene, rays, "compacted " + Describe(options));
+
+        // A compacted blas still refits.
+        for (float &position : scene.meshes[0].positions) {
+            position *= 1.25f;
+        }
+        scene.Update();
+        GeometryTriangleDescription geometry = scene.meshes[0].Describe();
+        EXPECT(traversal.Get().RefitBLAS(1, &geometry, &blases[0]) == Result::SUCCESS, "refit compacted");
+        geometry = scene.meshes.back().Describe();
+        EXPECT(traversal.Get().RefitBLAS(1, &geometry, &blases.back()) == Result::SUCCESS, "refit compacted empty");
+        traversal.CreateTLAS(scene);
+        ExpectClosestHitsMatch(traversal, scene, rays, "refit compacted " + Describe(options));
+        scene = MakeSceneWithEmptyMesh();
+    }
+}
+
+uint64_t TotalBytes(const ASMemoryUsage &usage)
+{
+    return usage.geometryBytes + usage.bvhBytes + usage.triangleBlockBytes + usage.refitBytes + usage.slackBytes;
+}
+
+/// The blas part of GetMemoryStats has to be the sum of GetBLASMemoryUsage over the given blases.
+ASMemoryStats ExpectMemoryStatsAddUp(const TestTraversal &traversal, const std::vector<BLAS> &blases,
+                                     const std::string &context)
+{
+    ASMemoryUsage sum {};
+    for (BLAS blas : blases) {
+        ASMemoryUsage usage {};
+        EXPECT(traversal.Get().GetBLASMemoryUsage(blas, &usage) == Result::SUCCESS, context + " usage");
+        sum.geometryBytes += usage.geometryBytes;
+        sum.bvhBytes += usage.bvhBytes;
+        sum.triangleBlockBytes += usage.triangleBlockBytes;
+        sum.refitBytes += usage.refitBytes;
+        sum.slackBytes += usage.slackBytes;
+    }
+    ASMemoryStats stats {};
+    EXPECT(traversal.Get().GetMemoryStats(&stats) == Result::SUCCESS, context + " stats");
+    EXPECT(stats.blasCount == blases.size() && stats.blases.geometryBytes == sum.geometryBytes &&
+           stats.blases.bvhBytes == sum.bvhBytes && stats.blases.triangleBlockBytes == sum.triangleBlockBytes &&
+           stats.blases.refitBytes == sum.refitBytes && stats.blases.slackBytes == sum.slackBytes, context);
+    return stats;
+}
+
+void TestMemoryStats()
+{
+    TestTraversal empty;
+    ASMemoryStats none = ExpectMemoryStatsAddUp(empty, {}, "no structures");
+    EXPECT(TotalBytes(none.blases) == 0 && TotalBytes(none.tlas) == 0, "no structures");
+
+    Scene scene = MakeSceneWithEmptyMesh();
+    TestTraversal traversal(scene);
+    std::vector<BLAS> blases = traversal.GetBlases();
+    ASMemoryStats built = ExpectMemoryStatsAddUp(traversal, blases, "built");
+    EXPECT(built.tlas.geometryBytes != 0 && built.tlas.bvhBytes != 0, "tlas usage");
+    EXPECT(built.blases.refitBytes != 0, "refit data before compaction");
+
+    EXPECT(traversal.Get().CompactBLAS(static_cast<uint32_t>(blases.size()), blases.data()) == Result::SUCCESS,
+           "compact");
+    ASMemoryStats compacted = ExpectMemoryStatsAddUp(traversal, blases, "compacted");
+    EXPECT(compacted.blases.refitBytes == 0 && compacted.blases.slackBytes == 0 &&
+           TotalBytes(compacted.blases) < TotalBytes(built.blases), "compaction frees memory");
+
+    // A destroyed blas counts until the tlas no longer refers to it.
+    BLAS sphere = blases[1];
+    ASMemoryUsage sphereUsage {};
+    EXPECT(traversal.Get().GetBLASMemoryUsage(sphere, &sphereUsage) == Result::SUCCESS, "sphere usage");
+    EXPECT(traversal.Get().DestroyBLAS(1, &sphere) == Result::SUCCESS, "destroy");
+    ASMemoryStats destroyed {};
+    EXPECT(traversal.Get().GetMemoryStats(&destroyed) == Result::SUCCESS, "stats after destroy");
+    EXPECT(destroyed.blasCount == blases.size() && TotalBytes(destroyed.blases) == TotalBytes(compacted.blases),
+           "destroyed blas still instanced");
+    scene.instances.erase(std::remove_if(scene.instances.begin(), scene.instances.end(),
+                                         [](const TestInstance &instance) { return instance.mesh == 1; }),
+                          scene.instances.end());
+    scene.Update();
+    traversal.CreateTLAS(scene);
+    blases.erase(blases.begin() + 1);
+    ASMemoryStats released = ExpectMemoryStatsAddUp(traversal, blases, "released");
+    EXPECT(TotalBytes(released.blases) == TotalBytes(compacted.blases) - TotalBytes(sphereUsage) &&
+           TotalBytes(released.tlas) < TotalBytes(compacted.tlas), "destroyed blas released");
+}
+
+void TestEmptyBLAS()
+{
+    Scene scene = MakeSceneWithEmptyMesh();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 4, 9);
+    uint32_t empty = static_cast<uint32_t>(scene.meshes.size() - 1);
+    for (ASBuildMethod method : BUILD_METHODS) {
+        for (uint32_t buildFlags : BUILD_FLAGS) {
+            ASBuildOptions options;
+            options.method = method;
+            options.flags = buildFlags;
+            TestTraversal traversal(scene, options);
+            ExpectClosestHitsMatch(traversal, scene, rays, "empty blas " + Describe(options));
+            GeometryTriangleDescription geometry = scene.meshes[empty].Describe();
+            EXPECT(traversal.Get().RefitBLAS(1, &geometry, &traversal.GetBlases()[empty]) == Result::SUCCESS,
+                   "refit empty " + Describe(options));
+            ExpectClosestHitsMatch(traversal, scene, rays, "refit empty blas " + Describe(options));
+        }
+    }
+}
+
+void TestEmptyTLAS()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 4, 10);
+    std::vector<Ray> cameraRays = MakeCameraRays();
+    Size region {REGION_WIDTH, REGION_HEIGHT};
+    Scene empty;
+    TestTraversal traversal;
+    EXPECT(traversal.Get().CreateTLAS(0, nullptr) == Result::SUCCESS, "empty tlas");
+    for (uint32_t rayFlags : RAY_FLAGS) {
+        ExpectMatchesReference(traversal, empty, rays, TraceReference(empty, rays, GetReferenceFlags(rayFlags)),
+                               rayFlags, "empty tlas");
+        ExpectMatchesReference(traversal, empty, cameraRays,
+                               TraceReference(empty, cameraRays, GetReferenceFlags(rayFlags)), rayFlags,
+                               "empty tlas region", &region);
+    }
+    HitDistancePrimitiveInstanceCoordinates hit;
+    EXPECT(traversal.Get().Intersect(rays[0], 0, &hit) == Result::SUCCESS && hit.t < 0.0f, "intersect");
+    PointQuery query {{0.0f, 0.0f, 0.0f}, std::numeric_limits<float>::infinity()};
+    ClosestPointHit closest;
+    EXPECT(traversal.Get().ClosestPoint(1, &query, &closest) == Result::SUCCESS && closest.distance < 0.0f,
+           "closest point");
+    uint32_t hitCount = 1;
+    EXPECT(traversal.Get().RadiusQuery(1, &query, 0, &hitCount, nullptr) == Result::SUCCESS && hitCount == 0,
+           "radius query");
+    EXPECT(traversal.Get().UpdateTLAS(0, nullptr, nullptr) == Result::SUCCESS, "update empty tlas");
+
+    // The blases of an emptied tlas still build a full one afterwards.
+    TestTraversal emptied(scene);
+    EXPECT(emptied.Get().CreateTLAS(0, nullptr) == Result::SUCCESS, "emptied tlas");
+    std::vector<uint8_t> hits;
+    EXPECT(emptied.Trace(rays, 0, TraceRayHitFormat::T, hits) == Result::SUCCESS, "trace emptied tlas");
+    emptied.CreateTLAS(scene);
+    ExpectClosestHitsMatch(emptied, scene, rays, "refilled tlas");
+}
+
+/// The bits of a half holding a float exactly, i.e. zero or a normal half such as the 1/1024 grid within (-2, 2).
+uint16_t ToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    if ((bits & 0x7FFFFFFFu) == 0) {
+        return static_cast<uint16_t>(sign);
+    }
+    return static_cast<uint16_t>(sign | ((((bits >> 23) & 0xFFu) - 112) << 10) | ((bits >> 13) & 0x3FFu));
+}
+
+/**
+ * Encode a mesh in the given formats, interleaved at an odd stride and offset so that no value is aligned, and
+ * move its positions to the values they decode to.
+ */
+GeometryTriangleDescription2 EncodeMesh(TestMesh &mesh, VertexFormat vertexFormat, IndexFormat indexFormat,
+                                        std::vector<uint8_t> &vertices, std::vector<uint8_t> &indices)
+{
+    const uint32_t vertexStride = 23;
+    const uint32_t vertexOffset = 5;
+    const uint32_t indexOffset = 3;
+    uint32_t vertexCount = static_cast<uint32_t>(mesh.positions.size() / 3);
+    vertices.assign(vertexOffset + vertexCount * vertexStride, HIT_FILL);
+    for (uint32_t i = 0; i < vertexCount; i++) {
+        uint8_t *vertex = &vertices[vertexOffset + i * vertexStride];
+        for (int axis = 0; axis < 3; axis++) {
+            float &position = mesh.positions[i * 3 + axis];
+            if (vertexFormat == VertexFormat::HALF3) {
+                position = std::round(position * 1024.0f) / 1024.0f;
+                uint16_t half = ToHalf(position);
+                memcpy(vertex + axis * sizeof(half), &half, sizeof(half));
+            } else if (vertexFormat == VertexFormat::SNORM16_3) {
+                int16_t snorm = static_cast<int16_t>(std::lround(position * 32767.0f));
+                position = snorm / 32767.0f;
+                memcpy(vertex + axis * sizeof(snorm), &snorm, sizeof(snorm));
+            } else {
+                memcpy(vertex + axis * sizeof(position), &position, sizeof(position));
+            }
+        }
+    }
+    size_t indexBytes = indexFormat == IndexFormat::UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+    indices.assign(indexOffset + mesh.indices.size() * indexBytes, HIT_FILL);
+    for (size_t i = 0; i < mesh.indices.size(); i++) {
+        uint16_t narrow = static_cast<uint16_t>(mesh.indices[i]);
+        memcpy(&indices[indexOffset + i * indexBytes], indexBytes == sizeof(narrow) ?
+               static_cast<const void *>(&narrow) : &mesh.indices[i], indexBytes);
+    }
+    GeometryTriangleDescription2 geometry {};
+    geometry.vertices.type = BufferType::CPU;
+    geometry.vertices.cpuBuffer = vertices.data();
+    geometry.vertexFormat = vertexFormat;
+    geometry.vertexStrideBytes = vertexStride;
+    geometry.vertexOffsetBytes = vertexOffset;
+    geometry.verticesCount = vertexCount;
+    geometry.indices.type = BufferType::CPU;
+    geometry.indices.cpuBuffer = indices.data();
+    geometry.indexFormat = indexFormat;
+    geometry.indexOffsetBytes = indexOffset;
+    geometry.indicesCount = static_cast<uint32_t>(mesh.indices.size());
+    return geometry;
+}
+
+void TestGeometryFormats()
+{
+    const VertexFormat vertexFormats[] = {VertexFormat::FLOAT3, VertexFormat::HALF3, VertexFormat::SNORM16_3};
+    const IndexFormat indexFormats[] = {IndexFormat::UINT32, IndexFormat::UINT16};
+    const std::string path = "TraversalTest_formats.bin";
+    for (VertexFormat vertexFormat : vertexFormats) {
+        for (IndexFormat indexFormat : indexFormats) {
+            std::string context = "vertex format " + std::to_string(static_cast<int>(vertexFormat)) +
+                " index format " + std::to_string(static_cast<int>(indexFormat));
+            Scene scene = MakeScene();
+            for (TestMesh &mesh : scene.meshes) {
+                // Halved, so that the soup fits into the [-1, 1] of SNORM16_3.
+                for (float &position : mesh.positions) {
+                    position *= 0.5f;
+                }
+            }
+            std::vector<std::vector<uint8_t>> vertices(scene.meshes.size());
+            std::vector<std::vector<uint8_t>> indices(scene.meshes.size());
+            std::vector<GeometryTriangleDescription2> geometries;
+            for (size_t i = 0; i < scene.meshes.size(); i++) {
+                geometries.push_back(EncodeMesh(scene.meshes[i], vertexFormat, indexFormat, vertices[i],
+                                                indices[i]));
+            }
+            scene.Update();
+            std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 4, 11);
+            TestTraversal traversal;
+            std::vector<BLAS> &blases = traversal.GetBlases();
+            blases.resize(geometries.size());
+            EXPECT(traversal.Get().CreateBLAS(ASBuildOptions(), static_cast<uint32_t>(geometries.size()),
+                                              geometries.data(), blases.data()) == Result::SUCCESS, context);
+            traversal.CreateTLAS(scene);
+            ExpectClosestHitsMatch(traversal, scene, rays, context);
+
+            for (float &position : scene.meshes[1].positions) {
+                position *= 0.75f;
+            }
+            geometries[1] = EncodeMesh(scene.meshes[1], vertexFormat, indexFormat, vertices[1], indices[1]);
+            scene.Update();
+            EXPECT(traversal.Get().RefitBLAS(1, &geometries[1], &blases[1]) == Result::SUCCESS, "refit " + context);
+            traversal.CreateTLAS(scene);
+            ExpectClosestHitsMatch(traversal, scene, rays, "refit " + context);
+
+            // A file matches the decoded mesh, so one saved from floats loads for any format.
+            TestTraversal saved(scene);
+            EXPECT(saved.Get().SaveBLAS(saved.GetBlases()[1], path.c_str()) == Result::SUCCESS, "save " + context);
+            BLAS loaded;
+            EXPECT(traversal.Get().LoadBLAS(ASBuildOptions(), geometries[1], path.c_str(), &loaded) ==
+                   Result::SUCCESS, "load " + context);
+            blases[1] = loaded;
+            traversal.CreateTLAS(scene);
+            ExpectClosestHitsMatch(traversal, scene, rays, "load " + context);
+        }
+    }
+    remove(path.c_str());
+}
+
+/// Trace through a server over and over until killed, telling the parent through the pipe once the first call is
+/// through.
+void RunDoomedClient(const std::string &name, const std::vector<Ray> &rays, int pipe)
+{
+    const uint32_t attachAttempts = 10000;
+    TraversalClient client;
+    for (uint32_t attempt = 0; client.Attach(name.c_str()) != Result::SUCCESS; attempt++) {
+        if (attempt == attachAttempts) {
+            _exit(1);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    TraceRayHitFormat format = TraceRayHitFormat::T_PRIMID_INSTID_U_V;
+    std::vector<uint8_t> hits(GetHitBufferBytes(format, static_cast<uint32_t>(rays.size())));
+    Buffer rayBuffer {BufferType::CPU, {const_cast<Ray *>(rays.data())}};
+    Buffer hitBuffer {BufferType::CPU, {hits.data()}};
+    bool told = false;
+    while (client.TraceRays(static_cast<uint32_t>(rays.size()), 0, rayBuffer, hitBuffer, format) ==
+        Result::SUCCESS) {
+        if (!told) {
+            const char ready = 1;
+            told = write(pipe, &ready, 1) == 1;
+        }
+    }
+    _exit(0);
+}
+
+void TestServerClientCrash()
+{
+    const uint32_t clientCount = 4;
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 4, 12);
+    std::string name = "/rayshop-test-" + std::to_string(getpid());
+    int pipes[2];
+    if (pipe(pipes) != 0) {
+        EXPECT(false, "pipe");
+        return;
+    }
+    // Forked before the traversal starts any thread, the clients attach once the server runs.
+    std::vector<pid_t> clients;
+    for (uint32_t i = 0; i < clientCount; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipes[0]);
+            RunDoomedClient(name, rays, pipes[1]);
+        }
+        EXPECT(pid > 0, "fork");
+        if (pid > 0) {
+            clients.push_back(pid);
+        }
+    }
+    close(pipes[1]);
+
+    TestTraversal traversal(scene);
+    RayServerOptions options;
+    options.slotCount = 2;
+    options.slotRayCount = 64;
+    EXPECT(traversal.Get().StartServer(name.c_str(), options) == Result::SUCCESS, "start server");
+    for (size_t i = 0; i < clients.size(); i++) {
+        char ready;
+        EXPECT(read(pipes[0], &ready, 1) == 1, "client " + std::to_string(i) + " traced");
+    }
+    close(pipes[0]);
+    // Killed in the middle of their calls, the clients die holding about all of the slots.
+    for (pid_t pid : clients) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+
+    // Without the slots of the dead back, this would wait forever.
+    TraversalClient client;
+    EXPECT(client.Attach(name.c_str()) == Result::SUCCESS, "attach");
+    TraceRayHitFormat format = TraceRayHitFormat::T_PRIMID_INSTID_U_V;
+    std::vector<uint8_t> hits(GetHitBufferBytes(format, static_cast<uint32_t>(rays.size())), HIT_FILL);
+    Buffer rayBuffer {BufferType::CPU, {rays.data()}};
+    Buffer hitBuffer {BufferType::CPU, {hits.data()}};
+    EXPECT(client.TraceRays(static_cast<uint32_t>(rays.size()), 0, rayBuffer, hitBuffer, format) == Result::SUCCESS,
+           "trace after crashes");
+    uint32_t mismatches = CompareHits(scene, rays, TraceReference(scene, rays, 0), 0, format, hits);
+    EXPECT(mismatches == 0, "trace after crashes, " + std::to_string(mismatches) + " rays");
+    client.Detach();
+    EXPECT(traversal.Get().StopServer() == Result::SUCCESS, "stop server");
+}
+
+/// Leave the rings of a server stalled the way a client killed in the middle of its pushes and pops would: one free
+/// slot marked as submitted by the dead client but never pushed, the other popped without freeing its cell.
+void StallRings(const std::string &name, int32_t deadPid)
+{
+    Cpu::SharedSegment segment;
+    EXPECT(segment.Open(name.c_str()) == Result::SUCCESS, "open segment");
+    Cpu::SharedHeader *header = segment.GetHeader();
+    uint32_t slot;
+    if (header == nullptr || !Cpu::PopRing(header->freeSlots, header->slotCount - 1, slot)) {
+        EXPECT(false, "take slot");
+        return;
+    }
+    header->slots[slot].owner.store(deadPid);
+    header->slots[slot].state.store(Cpu::SLOT_SUBMITTED);
+    header->submittedSlots.head.fetch_add(1);
+    header->freeSlots.tail.fetch_add(1);
+}
+
+void TestServerRingStall()
+{
+    Scene scene = MakeScene();
+    std::vector<Ray> rays = MakeRays(scene, RAY_COUNT / 4, 13);
+    std::string name = "/rayshop-test-" + std::to_string(getpid());
+    // Forked before the traversal starts any thread, the pid is gone for good once waited for.
+    pid_t deadPid = fork();
+    if (deadPid == 0) {
+        _exit(0);
+    }
+    EXPECT(deadPid > 0 && waitpid(deadPid, nullptr, 0) == deadPid, "fork");
+
+    TestTraversal traversal(scene);
+    RayServerOptions options;
+    options.slotCount = 2;
+    options.slotRayCount = 64;
+    EXPECT(traversal.Get().StartServer(name.c_str(), options) == Result::SUCCESS, "start server");
+    StallRings(name, static_cast<int32_t>(deadPid));
+
+    // Every batch goes through the one slot the server takes back, past both stalled cells; without the server
+    // repairing them, this would wait forever.
+    TraversalClient client;
+    EXPECT(client.Attach(name.c_str()) == Result::SUCCESS, "attach");
+    TraceRayHitFormat format = TraceRayHitFormat::T_PRIMID_INSTID_U_V;
+    std::vector<uint8_t> hits(GetHitBufferBytes(format, static_cast<uint32_t>(rays.size())), HIT_FILL);
+    Buffer rayBuffer {BufferType::CPU, {rays.data()}};
+    Buffer hitBuffer {BufferType::CPU, {hits.data()}};
+    EXPECT(client.TraceRays(static_cast<uint32_t>(rays.size()), 0, rayBuffer, hitBuffer, format) == Result::SUCCESS,
+           "trace past stalled rings");
+    uint32_t mismatches = CompareHits(scene, rays, TraceReference(scene, rays, 0), 0, format, hits);
+    EXPECT(mismatches == 0, "trace past stalled rings, " + std::to_string(mismatches) + " rays");
+    client.Detach();
+    EXPECT(traversal.Get().StopServer() == Result::SUCCESS, "stop server");
+}
+
+struct TestCase {
+    const char *name;
+    void (*run)();
+};
+
+const TestCase TEST_CASES[] = {
+    {"BuildMethods", TestBuildMethods},
+    {"ImageRegions", TestImageRegions},
+    {"ReorderRays", TestReorderRays},
+    {"Intersect", TestIntersect},
+    {"PointQueries", TestPointQueries},
+    {"AsyncBuild", TestAsyncBuild},
+    {"QuantizedNodes", TestQuantizedNodes},
+    {"InvalidParameters", TestInvalidParameters},
+    {"Refit", TestRefit},
+    {"SahRatio", TestSahRatio},
+    {"SahCosts", TestSahCosts},
+    {"UpdateTLAS", TestUpdateTLAS},
+    {"SaveLoad", TestSaveLoad},
+    {"Compact", TestCompact},
+    {"MemoryStats", TestMemoryStats},
+    {"EmptyBLAS", TestEmptyBLAS},
+    {"EmptyTLAS", TestEmptyTLAS},
+    {"GeometryFormats", TestGeometryFormats},
+    {"ServerClientCrash", TestServerClientCrash},
+    {"ServerRingStall", TestServerRingStall},
+};
+} // namespace
+
+/// Run the cases named on the command line, or all of them.
+int main(int argc, char **argv)
+{
+    int failedCases = 0;
+    for (const TestCase &test : TEST_CASES) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++) {
+            selected = selected || strcmp(argv[i], test.name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        int failures = g_failures;
+        test.run();
+        bool passed = g_failures == failures;
+        printf("%s %s\n", passed ? "PASSED" : "FAILED", test.name);
+        failedCases += passed ? 0 : 1;
+    }
+    return failedCases == 0 ? 0 : 1;
+}